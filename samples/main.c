@@ -3,6 +3,9 @@
 
 void __interrupt() low_isr() {
     timers_isr();
+#ifdef HAS_DIGITAL_COUNTER
+    dcnt_interrupt();
+#endif
 }
 
 static void enableInterrupts() {
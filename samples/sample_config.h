@@ -6,6 +6,8 @@
  */
 #define HAS_LED_BLINK
 #define HAS_BMP180
+// Flow counter on the INT pin, it requires the custom persistence data
+//#define HAS_DIGITAL_COUNTER
 
 /**
  * Auto-select hardware based on activated samples
@@ -15,13 +15,51 @@ typedef struct {
      * Count of CRC errors in the reading period
      */
     uint8_t crcErrors;
+#ifdef BUS_CL_DEFERRED_COMMIT
+    /**
+     * Status of the last deferred write, see `bus_cl_commitStatus`
+     */
+    uint8_t commitStatus;
+#else
     uint8_t _filler2;
+#endif
 } SYS_REGISTERS;
 
 #define SYS_REGS_ADDRESS (0)
 #define SYS_REGS_ADDRESS_BE (LE_TO_BE_16(SYS_REGS_ADDRESS))
 #define SYS_REGS_COUNT (sizeof(SYS_REGISTERS) / 2)
 
+#ifdef BUS_CL_CHANGE_RANGES
+/**
+ * The writable ranges tracked for `READ_CHANGED_RANGES`, as index in `regs_changeRanges`
+ */
+#define CHANGE_RANGE_SYS (0)
+#ifdef HAS_LED_BLINK
+#define CHANGE_RANGE_LEDBLINK (1)
+#define CHANGE_RANGE_COUNT (2)
+#else
+#define CHANGE_RANGE_COUNT (1)
+#endif
+#if BUS_CL_CHANGE_RANGES != CHANGE_RANGE_COUNT
+#error BUS_CL_CHANGE_RANGES should be the count of the tracked ranges of the samples
+#endif
+
+const BUS_CL_REG_RANGE regs_changeRanges[BUS_CL_CHANGE_RANGES] = {
+    { SYS_REGS_ADDRESS, SYS_REGS_COUNT },
+#ifdef HAS_LED_BLINK
+    { LEDBLINK_REGS_ADDRESS, LEDBLINK_REGS_COUNT },
+#endif
+};
+#endif
+
+#ifdef HAS_DIGITAL_COUNTER
+// The flow is the count of ticks in a second
+static TICK_TYPE s_counterTime;
+#ifdef BUS_CL_SNAPSHOT
+static uint16_t s_counterSnapshotSeq;
+#endif
+#endif
+
 void samples_init() {
 #ifdef HAS_LED_BLINK
     blinker_init();
@@ -32,6 +70,10 @@ void samples_init() {
 #ifdef HAS_BMP180
     bmp180_init();
 #endif
+#ifdef HAS_DIGITAL_COUNTER
+    dcnt_init();
+    s_counterTime = timers_get();
+#endif
 }
 
 void samples_poll() {
@@ -44,6 +86,12 @@ void samples_poll() {
 #ifdef HAS_BMP180
     bmp180_poll();
 #endif
+#ifdef HAS_DIGITAL_COUNTER
+    if ((timers_get() - s_counterTime) >= TICKS_PER_SECOND) {
+        s_counterTime = timers_get();
+        dcnt_poll();
+    }
+#endif
 }
 
 static uint16_t addressBe;
@@ -85,6 +133,10 @@ _Bool regs_validateReg() {
             bus_cl_exceptionCode = ERR_INVALID_FUNCTION;
             return false;
         }
+#ifdef BUS_CL_READ_CACHE_SIZE
+        // Calibration data never changes
+        bus_cl_cacheable = true;
+#endif
         return true;
     }
     if (addressBe == BMP180_REGS_DATA_ADDRESS_BE) {
@@ -98,32 +150,126 @@ _Bool regs_validateReg() {
         }
         return true;
     }
+#ifdef BUS_CL_SNAPSHOT
+    if (addressBe == BMP180_REGS_SNAPSHOT_ADDRESS_BE) {
+        if (count != BMP180_REGS_SNAPSHOT_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_SIZE;
+            return false;
+        }
+        if (bus_cl_header.header.function != READ_HOLDING_REGISTERS) {
+            bus_cl_exceptionCode = ERR_INVALID_FUNCTION;
+            return false;
+        }
+        return true;
+    }
+#endif
+#endif
+
+#ifdef HAS_DIGITAL_COUNTER
+    if (addressBe == DCNT_REGS_DATA_ADDRESS_BE) {
+        if (count != DCNT_REGS_DATA_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_SIZE;
+            return false;
+        }
+        if (bus_cl_header.header.function != READ_HOLDING_REGISTERS) {
+            bus_cl_exceptionCode = ERR_INVALID_FUNCTION;
+            return false;
+        }
+        return true;
+    }
+#ifdef BUS_CL_SNAPSHOT
+    if (addressBe == DCNT_REGS_SNAPSHOT_ADDRESS_BE) {
+        if (count != DCNT_REGS_SNAPSHOT_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_SIZE;
+            return false;
+        }
+        if (bus_cl_header.header.function != READ_HOLDING_REGISTERS) {
+            bus_cl_exceptionCode = ERR_INVALID_FUNCTION;
+            return false;
+        }
+        return true;
+    }
+#endif
 #endif
     
     bus_cl_exceptionCode = ERR_INVALID_ADDRESS;
     return false;
 }
 
-_Bool regs_onReceive() {
+static _Bool applyRegs(const uint8_t* data) {
     if (addressBe == SYS_REGS_ADDRESS_BE) {
         // Ignore data, reset flags and counters
         sys_resetReason = RESET_NONE;
         bus_cl_crcErrors = 0;
+#ifdef BUS_CL_CHANGE_RANGES
+        bus_cl_setChanged(CHANGE_RANGE_SYS);
+#endif
         return true;
     }
 #ifdef HAS_LED_BLINK
     if (addressBe == LEDBLINK_REGS_ADDRESS_BE) {
-        memcpy(&blinker_regs, rs485_buffer, sizeof(LedBlinkRegsiters));
-        return blinker_conf();
+        memcpy(&blinker_regs, data, sizeof(LedBlinkRegsiters));
+        if (!blinker_conf()) {
+            return false;
+        }
+#ifdef BUS_CL_CHANGE_RANGES
+        bus_cl_setChanged(CHANGE_RANGE_LEDBLINK);
+#endif
+        return true;
     }
 #endif
     return false;
 }
 
+#ifdef HAS_DIGITAL_COUNTER
+// Counter and flow registers, in big-endian
+static void writeCounterRegs(uint8_t* buffer, const DCNT_DATA* data) {
+    buffer[0] = (uint8_t)(data->counter >> 24);
+    buffer[1] = (uint8_t)(data->counter >> 16);
+    buffer[2] = (uint8_t)(data->counter >> 8);
+    buffer[3] = (uint8_t)data->counter;
+    buffer[4] = (uint8_t)(data->flow >> 8);
+    buffer[5] = (uint8_t)data->flow;
+}
+#endif
+
+#ifdef BUS_CL_STAGED_WRITE
+/**
+ * Holds the data of the writable registers until the request CRC is validated
+ */
+static union {
+    SYS_REGISTERS sys;
+#ifdef HAS_LED_BLINK
+    LedBlinkRegsiters blinker;
+#endif
+} s_stagedRegs;
+
+_Bool regs_onReceive() {
+    // Size already validated
+    memcpy(&s_stagedRegs, rs485_buffer, bus_cl_header.address.countL * 2);
+    return true;
+}
+
+_Bool regs_onCommit() {
+    return applyRegs((const uint8_t*)&s_stagedRegs);
+}
+
+void regs_onAbort() {
+    // Nothing applied yet
+}
+#else
+_Bool regs_onReceive() {
+    return applyRegs(rs485_buffer);
+}
+#endif
+
 void regs_onSend() {
     if (addressBe == SYS_REGS_ADDRESS_BE) {
         ((SYS_REGISTERS*)rs485_buffer)->crcErrors = bus_cl_crcErrors;
         ((SYS_REGISTERS*)rs485_buffer)->resetReason = sys_resetReason;
+#ifdef BUS_CL_DEFERRED_COMMIT
+        ((SYS_REGISTERS*)rs485_buffer)->commitStatus = bus_cl_commitStatus;
+#endif
         return;
     }
     
@@ -143,6 +289,51 @@ void regs_onSend() {
         bmp180_readRawData();
         return;
     }
+#ifdef BUS_CL_SNAPSHOT
+    if (addressBe == BMP180_REGS_SNAPSHOT_ADDRESS_BE) {
+        bmp180_readSnapshot();
+        return;
+    }
+#endif
+#endif
+
+#ifdef HAS_DIGITAL_COUNTER
+    DCNT_DATA data;
+    if (addressBe == DCNT_REGS_DATA_ADDRESS_BE) {
+        dcnt_getDataCopy(&data);
+        writeCounterRegs(rs485_buffer, &data);
+        return;
+    }
+#ifdef BUS_CL_SNAPSHOT
+    if (addressBe == DCNT_REGS_SNAPSHOT_ADDRESS_BE) {
+        // The data latched by the last trigger, not the current one
+        dcnt_getSnapshot(&data);
+        rs485_buffer[0] = (uint8_t)(s_counterSnapshotSeq >> 8);
+        rs485_buffer[1] = (uint8_t)s_counterSnapshotSeq;
+        writeCounterRegs(rs485_buffer + 2, &data);
+        return;
+    }
+#endif
 #endif
 }
 
+#ifdef BUS_CL_ASYNC_SEND
+_Bool regs_onSendComplete() {
+    // Try again
+    bus_cl_sendPending = false;
+    regs_onSend();
+    return !bus_cl_sendPending;
+}
+#endif
+
+#ifdef BUS_CL_SNAPSHOT
+void regs_onLatch() {
+#ifdef HAS_BMP180
+    bmp180_latch();
+#endif
+#ifdef HAS_DIGITAL_COUNTER
+    dcnt_latch();
+    s_counterSnapshotSeq = bus_cl_snapshotSeq;
+#endif
+}
+#endif
@@ -5,6 +5,9 @@
 #include "src/bmp180.h" 
 #include "src/led_blink.h"
 #include "src/hardware/i2c.h" 
+#ifdef HAS_DIGITAL_COUNTER
+#include "src/counter.h"
+#endif
 
 #define LE_TO_BE_16(v) (((v & 0xff) << 8) + (v >> 8))
 
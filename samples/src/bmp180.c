@@ -42,10 +42,22 @@ static enum {
 // Access this buffer immediately after a read operation to find data
 static uint8_t calibrationData[22];
 
-static struct {
+typedef struct {
     uint8_t temperature[2];
     uint8_t pressure[3];
-} rawData;
+} RAW_DATA;
+static RAW_DATA rawData;
+
+#ifdef BUS_CL_SNAPSHOT
+// Copy of the last complete measurement, since `rawData` is filled in two steps
+static RAW_DATA s_lastData;
+// Latched by the broadcast trigger
+static struct {
+    uint8_t seq[2];
+    RAW_DATA data;
+    uint8_t _filler;
+} s_snapshot;
+#endif
 
 static TICK_TYPE s_lastTime;
 static uint8_t i2cBuffer[2];
@@ -147,6 +159,9 @@ void bmp180_poll() {
         case STATE_WAIT_DATA:   
             s_state = STATE_IDLE;
             s_lastTime = timers_get();
+#ifdef BUS_CL_SNAPSHOT
+            s_lastData = rawData;
+#endif
             // Buffer ready!
             break;
             
@@ -159,9 +174,20 @@ void bmp180_poll() {
     }
 }
 
+static void setBusy() {
+#ifdef BUS_CL_ASYNC_SEND
+    if (bus_cl_header.header.function == READ_HOLDING_REGISTERS) {
+        // Deferred, the read is completed by `regs_onSendComplete`
+        bus_cl_sendPending = true;
+        return;
+    }
+#endif
+    bus_cl_exceptionCode = ERR_DEVICE_BUSY;
+}
+
 void bmp180_readRawData() {    
     if (s_state != STATE_IDLE) {
-        bus_cl_exceptionCode = ERR_DEVICE_BUSY;
+        setBusy();
         return;
     }
     memcpy(rs485_buffer, (uint8_t*)&rawData, sizeof(rawData));
@@ -169,10 +195,23 @@ void bmp180_readRawData() {
 
 void bmp180_readCalibrationData() {    
     if (s_state != STATE_IDLE) {
-        bus_cl_exceptionCode = ERR_DEVICE_BUSY;
+        setBusy();
         return;
     }
     memcpy(rs485_buffer, (uint8_t*)&calibrationData, sizeof(calibrationData));
 }
 
+#ifdef BUS_CL_SNAPSHOT
+void bmp180_latch() {
+    s_snapshot.seq[0] = (uint8_t)(bus_cl_snapshotSeq >> 8);
+    s_snapshot.seq[1] = (uint8_t)bus_cl_snapshotSeq;
+    s_snapshot.data = s_lastData;
+}
+
+void bmp180_readSnapshot() {
+    // Never busy
+    memcpy(rs485_buffer, (uint8_t*)&s_snapshot, sizeof(s_snapshot));
+}
+#endif
+
 #endif
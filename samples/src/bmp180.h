@@ -13,9 +13,13 @@ extern "C" {
 #define BMP180_REGS_CALIB_COUNT (11)
 #define BMP180_REGS_DATA_ADDRESS (1024 + 11)
 #define BMP180_REGS_DATA_COUNT (3)
+// Sequence number of the trigger and data
+#define BMP180_REGS_SNAPSHOT_ADDRESS (1024 + 14)
+#define BMP180_REGS_SNAPSHOT_COUNT (4)
 
 #define BMP180_REGS_CALIB_ADDRESS_BE (LE_TO_BE_16(BMP180_REGS_CALIB_ADDRESS))
 #define BMP180_REGS_DATA_ADDRESS_BE (LE_TO_BE_16(BMP180_REGS_DATA_ADDRESS))
+#define BMP180_REGS_SNAPSHOT_ADDRESS_BE (LE_TO_BE_16(BMP180_REGS_SNAPSHOT_ADDRESS))
 
 void bmp180_init();
 
@@ -26,6 +30,12 @@ void bmp180_poll();
 void bmp180_readRawData();
 void bmp180_readCalibrationData();
 
+#ifdef BUS_CL_SNAPSHOT
+// Latch the last measurement, see `regs_onLatch`
+void bmp180_latch();
+void bmp180_readSnapshot();
+#endif
+
 #ifdef	__cplusplus
 }
 #endif
@@ -73,3 +73,16 @@ void dcnt_getDataCopy(DCNT_DATA* data) {
     *data = s_data;
     DCNT_IE = 1;
 }
+
+#ifdef BUS_CL_SNAPSHOT
+// Latched by the broadcast trigger
+static DCNT_DATA s_snapshot;
+
+void dcnt_latch() {
+    dcnt_getDataCopy(&s_snapshot);
+}
+
+void dcnt_getSnapshot(DCNT_DATA* data) {
+    *data = s_snapshot;
+}
+#endif
@@ -1,8 +1,22 @@
 #ifndef DIG_COUNTER_H
 #define	DIG_COUNTER_H
 
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
 // Used for flow counter. Uses interrupts to not lose any tick.
 
+// Counter (high word first) and flow
+#define DCNT_REGS_DATA_ADDRESS (1536)
+#define DCNT_REGS_DATA_COUNT (3)
+// Sequence number of the trigger and data
+#define DCNT_REGS_SNAPSHOT_ADDRESS (1536 + 3)
+#define DCNT_REGS_SNAPSHOT_COUNT (4)
+
+#define DCNT_REGS_DATA_ADDRESS_BE (LE_TO_BE_16(DCNT_REGS_DATA_ADDRESS))
+#define DCNT_REGS_SNAPSHOT_ADDRESS_BE (LE_TO_BE_16(DCNT_REGS_SNAPSHOT_ADDRESS))
+
 void dcnt_interrupt(void);
 void dcnt_init(void);
 void dcnt_poll(void);
@@ -16,5 +30,15 @@ typedef struct {
 } DCNT_DATA;
 void dcnt_getDataCopy(DCNT_DATA* data);
 
+#ifdef BUS_CL_SNAPSHOT
+// Copy the data at the time of the `LATCH_SNAPSHOT` broadcast, see `regs_onLatch`
+void dcnt_latch(void);
+void dcnt_getSnapshot(DCNT_DATA* data);
+#endif
+
+#ifdef	__cplusplus
+}
+#endif
+
 #endif	/* COUNTER_H */
 
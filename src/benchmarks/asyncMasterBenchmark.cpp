@@ -0,0 +1,82 @@
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "simulatedBus.h"
+#include "pic-modbus/async_master.hpp"
+
+// Operations per second of the coroutine interface of the master, on the simulated line.
+// Usage: asyncMasterBenchmark [operations] [concurrent tasks]
+
+using modbus::AsyncMaster;
+using modbus::Executor;
+using modbus::Task;
+
+#define NODES (4)
+
+// Heap usage of the coroutine frames
+static size_t s_allocated = 0;
+static size_t s_allocations = 0;
+
+void* operator new(size_t size) {
+    s_allocated += size;
+    s_allocations++;
+    void* ptr = malloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+static Task<void> worker(AsyncMaster& master, int first, int count, int stride, int* errors) {
+    for (int i = first; i < count; i += stride) {
+        if (!co_await master.readHolding(i % NODES + 1, i % SIM_REGS_COUNT, 1)) {
+            (*errors)++;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int operations = argc > 1 ? atoi(argv[1]) : 20000;
+    int tasks = argc > 2 ? atoi(argv[2]) : 1000;
+
+    simInit(NODES);
+    Executor executor;
+    AsyncMaster master(&simMaster->ctx, executor);
+
+    int errors = 0;
+    size_t allocated = s_allocated;
+    size_t allocations = s_allocations;
+    for (int i = 0; i < tasks; i++) {
+        executor.spawn(worker(master, i, operations, tasks, &errors));
+    }
+    // Started: all the operations pending
+    executor.runReady();
+    size_t frameBytes = (s_allocated - allocated) / tasks;
+    size_t frameAllocations = (s_allocations - allocations) / tasks;
+
+    double simTime = 0;
+    auto start = std::chrono::steady_clock::now();
+    executor.run([&] {
+        TICK_TYPE before = simTimer;
+        simPoll(SIM_POLL_TICKS);
+        simTime += (TICK_TYPE)(simTimer - before);
+    });
+    double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    simTime /= TICKS_PER_SECOND;
+
+    printf("Operations: %d, concurrent tasks: %d, errors: %d\n", operations, tasks, errors);
+    printf("Heap per pending task: %zu bytes in %zu allocations\n", frameBytes, frameAllocations);
+    printf("Bus throughput: %.0f ops/s at %d baud (simulated time %.1f s)\n", operations / simTime, RS485_BAUD, simTime);
+    printf("Host throughput: %.0f ops/s of CPU time, simulation of the line and of the nodes included (%.3f s)\n", operations / wallTime, wallTime);
+    return errors != 0;
+}
@@ -0,0 +1,159 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../tests/ptyNode.h"
+#include "pic-modbus/linux/gateway.h"
+
+// Latency and throughput of the Modbus TCP to RTU gateway on localhost, with nodes on pseudo-terminal pairs
+// behind two ports. The clients read 4 registers in a closed loop:
+// - spread over the units of the two ports, with 1, 4 and 16 clients;
+// - overlapping ranges of the same unit (like SCADA clients polling the same node), with and without coalescing,
+//   and then served from the cache with a 100 ms TTL.
+// Usage: gatewayBenchmark [seconds per run]
+
+#define PORTS (2)
+#define COUNT (4)
+
+static GATEWAY s_gateway;
+
+struct Client {
+    std::thread thread;
+    std::vector<TICK_TYPE> latencies;
+    int errors = 0;
+};
+
+static int connectClient() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = { };
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(s_gateway.tcpPort);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool receiveAll(int fd, uint8_t* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t count = recv(fd, buffer, size, 0);
+        if (count <= 0) {
+            return false;
+        }
+        buffer += count;
+        size -= count;
+    }
+    return true;
+}
+
+static void runClient(Client* client, uint8_t unit, uint16_t address, TICK_TYPE duration) {
+    int fd = connectClient();
+    TICK_TYPE start = timers_get();
+    for (uint16_t id = 0; (TICK_TYPE)(timers_get() - start) < duration; id++) {
+        uint8_t request[] = { (uint8_t)(id >> 8), (uint8_t)id, 0, 0, 0, 6, unit, READ_HOLDING_REGISTERS, (uint8_t)(address >> 8), (uint8_t)address, 0, COUNT };
+        TICK_TYPE sent = timers_get();
+        if (send(fd, request, sizeof(request), 0) != sizeof(request)) {
+            break;
+        }
+        // The response has a fixed size, or it is an exception
+        uint8_t response[GATEWAY_MBAP_SIZE + 2 + COUNT * 2];
+        if (!receiveAll(fd, response, GATEWAY_MBAP_SIZE + 2)) {
+            break;
+        }
+        if (response[GATEWAY_MBAP_SIZE] & 0x80) {
+            client->errors++;
+            continue;
+        }
+        if (!receiveAll(fd, response + GATEWAY_MBAP_SIZE + 2, COUNT * 2)) {
+            break;
+        }
+        client->latencies.push_back(timers_get() - sent);
+    }
+    close(fd);
+}
+
+// `overlapping` clients all read the first unit, from addresses 0, 2, 4...
+static void run(const char* name, int clients, bool overlapping, bool coalesce, double seconds) {
+    s_gateway.coalesce = coalesce;
+    uint32_t transactions = s_gateway.transactions;
+    std::atomic<bool> running(true);
+    std::thread gateway([&] {
+        while (running.load()) {
+            modbus_loop_wait(&s_gateway.loop, TICKS_PER_SECOND / 10);
+        }
+    });
+
+    TICK_TYPE duration = (TICK_TYPE)(seconds * TICKS_PER_SECOND);
+    std::vector<Client> runs(clients);
+    for (int i = 0; i < clients; i++) {
+        uint8_t unit = overlapping ? 1 : i % PORTS + 1;
+        uint16_t address = overlapping ? (i % 8) * 2 : i % 8;
+        runs[i].thread = std::thread(runClient, &runs[i], unit, address, duration);
+    }
+    std::vector<TICK_TYPE> latencies;
+    int errors = 0;
+    for (auto& run : runs) {
+        run.thread.join();
+        latencies.insert(latencies.end(), run.latencies.begin(), run.latencies.end());
+        errors += run.errors;
+    }
+    running.store(false);
+    modbus_loop_wake(&s_gateway.loop);
+    gateway.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    printf("%s, %2d clients: %.1f requests/s, %.2f serial transactions per request, latency p50 %.1f ms, p99 %.1f ms, %d errors\n",
+        name, clients, n / seconds, n ? (double)(s_gateway.transactions - transactions) / n : 0,
+        n ? latencies[n / 2] / 1000.0 : 0, n ? latencies[n * 99 / 100] / 1000.0 : 0, errors);
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+
+    timers_init();
+    if (!gateway_init(&s_gateway, 0)) {
+        perror("gateway");
+        return 1;
+    }
+    std::vector<PtyNode*> nodes;
+    for (int i = 0; i < PORTS; i++) {
+        PtyNode* node = ptyNode_start(i + 1);
+        int port = node ? gateway_attachPort(&s_gateway, node->masterFd) : -1;
+        if (port < 0) {
+            perror("port");
+            return 1;
+        }
+        gateway_route(&s_gateway, i + 1, port);
+        nodes.push_back(node);
+    }
+
+    printf("%d baud, reading %d registers, %d ports\n", RS485_BAUD, COUNT, PORTS);
+    const int clientCounts[] = { 1, 4, 16 };
+    for (int clients : clientCounts) {
+        run("Spread", clients, false, true, seconds);
+    }
+    run("Overlapping, not coalesced", 16, true, false, seconds);
+    run("Overlapping, coalesced", 16, true, true, seconds);
+    // Between the runs, the gateway thread is stopped
+    gateway_cacheRange(&s_gateway, 1, 0, PTY_NODE_REGS_COUNT, 100);
+    run("Overlapping, cached", 16, true, true, seconds);
+
+    for (auto node : nodes) {
+        ptyNode_stop(node);
+    }
+    gateway_close(&s_gateway);
+    return 0;
+}
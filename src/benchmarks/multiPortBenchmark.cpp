@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../tests/ptyNode.h"
+#include "pic-modbus/linux/multi_port_master.hpp"
+
+// Aggregate throughput of the multi-port master, with 1, 2, 4... ports up to the maximum, each one with
+// a node on a pseudo-terminal pair. The timings of the line (see `RS485_BAUD`) are enforced by the line module
+// of both sides, so each port behaves like a real bus.
+// Usage: multiPortBenchmark [seconds per run] [max ports]
+
+using modbus::MultiPortMaster;
+
+#define STATION (1)
+// Requests queued to each port
+#define OUTSTANDING (16)
+
+static MultiPortMaster::Request request(uint32_t id) {
+    MultiPortMaster::Request ret = { };
+    ret.id = id;
+    ret.station = STATION;
+    ret.function = READ_HOLDING_REGISTERS;
+    ret.address = id % 8;
+    ret.count = 4;
+    return ret;
+}
+
+// Returns the completed operations per second
+static double run(int ports, double seconds, int* errors) {
+    std::vector<PtyNode*> nodes;
+    MultiPortMaster master;
+    for (int i = 0; i < ports; i++) {
+        PtyNode* node = ptyNode_start(STATION);
+        if (!node || master.addPort(node->masterFd) < 0) {
+            perror("port");
+            exit(1);
+        }
+        nodes.push_back(node);
+    }
+    master.start();
+
+    uint32_t id = 0;
+    for (int i = 0; i < ports; i++) {
+        for (int j = 0; j < OUTSTANDING; j++) {
+            master.submit(i, request(id++));
+        }
+    }
+    long completed = 0;
+    TICK_TYPE start = timers_get();
+    TICK_TYPE duration = (TICK_TYPE)(seconds * TICKS_PER_SECOND);
+    while ((TICK_TYPE)(timers_get() - start) < duration) {
+        MultiPortMaster::Result result;
+        if (!master.poll(result)) {
+            master.wait(10);
+            continue;
+        }
+        completed++;
+        if (result.result != NO_ERROR) {
+            (*errors)++;
+        }
+        // Keep the port busy
+        master.submit(result.port, request(id++));
+    }
+    double elapsed = (double)(TICK_TYPE)(timers_get() - start) / TICKS_PER_SECOND;
+
+    master.stop();
+    for (auto node : nodes) {
+        ptyNode_stop(node);
+    }
+    return completed / elapsed;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 2;
+    int maxPorts = argc > 2 ? atoi(argv[2]) : 8;
+
+    timers_init();
+    printf("%d baud, reading 4 registers\n", RS485_BAUD);
+    double single = 0;
+    for (int ports = 1; ports <= maxPorts; ports *= 2) {
+        int errors = 0;
+        double rate = run(ports, seconds, &errors);
+        if (ports == 1) {
+            single = rate;
+        }
+        printf("%d ports: %.1f ops/s, %.2fx of a single port, %d errors\n", ports, rate, rate / single, errors);
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+#include "pic-modbus/registers.hpp"
+
+// Decoding of full read responses (125 registers), word by word as the master engine does, and with the
+// block byte-swap of `decodeRegisters`; then the typed extraction of the float32 values of the responses.
+// Usage: registersBenchmark [responses]
+
+using namespace modbus;
+
+#if defined(__AVX2__)
+static const char* s_simd = "AVX2";
+#elif defined(__SSSE3__)
+static const char* s_simd = "SSSE3";
+#elif defined(__SSE2__)
+static const char* s_simd = "SSE2";
+#elif defined(__ARM_NEON)
+static const char* s_simd = "NEON";
+#else
+static const char* s_simd = "none";
+#endif
+
+// 62 float32 values, and a status register
+template<uint16_t... I>
+struct FloatsOf {
+    using Type = Layout<F32<I * 2>..., U16<124>>;
+};
+using Response = FloatsOf<0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+    26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54,
+    55, 56, 57, 58, 59, 60, 61>::Type;
+static_assert(Response::size == MaxRegisters, "Full response");
+
+// As `parseResponse` of the master engine
+__attribute__((noinline)) static void decodeScalar(const uint8_t* wire, uint16_t* registers, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        registers[i] = (uint16_t)((wire[i * 2] << 8) | wire[i * 2 + 1]);
+    }
+}
+
+__attribute__((noinline)) static void decodeSimd(const uint8_t* wire, uint16_t* registers, size_t count) {
+    decodeRegisters(wire, registers, count);
+}
+
+template<uint16_t... I>
+static float sum(const Response::Registers& registers) {
+    float ret = 0;
+    for (float value : { registers.get<F32<I * 2>>()... }) {
+        ret += value;
+    }
+    return ret;
+}
+
+static float sumFloats(const Response::Registers& registers) {
+    return sum<0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28,
+        29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55, 56,
+        57, 58, 59, 60, 61>(registers);
+}
+
+template<typename F>
+static double run(const char* name, const std::vector<uint8_t>& wire, int responses, uint16_t* registers, F decode) {
+    // The responses as received, one after another (+ 3 for the header of the frames)
+    size_t frames = wire.size() / (MaxRegisters * 2 + 3);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < responses; i++) {
+        decode(wire.data() + (i % frames) * (MaxRegisters * 2 + 3) + 3, registers, MaxRegisters);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / responses;
+    printf("  %-24s %7.1f ns per response, %6.2f GB/s\n", name, ns, MaxRegisters * 2 / ns);
+    return ns;
+}
+
+int main(int argc, char** argv) {
+    int responses = argc > 1 ? atoi(argv[1]) : 2000000;
+
+    // Responses of 125 registers, in 64 kB of frames
+    std::vector<uint8_t> wire(256 * (MaxRegisters * 2 + 3));
+    srand(1);
+    for (size_t i = 0; i < wire.size(); i += MaxRegisters * 2 + 3) {
+        uint16_t values[MaxRegisters];
+        for (uint16_t j = 0; j < MaxRegisters - 1; j += 2) {
+            F32<0>::set(values + j, (float)(rand() % 100000) / 100);
+        }
+        values[MaxRegisters - 1] = (uint16_t)rand();
+        encodeRegisters(values, wire.data() + i + 3, MaxRegisters);
+    }
+
+    printf("%d responses of %d registers, SIMD: %s\n", responses, MaxRegisters, s_simd);
+    Response::Registers scalar, simd;
+    double scalarTime = run("word by word:", wire, responses, scalar.data, decodeScalar);
+    double simdTime = run("decodeRegisters:", wire, responses, simd.data, decodeSimd);
+    if (memcmp(scalar.data, simd.data, sizeof(scalar.data)) != 0) {
+        printf("Different results\n");
+        return 1;
+    }
+    printf("  speedup: %.1fx\n", scalarTime / simdTime);
+
+    // Decode and the typed fields
+    size_t frames = wire.size() / (MaxRegisters * 2 + 3);
+    float total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < responses; i++) {
+        simd.decode(wire.data() + (i % frames) * (MaxRegisters * 2 + 3) + 3);
+        total += sumFloats(simd);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / responses;
+    printf("  %-24s %7.1f ns per response (62 float32 values, checksum %g)\n", "decode and read fields:", ns, total);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "simulatedBus.h"
+
+// Scan-cycle time of the master on the simulated line (simulated time), reading 4 registers of each of 8 nodes,
+// with some of them offline. Built twice: with `BUS_MS_ADAPTIVE_TIMEOUT`, and with the fixed timeout
+// (scanCycleBenchmarkFixed).
+// Usage: scanCycleBenchmark [cycles]
+
+#define NODES (8)
+#define COUNT (4)
+
+static int s_errors;
+
+static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result) {
+    CTX_UNUSED;
+    (void)request;
+    s_errors += result != NO_ERROR;
+}
+
+// The last `offline` nodes don't answer
+static void run(int offline, int cycles) {
+    simInit(NODES);
+    for (int i = NODES - offline; i < NODES; i++) {
+        simNodes[i]->offline = true;
+    }
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data[NODES][COUNT];
+    TICK_TYPE worst = 0;
+    TICK_TYPE start = simTimer;
+    s_errors = 0;
+    for (int cycle = 0; cycle < cycles; cycle++) {
+        TICK_TYPE cycleStart = simTimer;
+        for (int i = 0; i < NODES; i++) {
+            BUS_MS_REQUEST request = { (uint8_t)(i + 1), READ_HOLDING_REGISTERS, 0, COUNT, data[i], onComplete, NULL };
+            if (!bus_ms_enqueue(&simMaster->ctx, &request)) {
+                abort();
+            }
+        }
+        while (simMaster->ctx.bus_ms.queueCount > 0) {
+            simPoll(TICKS_PER_CHAR);
+        }
+        TICK_TYPE elapsed = simTimer - cycleStart;
+        worst = elapsed > worst ? elapsed : worst;
+    }
+    TICK_TYPE elapsed = simTimer - start;
+    printf("%d/%d nodes offline: scan cycle %.1f ms on average, %.1f ms worst, %d errors, %u timeouts\n",
+        offline, NODES, elapsed / 1000.0 / cycles, worst / 1000.0, s_errors, simMaster->ctx.bus_ms.timeouts);
+}
+
+int main(int argc, char** argv) {
+    int cycles = argc > 1 ? atoi(argv[1]) : 100;
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+    printf("Adaptive timeouts, %d baud, %d cycles\n", RS485_BAUD, cycles);
+#else
+    printf("Fixed timeout of %u ms, %d baud, %d cycles\n", BUS_MS_RESPONSE_TIMEOUT / 1000, RS485_BAUD, cycles);
+#endif
+    const int offline[] = { 0, 1, 2, 4 };
+    for (int count : offline) {
+        run(count, cycles);
+    }
+    return 0;
+}
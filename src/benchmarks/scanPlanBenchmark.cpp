@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/bus_scan.h"
+
+// Reads per scan cycle and estimated cycle time on the line, of realistic register maps:
+// - one read per point;
+// - the contiguous points merged (as long as they fit the frames);
+// - the planner, with the RTU costs of nodes answering in 5 ms.
+// Usage: scanPlanBenchmark [planner runs]
+
+struct Map {
+    const char* name;
+    std::vector<BUS_SCAN_POINT> points;
+};
+
+static void add(Map& map, uint8_t station, uint16_t address, uint8_t count) {
+    BUS_SCAN_POINT point = { };
+    point.station = station;
+    point.address = address;
+    point.count = count;
+    map.points.push_back(point);
+}
+
+// Three-phase energy meter: float32 values (voltages, currents, powers, power factors, frequency, energies)
+static void energyMeter(Map& map, uint8_t station) {
+    const uint16_t addresses[] = { 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30, 32, 34, 36, 38, 40,
+        42, 46, 52, 56, 60, 62, 70, 72, 74, 76, 78, 84, 86, 88, 100, 102, 200, 202, 342, 344 };
+    for (uint16_t address : addresses) {
+        add(map, station, address, 2);
+    }
+}
+
+// PV inverter (SunSpec-like model): 16-bit values, each group followed by its scale factor, with reserved registers
+static void inverter(Map& map, uint8_t station) {
+    const uint16_t addresses[] = { 40071, 40072, 40073, 40074, 40075, 40076, 40077, 40078, 40079, 40080, 40081,
+        40083, 40084, 40085, 40086, 40087, 40088, 40089, 40090, 40093, 40094, 40096, 40097, 40098, 40099, 40100,
+        40101, 40102, 40103, 40104, 40107, 40108, 40109, 40110, 40111, 40117, 40118 };
+    for (uint16_t address : addresses) {
+        add(map, station, address, 1);
+    }
+    // Lifetime energy, 32-bit
+    add(map, station, 40093, 2);
+}
+
+// PLC: words scattered in the data area
+static void plc(Map& map, uint8_t station) {
+    srand(station);
+    for (int i = 0; i < 120; i++) {
+        add(map, station, (uint16_t)(rand() % 1200), rand() % 4 == 0 ? 2 : 1);
+    }
+}
+
+// Contiguous (or overlapping) points merged, while they fit
+static std::vector<BUS_MS_REQUEST> mergeContiguous(std::vector<BUS_SCAN_POINT> points, uint8_t maxRegisters) {
+    std::sort(points.begin(), points.end(), [](const BUS_SCAN_POINT& a, const BUS_SCAN_POINT& b) {
+        return a.station != b.station ? a.station < b.station : a.address < b.address;
+    });
+    std::vector<BUS_MS_REQUEST> reads;
+    for (auto& point : points) {
+        if (!reads.empty()) {
+            BUS_MS_REQUEST& last = reads.back();
+            uint32_t end = std::max<uint32_t>(last.address + last.count, point.address + point.count);
+            if (last.station == point.station && point.address <= last.address + last.count && end - last.address <= maxRegisters) {
+                last.count = (uint8_t)(end - last.address);
+                continue;
+            }
+        }
+        BUS_MS_REQUEST read = { point.station, READ_HOLDING_REGISTERS, point.address, point.count, NULL, NULL, NULL };
+        reads.push_back(read);
+    }
+    return reads;
+}
+
+static void run(Map& map, const BUS_SCAN_COSTS& costs, int runs) {
+    std::vector<BUS_MS_REQUEST> single;
+    for (auto& point : map.points) {
+        BUS_MS_REQUEST read = { point.station, READ_HOLDING_REGISTERS, point.address, point.count, NULL, NULL, NULL };
+        single.push_back(read);
+    }
+    std::vector<BUS_MS_REQUEST> contiguous = mergeContiguous(map.points, costs.maxRegisters);
+
+    std::vector<BUS_MS_REQUEST> planned(map.points.size());
+    std::vector<uint16_t> data(map.points.size() * BUS_SCAN_MAX_REGISTERS);
+    int count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++) {
+        count = bus_scan_plan(map.points.data(), (uint16_t)map.points.size(), &costs, planned.data(), (uint16_t)planned.size(), data.data(), (uint16_t)data.size());
+    }
+    double planTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / runs;
+    if (count < 0) {
+        printf("%s: planning failed\n", map.name);
+        exit(1);
+    }
+
+    printf("%s, %zu points:\n", map.name, map.points.size());
+    printf("  one read per point: %4zu reads, %7.1f ms\n", single.size(), bus_scan_cost(&costs, single.data(), (uint16_t)single.size()) / 1000.0);
+    printf("  contiguous merged:  %4zu reads, %7.1f ms\n", contiguous.size(), bus_scan_cost(&costs, contiguous.data(), (uint16_t)contiguous.size()) / 1000.0);
+    printf("  planned:            %4d reads, %7.1f ms (planned in %.1f us)\n", count, bus_scan_cost(&costs, planned.data(), (uint16_t)count) / 1000.0, planTime);
+}
+
+int main(int argc, char** argv) {
+    int runs = argc > 1 ? atoi(argv[1]) : 1000;
+
+    BUS_SCAN_COSTS costs;
+    bus_scan_rtuCosts(&costs, TICKS_PER_SECOND / 200);
+    printf("%d baud, up to %d registers per read, %u us per transaction and %u us per register\n",
+        RS485_BAUD, costs.maxRegisters, costs.transactionCost, costs.registerCost);
+
+    Map meter = { "Energy meter", { } };
+    energyMeter(meter, 1);
+    run(meter, costs, runs);
+
+    Map pv = { "PV inverter", { } };
+    inverter(pv, 1);
+    run(pv, costs, runs);
+
+    Map controller = { "PLC", { } };
+    plc(controller, 1);
+    run(controller, costs, runs);
+
+    Map site = { "Site: 8 meters, 4 inverters, 2 PLCs", { } };
+    for (uint8_t i = 1; i <= 8; i++) {
+        energyMeter(site, i);
+    }
+    for (uint8_t i = 9; i <= 12; i++) {
+        inverter(site, i);
+    }
+    plc(site, 13);
+    plc(site, 14);
+    run(site, costs, runs);
+    return 0;
+}
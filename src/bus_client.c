@@ -1,13 +1,14 @@
-#include "pic-modbus/bus_client.h"
-#include "pic-modbus/crc.h"
-#include "pic-modbus/rs485.h"
+#include <string.h>
+#include "pic-modbus/modbus.h"
 
 /**
  * Specific module for client Modbus RTU nodes (RS485), optimized
  * for 8-bit CPUs with low memory.
  */
 
-ModbusRtuHoldingRegisterRequest bus_cl_header;
+#ifndef MODBUS_CONTEXT_API
+BUS_CL_CONTEXT bus_cl_ctx;
+#endif
 
 typedef struct {
     ModbusRtuPacketHeader header;
@@ -22,96 +23,819 @@ typedef struct {
     uint8_t size;
 } ModbusRtuPacketReadResponse;
 
-// If != NO_ERR, write an error
-uint8_t bus_cl_exceptionCode;
-static uint8_t messageSize;
+// See `BUS_CL_CONTEXT`
+#define messageSize (MODBUS_CTX(bus_cl).messageSize)
+#define s_function (MODBUS_CTX(bus_cl).function)
+#define s_requestComplete (MODBUS_CTX(bus_cl).requestComplete)
+#ifdef BUS_CL_STAGED_WRITE
+#define s_staged (MODBUS_CTX(bus_cl).staged)
+#endif
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+#define s_lastWriteCrc (MODBUS_CTX(bus_cl).lastWriteCrc)
+#define s_lastWriteSize (MODBUS_CTX(bus_cl).lastWriteSize)
+#define s_lastWriteTime (MODBUS_CTX(bus_cl).lastWriteTime)
+#define s_replay (MODBUS_CTX(bus_cl).replay)
+#endif
+#ifdef BUS_CL_DEFERRED_COMMIT
+#define s_commitDeferred (MODBUS_CTX(bus_cl).commitDeferred)
+#endif
 
-BUS_CL_RTU_STATE bus_cl_rtu_state;
-uint8_t bus_cl_crcErrors;
+#ifdef BUS_CL_READ_CACHE_SIZE
+#if BUS_CL_READ_CACHE_DATA_SIZE > RS485_BUF_SIZE - 5
+#error BUS_CL_READ_CACHE_DATA_SIZE too big: the whole response should fit the buffer
+#endif
+typedef BUS_CL_READ_CACHE_ENTRY ReadCacheEntry;
 
-void bus_cl_init() {
+#define s_readCache (MODBUS_CTX(bus_cl).readCache)
+#define s_readCacheNext (MODBUS_CTX(bus_cl).readCacheNext)
+#define s_readCacheEntry (MODBUS_CTX(bus_cl).readCacheEntry)
+#define s_readCacheHit (MODBUS_CTX(bus_cl).readCacheHit)
+#define s_readCacheVersion (MODBUS_CTX(bus_cl).readCacheVersion)
+#endif
+
+#ifdef BUS_CL_CHANGE_RANGES
+#define s_rangeChangeSeq (MODBUS_CTX(bus_cl).rangeChangeSeq)
+// How many changed ranges fit the response buffer, after the sequence number
+#define CHANGED_RANGES_MAX_COUNT ((RS485_BUF_SIZE - sizeof(ModbusRtuPacketReadResponse) - sizeof(uint16_t)) / 4)
+#endif
+
+// Max data size of a read response (125 registers), to fit the RTU packet
+#define READ_RESPONSE_MAX_DATA_SIZE (250)
+// The data of the read in `bus_cl_header` fits the response and the buffer (and so the 8-bit `messageSize`)
+#define READ_DATA_FITS (bus_cl_header.address.countL * 2 <= READ_RESPONSE_MAX_DATA_SIZE && bus_cl_header.address.countL * 2 <= RS485_BUF_SIZE)
+
+#ifdef BUS_CL_MULTIPLE_RANGES_MAX
+#if (BUS_CL_MULTIPLE_RANGES_MAX - 1) * 4 > RS485_BUF_SIZE
+#error BUS_CL_MULTIPLE_RANGES_MAX too big: the additional ranges should fit the buffer
+#endif
+#define s_ranges (MODBUS_CTX(bus_cl).ranges)
+#define s_rangeCount (MODBUS_CTX(bus_cl).rangeCount)
+#endif
+
+#ifdef BUS_CL_ASYNC_SEND
+#define s_sendPendingTime (MODBUS_CTX(bus_cl).sendPendingTime)
+#endif
+
+#ifdef BUS_CL_IMAGES
+#define s_imageRange (MODBUS_CTX(bus_cl).imageRange)
+#define s_imageOffset (MODBUS_CTX(bus_cl).imageOffset)
+#endif
+
+#ifdef BUS_CL_SNAPSHOT
+#define s_broadcast (MODBUS_CTX(bus_cl).broadcast)
+#endif
+
+#ifdef BUS_CL_READ_CACHE_SIZE
+static void flushReadCache(CTX_PARAM) {
+    for (uint8_t i = 0; i < BUS_CL_READ_CACHE_SIZE; i++) {
+        s_readCache[i].count = 0;
+    }
+    s_readCacheVersion = bus_cl_dataVersion;
+}
+#endif
+
+void bus_cl_init(CTX_PARAM) {
     // RS485 already in receive mode
     bus_cl_rtu_state = BUS_CL_RTU_IDLE;
     bus_cl_crcErrors = 0;
+#ifdef BUS_CL_STAGED_WRITE
+    s_staged = false;
+#endif
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+    s_lastWriteSize = 0;
+#endif
+#ifdef BUS_CL_DEFERRED_COMMIT
+    s_commitDeferred = false;
+    bus_cl_commitStatus = NO_ERROR;
+#endif
+#ifdef BUS_CL_READ_CACHE_SIZE
+    flushReadCache(CTX_ARG);
+    s_readCacheNext = 0;
+#endif
+#ifdef BUS_CL_CHANGE_RANGES
+    // Every range is changed after the reset, with distinct sequence numbers
+    for (uint8_t i = 0; i < BUS_CL_CHANGE_RANGES; i++) {
+        s_rangeChangeSeq[i] = i + 1;
+    }
+    bus_cl_changeSeq = BUS_CL_CHANGE_RANGES;
+#endif
+}
+
+#ifdef BUS_CL_STAGED_WRITE
+static void abortStaged(CTX_PARAM) {
+#ifdef BUS_CL_DEFERRED_COMMIT
+    if (s_commitDeferred) {
+        // Dropped with the response
+        s_commitDeferred = false;
+        bus_cl_commitStatus = BUS_CL_COMMIT_ABORTED;
+        regs_onAbort(CTX_ARG);
+        return;
+    }
+#endif
+    if (s_staged) {
+        s_staged = false;
+        regs_onAbort(CTX_ARG);
+    }
+}
+
+// Apply the staged data. In case of error, the exception code is set
+static _Bool commitStaged(CTX_PARAM) {
+    if (!regs_onCommit(CTX_ARG)) {
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+        // Not successful, so it can't be replayed
+        s_lastWriteSize = 0;
+#endif
+        return false;
+    }
+    return true;
+}
+#endif
+
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+/**
+ * Check if the validated request is the retry of the last successful write request.
+ * Otherwise remember it for the next one.
+ */
+static _Bool isReplayedWrite(CTX_PARAM_ uint16_t crc) {
+    if (bus_cl_header.header.function != WRITE_HOLDING_REGISTERS) {
+        // Any other request breaks the sequence
+        s_lastWriteSize = 0;
+        return false;
+    }
+    TICK_TYPE now = timers_get();
+    if (s_lastWriteSize == messageSize && s_lastWriteCrc == crc && (TICK_TYPE)(now - s_lastWriteTime) < BUS_CL_WRITE_REPLAY_TIMEOUT) {
+        return true;
+    }
+    s_lastWriteSize = messageSize;
+    s_lastWriteCrc = crc;
+    s_lastWriteTime = now;
+    return false;
+}
+
+// The write request in `bus_cl_header` can be the retry of the last successful one, and the whole frame fits the buffer
+static _Bool canBeReplayed(CTX_PARAM) {
+    return s_lastWriteSize != 0 && s_lastWriteSize == messageSize && messageSize + sizeof(uint16_t) <= RS485_BUF_SIZE
+        && (TICK_TYPE)(timers_get() - s_lastWriteTime) < BUS_CL_WRITE_REPLAY_TIMEOUT;
+}
+
+// Called with the data and the CRC of the write request in the buffer, before the data is consumed:
+// check if the frame is the same of the last successful write
+static _Bool isReplayedFrame(CTX_PARAM) {
+    uint16_t crc = crc16;
+    for (uint8_t i = 0; i < messageSize; i++) {
+        crc_update(CTX_ARG_ rs485_buffer[i]);
+    }
+    // CRC is LSB first
+    uint16_t expectedCrc = le16toh(crc16);
+    // Updated again when the data is discarded
+    crc16 = crc;
+    uint16_t frameCrc = *((const uint16_t*)(rs485_buffer + messageSize));
+    return frameCrc == expectedCrc && frameCrc == s_lastWriteCrc;
+}
+#endif
+
+#ifdef BUS_CL_READ_CACHE_SIZE
+static _Bool findCachedResponse(CTX_PARAM) {
+    if (s_readCacheVersion != bus_cl_dataVersion) {
+        // Drop the old versions, they would match again when the version wraps around
+        flushReadCache(CTX_ARG);
+    }
+    if (bus_cl_header.address.countH != 0) {
+        return false;
+    }
+    for (uint8_t i = 0; i < BUS_CL_READ_CACHE_SIZE; i++) {
+        ReadCacheEntry* entry = &s_readCache[i];
+        if (entry->count == bus_cl_header.address.countL && entry->registerAddressBe == bus_cl_header.address.registerAddressBe && entry->version == bus_cl_dataVersion) {
+            s_readCacheEntry = entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called when the response data is ready in the buffer
+static void cacheResponseData(CTX_PARAM) {
+    if (!bus_cl_cacheable || bus_cl_exceptionCode != NO_ERROR || messageSize > BUS_CL_READ_CACHE_DATA_SIZE) {
+        return;
+    }
+    ReadCacheEntry* entry = &s_readCache[s_readCacheNext];
+    if (++s_readCacheNext >= BUS_CL_READ_CACHE_SIZE) {
+        s_readCacheNext = 0;
+    }
+    // Still not valid, until the CRC is stored
+    entry->count = 0;
+    entry->registerAddressBe = bus_cl_header.address.registerAddressBe;
+    entry->version = bus_cl_dataVersion;
+    ((ModbusRtuPacketReadResponse*)entry->response)->header = bus_cl_header.header;
+    ((ModbusRtuPacketReadResponse*)entry->response)->size = messageSize;
+    memcpy(entry->response + sizeof(ModbusRtuPacketReadResponse), rs485_buffer, messageSize);
+    s_readCacheEntry = entry;
+}
+
+// Called when the response CRC is ready in the buffer
+static void cacheResponseCrc(CTX_PARAM) {
+    if (s_readCacheEntry) {
+        memcpy(s_readCacheEntry->response + sizeof(ModbusRtuPacketReadResponse) + messageSize, rs485_buffer, sizeof(uint16_t));
+        s_readCacheEntry->count = bus_cl_header.address.countL;
+        s_readCacheEntry = NULL;
+    }
+}
+#endif
+
+#ifdef BUS_CL_CHANGE_RANGES
+void bus_cl_setChanged(CTX_PARAM_ uint8_t range) {
+    s_rangeChangeSeq[range] = ++bus_cl_changeSeq;
+}
+
+// Sequence numbers can wrap around
+static _Bool isSeqAfter(uint16_t seq, uint16_t ref) {
+    return (int16_t)(seq - ref) > 0;
+}
+
+static void writeChangedRanges(CTX_PARAM) {
+    // Request parameters
+    uint16_t since = (((uint16_t)bus_cl_header.address.registerAddressH) << 8) | bus_cl_header.address.registerAddressL;
+    uint8_t maxCount = (bus_cl_header.address.countH != 0 || bus_cl_header.address.countL > CHANGED_RANGES_MAX_COUNT) ? CHANGED_RANGES_MAX_COUNT : bus_cl_header.address.countL;
+
+    uint16_t seq = bus_cl_changeSeq;
+    if (isSeqAfter(since, seq)) {
+        // Sequence number of before the reset of the node: every range changed since then
+        since = seq;
+        for (uint8_t i = 0; i < BUS_CL_CHANGE_RANGES; i++) {
+            if (isSeqAfter(since, s_rangeChangeSeq[i])) {
+                since = s_rangeChangeSeq[i];
+            }
+        }
+        since--;
+    }
+    uint8_t* data = rs485_buffer + sizeof(ModbusRtuPacketReadResponse) + sizeof(uint16_t);
+    uint8_t count = 0;
+    while (1) {
+        // Find the oldest change after `since`
+        uint8_t found = BUS_CL_CHANGE_RANGES;
+        for (uint8_t i = 0; i < BUS_CL_CHANGE_RANGES; i++) {
+            if (isSeqAfter(s_rangeChangeSeq[i], since) && (found == BUS_CL_CHANGE_RANGES || isSeqAfter(s_rangeChangeSeq[found], s_rangeChangeSeq[i]))) {
+                found = i;
+            }
+        }
+        if (found == BUS_CL_CHANGE_RANGES) {
+            break;
+        }
+        if (count >= maxCount) {
+            // Truncated: the master should ask again from the last range returned
+            seq = since;
+            break;
+        }
+        *(data++) = (uint8_t)(regs_changeRanges[found].address >> 8);
+        *(data++) = (uint8_t)(regs_changeRanges[found].address);
+        *(data++) = 0;
+        *(data++) = regs_changeRanges[found].count;
+        count++;
+        since = s_rangeChangeSeq[found];
+    }
+
+    ((ModbusRtuPacketReadResponse*)rs485_buffer)->header = bus_cl_header.header;
+    rs485_buffer[sizeof(ModbusRtuPacketReadResponse)] = (uint8_t)(seq >> 8);
+    rs485_buffer[sizeof(ModbusRtuPacketReadResponse) + 1] = (uint8_t)seq;
+    ((ModbusRtuPacketReadResponse*)rs485_buffer)->size = sizeof(uint16_t) + count * 4;
+    rs485_write(CTX_ARG_ sizeof(ModbusRtuPacketReadResponse) + sizeof(uint16_t) + count * 4);
+}
+#endif
+
+#ifdef BUS_CL_IMAGES
+void bus_cl_publishImage(BUS_CL_IMAGE* image) {
+    image->readIndex ^= 1;
+    image->seq++;
+}
+
+// Check if the read range in `bus_cl_header` is entirely in an image
+static _Bool findImage(CTX_PARAM) {
+    s_imageRange = NULL;
+    if (bus_cl_header.address.countH != 0 || bus_cl_header.address.countL == 0) {
+        return false;
+    }
+    uint16_t address = (((uint16_t)bus_cl_header.address.registerAddressH) << 8) | bus_cl_header.address.registerAddressL;
+    for (uint8_t i = 0; i < BUS_CL_IMAGES; i++) {
+        const BUS_CL_IMAGE_RANGE* range = &regs_images[i];
+        if (address >= range->address && address + bus_cl_header.address.countL <= range->address + range->count) {
+            s_imageRange = range;
+            s_imageOffset = (uint8_t)(address - range->address) * 2;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copy the requested registers from the published buffer, again if it was published in the meantime
+static void copyImage(CTX_PARAM) {
+    BUS_CL_IMAGE* image = s_imageRange->image;
+    uint8_t seq;
+    do {
+        seq = image->seq;
+        memcpy(rs485_buffer, image->buffers[image->readIndex] + s_imageOffset, bus_cl_header.address.countL * 2);
+    } while (seq != image->seq);
+}
+#endif
+
+// Fill the buffer with the data of the read range in `bus_cl_header`
+static void readData(CTX_PARAM) {
+#ifdef BUS_CL_IMAGES
+    if (s_imageRange) {
+        copyImage(CTX_ARG);
+        return;
+    }
+#endif
+    regs_onSend(CTX_ARG);
+}
+
+#ifdef BUS_CL_MULTIPLE_RANGES_MAX
+// Validate the range in `bus_cl_header` as a read request
+static _Bool validateReadRange(CTX_PARAM) {
+    if (bus_cl_header.address.countH != 0) {
+        bus_cl_exceptionCode = ERR_INVALID_SIZE;
+        return false;
+    }
+#ifdef BUS_CL_IMAGES
+    if (findImage(CTX_ARG)) {
+        if (!READ_DATA_FITS) {
+            bus_cl_exceptionCode = ERR_INVALID_SIZE;
+            return false;
+        }
+        return true;
+    }
+#endif
+    bus_cl_header.header.function = READ_HOLDING_REGISTERS;
+    _Bool ret = regs_validateReg(CTX_ARG);
+    bus_cl_header.header.function = READ_MULTIPLE_RANGES;
+    return ret;
+}
+#endif
+
+// Transmit error data in one go
+static void writeException(CTX_PARAM) {
+    ((ModbusRtuPacketErrorResponse*)rs485_buffer)->header.stationAddress = bus_cl_header.header.stationAddress;
+    ((ModbusRtuPacketErrorResponse*)rs485_buffer)->header.function = bus_cl_header.header.function | 0x80;
+    ((ModbusRtuPacketErrorResponse*)rs485_buffer)->error = bus_cl_exceptionCode;
+    rs485_write(CTX_ARG_ sizeof(ModbusRtuPacketErrorResponse));
+}
+
+// Prepare the read response header, transmitted before the data
+static void setReadResponseHeader(CTX_PARAM) {
+    ((ModbusRtuPacketReadResponse*)rs485_header)->header = bus_cl_header.header;
+    ((ModbusRtuPacketReadResponse*)rs485_header)->size = messageSize;
+}
+
+/**
+ * READ_HOLDING_REGISTERS function
+ */
+
+static _Bool readOnHeader(CTX_PARAM) {
+    // Count(16) is always < 128
+    messageSize = ((uint8_t)bus_cl_header.address.countL) * 2;
+#ifdef BUS_CL_IMAGES
+    if (findImage(CTX_ARG)) {
+#ifdef BUS_CL_READ_CACHE_SIZE
+        // Copying the image is already cheap
+        s_readCacheHit = false;
+        bus_cl_cacheable = false;
+#endif
+        if (!READ_DATA_FITS) {
+            bus_cl_exceptionCode = ERR_INVALID_SIZE;
+            return false;
+        }
+        return true;
+    }
+#endif
+#ifdef BUS_CL_READ_CACHE_SIZE
+    s_readCacheHit = findCachedResponse(CTX_ARG);
+    if (s_readCacheHit) {
+        // Already validated when cached
+        return true;
+    }
+    bus_cl_cacheable = false;
+#endif
+    if (!regs_validateReg(CTX_ARG)) {
+        return false;
+    }
+#ifdef BUS_CL_ASYNC_SEND
+    if (!READ_DATA_FITS) {
+        // The whole data should fit the buffer
+        bus_cl_exceptionCode = ERR_INVALID_SIZE;
+        return false;
+    }
+#endif
+    return true;
+}
+
+#ifndef BUS_CL_ASYNC_SEND
+// Fill the buffer with the response data, transmitted after `headerSize` bytes of `rs485_header`.
+// The line is engaged before calling the handlers, so the data is prepared while the line switches over.
+static void readSendData(CTX_PARAM_ uint8_t headerSize) {
+    rs485_writeWithHeader(CTX_ARG_ headerSize, messageSize);
+    readData(CTX_ARG);
+#ifdef BUS_CL_READ_CACHE_SIZE
+    cacheResponseData(CTX_ARG);
+#endif
+}
+#endif
+
+static BUS_CL_RTU_STATE readOnResponse(CTX_PARAM) {
+#ifdef BUS_CL_READ_CACHE_SIZE
+    if (s_readCacheHit) {
+        // Transmit the whole cached response in one go, CRC included
+        uint8_t size = sizeof(ModbusRtuPacketReadResponse) + messageSize + sizeof(uint16_t);
+        memcpy(rs485_buffer, s_readCacheEntry->response, size);
+        s_readCacheEntry = NULL;
+        rs485_write(CTX_ARG_ size);
+        return BUS_CL_RTU_WAIT_FOR_FLUSH;
+    }
+#endif
+#ifdef BUS_CL_ASYNC_SEND
+    // Prepare the data before the header, the handler can defer it
+    bus_cl_sendPending = false;
+    readData(CTX_ARG);
+    s_sendPendingTime = timers_get();
+    return BUS_CL_RTU_WAIT_FOR_DATA;
+#else
+    // The header is transmitted back-to-back with the data
+    setReadResponseHeader(CTX_ARG);
+    readSendData(CTX_ARG_ sizeof(ModbusRtuPacketReadResponse));
+    return BUS_CL_RTU_WRITE_RESPONSE_CRC;
+#endif
+}
+
+static const BUS_CL_FUNCTION s_readFunction = { readOnHeader, NULL, NULL, readOnResponse, NULL };
+
+/**
+ * WRITE_HOLDING_REGISTERS function
+ */
+
+static _Bool writeOnHeader(CTX_PARAM) {
+    messageSize = ((uint8_t)bus_cl_header.address.countL) * 2;
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+    s_replay = canBeReplayed(CTX_ARG);
+    if (s_replay) {
+        // Validated with the data, if not replayed
+        return true;
+    }
+#endif
+    return regs_validateReg(CTX_ARG);
+}
+
+static _Bool writeOnDataSize(CTX_PARAM_ uint8_t size) {
+    return size == messageSize;
+}
+
+static _Bool writeOnData(CTX_PARAM) {
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+    if (s_replay) {
+        s_replay = isReplayedFrame(CTX_ARG);
+        if (s_replay) {
+            // Already applied: the register handlers are not called
+            return true;
+        }
+        if (!regs_validateReg(CTX_ARG)) {
+            return false;
+        }
+    }
+#endif
+#ifdef BUS_CL_DEFERRED_COMMIT
+    bus_cl_deferCommit = false;
+#endif
+    if (!regs_onReceive(CTX_ARG)) {
+        return false;
+    }
+#ifdef BUS_CL_STAGED_WRITE
+    s_staged = true;
+#endif
+    return true;
+}
+
+static BUS_CL_RTU_STATE writeOnResponse(CTX_PARAM) {
+    // Response of write registers always contains the address and register count
+    *((ModbusRtuPacketWriteResponse*)rs485_buffer) = bus_cl_header;
+    rs485_write(CTX_ARG_ sizeof(ModbusRtuPacketWriteResponse));
+    return BUS_CL_RTU_WRITE_RESPONSE_CRC;
+}
+
+static const BUS_CL_FUNCTION s_writeFunction = { writeOnHeader, writeOnDataSize, writeOnData, writeOnResponse, NULL };
+
+#ifdef BUS_CL_CHANGE_RANGES
+/**
+ * READ_CHANGED_RANGES function
+ */
+
+static _Bool changedRangesOnHeader(CTX_PARAM) {
+    // No register data to validate, but at least a range should be returned, or the master couldn't progress
+    if (bus_cl_header.address.countH == 0 && bus_cl_header.address.countL == 0) {
+        bus_cl_exceptionCode = ERR_INVALID_SIZE;
+        return false;
+    }
+    return true;
+}
+
+static BUS_CL_RTU_STATE changedRangesOnResponse(CTX_PARAM) {
+    writeChangedRanges(CTX_ARG);
+    return BUS_CL_RTU_WRITE_RESPONSE_CRC;
+}
+
+static const BUS_CL_FUNCTION s_changedRangesFunction = { changedRangesOnHeader, NULL, NULL, changedRangesOnResponse, NULL };
+#endif
+
+#ifdef BUS_CL_MULTIPLE_RANGES_MAX
+/**
+ * READ_MULTIPLE_RANGES function
+ */
+
+static _Bool multipleRangesOnHeader(CTX_PARAM) {
+    if (!validateReadRange(CTX_ARG)) {
+        return false;
+    }
+    s_ranges[0] = bus_cl_header.address;
+    s_rangeCount = 1;
+    return true;
+}
+
+// Check the byte count of the additional ranges
+static _Bool multipleRangesOnDataSize(CTX_PARAM_ uint8_t size) {
+    CTX_UNUSED;
+    return (size % sizeof(ModbusRtuHoldingRegisterData)) == 0 && size <= (BUS_CL_MULTIPLE_RANGES_MAX - 1) * sizeof(ModbusRtuHoldingRegisterData);
+}
+
+// Called when the additional ranges are in the buffer
+static _Bool multipleRangesOnData(CTX_PARAM) {
+    const ModbusRtuHoldingRegisterData* range = (const ModbusRtuHoldingRegisterData*)rs485_buffer;
+    for (uint8_t i = messageSize / sizeof(ModbusRtuHoldingRegisterData); i != 0; i--, range++) {
+        bus_cl_header.address = *range;
+        if (!validateReadRange(CTX_ARG)) {
+            return false;
+        }
+        s_ranges[s_rangeCount++] = *range;
+    }
+
+    uint16_t size = 0;
+    for (uint8_t i = 0; i < s_rangeCount; i++) {
+        size += s_ranges[i].countL * 2;
+    }
+    // The whole data is read before the response
+    if (size > READ_RESPONSE_MAX_DATA_SIZE || size > RS485_BUF_SIZE) {
+        bus_cl_exceptionCode = ERR_INVALID_SIZE;
+        return false;
+    }
+    // Now the size of the response data
+    messageSize = (uint8_t)size;
+    return true;
+}
+
+// Read the data of all the ranges before transmitting the response header, so the errors of the handlers 
+// (e.g. device busy) are reported with an exception response
+static BUS_CL_RTU_STATE multipleRangesOnResponse(CTX_PARAM) {
+    // From the last range: the handlers fill the start of the buffer, and each range is then moved 
+    // after the space of the ranges before it
+    uint8_t offset = messageSize;
+    for (uint8_t i = s_rangeCount; i != 0; i--) {
+        bus_cl_header.address = s_ranges[i - 1];
+        // Restore the handler state for the range, validated again
+        if (validateReadRange(CTX_ARG)) {
+#ifdef BUS_CL_ASYNC_SEND
+            bus_cl_sendPending = false;
+#endif
+            readData(CTX_ARG);
+#ifdef BUS_CL_ASYNC_SEND
+            if (bus_cl_sendPending) {
+                // Can't be deferred
+                bus_cl_sendPending = false;
+                bus_cl_exceptionCode = ERR_DEVICE_BUSY;
+            }
+#endif
+        }
+        if (bus_cl_exceptionCode != NO_ERROR) {
+            writeException(CTX_ARG);
+            return BUS_CL_RTU_WRITE_RESPONSE_CRC;
+        }
+        uint8_t size = bus_cl_header.address.countL * 2;
+        offset -= size;
+        memmove(rs485_buffer + offset, rs485_buffer, size);
+    }
+    setReadResponseHeader(CTX_ARG);
+    rs485_writeWithHeader(CTX_ARG_ sizeof(ModbusRtuPacketReadResponse), messageSize);
+    return BUS_CL_RTU_WRITE_RESPONSE_CRC;
+}
+
+static const BUS_CL_FUNCTION s_multipleRangesFunction = { multipleRangesOnHeader, multipleRangesOnDataSize, multipleRangesOnData, multipleRangesOnResponse, NULL };
+#endif
+
+#ifdef BUS_CL_SNAPSHOT
+/**
+ * LATCH_SNAPSHOT function
+ */
+
+static _Bool latchOnHeader(CTX_PARAM) {
+    CTX_UNUSED;
+    // No register data to validate
+    return true;
+}
+
+// Called when the request CRC is validated, at the same time on all the nodes
+static void latch(CTX_PARAM) {
+    bus_cl_snapshotSeq = (((uint16_t)bus_cl_header.address.registerAddressH) << 8) | bus_cl_header.address.registerAddressL;
+    regs_onLatch(CTX_ARG);
+}
+
+// The response is the echo of the request, like the write response
+static const BUS_CL_FUNCTION s_latchFunction = { latchOnHeader, NULL, NULL, writeOnResponse, NULL };
+#endif
+
+// The switch only contains the enabled functions
+static const BUS_CL_FUNCTION* findFunction(uint8_t function) {
+    switch (function) {
+        case READ_HOLDING_REGISTERS:
+            return &s_readFunction;
+        case WRITE_HOLDING_REGISTERS:
+            return &s_writeFunction;
+#ifdef BUS_CL_CHANGE_RANGES
+        case READ_CHANGED_RANGES:
+            return &s_changedRangesFunction;
+#endif
+#ifdef BUS_CL_MULTIPLE_RANGES_MAX
+        case READ_MULTIPLE_RANGES:
+            return &s_multipleRangesFunction;
+#endif
+#ifdef BUS_CL_SNAPSHOT
+        case LATCH_SNAPSHOT:
+            return &s_latchFunction;
+#endif
+#ifdef BUS_CL_CUSTOM_FUNCTIONS
+#define BUS_CL_FUNCTION_CASE(code, handlers) case code: return &handlers;
+        BUS_CL_CUSTOM_FUNCTIONS(BUS_CL_FUNCTION_CASE)
+#undef BUS_CL_FUNCTION_CASE
+#endif
+        default:
+            return NULL;
+    }
+}
+
+#ifdef BUS_CL_ASYNC_SEND
+// Transmit the whole read response in one go, when the data is ready in the buffer
+static void writeReadResponse(CTX_PARAM) {
+#ifdef BUS_CL_READ_CACHE_SIZE
+    cacheResponseData(CTX_ARG);
+#endif
+    setReadResponseHeader(CTX_ARG);
+    rs485_writeWithHeader(CTX_ARG_ sizeof(ModbusRtuPacketReadResponse), messageSize);
+}
+#endif
+
+TICK_TYPE bus_cl_timeout(CTX_PARAM) {
+    if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE && s_requestComplete) {
+        // The response can start at the next poll
+        return 0;
+    }
+#ifdef BUS_CL_ASYNC_SEND
+    if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_DATA) {
+        // Poll `regs_onSendComplete`
+        return TICKS_PER_CHAR;
+    }
+#endif
+    return RS485_NO_TIMEOUT;
 }
 
 // Called often
-__bit bus_cl_poll() {
+__bit bus_cl_poll(CTX_PARAM) {
+#ifdef BUS_CL_DEFERRED_COMMIT
+    if (s_commitDeferred && bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH && rs485_state == RS485_LINE_RX) {
+        // The response is transmitted, now apply the data. Errors can only be stored in the status.
+        s_commitDeferred = false;
+        bus_cl_commitStatus = commitStaged(CTX_ARG) ? NO_ERROR : bus_cl_exceptionCode;
+    }
+#endif
+
     if (rs485_isMarkCondition && bus_cl_rtu_state != BUS_CL_RTU_IDLE) {
-        if (bus_cl_rtu_state != BUS_CL_RTU_WAIT_FOR_RESPONSE) {
+        if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE) {
+            bus_cl_rtu_state = BUS_CL_RTU_RESPONSE;
+        }
+#ifdef BUS_CL_ASYNC_SEND
+        else if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_DATA) {
+            // The response is still to be transmitted
+        }
+#endif
+        else {
             // Abort reading, go idle
+#ifdef BUS_CL_STAGED_WRITE
+            abortStaged(CTX_ARG);
+#endif
             bus_cl_rtu_state = BUS_CL_RTU_IDLE;
             return false;
-        } else {
-            bus_cl_rtu_state = BUS_CL_RTU_RESPONSE;
         }
     }
 
+    if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE && s_requestComplete) {
+        // The RS485 module engages the line in time
+        bus_cl_rtu_state = BUS_CL_RTU_RESPONSE;
+    }
+
+    if (rs485_state == RS485_LINE_RX && (bus_cl_rtu_state == BUS_CL_RTU_SEND_DATA || bus_cl_rtu_state == BUS_CL_RTU_WRITE_RESPONSE_CRC)) {
+        // Response dropped by the RS485 module, the request was not complete
+#ifdef BUS_CL_STAGED_WRITE
+        abortStaged(CTX_ARG);
+#endif
+        bus_cl_rtu_state = BUS_CL_RTU_IDLE;
+        return false;
+    }
+
     if (bus_cl_rtu_state == BUS_CL_RTU_IDLE) {
         // Wait for at least a read message request size
-        if (rs485_readAvail() < sizeof(ModbusRtuHoldingRegisterRequest)) {
+        if (rs485_readAvail(CTX_ARG) < sizeof(ModbusRtuHoldingRegisterRequest)) {
             // Nothing to do, wait for more data
             return false;
         }
         // Read and free the buffer
         bus_cl_header = *((const ModbusRtuHoldingRegisterRequest*)rs485_buffer);
-        rs485_discard(sizeof(ModbusRtuHoldingRegisterRequest));
+        rs485_discard(CTX_ARG_ sizeof(ModbusRtuHoldingRegisterRequest));
+        s_requestComplete = false;
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+        s_replay = false;
+#endif
+#ifdef BUS_CL_SNAPSHOT
+        s_broadcast = false;
+#endif
+#ifdef BUS_CL_READ_CACHE_SIZE
+        s_readCacheHit = false;
+        s_readCacheEntry = NULL;
+#endif
 
-        if (bus_cl_header.header.stationAddress == STATION_NODE) {
-            if (bus_cl_header.header.function == READ_HOLDING_REGISTERS || bus_cl_header.header.function == WRITE_HOLDING_REGISTERS) {
-                if (!regs_validateReg()) {
-                    // Error was set, respond with error
-                    bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_RESPONSE;
-                    return false;
-                }
-                // Count(16) is always < 128
-                messageSize = ((uint8_t)bus_cl_header.address.countL) * 2;
-
-                if (bus_cl_header.header.function == READ_HOLDING_REGISTERS) {
-                    // Ok, function data must be read. Wait for packet to end with CRC and then send
-                    // response
-                    bus_cl_rtu_state = BUS_CL_RTU_CHECK_REQUEST_CRC;
-                } else {
-                    bus_cl_rtu_state = BUS_CL_RTU_RECEIVE_DATA_SIZE;
-                }
-            } else {
+        if (bus_cl_header.header.stationAddress == bus_cl_station) {
+            s_function = findFunction(bus_cl_header.header.function);
+            if (!s_function) {
                 // Invalid function, return error
                 bus_cl_exceptionCode = ERR_INVALID_FUNCTION;
                 bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_RESPONSE;
                 return false;
             }
-        } else {
+            if (!s_function->onHeader(CTX_ARG)) {
+                // Error was set, respond with error
+                bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_RESPONSE;
+                return false;
+            }
+            if (s_function->onDataSize) {
+                bus_cl_rtu_state = BUS_CL_RTU_RECEIVE_DATA_SIZE;
+            } else {
+                // No function data. Wait for packet to end with CRC and then send response
+                bus_cl_rtu_state = BUS_CL_RTU_CHECK_REQUEST_CRC;
+            }
+        }
+#ifdef BUS_CL_SNAPSHOT
+        else if (bus_cl_header.header.stationAddress == BROADCAST_ADDRESS && bus_cl_header.header.function == LATCH_SNAPSHOT) {
+            // Only the CRC to check
+            s_function = &s_latchFunction;
+            s_broadcast = true;
+            bus_cl_rtu_state = BUS_CL_RTU_CHECK_REQUEST_CRC;
+        }
+#endif
+        else {
             // No this station, wait for idle
             bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_IDLE;
         }
     }
     
     if (bus_cl_rtu_state == BUS_CL_RTU_RECEIVE_DATA_SIZE) {
-        if (rs485_readAvail() < 1) {
+        if (rs485_readAvail(CTX_ARG) < 1) {
             // Nothing to do, wait for more data
             return false;
         }
+        uint8_t size = rs485_buffer[0];
         // Free the buffer
-        rs485_discard(1);
-        if (rs485_buffer[0] != messageSize) {
+        rs485_discard(CTX_ARG_ 1);
+        if (!s_function->onDataSize(CTX_ARG_ size)) {
             // Invalid size, return error
             bus_cl_exceptionCode = ERR_INVALID_SIZE;
             bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_RESPONSE;
             return false;
         } else {
+            messageSize = size;
             bus_cl_rtu_state = BUS_CL_RTU_RECEIVE_DATA;
         }
     }
 
     if (bus_cl_rtu_state == BUS_CL_RTU_RECEIVE_DATA) {
         // Wait for register data + count byte
-        if (rs485_readAvail() < messageSize) {
+        uint8_t avail = messageSize;
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+        if (s_replay) {
+            // Also the CRC, to check the frame before dispatching the data
+            avail += sizeof(uint16_t);
+        }
+#endif
+        if (rs485_readAvail(CTX_ARG) < avail) {
             // Nothing to do, wait for more data
             return false;
         }
-        // Free the buffer
-        rs485_discard(messageSize);
-        if (!regs_onReceive()) {
+        // The handler can reuse `messageSize`
+        uint8_t size = messageSize;
+        _Bool ok = s_function->onData(CTX_ARG);
+        // Free the buffer, once the data is consumed
+        rs485_discard(CTX_ARG_ size);
+        if (!ok) {
             // Data/custom error, error is set
             bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_RESPONSE;
             return false;
@@ -125,71 +849,132 @@ __bit bus_cl_poll() {
         // CRC is LSB first
         uint16_t expectedCrc = le16toh(crc16);
 
-        if (rs485_readAvail() < sizeof(uint16_t)) {
+        if (rs485_readAvail(CTX_ARG) < sizeof(uint16_t)) {
             // Nothing to do, wait for more data
             return false;
         }
+        uint16_t crc = *((const uint16_t*)rs485_buffer);
         // Free the buffer
-        rs485_discard(sizeof(uint16_t));
+        rs485_discard(CTX_ARG_ sizeof(uint16_t));
 
         bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_RESPONSE;
-        if (expectedCrc != *((const uint16_t*)rs485_buffer)) {
+        if (expectedCrc != crc) {
             // Invalid CRC, skip data.
+#ifdef BUS_CL_STAGED_WRITE
+            // Staged function data is dropped
+            abortStaged(CTX_ARG);
+#else
             // TODO: However the function data was already sent to registers!
+#endif
             bus_cl_crcErrors++;
             bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_IDLE;
         } else {
-            // Ok, go on with the response
+#ifdef BUS_CL_SNAPSHOT
+            if (s_function == &s_latchFunction) {
+                // As soon as possible, to reduce the skew between the nodes
+                latch(CTX_ARG);
+                if (s_broadcast) {
+                    // No response
+                    bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_IDLE;
+                    return false;
+                }
+            }
+#endif
+            // Ok, go on with the response. The frame length is known, so the frame is complete
             bus_cl_exceptionCode = NO_ERROR;
+            s_requestComplete = true;
+            rs485_setFrameComplete(CTX_ARG);
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+            if (s_replay) {
+                // Data already applied and never staged: send the same (echo) response
+            } else if (isReplayedWrite(CTX_ARG_ expectedCrc)) {
+                // Frame too big to be checked before staging: drop the staged copy
+                abortStaged(CTX_ARG);
+            }
+#endif
+#ifdef BUS_CL_STAGED_WRITE
+            if (s_staged) {
+                s_staged = false;
+#ifdef BUS_CL_DEFERRED_COMMIT
+                if (bus_cl_deferCommit) {
+                    // Committed after the response is transmitted
+                    s_commitDeferred = true;
+                    bus_cl_commitStatus = BUS_CL_COMMIT_PENDING;
+                } else
+#endif
+                {
+                    commitStaged(CTX_ARG);
+                }
+            }
+#endif
         }
     }
 
     if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE) {
-        rs485_discard(rs485_readAvail());
+        rs485_discard(CTX_ARG_ rs485_readAvail(CTX_ARG));
         return false;
     }
 
     if (bus_cl_rtu_state == BUS_CL_RTU_RESPONSE) {
-        // Copy whole header (and overwrite data in case of error)
-        // Response of write registers always contains the address and register count
-        *((ModbusRtuHoldingRegisterRequest*)rs485_buffer) = bus_cl_header;
         if (bus_cl_exceptionCode == NO_ERROR) {
-            // Transmit packet data in one go
-            if (bus_cl_header.header.function == READ_HOLDING_REGISTERS) {
-                // Now, if write, open stream
-                ((ModbusRtuPacketReadResponse*)rs485_buffer)->size = messageSize;
-                rs485_write(sizeof(ModbusRtuPacketReadResponse));
-                bus_cl_rtu_state = BUS_CL_RTU_SEND_DATA;
-            } else {
-                rs485_write(sizeof(ModbusRtuPacketWriteResponse));
-                bus_cl_rtu_state = BUS_CL_RTU_WRITE_RESPONSE_CRC;
-            }
+            bus_cl_rtu_state = s_function->onResponse(CTX_ARG);
         } else {
-            // Transmit error data in one go
-            ((ModbusRtuPacketErrorResponse*)rs485_buffer)->header.function = ((ModbusRtuPacketErrorResponse*)rs485_buffer)->header.function | 0x80;
-            ((ModbusRtuPacketErrorResponse*)rs485_buffer)->error = bus_cl_exceptionCode;
-            rs485_write(sizeof(ModbusRtuPacketErrorResponse));
+            writeException(CTX_ARG);
             bus_cl_rtu_state = BUS_CL_RTU_WRITE_RESPONSE_CRC;
         }
     }
 
+#ifdef BUS_CL_ASYNC_SEND
+    if (bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_DATA) {
+        if (rs485_readAvail(CTX_ARG) > 0 || rs485_frameError) {
+            // The master gave up (e.g. a retry, or a request to another station): drop the response,
+            // not to collide with the traffic on the line, and handle the new frame
+            bus_cl_sendPending = false;
+            bus_cl_rtu_state = BUS_CL_RTU_IDLE;
+            return false;
+        }
+        if (bus_cl_sendPending) {
+            if (!regs_onSendComplete(CTX_ARG)) {
+                if ((TICK_TYPE)(timers_get() - s_sendPendingTime) < BUS_CL_ASYNC_SEND_TIMEOUT) {
+                    // Data still not ready
+                    return false;
+                }
+                // Give up, the master would time out
+                bus_cl_exceptionCode = ERR_DEVICE_BUSY;
+            }
+            bus_cl_sendPending = false;
+        }
+        if (bus_cl_exceptionCode == NO_ERROR) {
+            writeReadResponse(CTX_ARG);
+        } else {
+            writeException(CTX_ARG);
+        }
+        bus_cl_rtu_state = BUS_CL_RTU_WRITE_RESPONSE_CRC;
+    }
+#endif
+
     if (bus_cl_rtu_state == BUS_CL_RTU_SEND_DATA) {
         // Wait for the bus to switch over
-        if (rs485_writeInProgress()) {
+        if (rs485_writeInProgress(CTX_ARG)) {
+            return false;
+        }
+        if (!s_function->onSendData(CTX_ARG)) {
+            // More data to send
             return false;
         }
-        regs_onSend();
-        rs485_write(messageSize);
         bus_cl_rtu_state = BUS_CL_RTU_WRITE_RESPONSE_CRC;
     }
 
     if (bus_cl_rtu_state == BUS_CL_RTU_WRITE_RESPONSE_CRC) {
-        if (rs485_writeInProgress()) {
+        if (rs485_writeInProgress(CTX_ARG)) {
             return false;
         }
         // CRC is LSB first
         *((uint16_t*)rs485_buffer) = htole16(crc16);
-        rs485_write(sizeof(uint16_t));
+#ifdef BUS_CL_READ_CACHE_SIZE
+        cacheResponseCrc(CTX_ARG);
+#endif
+        rs485_write(CTX_ARG_ sizeof(uint16_t));
         bus_cl_rtu_state = BUS_CL_RTU_WAIT_FOR_FLUSH;
         return false;
     }
@@ -0,0 +1,432 @@
+#include <string.h>
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/bus_master.h"
+
+/**
+ * Modbus RTU master engine, see `bus_master.h`
+ */
+
+#ifndef MODBUS_CONTEXT_API
+BUS_MS_CONTEXT bus_ms_ctx;
+#endif
+
+// See `BUS_MS_CONTEXT`
+#define s_state (MODBUS_CTX(bus_ms).state)
+#define s_queue (MODBUS_CTX(bus_ms).queue)
+#define s_queueHead (MODBUS_CTX(bus_ms).queueHead)
+#define s_retries (MODBUS_CTX(bus_ms).retries)
+#define s_lastTick (MODBUS_CTX(bus_ms).lastTick)
+#define s_skipResult (MODBUS_CTX(bus_ms).skipResult)
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+#define s_timeout (MODBUS_CTX(bus_ms).timeout)
+#define s_turnaround (MODBUS_CTX(bus_ms).turnaround)
+#define s_nodes (MODBUS_CTX(bus_ms).nodes)
+#define s_nextNode (MODBUS_CTX(bus_ms).nextNode)
+#else
+#define s_timeout BUS_MS_RESPONSE_TIMEOUT
+#endif
+
+// The request in progress
+#define s_request (s_queue[s_queueHead])
+
+// Station, function and byte count (or exception code), followed by the data and the CRC
+#define RESPONSE_HEADER_SIZE (3)
+#define ERROR_RESPONSE_SIZE (RESPONSE_HEADER_SIZE + sizeof(uint16_t))
+// Echo of the request header, and the CRC
+#define WRITE_RESPONSE_SIZE (sizeof(ModbusRtuHoldingRegisterRequest) + sizeof(uint16_t))
+
+void bus_ms_init(CTX_PARAM) {
+    s_state = BUS_MS_IDLE;
+    s_queueHead = 0;
+    bus_ms_pending = 0;
+    s_retries = 0;
+    bus_ms_crcErrors = 0;
+    bus_ms_timeouts = 0;
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+    memset(s_nodes, 0, sizeof(s_nodes));
+    s_nextNode = 0;
+    bus_ms_skipped = 0;
+#endif
+}
+
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+static BUS_MS_NODE* findNode(CTX_PARAM_ uint8_t station) {
+    for (uint8_t i = 0; i < BUS_MS_ADAPTIVE_TIMEOUT; i++) {
+        if (s_nodes[i].station == station) {
+            return &s_nodes[i];
+        }
+    }
+    return NULL;
+}
+
+// The entry of the node, a free one or the oldest one
+static BUS_MS_NODE* addNode(CTX_PARAM_ uint8_t station) {
+    BUS_MS_NODE* node = findNode(CTX_ARG_ station);
+    if (node) {
+        return node;
+    }
+    node = findNode(CTX_ARG_ 0);
+    if (!node) {
+        node = &s_nodes[s_nextNode];
+        s_nextNode = (s_nextNode + 1) % BUS_MS_ADAPTIVE_TIMEOUT;
+    }
+    memset(node, 0, sizeof(BUS_MS_NODE));
+    node->station = station;
+    return node;
+}
+
+static _Bool isDown(const BUS_MS_NODE* node) {
+    return node && node->failures > 0;
+}
+
+// A node down, and not yet time to probe it
+static _Bool isSkipped(CTX_PARAM_ uint8_t station) {
+    const BUS_MS_NODE* node = findNode(CTX_ARG_ station);
+    if (!isDown(node)) {
+        return false;
+    }
+    TICK_TYPE interval = BUS_MS_PROBE_INTERVAL;
+    for (uint8_t i = 1; i < node->failures && interval < BUS_MS_PROBE_MAX_INTERVAL; i++) {
+        interval *= 2;
+    }
+    if (interval > BUS_MS_PROBE_MAX_INTERVAL) {
+        interval = BUS_MS_PROBE_MAX_INTERVAL;
+    }
+    return (TICK_TYPE)(timers_get() - node->failedTick) < interval;
+}
+
+_Bool bus_ms_isDown(CTX_PARAM_ uint8_t station) {
+    return isDown(findNode(CTX_ARG_ station));
+}
+
+TICK_TYPE bus_ms_responseTimeout(CTX_PARAM_ uint8_t station) {
+    const BUS_MS_NODE* node = findNode(CTX_ARG_ station);
+    if (!node || node->srtt == 0 || isDown(node)) {
+        return BUS_MS_RESPONSE_TIMEOUT;
+    }
+    TICK_TYPE timeout = (node->srtt >> 3) + node->rttvar;
+    if (timeout < BUS_MS_MIN_RESPONSE_TIMEOUT) {
+        timeout = BUS_MS_MIN_RESPONSE_TIMEOUT;
+    }
+    return timeout < BUS_MS_RESPONSE_TIMEOUT ? timeout : BUS_MS_RESPONSE_TIMEOUT;
+}
+
+// Timeout of the request in progress: doubled at each retry
+static TICK_TYPE responseTimeout(CTX_PARAM) {
+    TICK_TYPE timeout = bus_ms_responseTimeout(CTX_ARG_ s_request.station);
+    for (uint8_t i = 0; i < s_retries && timeout < BUS_MS_RESPONSE_TIMEOUT; i++) {
+        timeout *= 2;
+    }
+    return timeout < BUS_MS_RESPONSE_TIMEOUT ? timeout : BUS_MS_RESPONSE_TIMEOUT;
+}
+
+// Valid response of the node (also an exception)
+static void nodeAnswered(CTX_PARAM) {
+    BUS_MS_NODE* node = addNode(CTX_ARG_ s_request.station);
+    node->failures = 0;
+    if (s_retries > 0 || s_turnaround == 0) {
+        // Maybe the response of a previous transmission
+        return;
+    }
+    if (node->srtt == 0) {
+        node->srtt = s_turnaround << 3;
+        node->rttvar = s_turnaround << 1;
+    } else {
+        // Fixed point, as the TCP stacks: srtt += (r - srtt) / 8, rttvar += (|r - srtt| - rttvar) / 4
+        TICK_TYPE srtt = node->srtt >> 3;
+        TICK_TYPE error = s_turnaround >= srtt ? s_turnaround - srtt : srtt - s_turnaround;
+        if (s_turnaround >= srtt) {
+            node->srtt += s_turnaround - srtt;
+        } else {
+            node->srtt -= srtt - s_turnaround;
+        }
+        node->rttvar = node->rttvar - (node->rttvar >> 2) + error;
+    }
+}
+
+// No response after the retries
+static void nodeFailed(CTX_PARAM) {
+    BUS_MS_NODE* node = addNode(CTX_ARG_ s_request.station);
+    if (node->failures < 0xff) {
+        node->failures++;
+    }
+    node->failedTick = timers_get();
+}
+#endif
+
+_Bool bus_ms_isValid(const BUS_MS_REQUEST* request) {
+    if (request->count == 0) {
+        return false;
+    }
+    if (request->function == READ_HOLDING_REGISTERS) {
+        return request->station != BROADCAST_ADDRESS && RESPONSE_HEADER_SIZE + request->count * 2 + sizeof(uint16_t) <= RS485_BUF_SIZE;
+    } else if (request->function == WRITE_HOLDING_REGISTERS) {
+        // The CRC is written after the data
+        return sizeof(ModbusRtuHoldingRegisterRequest) + 1 + request->count * 2 <= RS485_BUF_SIZE;
+    }
+    return false;
+}
+
+_Bool bus_ms_enqueue(CTX_PARAM_ const BUS_MS_REQUEST* request) {
+    if (bus_ms_pending >= BUS_MS_QUEUE_SIZE || !bus_ms_isValid(request)) {
+        return false;
+    }
+    s_queue[(s_queueHead + bus_ms_pending) % BUS_MS_QUEUE_SIZE] = *request;
+    bus_ms_pending++;
+    return true;
+}
+
+static void writeRequest(CTX_PARAM) {
+    ModbusRtuHoldingRegisterRequest* header = (ModbusRtuHoldingRegisterRequest*)rs485_buffer;
+    header->header.stationAddress = s_request.station;
+    header->header.function = s_request.function;
+    header->address.registerAddressBe = htobe16(s_request.address);
+    header->address.countBe = htobe16(s_request.count);
+    RS485_SIZE_TYPE size = sizeof(ModbusRtuHoldingRegisterRequest);
+    if (s_request.function == WRITE_HOLDING_REGISTERS) {
+        rs485_buffer[size++] = s_request.count * 2;
+        for (uint8_t i = 0; i < s_request.count; i++) {
+            rs485_buffer[size++] = (uint8_t)(s_request.data[i] >> 8);
+            rs485_buffer[size++] = (uint8_t)s_request.data[i];
+        }
+    }
+    rs485_write(CTX_ARG_ size);
+}
+
+static void complete(CTX_PARAM_ uint8_t result) {
+    // The handler can queue more requests
+    BUS_MS_REQUEST request = s_request;
+    s_queueHead = (s_queueHead + 1) % BUS_MS_QUEUE_SIZE;
+    bus_ms_pending--;
+    s_retries = 0;
+    s_state = BUS_MS_IDLE;
+    if (request.onComplete) {
+        request.onComplete(CTX_ARG_ &request, result);
+    }
+}
+
+// Transmit the request again, or fail with `result`
+static void retry(CTX_PARAM_ uint8_t result) {
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+    // The probes of the nodes down are not retried
+    uint8_t retries = bus_ms_isDown(CTX_ARG_ s_request.station) ? 0 : BUS_MS_RETRIES;
+#else
+    uint8_t retries = BUS_MS_RETRIES;
+#endif
+    if (s_retries < retries) {
+        s_retries++;
+        s_state = BUS_MS_IDLE;
+    } else {
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+        if (result == BUS_MS_ERR_TIMEOUT) {
+            nodeFailed(CTX_ARG);
+        }
+#endif
+        complete(CTX_ARG_ result);
+    }
+}
+
+// Skip the rest of the response, then retry
+static void skip(CTX_PARAM_ uint8_t result) {
+    s_skipResult = result;
+    s_state = BUS_MS_SKIP;
+}
+
+// Size of the whole response, known from its header. Up to 260 bytes for a wrong byte count.
+static uint16_t responseSize(const uint8_t* header) {
+    if (header[1] & 0x80) {
+        return ERROR_RESPONSE_SIZE;
+    } else if (header[1] == READ_HOLDING_REGISTERS) {
+        return RESPONSE_HEADER_SIZE + header[2] + sizeof(uint16_t);
+    } else {
+        return WRITE_RESPONSE_SIZE;
+    }
+}
+
+// Parse the response, with valid CRC. Returns the result, or `BUS_MS_ERR_INVALID_RESPONSE`
+static uint8_t parseResponse(CTX_PARAM_ const uint8_t* frame) {
+    if (frame[1] & 0x80) {
+        return frame[2];
+    }
+    if (s_request.function == READ_HOLDING_REGISTERS) {
+        if (frame[2] != s_request.count * 2) {
+            return BUS_MS_ERR_INVALID_RESPONSE;
+        }
+        const uint8_t* data = frame + RESPONSE_HEADER_SIZE;
+        for (uint8_t i = 0; i < s_request.count; i++, data += 2) {
+            s_request.data[i] = (data[0] << 8) | data[1];
+        }
+    } else {
+        const ModbusRtuHoldingRegisterRequest* echo = (const ModbusRtuHoldingRegisterRequest*)frame;
+        if (be16toh(echo->address.registerAddressBe) != s_request.address || be16toh(echo->address.countBe) != s_request.count) {
+            return BUS_MS_ERR_INVALID_RESPONSE;
+        }
+    }
+    return NO_ERROR;
+}
+
+static void receive(CTX_PARAM) {
+    RS485_SIZE_TYPE avail = rs485_readAvail(CTX_ARG);
+    if (avail == 0) {
+        if ((TICK_TYPE)(timers_get() - s_lastTick) >= s_timeout) {
+            bus_ms_timeouts++;
+            retry(CTX_ARG_ BUS_MS_ERR_TIMEOUT);
+        }
+        return;
+    }
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+    if (s_turnaround == 0) {
+        s_turnaround = timers_get() - s_lastTick;
+        if (s_turnaround == 0) {
+            s_turnaround = 1;
+        }
+    }
+#endif
+    if (avail < RESPONSE_HEADER_SIZE) {
+        if (rs485_isMarkCondition) {
+            // Truncated
+            skip(CTX_ARG_ BUS_MS_ERR_INVALID_RESPONSE);
+        }
+        return;
+    }
+
+    if (rs485_buffer[0] != s_request.station || (rs485_buffer[1] & 0x7f) != s_request.function) {
+        skip(CTX_ARG_ BUS_MS_ERR_INVALID_RESPONSE);
+        return;
+    }
+    uint16_t size = responseSize(rs485_buffer);
+    if (size > RS485_BUF_SIZE) {
+        skip(CTX_ARG_ BUS_MS_ERR_INVALID_RESPONSE);
+        return;
+    }
+    if (avail < size) {
+        if (rs485_isMarkCondition) {
+            // Truncated
+            skip(CTX_ARG_ BUS_MS_ERR_INVALID_RESPONSE);
+        }
+        return;
+    }
+
+    // The CRC of the whole frame, CRC included, is zero
+    uint8_t frame[RS485_BUF_SIZE];
+    memcpy(frame, rs485_buffer, size);
+    rs485_discard(CTX_ARG_ size);
+    if (crc16 != 0) {
+        bus_ms_crcErrors++;
+        skip(CTX_ARG_ BUS_MS_ERR_INVALID_RESPONSE);
+        return;
+    }
+    uint8_t result = parseResponse(CTX_ARG_ frame);
+    if (result == BUS_MS_ERR_INVALID_RESPONSE) {
+        skip(CTX_ARG_ result);
+    } else {
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+        nodeAnswered(CTX_ARG);
+#endif
+        complete(CTX_ARG_ result);
+    }
+}
+
+void bus_ms_poll(CTX_PARAM) {
+    if (s_state == BUS_MS_IDLE) {
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+        // One per poll, the handler could queue another request to the same node
+        if (bus_ms_pending > 0 && isSkipped(CTX_ARG_ s_request.station)) {
+            bus_ms_skipped++;
+            complete(CTX_ARG_ BUS_MS_ERR_NODE_DOWN);
+            return;
+        }
+#endif
+        // Wait for the line to be idle
+        if (bus_ms_pending == 0 || rs485_state != RS485_LINE_RX || !rs485_isMarkCondition) {
+            return;
+        }
+        // Drop stray data
+        rs485_discard(CTX_ARG_ rs485_readAvail(CTX_ARG));
+        writeRequest(CTX_ARG);
+        s_state = BUS_MS_SEND;
+        return;
+    }
+
+    if (s_state == BUS_MS_SEND) {
+        if (rs485_writeInProgress(CTX_ARG)) {
+            return;
+        }
+        // CRC is LSB first
+        *((uint16_t*)rs485_buffer) = htole16(crc16);
+        rs485_write(CTX_ARG_ sizeof(uint16_t));
+        s_state = BUS_MS_WAIT_FOR_FLUSH;
+        return;
+    }
+
+    if (s_state == BUS_MS_WAIT_FOR_FLUSH) {
+        if (rs485_state != RS485_LINE_RX) {
+            return;
+        }
+        s_lastTick = timers_get();
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+        s_timeout = responseTimeout(CTX_ARG);
+        s_turnaround = 0;
+#endif
+        s_state = s_request.station == BROADCAST_ADDRESS ? BUS_MS_TURNAROUND : BUS_MS_RECEIVE;
+    }
+
+    if (s_state == BUS_MS_TURNAROUND) {
+        if ((TICK_TYPE)(timers_get() - s_lastTick) >= BUS_MS_TURNAROUND_DELAY) {
+            complete(CTX_ARG_ NO_ERROR);
+        }
+        return;
+    }
+
+    if (s_state == BUS_MS_RECEIVE) {
+        receive(CTX_ARG);
+    }
+
+    if (s_state == BUS_MS_SKIP) {
+        rs485_discard(CTX_ARG_ rs485_readAvail(CTX_ARG));
+        if (rs485_isMarkCondition) {
+            retry(CTX_ARG_ s_skipResult);
+        }
+    }
+}
+
+// Ticks left before `timeout` ticks are elapsed from the end of the request
+static TICK_TYPE remaining(CTX_PARAM_ TICK_TYPE timeout) {
+    TICK_TYPE elapsed = timers_get() - s_lastTick;
+    return elapsed >= timeout ? 0 : timeout - elapsed;
+}
+
+TICK_TYPE bus_ms_timeout(CTX_PARAM) {
+    switch (s_state) {
+        case BUS_MS_IDLE:
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+            if (bus_ms_pending > 0 && isSkipped(CTX_ARG_ s_request.station)) {
+                return 0;
+            }
+#endif
+            if (bus_ms_pending > 0 && rs485_state == RS485_LINE_RX && rs485_isMarkCondition) {
+                return 0;
+            }
+            break;
+        case BUS_MS_SEND:
+            if (!rs485_writeInProgress(CTX_ARG)) {
+                return 0;
+            }
+            break;
+        case BUS_MS_RECEIVE:
+            if (rs485_readAvail(CTX_ARG) == 0) {
+                return remaining(CTX_ARG_ s_timeout);
+            }
+            break;
+        case BUS_MS_SKIP:
+            if (rs485_isMarkCondition) {
+                return 0;
+            }
+            break;
+        case BUS_MS_TURNAROUND:
+            return remaining(CTX_ARG_ BUS_MS_TURNAROUND_DELAY);
+        default:
+            break;
+    }
+    return RS485_NO_TIMEOUT;
+}
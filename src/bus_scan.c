@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/bus_scan.h"
+
+/**
+ * Scan-cycle planner of the master, see `bus_scan.h`
+ */
+
+static uint32_t endOf(const BUS_SCAN_POINT* point) {
+    return (uint32_t)point->address + point->count;
+}
+
+static int compare(const void* a, const void* b) {
+    const BUS_SCAN_POINT* p1 = (const BUS_SCAN_POINT*)a;
+    const BUS_SCAN_POINT* p2 = (const BUS_SCAN_POINT*)b;
+    if (p1->station != p2->station) {
+        return p1->station - p2->station;
+    }
+    if (p1->address != p2->address) {
+        return p1->address - p2->address;
+    }
+    return p1->count - p2->count;
+}
+
+// The gaps between the points `first`..`last` (sorted) are small enough to read them together
+static _Bool gapsFit(const BUS_SCAN_POINT* points, uint16_t first, uint16_t last, uint16_t maxGap) {
+    uint32_t end = endOf(&points[first]);
+    for (uint16_t i = first + 1; i <= last; i++) {
+        if (points[i].address > end && points[i].address - end > maxGap) {
+            return false;
+        }
+        if (endOf(&points[i]) > end) {
+            end = endOf(&points[i]);
+        }
+    }
+    return true;
+}
+
+// End of the registers of the points `first`..`last`
+static uint32_t readEnd(const BUS_SCAN_POINT* points, uint16_t first, uint16_t last) {
+    uint32_t end = 0;
+    for (uint16_t i = first; i <= last; i++) {
+        end = endOf(&points[i]) > end ? endOf(&points[i]) : end;
+    }
+    return end;
+}
+
+void bus_scan_rtuCosts(BUS_SCAN_COSTS* costs, TICK_TYPE turnaround) {
+    costs->transactionCost = (uint32_t)BUS_SCAN_TRANSACTION_CHARS * TICKS_PER_CHAR + turnaround;
+    costs->registerCost = 2 * (uint32_t)TICKS_PER_CHAR;
+    costs->maxRegisters = BUS_SCAN_MAX_REGISTERS;
+    costs->maxGap = 0xffff;
+}
+
+int bus_scan_plan(BUS_SCAN_POINT* points, uint16_t pointCount, const BUS_SCAN_COSTS* costs, BUS_MS_REQUEST* reads, uint16_t maxReads, uint16_t* data, uint16_t dataSize) {
+    uint8_t maxRegisters = costs->maxRegisters < BUS_SCAN_MAX_REGISTERS ? costs->maxRegisters : BUS_SCAN_MAX_REGISTERS;
+    for (uint16_t i = 0; i < pointCount; i++) {
+        if (points[i].count == 0 || points[i].count > maxRegisters || endOf(&points[i]) > 0x10000) {
+            return -1;
+        }
+    }
+    qsort(points, pointCount, sizeof(BUS_SCAN_POINT), compare);
+
+    // The best plan of the points up to `i` ends with a read of the points `first`..`i` of the same node,
+    // after the best plan of the points before `first`
+    for (uint16_t i = 0; i < pointCount; i++) {
+        BUS_SCAN_POINT* point = &points[i];
+        point->planCost = UINT32_MAX;
+        uint32_t end = endOf(point);
+        for (int32_t first = i; first >= 0 && points[first].station == point->station; first--) {
+            if (endOf(&points[first]) > end) {
+                end = endOf(&points[first]);
+            }
+            uint32_t span = end - points[first].address;
+            if (span > maxRegisters) {
+                // Only wider with the points before
+                break;
+            }
+            if (!gapsFit(points, (uint16_t)first, i, costs->maxGap)) {
+                continue;
+            }
+            uint32_t cost = (first > 0 ? points[first - 1].planCost : 0) + costs->transactionCost + span * costs->registerCost;
+            if (cost < point->planCost) {
+                point->planCost = cost;
+                point->planFirst = (uint16_t)first;
+            }
+        }
+    }
+
+    // The reads, from the last one
+    uint16_t readCount = 0;
+    uint32_t registers = 0;
+    for (int32_t last = (int32_t)pointCount - 1; last >= 0; last = points[last].planFirst - 1) {
+        registers += readEnd(points, points[last].planFirst, (uint16_t)last) - points[points[last].planFirst].address;
+        readCount++;
+    }
+    if (readCount > maxReads || registers > dataSize) {
+        return -1;
+    }
+    uint16_t r = readCount;
+    for (int32_t last = (int32_t)pointCount - 1; last >= 0; last = points[last].planFirst - 1) {
+        uint16_t first = points[last].planFirst;
+        BUS_MS_REQUEST* read = &reads[--r];
+        read->station = points[first].station;
+        read->function = READ_HOLDING_REGISTERS;
+        read->address = points[first].address;
+        read->count = (uint8_t)(readEnd(points, first, (uint16_t)last) - read->address);
+        registers -= read->count;
+        read->data = data + registers;
+        read->onComplete = NULL;
+        read->user = NULL;
+        for (uint16_t i = first; i <= last; i++) {
+            points[i].read = r;
+            points[i].data = read->data + (points[i].address - read->address);
+        }
+    }
+    return readCount;
+}
+
+uint32_t bus_scan_cost(const BUS_SCAN_COSTS* costs, const BUS_MS_REQUEST* reads, uint16_t readCount) {
+    uint32_t cost = 0;
+    for (uint16_t i = 0; i < readCount; i++) {
+        cost += costs->transactionCost + reads[i].count * costs->registerCost;
+    }
+    return cost;
+}
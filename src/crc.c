@@ -1,12 +1,14 @@
-#include "pic-modbus/crc.h"
+#include "pic-modbus/modbus.h"
 
-uint16_t crc16;
+#ifndef MODBUS_CONTEXT_API
+CRC_CONTEXT crc_ctx;
+#endif
 
-void crc_reset() {
+void crc_reset(CTX_PARAM) {
     crc16 = 0xffff;
 }
 
-void crc_update(uint8_t ch) {
+void crc_update(CTX_PARAM_ uint8_t ch) {
     crc16 ^= ch;
     for (uint8_t i = 8; i != 0; i--) {
         if (crc16 & 1) {
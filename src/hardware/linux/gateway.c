@@ -0,0 +1,685 @@
+// accept4
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "pic-modbus/linux/gateway.h"
+
+// Modbus TCP to RTU gateway, see `gateway.h`
+
+// Unit identifier, function, address and count
+#define REQUEST_SIZE (GATEWAY_MBAP_SIZE - 1 + sizeof(ModbusRtuHoldingRegisterRequest))
+
+static void onClientEvents(MODBUS_LOOP_FD* source, uint32_t events);
+
+static uint16_t readBe16(const uint8_t* data) {
+    return (data[0] << 8) | data[1];
+}
+
+static void writeBe16(uint8_t* data, uint16_t value) {
+    data[0] = (uint8_t)(value >> 8);
+    data[1] = (uint8_t)value;
+}
+
+static uint8_t clientIndex(GATEWAY_CLIENT* client) {
+    return (uint8_t)(client - client->gateway->clients);
+}
+
+static void closeClient(GATEWAY_CLIENT* client) {
+    GATEWAY* gateway = client->gateway;
+    // Drop the queued requests, but not the active ones
+    for (uint8_t p = 0; p < gateway->portCount; p++) {
+        GATEWAY_PORT* port = &gateway->ports[p];
+        for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+            GATEWAY_TRANSACTION* t = &port->queue[i];
+            if (t->used && !t->merged && t->client == clientIndex(client) && t->generation == client->generation) {
+                t->used = false;
+                port->queueCount--;
+            }
+        }
+    }
+    modbus_loop_removeFd(&gateway->loop, &client->source);
+    close(client->source.fd);
+    client->source.fd = -1;
+    client->generation++;
+}
+
+// There is room for the responses of all the requests in progress, and of the next one
+static _Bool canAccept(GATEWAY_CLIENT* client) {
+    return client->pending < GATEWAY_CLIENT_PENDING && client->txCount + (client->pending + 1) * GATEWAY_FRAME_SIZE <= GATEWAY_CLIENT_TX_SIZE;
+}
+
+static void updateEvents(GATEWAY_CLIENT* client) {
+    uint32_t events = 0;
+    if (canAccept(client) && client->rxCount < GATEWAY_FRAME_SIZE) {
+        events |= EPOLLIN;
+    }
+    if (client->txCount > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events != client->events) {
+        client->events = events;
+        modbus_loop_modifyFd(&client->gateway->loop, &client->source, events);
+    }
+}
+
+// Returns false if the client was closed
+static _Bool flush(GATEWAY_CLIENT* client) {
+    if (client->txCount == 0) {
+        return true;
+    }
+    ssize_t count = send(client->source.fd, client->txBuffer, client->txCount, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            closeClient(client);
+            return false;
+        }
+        count = 0;
+    }
+    client->txCount -= count;
+    memmove(client->txBuffer, client->txBuffer + count, client->txCount);
+    return true;
+}
+
+// Queue a response with its MBAP header, and send it
+static void respond(GATEWAY_CLIENT* client, uint16_t transactionId, uint8_t unit, const uint8_t* pdu, uint8_t pduSize) {
+    uint8_t* frame = client->txBuffer + client->txCount;
+    writeBe16(frame, transactionId);
+    writeBe16(frame + 2, 0);
+    writeBe16(frame + 4, pduSize + 1);
+    frame[6] = unit;
+    memcpy(frame + GATEWAY_MBAP_SIZE, pdu, pduSize);
+    client->txCount += GATEWAY_MBAP_SIZE + pduSize;
+    if (flush(client)) {
+        updateEvents(client);
+    }
+}
+
+static void respondException(GATEWAY_CLIENT* client, uint16_t transactionId, uint8_t unit, uint8_t function, uint8_t code) {
+    uint8_t pdu[2] = { function | 0x80, code };
+    client->gateway->exceptions++;
+    respond(client, transactionId, unit, pdu, sizeof(pdu));
+}
+
+static void respondRead(GATEWAY_CLIENT* client, uint16_t transactionId, uint8_t unit, const uint16_t* data, uint8_t count) {
+    uint8_t pdu[2 + GATEWAY_MAX_REGISTERS * 2];
+    pdu[0] = READ_HOLDING_REGISTERS;
+    pdu[1] = count * 2;
+    for (uint8_t i = 0; i < count; i++) {
+        writeBe16(pdu + 2 + i * 2, data[i]);
+    }
+    respond(client, transactionId, unit, pdu, 2 + count * 2);
+}
+
+// Microseconds from `CLOCK_MONOTONIC`, for the cache
+static uint64_t now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// Time-to-live of the registers of a read: the shortest one of the ranges it overlaps, 0 if not cached
+// or if a register is not in any range
+static uint64_t cacheTtl(GATEWAY* gateway, const BUS_MS_REQUEST* request) {
+    uint32_t end = (uint32_t)request->address + request->count;
+    uint64_t ttl = UINT64_MAX;
+    for (uint8_t i = 0; i < gateway->cacheRuleCount; i++) {
+        const GATEWAY_CACHE_RULE* rule = &gateway->cacheRules[i];
+        if (rule->unit == request->station && request->address < (uint32_t)rule->address + rule->count
+            && end > rule->address && rule->ttl < ttl) {
+            ttl = rule->ttl;
+        }
+    }
+    // The registers covered by the ranges, from the first one
+    uint32_t covered = request->address;
+    while (covered < end) {
+        uint32_t next = covered;
+        for (uint8_t i = 0; i < gateway->cacheRuleCount; i++) {
+            const GATEWAY_CACHE_RULE* rule = &gateway->cacheRules[i];
+            uint32_t ruleEnd = (uint32_t)rule->address + rule->count;
+            if (rule->unit == request->station && rule->address <= covered && ruleEnd > next) {
+                next = ruleEnd;
+            }
+        }
+        if (next == covered) {
+            return 0;
+        }
+        covered = next;
+    }
+    return ttl;
+}
+
+// The registers of a read, if cached and not expired
+static const uint16_t* cacheLookup(GATEWAY* gateway, const BUS_MS_REQUEST* request) {
+    uint64_t ttl = cacheTtl(gateway, request);
+    if (ttl == 0) {
+        return NULL;
+    }
+    uint64_t time = now();
+    for (uint8_t i = 0; i < GATEWAY_CACHE_ENTRIES; i++) {
+        const GATEWAY_CACHE_ENTRY* entry = &gateway->cache[i];
+        if (entry->used && entry->unit == request->station && request->address >= entry->address
+            && request->address + request->count <= entry->address + entry->count && time - entry->time < ttl) {
+            return entry->data + (request->address - entry->address);
+        }
+    }
+    return NULL;
+}
+
+// Store the registers read, if a part of them can be cached
+static void cacheStore(GATEWAY* gateway, const BUS_MS_REQUEST* request) {
+    _Bool cacheable = false;
+    for (uint8_t i = 0; i < gateway->cacheRuleCount; i++) {
+        const GATEWAY_CACHE_RULE* rule = &gateway->cacheRules[i];
+        if (rule->unit == request->station && rule->ttl > 0 && request->address < (uint32_t)rule->address + rule->count
+            && (uint32_t)request->address + request->count > rule->address) {
+            cacheable = true;
+            break;
+        }
+    }
+    if (!cacheable) {
+        return;
+    }
+    // The same range, or a free entry, or the oldest one
+    GATEWAY_CACHE_ENTRY* entry = NULL;
+    for (uint8_t i = 0; i < GATEWAY_CACHE_ENTRIES; i++) {
+        GATEWAY_CACHE_ENTRY* e = &gateway->cache[i];
+        if (e->used && e->unit == request->station && e->address == request->address && e->count == request->count) {
+            entry = e;
+            break;
+        }
+        if (!entry || (entry->used && (!e->used || e->time < entry->time))) {
+            entry = e;
+        }
+    }
+    entry->used = true;
+    entry->unit = request->station;
+    entry->address = request->address;
+    entry->count = request->count;
+    entry->time = now();
+    memcpy(entry->data, request->data, request->count * sizeof(uint16_t));
+}
+
+// Drop the cached registers overlapping a write (to all the units if broadcast)
+static void cacheInvalidate(GATEWAY* gateway, const BUS_MS_REQUEST* request) {
+    for (uint8_t i = 0; i < GATEWAY_CACHE_ENTRIES; i++) {
+        GATEWAY_CACHE_ENTRY* entry = &gateway->cache[i];
+        if (entry->used && (request->station == BROADCAST_ADDRESS || entry->unit == request->station)
+            && request->address < entry->address + entry->count && request->address + request->count > entry->address) {
+            entry->used = false;
+        }
+    }
+}
+
+static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result);
+static _Bool parse(GATEWAY_CLIENT* client);
+
+// A write to `unit` is queued before `seq`
+static _Bool writtenBefore(GATEWAY_PORT* port, uint8_t unit, uint32_t seq) {
+    for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+        const GATEWAY_TRANSACTION* other = &port->queue[i];
+        if (other->used && other->request.function == WRITE_HOLDING_REGISTERS && other->request.station == unit
+            && (int32_t)(other->seq - seq) < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// An older transaction of the same client is still queued, not to be overtaken
+static _Bool queuedBefore(GATEWAY_PORT* port, const GATEWAY_TRANSACTION* t) {
+    for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+        const GATEWAY_TRANSACTION* other = &port->queue[i];
+        if (other->used && !other->merged && other->client == t->client && (int32_t)(other->seq - t->seq) < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Extend the read of the port with the queued reads of the same unit, overlapping or adjacent,
+// as long as the frames fit. The reads after a queued write, or after a queued request of the same
+// client, are not anticipated.
+static void coalesce(GATEWAY_PORT* port) {
+    BUS_MS_REQUEST* batch = &port->batch;
+    _Bool changed = true;
+    while (changed) {
+        changed = false;
+        for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+            GATEWAY_TRANSACTION* t = &port->queue[i];
+            if (!t->used || t->merged || t->alone || t->request.function != READ_HOLDING_REGISTERS || t->request.station != batch->station) {
+                continue;
+            }
+            uint32_t start = t->request.address;
+            uint32_t end = start + t->request.count;
+            uint32_t batchEnd = (uint32_t)batch->address + batch->count;
+            if (start > batchEnd || end < batch->address) {
+                continue;
+            }
+            uint32_t mergedStart = start < batch->address ? start : batch->address;
+            uint32_t mergedEnd = end > batchEnd ? end : batchEnd;
+            if (mergedEnd - mergedStart > GATEWAY_MAX_REGISTERS || writtenBefore(port, t->request.station, t->seq) || queuedBefore(port, t)) {
+                continue;
+            }
+            batch->address = (uint16_t)mergedStart;
+            batch->count = (uint8_t)(mergedEnd - mergedStart);
+            t->merged = true;
+            port->gateway->coalesced++;
+            changed = true;
+        }
+    }
+}
+
+// Start the next transaction: the oldest one of the next client in turn
+static void schedule(GATEWAY_PORT* port) {
+    if (port->active || port->queueCount == 0) {
+        return;
+    }
+    GATEWAY_TRANSACTION* next = NULL;
+    uint8_t nextTurn = 0;
+    for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+        GATEWAY_TRANSACTION* t = &port->queue[i];
+        if (!t->used) {
+            continue;
+        }
+        // Turns of the clients after the last one served
+        uint8_t turn = (uint8_t)((t->client + GATEWAY_MAX_CLIENTS - port->lastClient - 1) % GATEWAY_MAX_CLIENTS);
+        if (!next || turn < nextTurn || (turn == nextTurn && (int32_t)(t->seq - next->seq) < 0)) {
+            next = t;
+            nextTurn = turn;
+        }
+    }
+    port->active = next;
+    port->lastClient = next->client;
+    port->gateway->transactions++;
+    next->merged = true;
+    port->batch = next->request;
+    if (next->request.function == READ_HOLDING_REGISTERS) {
+        port->batch.data = port->batchData;
+        if (port->gateway->coalesce && !next->alone) {
+            coalesce(port);
+        }
+    }
+    // Always accepted, the requests are validated when received
+    bus_ms_enqueue(&port->ctx, &port->batch);
+}
+
+// Respond to a transaction served by `request`
+static void complete(GATEWAY_PORT* port, GATEWAY_TRANSACTION* t, const BUS_MS_REQUEST* request, uint8_t result) {
+    GATEWAY_CLIENT* client = &port->gateway->clients[t->client];
+    t->used = false;
+    t->merged = false;
+    port->queueCount--;
+    // Closed in the meantime
+    if (client->source.fd < 0 || client->generation != t->generation) {
+        return;
+    }
+
+    client->pending--;
+    uint8_t station = t->request.station;
+    uint8_t function = t->request.function;
+    if (result >= BUS_MS_ERR_TIMEOUT) {
+        respondException(client, t->transactionId, station, function, GATEWAY_ERR_TARGET_FAILED);
+    } else if (result != NO_ERROR) {
+        respondException(client, t->transactionId, station, function, result);
+    } else if (function == READ_HOLDING_REGISTERS) {
+        // Its slice of the registers read
+        respondRead(client, t->transactionId, station, request->data + (t->request.address - request->address), t->request.count);
+    } else {
+        uint8_t pdu[5] = { function };
+        writeBe16(pdu + 1, t->request.address);
+        writeBe16(pdu + 3, t->request.count);
+        respond(client, t->transactionId, station, pdu, sizeof(pdu));
+    }
+}
+
+// Handle the pipelined requests left in the buffers of the clients, now that they can be accepted
+static void resume(GATEWAY* gateway) {
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        GATEWAY_CLIENT* client = &gateway->clients[i];
+        if (client->source.fd >= 0 && client->rxCount >= GATEWAY_MBAP_SIZE && canAccept(client) && parse(client)) {
+            updateEvents(client);
+        }
+    }
+}
+
+static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result) {
+    GATEWAY_PORT* port = ctx->user;
+    port->active = NULL;
+    if (request->function == WRITE_HOLDING_REGISTERS) {
+        // Also if failed, maybe written anyway
+        cacheInvalidate(port->gateway, request);
+        if (port->gateway->image) {
+            register_image_invalidate(port->gateway->image, request->station, request->address, request->count);
+        }
+    } else if (result == NO_ERROR) {
+        if (port->gateway->image) {
+            register_image_publish(port->gateway->image, request->station, request->address, request->count, request->data);
+        }
+        if (!writtenBefore(port, request->station, port->gateway->nextSeq)) {
+            // Not if the unit is going to be written
+            cacheStore(port->gateway, request);
+        }
+    }
+    if (result != NO_ERROR && result < BUS_MS_ERR_TIMEOUT) {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+            count += port->queue[i].used && port->queue[i].merged;
+        }
+        if (count > 1) {
+            // Exception of the node, maybe caused by a single range: serve them one by one
+            for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+                GATEWAY_TRANSACTION* t = &port->queue[i];
+                if (t->used && t->merged) {
+                    t->merged = false;
+                    t->alone = true;
+                }
+            }
+            schedule(port);
+            return;
+        }
+    }
+    // All the transactions served, in order of arrival
+    while (true) {
+        GATEWAY_TRANSACTION* next = NULL;
+        for (uint8_t i = 0; i < GATEWAY_PORT_QUEUE_SIZE; i++) {
+            GATEWAY_TRANSACTION* t = &port->queue[i];
+            if (t->used && t->merged && (!next || (int32_t)(t->seq - next->seq) < 0)) {
+                next = t;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        complete(port, next, request, result);
+    }
+    schedule(port);
+    resume(port->gateway);
+}
+
+// Translate a whole MBAP frame to a RTU request, and queue it to the port of the unit
+static void handleRequest(GATEWAY_CLIENT* client, const uint8_t* frame, uint16_t size) {
+    GATEWAY* gateway = client->gateway;
+    gateway->requests++;
+    uint16_t transactionId = readBe16(frame);
+    // The RTU frame, without the CRC
+    const ModbusRtuHoldingRegisterRequest* rtu = (const ModbusRtuHoldingRegisterRequest*)(frame + GATEWAY_MBAP_SIZE - 1);
+    uint8_t unit = rtu->header.stationAddress;
+    uint8_t function = rtu->header.function;
+
+    if (function != READ_HOLDING_REGISTERS && function != WRITE_HOLDING_REGISTERS) {
+        respondException(client, transactionId, unit, function, ERR_INVALID_FUNCTION);
+        return;
+    }
+    uint16_t count = size >= REQUEST_SIZE ? be16toh(rtu->address.countBe) : 0;
+    _Bool valid = size >= REQUEST_SIZE && count <= GATEWAY_MAX_REGISTERS;
+    if (valid && function == WRITE_HOLDING_REGISTERS) {
+        valid = size > REQUEST_SIZE && frame[REQUEST_SIZE] == count * 2 && size == REQUEST_SIZE + 1 + count * 2;
+    }
+    if (!valid) {
+        respondException(client, transactionId, unit, function, ERR_INVALID_SIZE);
+        return;
+    }
+
+    uint8_t route = gateway->routes[unit];
+    GATEWAY_PORT* port = route < gateway->portCount ? &gateway->ports[route] : NULL;
+    if (!port || port->queueCount >= GATEWAY_PORT_QUEUE_SIZE) {
+        respondException(client, transactionId, unit, function, GATEWAY_ERR_PATH_UNAVAILABLE);
+        return;
+    }
+    GATEWAY_TRANSACTION* t = port->queue;
+    while (t->used) {
+        t++;
+    }
+    t->seq = gateway->nextSeq++;
+    t->client = clientIndex(client);
+    t->generation = client->generation;
+    t->transactionId = transactionId;
+    t->request.station = unit;
+    t->request.function = function;
+    t->request.address = be16toh(rtu->address.registerAddressBe);
+    t->request.count = (uint8_t)count;
+    t->request.data = t->data;
+    t->request.onComplete = onComplete;
+    t->request.user = t;
+    t->merged = false;
+    t->alone = false;
+    if (function == WRITE_HOLDING_REGISTERS) {
+        for (uint8_t i = 0; i < count; i++) {
+            t->data[i] = readBe16(frame + REQUEST_SIZE + 1 + i * 2);
+        }
+    }
+    if (!bus_ms_isValid(&t->request)) {
+        respondException(client, transactionId, unit, function, ERR_INVALID_SIZE);
+        return;
+    }
+    if (function == WRITE_HOLDING_REGISTERS) {
+        cacheInvalidate(gateway, &t->request);
+    } else if (client->pending == 0) {
+        // Not to answer before the requests in progress of the client
+        const uint16_t* cached = cacheLookup(gateway, &t->request);
+        if (cached) {
+            gateway->cacheHits++;
+            respondRead(client, transactionId, unit, cached, (uint8_t)count);
+            return;
+        }
+    }
+    t->used = true;
+    port->queueCount++;
+    client->pending++;
+    schedule(port);
+}
+
+// Handle the whole frames received. Returns false if the client was closed.
+static _Bool parse(GATEWAY_CLIENT* client) {
+    uint16_t pos = 0;
+    while (client->rxCount - pos >= GATEWAY_MBAP_SIZE && canAccept(client)) {
+        const uint8_t* frame = client->rxBuffer + pos;
+        uint16_t length = readBe16(frame + 4);
+        if (readBe16(frame + 2) != 0 || length < 2 || length > GATEWAY_FRAME_SIZE - GATEWAY_MBAP_SIZE + 1) {
+            // Not Modbus
+            closeClient(client);
+            return false;
+        }
+        uint16_t size = GATEWAY_MBAP_SIZE - 1 + length;
+        if (client->rxCount - pos < size) {
+            break;
+        }
+        handleRequest(client, frame, size);
+        if (client->source.fd < 0) {
+            return false;
+        }
+        pos += size;
+    }
+    client->rxCount -= pos;
+    memmove(client->rxBuffer, client->rxBuffer + pos, client->rxCount);
+    return true;
+}
+
+static void onClientEvents(MODBUS_LOOP_FD* source, uint32_t events) {
+    GATEWAY_CLIENT* client = source->user;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        closeClient(client);
+        return;
+    }
+    if ((events & EPOLLOUT) && !flush(client)) {
+        return;
+    }
+    // Not with a full buffer, or the 0 returned would look like the end of the stream
+    if ((events & EPOLLIN) && client->rxCount < GATEWAY_FRAME_SIZE) {
+        ssize_t count = recv(source->fd, client->rxBuffer + client->rxCount, GATEWAY_FRAME_SIZE - client->rxCount, MSG_DONTWAIT);
+        if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            closeClient(client);
+            return;
+        }
+        if (count > 0) {
+            client->rxCount += count;
+        }
+    }
+    // Also the frames left when the responses sent made room for them
+    if (!parse(client)) {
+        return;
+    }
+    updateEvents(client);
+}
+
+static void onListenerEvents(MODBUS_LOOP_FD* source, uint32_t events) {
+    // Only EPOLLIN
+    (void)events;
+    GATEWAY* gateway = source->user;
+    int fd;
+    while ((fd = accept4(source->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        GATEWAY_CLIENT* client = NULL;
+        for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+            if (gateway->clients[i].source.fd < 0) {
+                client = &gateway->clients[i];
+                break;
+            }
+        }
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        // Small frames, not to be delayed
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        client->source.fd = fd;
+        client->pending = 0;
+        client->rxCount = 0;
+        client->txCount = 0;
+        client->events = EPOLLIN;
+        if (!modbus_loop_addFd(&gateway->loop, &client->source, client->events)) {
+            close(fd);
+            client->source.fd = -1;
+        }
+    }
+}
+
+_Bool gateway_init(GATEWAY* gateway, uint16_t tcpPort) {
+    gateway->portCount = 0;
+    gateway->nextSeq = 0;
+    gateway->requests = 0;
+    gateway->exceptions = 0;
+    gateway->transactions = 0;
+    gateway->coalesced = 0;
+    gateway->cacheHits = 0;
+    gateway->coalesce = true;
+    gateway->cacheRuleCount = 0;
+    gateway->image = NULL;
+    memset(gateway->cache, 0, sizeof(gateway->cache));
+    memset(gateway->routes, GATEWAY_NO_ROUTE, sizeof(gateway->routes));
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        GATEWAY_CLIENT* client = &gateway->clients[i];
+        client->gateway = gateway;
+        client->generation = 0;
+        client->source.fd = -1;
+        client->source.onEvents = onClientEvents;
+        client->source.user = client;
+    }
+    if (!modbus_loop_init(&gateway->loop)) {
+        return false;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        modbus_loop_close(&gateway->loop);
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = { 0 };
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(tcpPort);
+    socklen_t addressSize = sizeof(address);
+    gateway->listener.fd = fd;
+    gateway->listener.onEvents = onListenerEvents;
+    gateway->listener.user = gateway;
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0
+        || getsockname(fd, (struct sockaddr*)&address, &addressSize) < 0 || !modbus_loop_addFd(&gateway->loop, &gateway->listener, EPOLLIN)) {
+        close(fd);
+        modbus_loop_close(&gateway->loop);
+        return false;
+    }
+    gateway->tcpPort = ntohs(address.sin_port);
+    return true;
+}
+
+static int addPort(GATEWAY* gateway, GATEWAY_PORT* port) {
+    MODBUS_CONTEXT* ctx = &port->ctx;
+    rs485_init(ctx);
+    bus_ms_init(ctx);
+    if (!modbus_loop_addMaster(&gateway->loop, ctx)) {
+        uart_close(ctx);
+        return -1;
+    }
+    if (gateway->portCount == 0) {
+        memset(gateway->routes, 0, sizeof(gateway->routes));
+    }
+    return gateway->portCount++;
+}
+
+static GATEWAY_PORT* newPort(GATEWAY* gateway) {
+    if (gateway->portCount >= MODBUS_LOOP_MAX_NODES) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    GATEWAY_PORT* port = &gateway->ports[gateway->portCount];
+    memset(port, 0, sizeof(GATEWAY_PORT));
+    port->ctx.user = port;
+    port->gateway = gateway;
+    return port;
+}
+
+int gateway_addPort(GATEWAY* gateway, const char* device) {
+    GATEWAY_PORT* port = newPort(gateway);
+    if (!port || !uart_open(&port->ctx, device)) {
+        return -1;
+    }
+    return addPort(gateway, port);
+}
+
+int gateway_attachPort(GATEWAY* gateway, int fd) {
+    GATEWAY_PORT* port = newPort(gateway);
+    if (!port) {
+        return -1;
+    }
+    uart_attach(&port->ctx, fd);
+    return addPort(gateway, port);
+}
+
+void gateway_route(GATEWAY* gateway, uint8_t unit, uint8_t port) {
+    gateway->routes[unit] = port;
+}
+
+_Bool gateway_cacheRange(GATEWAY* gateway, uint8_t unit, uint16_t address, uint16_t count, uint32_t ttl) {
+    if (gateway->cacheRuleCount >= GATEWAY_CACHE_RULES) {
+        return false;
+    }
+    GATEWAY_CACHE_RULE* rule = &gateway->cacheRules[gateway->cacheRuleCount++];
+    rule->unit = unit;
+    rule->address = address;
+    rule->count = count;
+    rule->ttl = (uint64_t)ttl * 1000;
+    return true;
+}
+
+void gateway_close(GATEWAY* gateway) {
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        if (gateway->clients[i].source.fd >= 0) {
+            closeClient(&gateway->clients[i]);
+        }
+    }
+    for (uint8_t i = 0; i < gateway->portCount; i++) {
+        uart_close(&gateway->ports[i].ctx);
+    }
+    gateway->portCount = 0;
+    close(gateway->listener.fd);
+    modbus_loop_close(&gateway->loop);
+}
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "pic-modbus/linux/loop.h"
+
+#define NANOSECONDS_PER_TICK (1000000000 / TICKS_PER_SECOND)
+
+// Events handled per wait, the others (level-triggered) are returned by the next wait
+#define MAX_EVENTS (MODBUS_LOOP_MAX_NODES + 32)
+
+// Keys of the loop fds in the epoll events, the nodes use their context
+static int s_timerKey;
+static int s_wakeKey;
+
+static _Bool addFd(MODBUS_LOOP* loop, int fd, void* key) {
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = key };
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+static _Bool isContext(MODBUS_LOOP* loop, void* key) {
+    for (uint8_t i = 0; i < loop->nodeCount; i++) {
+        if (loop->nodes[i] == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+_Bool modbus_loop_init(MODBUS_LOOP* loop) {
+    loop->nodeCount = 0;
+    loop->wakeups = 0;
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollFd < 0) {
+        return false;
+    }
+    loop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->timerFd < 0 || loop->wakeFd < 0 || !addFd(loop, loop->timerFd, &s_timerKey) || !addFd(loop, loop->wakeFd, &s_wakeKey)) {
+        modbus_loop_close(loop);
+        return false;
+    }
+    return true;
+}
+
+static _Bool addContext(MODBUS_LOOP* loop, MODBUS_CONTEXT* ctx, _Bool isMaster) {
+    if (loop->nodeCount >= MODBUS_LOOP_MAX_NODES) {
+        errno = ENOSPC;
+        return false;
+    }
+    if (!addFd(loop, ctx->uart.port.fd, ctx)) {
+        return false;
+    }
+    loop->isMaster[loop->nodeCount] = isMaster;
+    loop->waitWrite[loop->nodeCount] = false;
+    loop->nodes[loop->nodeCount++] = ctx;
+    return true;
+}
+
+_Bool modbus_loop_add(MODBUS_LOOP* loop, MODBUS_CONTEXT* ctx) {
+    return addContext(loop, ctx, false);
+}
+
+_Bool modbus_loop_addMaster(MODBUS_LOOP* loop, MODBUS_CONTEXT* ctx) {
+    return addContext(loop, ctx, true);
+}
+
+_Bool modbus_loop_addFd(MODBUS_LOOP* loop, MODBUS_LOOP_FD* source, uint32_t events) {
+    struct epoll_event event = { .events = events, .data.ptr = source };
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, source->fd, &event) == 0;
+}
+
+_Bool modbus_loop_modifyFd(MODBUS_LOOP* loop, MODBUS_LOOP_FD* source, uint32_t events) {
+    struct epoll_event event = { .events = events, .data.ptr = source };
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, source->fd, &event) == 0;
+}
+
+void modbus_loop_removeFd(MODBUS_LOOP* loop, MODBUS_LOOP_FD* source) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+void modbus_loop_wake(MODBUS_LOOP* loop) {
+    uint64_t one = 1;
+    // Already signaled if the counter is full
+    (void)!write(loop->wakeFd, &one, sizeof(one));
+}
+
+// Wait for the serial port to be writable only when a byte is pending, since it is almost always writable
+static _Bool updateWaitWrite(MODBUS_LOOP* loop, uint8_t i) {
+    MODBUS_CONTEXT* ctx = loop->nodes[i];
+    _Bool waitWrite = ctx->uart.port.txPending;
+    if (waitWrite == loop->waitWrite[i]) {
+        return true;
+    }
+    struct epoll_event event = { .events = EPOLLIN | (waitWrite ? EPOLLOUT : 0), .data.ptr = ctx };
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, ctx->uart.port.fd, &event) < 0) {
+        return false;
+    }
+    loop->waitWrite[i] = waitWrite;
+    return true;
+}
+
+// Poll a node or a master, and returns its next deadline
+static TICK_TYPE pollContext(MODBUS_LOOP* loop, uint8_t i) {
+    MODBUS_CONTEXT* ctx = loop->nodes[i];
+    if (loop->isMaster[i]) {
+        rs485_poll(ctx);
+        bus_ms_poll(ctx);
+        TICK_TYPE timeout = rs485_timeout(ctx);
+        TICK_TYPE masterTimeout = bus_ms_timeout(ctx);
+        return masterTimeout < timeout ? masterTimeout : timeout;
+    } else {
+        modbus_poll(ctx);
+        return modbus_timeout(ctx);
+    }
+}
+
+_Bool modbus_loop_wait(MODBUS_LOOP* loop, TICK_TYPE maxWait) {
+    TICK_TYPE timeout = maxWait;
+    for (uint8_t i = 0; i < loop->nodeCount; i++) {
+        TICK_TYPE nodeTimeout = pollContext(loop, i);
+        if (nodeTimeout < timeout) {
+            timeout = nodeTimeout;
+        }
+        if (!updateWaitWrite(loop, i)) {
+            return false;
+        }
+    }
+    if (timeout == 0) {
+        // Poll again straight away
+        return true;
+    }
+
+    // Relative, one-shot
+    struct itimerspec spec = { 0 };
+    spec.it_value.tv_sec = timeout / TICKS_PER_SECOND;
+    spec.it_value.tv_nsec = (long)(timeout % TICKS_PER_SECOND) * NANOSECONDS_PER_TICK;
+    if (timerfd_settime(loop->timerFd, 0, &spec, NULL) < 0) {
+        return false;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+    if (count < 0) {
+        // Interrupted by signals: not an error
+        return errno == EINTR;
+    }
+    loop->wakeups++;
+    for (int i = 0; i < count; i++) {
+        void* key = events[i].data.ptr;
+        if (key == &s_timerKey || key == &s_wakeKey) {
+            uint64_t counter;
+            // The timer is rearmed at the next wait
+            if (read(key == &s_timerKey ? loop->timerFd : loop->wakeFd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+                return false;
+            }
+        } else if (!isContext(loop, key)) {
+            MODBUS_LOOP_FD* source = key;
+            source->onEvents(source, events[i].events);
+        }
+    }
+    return true;
+}
+
+void modbus_loop_close(MODBUS_LOOP* loop) {
+    close(loop->wakeFd);
+    close(loop->timerFd);
+    close(loop->epollFd);
+    loop->nodeCount = 0;
+}
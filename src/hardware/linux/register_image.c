@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/linux/register_image.h"
+
+// Image of the registers in shared memory, see `register_image.h`
+
+static uint64_t now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// The registers of the range in the image, 0 if none
+static uint16_t clip(uint16_t address, uint16_t count) {
+    if (address >= REGISTER_IMAGE_REGISTERS) {
+        return 0;
+    }
+    return (uint32_t)address + count > REGISTER_IMAGE_REGISTERS ? REGISTER_IMAGE_REGISTERS - address : count;
+}
+
+// Make the sequence odd before changing the unit: the stores of the registers are not visible before it
+static void beginUpdate(REGISTER_IMAGE_UNIT* unit) {
+    __atomic_store_n(&unit->sequence, unit->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Make the sequence even again, after all the stores of the registers
+static void endUpdate(REGISTER_IMAGE_UNIT* unit) {
+    __atomic_store_n(&unit->sequence, unit->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void setValid(REGISTER_IMAGE_UNIT* unit, uint16_t address, uint16_t count, _Bool valid) {
+    for (uint16_t i = address; i < address + count; i++) {
+        if (valid) {
+            unit->valid[i / 8] |= (uint8_t)(1 << (i % 8));
+        } else {
+            unit->valid[i / 8] &= (uint8_t)~(1 << (i % 8));
+        }
+    }
+}
+
+_Bool register_image_create(REGISTER_IMAGE* image, const char* path) {
+    image->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (image->fd < 0) {
+        return false;
+    }
+    if (ftruncate(image->fd, sizeof(REGISTER_IMAGE_LAYOUT)) != 0) {
+        close(image->fd);
+        return false;
+    }
+    void* layout = mmap(NULL, sizeof(REGISTER_IMAGE_LAYOUT), PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+    if (layout == MAP_FAILED) {
+        close(image->fd);
+        return false;
+    }
+    image->layout = layout;
+
+    // Readers of a previous image see it not initialized while it is reset
+    REGISTER_IMAGE_HEADER* header = &image->layout->header;
+    __atomic_store_n(&header->magic, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(image->layout->units, 0, sizeof(image->layout->units));
+    header->version = REGISTER_IMAGE_VERSION;
+    header->registers = REGISTER_IMAGE_REGISTERS;
+    header->size = sizeof(REGISTER_IMAGE_LAYOUT);
+    __atomic_store_n(&header->magic, REGISTER_IMAGE_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+_Bool register_image_open(REGISTER_IMAGE* image, const char* path) {
+    image->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (image->fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(image->fd, &info) != 0 || info.st_size < (off_t)sizeof(REGISTER_IMAGE_LAYOUT)) {
+        close(image->fd);
+        errno = EINVAL;
+        return false;
+    }
+    void* layout = mmap(NULL, sizeof(REGISTER_IMAGE_LAYOUT), PROT_READ, MAP_SHARED, image->fd, 0);
+    if (layout == MAP_FAILED) {
+        close(image->fd);
+        return false;
+    }
+    image->layout = layout;
+
+    const REGISTER_IMAGE_HEADER* header = &image->layout->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != REGISTER_IMAGE_MAGIC || header->version != REGISTER_IMAGE_VERSION
+        || header->registers != REGISTER_IMAGE_REGISTERS || header->size != sizeof(REGISTER_IMAGE_LAYOUT)) {
+        register_image_close(image);
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+void register_image_publish(REGISTER_IMAGE* image, uint8_t unit, uint16_t address, uint16_t count, const uint16_t* data) {
+    count = clip(address, count);
+    if (count == 0) {
+        return;
+    }
+    REGISTER_IMAGE_UNIT* u = &image->layout->units[unit];
+    beginUpdate(u);
+    memcpy(&u->registers[address], data, count * sizeof(uint16_t));
+    setValid(u, address, count, true);
+    u->time = now();
+    endUpdate(u);
+}
+
+void register_image_invalidate(REGISTER_IMAGE* image, uint8_t unit, uint16_t address, uint16_t count) {
+    count = clip(address, count);
+    if (count == 0) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (unit == BROADCAST_ADDRESS || i == unit) {
+            REGISTER_IMAGE_UNIT* u = &image->layout->units[i];
+            beginUpdate(u);
+            setValid(u, address, count, false);
+            endUpdate(u);
+        }
+    }
+}
+
+_Bool register_image_read(const REGISTER_IMAGE* image, uint8_t unit, uint16_t address, uint16_t count, uint16_t* data, uint64_t* time) {
+    if (clip(address, count) != count) {
+        return false;
+    }
+    const REGISTER_IMAGE_UNIT* u = &image->layout->units[unit];
+    while (true) {
+        uint32_t sequence = __atomic_load_n(&u->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            // Let the writer end the update, it could be on the same CPU
+            sched_yield();
+            continue;
+        }
+        memcpy(data, &u->registers[address], count * sizeof(uint16_t));
+        _Bool valid = true;
+        for (uint16_t i = address; i < address + count; i++) {
+            valid = valid && (u->valid[i / 8] & (1 << (i % 8)));
+        }
+        uint64_t updated = u->time;
+        // The copies above are done before checking the sequence again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&u->sequence, __ATOMIC_RELAXED) == sequence) {
+            if (time) {
+                *time = updated;
+            }
+            return valid;
+        }
+    }
+}
+
+void register_image_close(REGISTER_IMAGE* image) {
+    munmap(image->layout, sizeof(REGISTER_IMAGE_LAYOUT));
+    close(image->fd);
+}
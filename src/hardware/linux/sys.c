@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pic-modbus/modbus.h"
+
+SYS_RESET_REASON sys_resetReason;
+
+void sys_init() {
+    sys_resetReason = RESET_POWER;
+}
+
+// There is no reset of the process: the error is logged, and the process is terminated (e.g. restarted by the service manager)
+void RESET() {
+    fprintf(stderr, "pic-modbus: fatal error 0x%02x\n", sys_resetReason);
+    abort();
+}
@@ -0,0 +1,19 @@
+#include <time.h>
+#include "pic-modbus/modbus.h"
+
+// Microseconds from `CLOCK_MONOTONIC`, not affected by system time changes
+
+static struct timespec s_start;
+
+void timers_init() {
+    clock_gettime(CLOCK_MONOTONIC, &s_start);
+}
+
+void timers_isr() {
+}
+
+TICK_TYPE timers_get() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TICK_TYPE)((now.tv_sec - s_start.tv_sec) * TICKS_PER_SECOND + (now.tv_nsec - s_start.tv_nsec) / (1000000000 / TICKS_PER_SECOND));
+}
@@ -0,0 +1,200 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "pic-modbus/modbus.h"
+
+// Serial port of a Linux host (e.g. USB to RS485 dongles), in raw 8N1 mode. 
+// The line driver is controlled by the RTS signal: most dongles have automatic direction control instead, 
+// and the ioctl errors are ignored (e.g. for pseudo-terminals). The echo of the transmitted data, if any (see
+// `UART_PORT::echo`), is dropped byte by byte: flushing the input would drop the start of a fast response too.
+// The bytes of a frame are written in one go, at the end of each poll (see `uart_flush`): a byte per system call
+// wakes up the peer for every byte, and a frame could be split by the scheduling of the threads.
+// The port is non-blocking: the data not accepted by the driver is kept until the port is writable again, and the
+// write errors are reported as framing errors of the line, like the UART hardware does.
+
+#define s_port (MODBUS_CTX(uart).port)
+
+static speed_t uart_speed(uint32_t baud) {
+    switch (baud) {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default: return B0;
+    }
+}
+
+_Bool uart_open(CTX_PARAM_ const char* device) {
+    speed_t speed = uart_speed(RS485_BAUD);
+    if (speed == B0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        close(fd);
+        return false;
+    }
+    cfmakeraw(&tio);
+    // 8N1, no flow control
+    tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        close(fd);
+        return false;
+    }
+
+    uart_attach(CTX_ARG_ fd);
+    return true;
+}
+
+void uart_attach(CTX_PARAM_ int fd) {
+    s_port.fd = fd;
+    s_port.rxCount = 0;
+    s_port.rxPos = 0;
+    s_port.txCount = 0;
+    s_port.txPending = false;
+    s_port.txFailed = false;
+    s_port.rxFailed = false;
+    s_port.lastError = 0;
+    s_port.echo = false;
+    s_port.echoCount = 0;
+}
+
+void uart_close(CTX_PARAM) {
+    close(s_port.fd);
+    s_port.fd = -1;
+}
+
+void uart_init(CTX_PARAM) {
+    // Drop stale data
+    tcflush(s_port.fd, TCIOFLUSH);
+    s_port.rxCount = 0;
+    s_port.rxPos = 0;
+    s_port.txCount = 0;
+    s_port.txPending = false;
+    s_port.txFailed = false;
+    uart_receive(CTX_ARG);
+    s_port.echoCount = 0;
+}
+
+void uart_transmit(CTX_PARAM) {
+    s_port.echoCount = 0;
+    int rts = TIOCM_RTS;
+    ioctl(s_port.fd, TIOCMBIS, &rts);
+}
+
+void uart_receive(CTX_PARAM) {
+    // The end of the frame can still be queued in the driver
+    tcdrain(s_port.fd);
+    int rts = TIOCM_RTS;
+    ioctl(s_port.fd, TIOCMBIC, &rts);
+    s_port.rxCount = 0;
+    s_port.rxPos = 0;
+    // The frame is over, but the line is still reported in error
+    s_port.txCount = 0;
+    s_port.txPending = false;
+    if (s_port.txFailed) {
+        s_port.txFailed = false;
+        s_port.rxFailed = true;
+    }
+}
+
+// Write the buffered data, and keep the rest if the driver buffer is full
+static void writeBuffer(CTX_PARAM) {
+    ssize_t count = write(s_port.fd, s_port.txBuffer, s_port.txCount);
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            // The rest of the frame is dropped: the master will retry
+            s_port.lastError = errno;
+            s_port.txFailed = true;
+            s_port.txCount = 0;
+            s_port.txPending = false;
+            return;
+        }
+        count = 0;
+    }
+    if (s_port.echo) {
+        s_port.echoCount += (uint16_t)count;
+    }
+    s_port.txCount -= (uint8_t)count;
+    memmove(s_port.txBuffer, s_port.txBuffer + count, s_port.txCount);
+    s_port.txPending = s_port.txCount > 0;
+}
+
+void uart_write(CTX_PARAM_ uint8_t b) {
+    if (s_port.txFailed) {
+        return;
+    }
+    // Room checked by `uart_tx_fifo_empty`
+    s_port.txBuffer[s_port.txCount++] = b;
+}
+
+void uart_flush(CTX_PARAM) {
+    if (s_port.txCount > 0) {
+        writeBuffer(CTX_ARG);
+    }
+}
+
+void uart_read(CTX_PARAM) {
+    // Errors are not reported by the driver in raw mode, only the failed writes
+    uart_lastCh.errs.OERR = false;
+    uart_lastCh.errs.FERR = s_port.rxFailed;
+    s_port.rxFailed = false;
+    uart_lastCh.data = s_port.rxBuffer[s_port.rxPos++];
+}
+
+_Bool uart_tx_fifo_empty(CTX_PARAM) {
+    if (s_port.txPending || s_port.txCount == UART_TX_BUFFER_SIZE) {
+        writeBuffer(CTX_ARG);
+        if (s_port.txPending) {
+            return false;
+        }
+    }
+    if (s_port.txFailed || s_port.txCount > 0) {
+        // Nothing is written, or the data is still buffered
+        return true;
+    }
+    int queued;
+    if (ioctl(s_port.fd, TIOCOUTQ, &queued) < 0) {
+        // Not supported, the data is transmitted by the driver
+        return true;
+    }
+    return queued < UART_TX_FIFO_SIZE;
+}
+
+_Bool uart_rx_fifo_empty(CTX_PARAM) {
+    if (s_port.rxPos < s_port.rxCount) {
+        return false;
+    }
+    do {
+        ssize_t count = read(s_port.fd, s_port.rxBuffer, UART_RX_BUFFER_SIZE);
+        if (count <= 0) {
+            s_port.rxCount = 0;
+            s_port.rxPos = 0;
+            return true;
+        }
+        s_port.rxCount = (uint8_t)count;
+        // Skip the echo of the last transmission
+        s_port.rxPos = (uint8_t)(s_port.echoCount < count ? s_port.echoCount : count);
+        s_port.echoCount -= s_port.rxPos;
+    } while (s_port.rxPos == s_port.rxCount);
+    return false;
+}
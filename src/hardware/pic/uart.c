@@ -20,7 +20,7 @@
 #define uart_disable_rx() RS485_RCSTA.CREN = 0;
 #endif
 
-UART_LAST_CH uart_lastCh;
+UART_CONTEXT uart_ctx;
 
 void uart_init() {
     RS485_RCSTA.SPEN = 1;
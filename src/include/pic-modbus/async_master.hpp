@@ -0,0 +1,344 @@
+#ifndef _MODBUS_ASYNC_MASTER_HPP
+#define _MODBUS_ASYNC_MASTER_HPP
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#include "modbus.h"
+
+/**
+ * C++20 coroutine interface of the master engine (see `bus_master.h`), for host applications:
+ *
+ *   modbus::Task<void> scan(modbus::AsyncMaster& master) {
+ *       auto response = co_await master.readHolding(node, address, count);
+ *       if (response) { ... response.registers ... }
+ *   }
+ *   executor.spawn(scan(master));
+ *   executor.run([&] { rs485_poll(ctx); bus_ms_poll(ctx); });
+ *
+ * Everything runs in a single thread: the completed requests resume their coroutines from the `Executor`, and
+ * never from inside `bus_ms_poll`. Each pending operation only costs its coroutine frame, registers included (no
+ * allocations until a `ReadResponse` is returned): the operations that don't fit the queue of the engine
+ * (`BUS_MS_QUEUE_SIZE`) wait in an intrusive list.
+ */
+
+#ifndef MODBUS_CONTEXT_API
+#error The async master requires MODBUS_CONTEXT_API
+#endif
+
+namespace modbus {
+
+template<typename T> class Task;
+
+namespace detail {
+
+// Resumes the awaiting coroutine when the task completes
+template<typename Promise>
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+        auto continuation = handle.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept { }
+};
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return { }; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    T value;
+
+    Task<T> get_return_object();
+    FinalAwaiter<Promise> final_suspend() noexcept { return { }; }
+    void return_value(T v) { value = std::move(v); }
+    T result() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+        return std::move(value);
+    }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    FinalAwaiter<Promise> final_suspend() noexcept { return { }; }
+    void return_void() { }
+    void result() {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+} // namespace detail
+
+/**
+ * Lazy coroutine, started when awaited (or spawned, see `Executor::spawn`)
+ */
+template<typename T = void>
+class Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) { }
+    Task(Task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) { }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        _handle.promise().continuation = awaiting;
+        return _handle;
+    }
+    T await_resume() { return _handle.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+};
+
+namespace detail {
+
+template<typename T>
+inline Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+} // namespace detail
+
+/**
+ * Single-threaded executor: a queue of the coroutines ready to be resumed
+ */
+class Executor {
+public:
+    /**
+     * Start a task, owned by the executor until its completion. Exceptions terminate the process.
+     */
+    template<typename T>
+    void spawn(Task<T> task) {
+        _spawned++;
+        post(detach(std::move(task)).handle);
+    }
+
+    // Queue a coroutine to resume
+    void post(std::coroutine_handle<> handle) {
+        _ready.push_back(handle);
+    }
+
+    // Resume the ready coroutines, returns how many
+    size_t runReady() {
+        size_t count = 0;
+        while (!_ready.empty()) {
+            auto handle = _ready.front();
+            _ready.pop_front();
+            handle.resume();
+            count++;
+        }
+        return count;
+    }
+
+    /**
+     * Run until all the spawned tasks are completed: `poll` (e.g. `rs485_poll` and `bus_ms_poll`) is called
+     * when no coroutine is ready.
+     */
+    template<typename Poll>
+    void run(Poll poll) {
+        while (_spawned > 0) {
+            if (runReady() == 0) {
+                poll();
+            }
+        }
+    }
+
+    // Count of the spawned tasks not completed yet
+    size_t spawned() const { return _spawned; }
+
+private:
+    // Eager coroutine that destroys itself at completion
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+            std::suspend_always initial_suspend() noexcept { return { }; }
+            std::suspend_never final_suspend() noexcept { return { }; }
+            void return_void() { }
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    template<typename T>
+    Detached detach(Task<T> task) {
+        co_await task;
+        _spawned--;
+    }
+
+    std::deque<std::coroutine_handle<>> _ready;
+    size_t _spawned = 0;
+};
+
+// Response of `AsyncMaster::readHolding`
+struct ReadResponse {
+    // `NO_ERROR`, the exception code of the node or `BUS_MS_ERR_*`
+    uint8_t error;
+    std::vector<uint16_t> registers;
+
+    explicit operator bool() const { return error == NO_ERROR; }
+};
+
+/**
+ * Awaitable operations on the master engine of a node context, initialized with `rs485_init` and `bus_ms_init`.
+ * The engine `onComplete` handlers are owned by this class.
+ */
+class AsyncMaster {
+public:
+    // Registers that fit the frames of the engine
+    static constexpr uint8_t MaxRegisters = (RS485_BUF_SIZE - 5) / 2;
+
+private:
+    // A pending request, in the coroutine frame with its registers
+    class Operation {
+    public:
+        // `data` is the registers to write, or NULL
+        Operation(AsyncMaster& master, uint8_t station, uint8_t function, uint16_t address, const uint16_t* data, size_t count)
+            : _master(master) {
+            _request.station = station;
+            _request.function = function;
+            _request.address = address;
+            // Too many registers: not valid, never transmitted
+            _request.count = count <= MaxRegisters ? (uint8_t)count : 0;
+            _request.onComplete = &AsyncMaster::onComplete;
+            if (data) {
+                memcpy(_data, data, _request.count * sizeof(uint16_t));
+            }
+        }
+        Operation(const Operation&) = delete;
+        Operation& operator=(const Operation&) = delete;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) {
+            // The operation is now at its final address, in the coroutine frame
+            _request.data = _data;
+            _request.user = this;
+            _handle = handle;
+            _master.submit(this);
+        }
+
+    protected:
+        AsyncMaster& _master;
+        uint16_t _data[MaxRegisters];
+        BUS_MS_REQUEST _request;
+        uint8_t _result = NO_ERROR;
+
+    private:
+        friend class AsyncMaster;
+        std::coroutine_handle<> _handle;
+        // Intrusive list of the operations waiting for the engine queue
+        Operation* _next = nullptr;
+    };
+
+    class ReadOperation : public Operation {
+    public:
+        using Operation::Operation;
+        ReadResponse await_resume() {
+            return { _result, _result == NO_ERROR ? std::vector<uint16_t>(_data, _data + _request.count) : std::vector<uint16_t>() };
+        }
+    };
+
+    class WriteOperation : public Operation {
+    public:
+        using Operation::Operation;
+        uint8_t await_resume() { return _result; }
+    };
+
+public:
+    AsyncMaster(MODBUS_CONTEXT* ctx, Executor& executor) : _ctx(ctx), _executor(executor) { }
+    AsyncMaster(const AsyncMaster&) = delete;
+    AsyncMaster& operator=(const AsyncMaster&) = delete;
+
+    /**
+     * `co_await` it to read `count` holding registers. See `ReadResponse`.
+     */
+    ReadOperation readHolding(uint8_t station, uint16_t address, uint8_t count) {
+        return ReadOperation(*this, station, READ_HOLDING_REGISTERS, address, nullptr, count);
+    }
+
+    /**
+     * `co_await` it to write the holding registers. Returns `NO_ERROR`, the exception code of the node or `BUS_MS_ERR_*`.
+     */
+    WriteOperation writeHolding(uint8_t station, uint16_t address, const std::vector<uint16_t>& registers) {
+        return WriteOperation(*this, station, WRITE_HOLDING_REGISTERS, address, registers.data(), registers.size());
+    }
+
+    // Count of the operations waiting for the engine queue
+    size_t waiting() const { return _waitingCount; }
+
+    MODBUS_CONTEXT* context() const { return _ctx; }
+
+private:
+    void submit(Operation* op) {
+        if (!bus_ms_isValid(&op->_request)) {
+            // Never accepted by the engine
+            op->_result = BUS_MS_ERR_INVALID_REQUEST;
+            _executor.post(op->_handle);
+        } else if (_waitingHead || !bus_ms_enqueue(_ctx, &op->_request)) {
+            // Queue full: wait, preserving the order
+            if (_waitingTail) {
+                _waitingTail->_next = op;
+            } else {
+                _waitingHead = op;
+            }
+            _waitingTail = op;
+            _waitingCount++;
+        }
+    }
+
+    // A slot of the engine queue is free: move the waiting operations
+    void feed() {
+        while (_waitingHead && bus_ms_enqueue(_ctx, &_waitingHead->_request)) {
+            _waitingHead = _waitingHead->_next;
+            if (!_waitingHead) {
+                _waitingTail = nullptr;
+            }
+            _waitingCount--;
+        }
+    }
+
+    static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result) {
+        // The master is known from the operation
+        CTX_UNUSED;
+        Operation* op = (Operation*)request->user;
+        op->_result = result;
+        op->_master._executor.post(op->_handle);
+        op->_master.feed();
+    }
+
+    MODBUS_CONTEXT* _ctx;
+    Executor& _executor;
+    Operation* _waitingHead = nullptr;
+    Operation* _waitingTail = nullptr;
+    size_t _waitingCount = 0;
+};
+
+} // namespace modbus
+
+#endif
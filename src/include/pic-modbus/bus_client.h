@@ -2,6 +2,7 @@
 #define	_MODBUS_CLIENT_H
 
 #include "configuration.h"
+#include "context.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,13 +13,13 @@ extern "C" {
  * It can be implemented, for instance, by RTU nodes (RS485 client), TCP clients or 
  * wireless radio client stations.
  *
- * Routers (e.g. from TCP to RTU) will run both client and server instances.
+ * Routers (e.g. from TCP to RTU) will run both client and server instances (see `bus_master.h`).
  */
 
 /**
  * Initialize the client node
  */
-void bus_cl_init();
+void bus_cl_init(CTX_PARAM);
 
 /**
  * Poll for bus client activities.
@@ -26,7 +27,13 @@ void bus_cl_init();
  * Returns false if the node is not currently active and it can be polled with larger period,
  * depending on the medium implementation (e.g. 1ms)
  */
-__bit bus_cl_poll();
+__bit bus_cl_poll(CTX_PARAM);
+
+/**
+ * Returns the ticks before the client should be polled again regardless of the line activity 
+ * (e.g. to start the response of a complete request), or `RS485_NO_TIMEOUT`. See `rs485_timeout`.
+ */
+TICK_TYPE bus_cl_timeout(CTX_PARAM);
 
 /***
  ***
@@ -51,13 +58,15 @@ typedef enum {
     BUS_CL_RTU_RECEIVE_DATA,
     // The function write function is piped to the "Read Register" function response
     BUS_CL_RTU_SEND_DATA,
+    // Wait for the register data to be ready, before transmitting the read response
+    BUS_CL_RTU_WAIT_FOR_DATA,
     // When the response is completed and the response CRC should be written
     BUS_CL_RTU_WRITE_RESPONSE_CRC,
     // Wait for the RS485 module to end the transmission
     BUS_CL_RTU_WAIT_FOR_FLUSH
 } BUS_CL_RTU_STATE;
-extern BUS_CL_RTU_STATE bus_cl_rtu_state;
-extern uint8_t bus_cl_crcErrors;
+#define bus_cl_rtu_state (MODBUS_CTX(bus_cl).rtuState)
+#define bus_cl_crcErrors (MODBUS_CTX(bus_cl).crcErrors)
 
 typedef enum {
     NO_ERROR = 0,
@@ -75,9 +84,16 @@ typedef enum {
 
 #define READ_HOLDING_REGISTERS (3)
 #define WRITE_HOLDING_REGISTERS (16)
+// User-defined function codes
+#define READ_CHANGED_RANGES (65)
+#define READ_MULTIPLE_RANGES (66)
+#define LATCH_SNAPSHOT (67)
+
+// Requests to all the stations, never answered
+#define BROADCAST_ADDRESS (0)
 
 // If != NO_ERR, write an error
-extern uint8_t bus_cl_exceptionCode;
+#define bus_cl_exceptionCode (MODBUS_CTX(bus_cl).exceptionCode)
 
 // The very header of every Modbus message
 typedef struct {
@@ -108,32 +124,400 @@ typedef struct {
     ModbusRtuHoldingRegisterData address;
 } ModbusRtuHoldingRegisterRequest;
 
+#ifdef BUS_CL_CHANGE_RANGES
+/**
+ * Change tracking of `BUS_CL_CHANGE_RANGES` register ranges, to let the master only read the ranges 
+ * modified since its last poll with the `READ_CHANGED_RANGES` function.
+ * The request has the same layout of `ModbusRtuHoldingRegisterRequest`: the address field contains the last sequence
+ * number known by the master, and the count field the max number of ranges to return (at least 1).
+ * The response contains the byte count, the sequence number to use for the next request and the address and count 
+ * of the changed ranges, oldest change first (all big-endian).
+ * When not all the changed ranges fit the response, the returned sequence number is the one of the last range 
+ * returned, so the master can ask again for the remaining ones.
+ * After a reset of the node every range is reported as changed from sequence 0, and the sequence numbers restart.
+ * When the master asks for the changes after a sequence number the node didn't reach yet (e.g. known before the reset),
+ * every range is returned, with the current sequence number.
+ */
+typedef struct {
+    uint16_t address;
+    uint8_t count;
+} BUS_CL_REG_RANGE;
+
+/**
+ * The tracked register ranges, defined by the application
+ */
+extern const BUS_CL_REG_RANGE regs_changeRanges[BUS_CL_CHANGE_RANGES];
+
+/**
+ * Sequence number of the last change
+ */
+#define bus_cl_changeSeq (MODBUS_CTX(bus_cl).changeSeq)
+
+/**
+ * Mark a range as changed. `range` is the index in `regs_changeRanges`
+ */
+void bus_cl_setChanged(CTX_PARAM_ uint8_t range);
+#endif
+
+#ifdef BUS_CL_IMAGES
+/**
+ * Double-buffered images of `BUS_CL_IMAGES` read-only register ranges. Read requests of registers
+ * in an image are answered by the bus client copying the published buffer, without calling `regs_validateReg`
+ * and `regs_onSend`.
+ * The producer (main loop or ISR) fills the whole write buffer and then publishes it with `bus_cl_publishImage`,
+ * that just swaps the buffer index. If a publish happens while a response is copied, the copy is done again,
+ * so the multi-register reads are always coherent and the producer never waits for the bus.
+ */
+typedef struct {
+    // The two buffers, with the registers in big-endian format
+    uint8_t* buffers[2];
+    // Index of the published buffer
+    volatile uint8_t readIndex;
+    // Incremented at every publish
+    volatile uint8_t seq;
+} BUS_CL_IMAGE;
+
+/**
+ * Define a `BUS_CL_IMAGE` with buffers of `size` bytes
+ */
+#define BUS_CL_IMAGE_DEFINE(name, size) \
+    static uint8_t name##_buffers[2][size]; \
+    BUS_CL_IMAGE name = { { name##_buffers[0], name##_buffers[1] }, 0, 0 }
+
+/**
+ * The buffer to fill before publishing it. It is the whole image, not only the changed registers.
+ */
+#define BUS_CL_IMAGE_WRITE_BUFFER(image) ((image)->buffers[(image)->readIndex ^ 1])
+
+/**
+ * Publish the write buffer of the image
+ */
+void bus_cl_publishImage(BUS_CL_IMAGE* image);
+
+typedef struct {
+    uint16_t address;
+    uint8_t count;
+    BUS_CL_IMAGE* image;
+} BUS_CL_IMAGE_RANGE;
+
+/**
+ * The register ranges served by images, defined by the application
+ */
+extern const BUS_CL_IMAGE_RANGE regs_images[BUS_CL_IMAGES];
+#endif
+
+#ifdef BUS_CL_MULTIPLE_RANGES_MAX
+/**
+ * The `READ_MULTIPLE_RANGES` function reads up to `BUS_CL_MULTIPLE_RANGES_MAX` non-contiguous register ranges in one go.
+ * The request has the same layout of `ModbusRtuHoldingRegisterRequest` for the first range, followed by
+ * the byte count and the address and count of the additional ranges (all big-endian).
+ * The response has the same layout of the read holding registers response, with the data of all the ranges
+ * concatenated, and it should fit the 256 bytes of a RTU packet and `RS485_BUF_SIZE`.
+ * Each range is validated as a single `READ_HOLDING_REGISTERS` request in `bus_cl_header`: 
+ * `regs_validateReg` is called again before every `regs_onSend`, that is called with the `READ_MULTIPLE_RANGES` function.
+ * The data of all the ranges is read (last range first) before the response is transmitted: if a handler sets 
+ * `bus_cl_exceptionCode` (e.g. `ERR_DEVICE_BUSY`), the exception is sent instead.
+ */
+#endif
+
 /**
  * Header of the last request received. It is valid for `regs_validateReg` processing and also during `regs_onReceive`
  * and `regs_onSend`
  */
-extern ModbusRtuHoldingRegisterRequest bus_cl_header;
+#define bus_cl_header (MODBUS_CTX(bus_cl).header)
+
+/**
+ * Handlers of a function code. The request should start with the same layout of `ModbusRtuHoldingRegisterRequest`,
+ * that is available in `bus_cl_header`.
+ * Handlers returning false should set `bus_cl_exceptionCode`: an error response is sent instead.
+ */
+typedef struct {
+    // Called when the request header is received
+    _Bool (*onHeader)(CTX_PARAM);
+    // Called with the byte count that follows the header, to validate it. NULL if the request has no other data.
+    _Bool (*onDataSize)(CTX_PARAM_ uint8_t size);
+    // Called when the request data (byte count bytes) is in the `rs485_buffer`
+    _Bool (*onData)(CTX_PARAM);
+    // Called when the request CRC is validated: it should start writing the response, CRC excluded.
+    // Returns `BUS_CL_RTU_WRITE_RESPONSE_CRC` when the response is complete, or `BUS_CL_RTU_SEND_DATA` 
+    // to continue writing in `onSendData`
+    BUS_CL_RTU_STATE (*onResponse)(CTX_PARAM);
+    // Called when the previous write is completed. Returns true when the response is complete.
+    _Bool (*onSendData)(CTX_PARAM);
+} BUS_CL_FUNCTION;
+
+#ifdef BUS_CL_CUSTOM_FUNCTIONS
+/**
+ * Custom functions can be added by defining `BUS_CL_CUSTOM_FUNCTIONS(F)` as a list of `F(code, handlers)`, 
+ * where `handlers` is the `BUS_CL_FUNCTION` defined by the application. 
+ * Function codes are dispatched by a switch, so only the enabled ones are compiled in.
+ */
+#define BUS_CL_DECLARE_FUNCTION(code, handlers) extern const BUS_CL_FUNCTION handlers;
+BUS_CL_CUSTOM_FUNCTIONS(BUS_CL_DECLARE_FUNCTION)
+#undef BUS_CL_DECLARE_FUNCTION
+#endif
 
 /**
  * Validate request of read/write a register range. Must validate address and size.
  * Header to check: `bus_cl_header`. Errors must be set to `bus_cl_exceptionCode`
  */
-_Bool regs_validateReg();
+_Bool regs_validateReg(CTX_PARAM);
+
+#ifdef BUS_CL_READ_CACHE_SIZE
+/**
+ * When `BUS_CL_READ_CACHE_SIZE` is defined, the last responses of up to `BUS_CL_READ_CACHE_SIZE` read requests 
+ * are cached (CRC included) and sent straight away when the same range is read again, without calling 
+ * `regs_validateReg` and `regs_onSend`.
+ * Only ranges flagged by `regs_validateReg` are cached, and only when they fit `BUS_CL_READ_CACHE_DATA_SIZE` bytes.
+ */
+#ifndef BUS_CL_READ_CACHE_DATA_SIZE
+#define BUS_CL_READ_CACHE_DATA_SIZE (RS485_BUF_SIZE - 5)
+#endif
+
+/**
+ * Reset before calling `regs_validateReg`. Set it to true to cache the response of the range to read.
+ */
+#define bus_cl_cacheable (MODBUS_CTX(bus_cl).cacheable)
+
+/**
+ * Version of the register data. The application should increment it every time 
+ * the content of a cacheable range changes: this invalidates all the cached responses.
+ * The cache is flushed when the client sees a new version, so the responses cached before can't be valid again
+ * when the version wraps around.
+ */
+#define bus_cl_dataVersion (MODBUS_CTX(bus_cl).dataVersion)
+#endif
 
 /**
  * Called when a range of registers (sys or app) is about to be written.
  * Packet header data is in `bus_cl_header`.
  * The `rs485_buffer` contains the data to write into the holding register(s).
+ * When `BUS_CL_STAGED_WRITE` is defined, the request CRC is still to be received: the data should
+ * only be staged, and then applied in `regs_onCommit`.
+ * Return true for no errors. Returns false and set `bus_cl_exceptionCode` in case of errors.
+ */
+_Bool regs_onReceive(CTX_PARAM);
+
+#ifdef BUS_CL_STAGED_WRITE
+/**
+ * Called when the CRC of a write request is validated, to apply the data staged by `regs_onReceive`.
+ * Packet header data is in `bus_cl_header`.
  * Return true for no errors. Returns false and set `bus_cl_exceptionCode` in case of errors.
  */
-_Bool regs_onReceive();
+_Bool regs_onCommit(CTX_PARAM);
+
+/**
+ * Called instead of `regs_onCommit` when the write request is dropped (wrong CRC, truncated packet 
+ * or replayed request, see `BUS_CL_WRITE_REPLAY_TIMEOUT`).
+ * The data staged by `regs_onReceive` should be discarded.
+ */
+void regs_onAbort(CTX_PARAM);
+#endif
+
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+#ifndef BUS_CL_STAGED_WRITE
+#error BUS_CL_WRITE_REPLAY_TIMEOUT requires BUS_CL_STAGED_WRITE
+#endif
+/**
+ * When a write request identical (same CRC and size) to the last successful one is received again in
+ * less than `BUS_CL_WRITE_REPLAY_TIMEOUT` ticks, it is considered a retry of the master that lost the response.
+ * The response is replayed without calling the register handlers: the data of a possible retry is kept in the
+ * buffer until its CRC is received, and only passed to `regs_validateReg` and `regs_onReceive` if the frame is different.
+ * Retried writes whose data and CRC don't fit `RS485_BUF_SIZE` are still staged, and then aborted.
+ */
+#endif
+
+#ifdef BUS_CL_DEFERRED_COMMIT
+#ifndef BUS_CL_STAGED_WRITE
+#error BUS_CL_DEFERRED_COMMIT requires BUS_CL_STAGED_WRITE
+#endif
+/**
+ * When `BUS_CL_DEFERRED_COMMIT` is defined, `regs_onReceive` can set `bus_cl_deferCommit` for slow writes
+ * (e.g. EEPROM): the write response is transmitted as soon as the request CRC is validated, and `regs_onCommit`
+ * is called from `bus_cl_poll` once the response is transmitted. The next request can't be received in the 
+ * meantime, so the master should wait for the commit to complete.
+ * The errors of the deferred `regs_onCommit` can't be reported in the response: the status of the last deferred
+ * commit is stored in `bus_cl_commitStatus`, and it can be exposed in a register.
+ */
+
+/**
+ * Reset before calling `regs_onReceive`. Set it to true to commit the data after the response.
+ */
+#define bus_cl_deferCommit (MODBUS_CTX(bus_cl).deferCommit)
+
+// Value of `bus_cl_commitStatus` until the deferred data is committed
+#define BUS_CL_COMMIT_PENDING (0xff)
+// Value of `bus_cl_commitStatus` when the response was dropped (the request was not complete), and the deferred
+// data was aborted with `regs_onAbort`
+#define BUS_CL_COMMIT_ABORTED (0xfe)
+
+/**
+ * `NO_ERROR` or the exception code of the last deferred commit, `BUS_CL_COMMIT_PENDING` or `BUS_CL_COMMIT_ABORTED`
+ */
+#define bus_cl_commitStatus (MODBUS_CTX(bus_cl).commitStatus)
+#endif
 
 /**
  * Called when the holding registers are about to be read (sent out). 
  * Packet header data is in `bus_cl_header`.
  * The `rs485_buffer` should be filled with the register content.
  */
-void regs_onSend();
+void regs_onSend(CTX_PARAM);
+
+#ifdef BUS_CL_ASYNC_SEND
+/**
+ * When `BUS_CL_ASYNC_SEND` is defined, `regs_onSend` is called before transmitting the response header of
+ * `READ_HOLDING_REGISTERS` requests. If the data is not ready yet (e.g. device busy), the handler can set 
+ * `bus_cl_sendPending` instead of filling the buffer: the response is then delayed, and `regs_onSendComplete` is
+ * polled until the data is ready, for at most `BUS_CL_ASYNC_SEND_TIMEOUT` ticks. After that the request
+ * fails with `ERR_DEVICE_BUSY`. If the line is active again in the meantime (the master timed out, and retried or
+ * moved on to another station), the response is dropped without transmitting anything.
+ * `BUS_CL_ASYNC_SEND_TIMEOUT` should be clearly shorter than the response timeout of the master (e.g. half of
+ * `BUS_MS_RESPONSE_TIMEOUT`, or of the adaptive timeouts of `BUS_MS_ADAPTIVE_TIMEOUT`), so that the exception
+ * still reaches the master in time.
+ * The handler can also set `bus_cl_exceptionCode` to respond with an error.
+ * The whole data should fit the buffer, so the max data size is `RS485_BUF_SIZE` bytes.
+ * The data of `READ_MULTIPLE_RANGES` requests can't be deferred: the request fails with `ERR_DEVICE_BUSY`.
+ */
+#ifndef BUS_CL_ASYNC_SEND_TIMEOUT
+#define BUS_CL_ASYNC_SEND_TIMEOUT (TICKS_PER_SECOND / 40)
+#endif
+
+/**
+ * Reset before calling `regs_onSend`. Set it to true to defer the data.
+ */
+#define bus_cl_sendPending (MODBUS_CTX(bus_cl).sendPending)
+
+/**
+ * Called to complete a deferred `regs_onSend`. Packet header data is in `bus_cl_header`.
+ * Returns true when the `rs485_buffer` is filled with the register content.
+ */
+_Bool regs_onSendComplete(CTX_PARAM);
+#endif
+
+#ifdef BUS_CL_SNAPSHOT
+/**
+ * The `LATCH_SNAPSHOT` function lets the master sample all the nodes at the same instant. When broadcast 
+ * (`BROADCAST_ADDRESS`), every node calls `regs_onLatch` as soon as the request CRC is validated, that is at the end 
+ * of the same frame (within the `bus_cl_poll` latency), and no response is sent. When addressed to a single node,
+ * the request is echoed back as a write response.
+ * The request has the same layout of `ModbusRtuHoldingRegisterRequest`: the address field contains a sequence 
+ * number chosen by the master, and the count is ignored.
+ */
+
+/**
+ * Sequence number of the last `LATCH_SNAPSHOT` request
+ */
+#define bus_cl_snapshotSeq (MODBUS_CTX(bus_cl).snapshotSeq)
+
+/**
+ * Called when a `LATCH_SNAPSHOT` request is validated. The sampled registers should be copied in a snapshot, 
+ * that is then read with normal read requests (e.g. publishing an image, see `BUS_CL_IMAGES`). 
+ * The snapshot should also contain `bus_cl_snapshotSeq`, to let the master check that all the nodes latched the 
+ * same request.
+ */
+void regs_onLatch(CTX_PARAM);
+#endif
+
+#ifdef MODBUS_CONTEXT_API
+/**
+ * Station address of the node. Set it before `bus_cl_init`
+ */
+#define bus_cl_station (MODBUS_CTX(bus_cl).station)
+#else
+#define bus_cl_station STATION_NODE
+#endif
+
+#ifdef BUS_CL_READ_CACHE_SIZE
+typedef struct {
+    // Key of the cached range. Count 0 means free entry.
+    uint16_t registerAddressBe;
+    uint8_t count;
+    // The value of `bus_cl_dataVersion` when the response was cached
+    uint16_t version;
+    // The whole response packet (header, byte count and data), CRC included
+    uint8_t response[sizeof(ModbusRtuPacketHeader) + 1 + BUS_CL_READ_CACHE_DATA_SIZE + sizeof(uint16_t)];
+} BUS_CL_READ_CACHE_ENTRY;
+#endif
+
+/**
+ * State of the bus client
+ * @internal
+ */
+typedef struct {
+#ifdef MODBUS_CONTEXT_API
+    uint8_t station;
+#endif
+    ModbusRtuHoldingRegisterRequest header;
+    uint8_t exceptionCode;
+    BUS_CL_RTU_STATE rtuState;
+    uint8_t crcErrors;
+    uint8_t messageSize;
+    // Handlers of the current request function
+    const BUS_CL_FUNCTION* function;
+    // Set when the whole request was received and validated, so the response doesn't need to wait for the mark condition
+    _Bool requestComplete;
+#ifdef BUS_CL_STAGED_WRITE
+    // Set when `regs_onReceive` staged data that still requires to be committed or aborted
+    _Bool staged;
+#endif
+#ifdef BUS_CL_WRITE_REPLAY_TIMEOUT
+    // CRC and data size of the last successful write request. Size 0 means no request to replay.
+    uint16_t lastWriteCrc;
+    uint8_t lastWriteSize;
+    TICK_TYPE lastWriteTime;
+    // Set when the current write request can be (or is) the retry of the last one
+    _Bool replay;
+#endif
+#ifdef BUS_CL_DEFERRED_COMMIT
+    _Bool deferCommit;
+    uint8_t commitStatus;
+    // Set when the staged data should be committed after the response is transmitted
+    _Bool commitDeferred;
+#endif
+#ifdef BUS_CL_READ_CACHE_SIZE
+    BUS_CL_READ_CACHE_ENTRY readCache[BUS_CL_READ_CACHE_SIZE];
+    // Next entry to replace
+    uint8_t readCacheNext;
+    // Entry hit by the current request, or entry being filled with the current response
+    BUS_CL_READ_CACHE_ENTRY* readCacheEntry;
+    _Bool readCacheHit;
+    _Bool cacheable;
+    uint16_t dataVersion;
+    // The data version of the cached entries
+    uint16_t readCacheVersion;
+#endif
+#ifdef BUS_CL_CHANGE_RANGES
+    uint16_t changeSeq;
+    // Sequence number of the last change of each range
+    uint16_t rangeChangeSeq[BUS_CL_CHANGE_RANGES];
+#endif
+#ifdef BUS_CL_MULTIPLE_RANGES_MAX
+    // The ranges requested by the `READ_MULTIPLE_RANGES` function
+    ModbusRtuHoldingRegisterData ranges[BUS_CL_MULTIPLE_RANGES_MAX];
+    uint8_t rangeCount;
+#endif
+#ifdef BUS_CL_ASYNC_SEND
+    _Bool sendPending;
+    // When the data was deferred
+    TICK_TYPE sendPendingTime;
+#endif
+#ifdef BUS_CL_IMAGES
+    // Image range of the current read request, NULL if the data is read with the handlers
+    const BUS_CL_IMAGE_RANGE* imageRange;
+    // Offset of the requested registers in the image buffers
+    uint8_t imageOffset;
+#endif
+#ifdef BUS_CL_SNAPSHOT
+    uint16_t snapshotSeq;
+    // Set when the current request is broadcast, so it is not answered
+    _Bool broadcast;
+#endif
+} BUS_CL_CONTEXT;
+
+#ifndef MODBUS_CONTEXT_API
+extern BUS_CL_CONTEXT bus_cl_ctx;
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,220 @@
+#ifndef _MODBUS_MASTER_H
+#define	_MODBUS_MASTER_H
+
+#include "configuration.h"
+#include "context.h"
+#include "bus_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Modbus RTU master (client) engine, built on the same RS485 line module (`rs485.c`) and CRC of the nodes.
+ * The requests are queued and transmitted one at a time; the responses are parsed, validated
+ * and then completed through the `onComplete` handler of the request. Timed-out or corrupted responses are
+ * retried up to `BUS_MS_RETRIES` times.
+ * With `BUS_MS_ADAPTIVE_TIMEOUT`, the response timeout of each node is derived from its response times, and
+ * the requests to the nodes that stopped answering fail fast, except for probes with exponential backoff.
+ * Only `READ_HOLDING_REGISTERS` and `WRITE_HOLDING_REGISTERS` are supported.
+ *
+ * The application should call `rs485_init` and then `bus_ms_init`, and then poll with `rs485_poll`
+ * and `bus_ms_poll` (see `bus_ms_timeout` for event-driven hosts).
+ * The whole request and response frames should fit `RS485_BUF_SIZE`.
+ */
+
+#ifndef BUS_MS_QUEUE_SIZE
+#define BUS_MS_QUEUE_SIZE (8)
+#endif
+
+// Ticks to wait for the response, from the end of the request transmission.
+// With `BUS_MS_ADAPTIVE_TIMEOUT`, the timeout of the nodes not yet measured, and the upper limit.
+#ifndef BUS_MS_RESPONSE_TIMEOUT
+#define BUS_MS_RESPONSE_TIMEOUT (TICKS_PER_SECOND / 20)
+#endif
+
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+// `BUS_MS_ADAPTIVE_TIMEOUT` tracks the response times of up to N nodes (the oldest entries are replaced), as the
+// TCP retransmission timeout (RFC 6298): the timeout of a node is its smoothed response time plus 4 times the
+// mean deviation, doubled at each retry. Only the first transmissions are measured (Karn's algorithm).
+// A node is down when a request times out after the retries: its requests fail with `BUS_MS_ERR_NODE_DOWN`
+// without being transmitted, but one every `BUS_MS_PROBE_INTERVAL` ticks (doubled at each failed probe,
+// up to `BUS_MS_PROBE_MAX_INTERVAL`) that is transmitted once.
+// Lower limit of the timeouts, to tolerate the jitter of the nodes and of the polling
+#ifndef BUS_MS_MIN_RESPONSE_TIMEOUT
+#define BUS_MS_MIN_RESPONSE_TIMEOUT (TICKS_PER_SECOND / 100)
+#endif
+#ifndef BUS_MS_PROBE_INTERVAL
+#define BUS_MS_PROBE_INTERVAL (TICKS_PER_SECOND / 4)
+#endif
+// Less than half the range of `TICK_TYPE`
+#ifndef BUS_MS_PROBE_MAX_INTERVAL
+#define BUS_MS_PROBE_MAX_INTERVAL (TICKS_PER_SECOND)
+#endif
+#endif
+
+// Retries of timed-out or corrupted requests
+#ifndef BUS_MS_RETRIES
+#define BUS_MS_RETRIES (2)
+#endif
+
+// Ticks to wait after a broadcast request, to let the nodes process it
+#ifndef BUS_MS_TURNAROUND_DELAY
+#define BUS_MS_TURNAROUND_DELAY (TICKS_PER_SECOND / 100)
+#endif
+
+// Results of the requests, other than `NO_ERROR` and the exception codes of the nodes (see `BUL_CL_RTU_EXCEPTION_CODE`)
+// No valid response in time, after the retries
+#define BUS_MS_ERR_TIMEOUT (0x80)
+// Wrong CRC or malformed response, after the retries
+#define BUS_MS_ERR_INVALID_RESPONSE (0x81)
+// Request not valid, see `bus_ms_isValid` (used by wrappers that queue requests on their own)
+#define BUS_MS_ERR_INVALID_REQUEST (0x82)
+// Not transmitted: the node is down, and it is not yet time to probe it (see `BUS_MS_ADAPTIVE_TIMEOUT`)
+#define BUS_MS_ERR_NODE_DOWN (0x83)
+
+typedef struct BUS_MS_REQUEST BUS_MS_REQUEST;
+
+struct BUS_MS_REQUEST {
+    // The node address, or `BROADCAST_ADDRESS` for write requests not answered
+    uint8_t station;
+    // `READ_HOLDING_REGISTERS` or `WRITE_HOLDING_REGISTERS`
+    uint8_t function;
+    uint16_t address;
+    uint8_t count;
+    // The registers to write, or filled with the registers read (in host endianness)
+    uint16_t* data;
+    // Called when the request is completed, with `NO_ERROR`, the exception code of the node or `BUS_MS_ERR_*`
+    void (*onComplete)(CTX_PARAM_ const BUS_MS_REQUEST* request, uint8_t result);
+    // Application data
+    void* user;
+};
+
+/**
+ * Initialize the master, after `rs485_init`
+ */
+void bus_ms_init(CTX_PARAM);
+
+/**
+ * Poll for master activities, after `rs485_poll`
+ */
+void bus_ms_poll(CTX_PARAM);
+
+/**
+ * Returns the ticks before the master should be polled again regardless of the line activity,
+ * or `RS485_NO_TIMEOUT`. See `rs485_timeout`.
+ */
+TICK_TYPE bus_ms_timeout(CTX_PARAM);
+
+/**
+ * Returns false if the request is not valid (e.g. unsupported function, or the frames don't fit `RS485_BUF_SIZE`).
+ */
+_Bool bus_ms_isValid(const BUS_MS_REQUEST* request);
+
+/**
+ * Queue a request, copied in the queue.
+ * Returns false if the queue is full, or if the request is not valid (see `bus_ms_isValid`).
+ */
+_Bool bus_ms_enqueue(CTX_PARAM_ const BUS_MS_REQUEST* request);
+
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+/**
+ * Returns the response timeout of the next request to the node (`BUS_MS_RESPONSE_TIMEOUT` if not measured or down).
+ */
+TICK_TYPE bus_ms_responseTimeout(CTX_PARAM_ uint8_t station);
+
+/**
+ * Returns true if the node is down: its requests fail, but the probes.
+ */
+_Bool bus_ms_isDown(CTX_PARAM_ uint8_t station);
+#endif
+
+/**
+ * Count of the requests queued or in progress
+ */
+#define bus_ms_pending (MODBUS_CTX(bus_ms).queueCount)
+
+// Statistics
+#define bus_ms_crcErrors (MODBUS_CTX(bus_ms).crcErrors)
+#define bus_ms_timeouts (MODBUS_CTX(bus_ms).timeouts)
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+// Requests failed with `BUS_MS_ERR_NODE_DOWN`
+#define bus_ms_skipped (MODBUS_CTX(bus_ms).skipped)
+#endif
+
+/**
+ * State of the master
+ * @internal
+ */
+typedef enum {
+    // No request in progress
+    BUS_MS_IDLE,
+    // Transmitting the request data, then the CRC
+    BUS_MS_SEND,
+    // Wait for the RS485 module to end the transmission
+    BUS_MS_WAIT_FOR_FLUSH,
+    // Wait for the response
+    BUS_MS_RECEIVE,
+    // Invalid response: skip the data until the mark condition
+    BUS_MS_SKIP,
+    // Wait after a broadcast request
+    BUS_MS_TURNAROUND
+} BUS_MS_STATE;
+
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+/**
+ * Response times of a node
+ * @internal
+ */
+typedef struct {
+    // 0 if the entry is free
+    uint8_t station;
+    // Consecutive requests timed out after the retries (or failed probes): down if not zero
+    uint8_t failures;
+    // Ticks from the end of the request to the first byte of the response: smoothed (scaled by 8, 0 if not
+    // measured) and mean deviation (scaled by 4)
+    TICK_TYPE srtt;
+    TICK_TYPE rttvar;
+    // Of the last failure, for the backoff of the probes
+    TICK_TYPE failedTick;
+} BUS_MS_NODE;
+#endif
+
+/**
+ * State of the master
+ * @internal
+ */
+typedef struct {
+    BUS_MS_STATE state;
+    // Circular queue, the head is the request in progress
+    BUS_MS_REQUEST queue[BUS_MS_QUEUE_SIZE];
+    uint8_t queueHead;
+    uint8_t queueCount;
+    uint8_t retries;
+    // Set at the end of the request transmission
+    TICK_TYPE lastTick;
+    // Result of the current request when the response is skipped
+    uint8_t skipResult;
+    uint16_t crcErrors;
+    uint16_t timeouts;
+#ifdef BUS_MS_ADAPTIVE_TIMEOUT
+    // Of the request in progress
+    TICK_TYPE timeout;
+    // Ticks to the first byte of the response in progress, 0 if none yet
+    TICK_TYPE turnaround;
+    BUS_MS_NODE nodes[BUS_MS_ADAPTIVE_TIMEOUT];
+    // The entry to replace next
+    uint8_t nextNode;
+    uint16_t skipped;
+#endif
+} BUS_MS_CONTEXT;
+
+#ifndef MODBUS_CONTEXT_API
+extern BUS_MS_CONTEXT bus_ms_ctx;
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _MODBUS_MASTER_H */
@@ -0,0 +1,78 @@
+#ifndef _MODBUS_SCAN_H
+#define	_MODBUS_SCAN_H
+
+#include "configuration.h"
+#include "context.h"
+#include "bus_master.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Scan-cycle planner of the master (see `bus_master.h`): it groups the register points to poll in the fewest
+ * and cheapest read requests, bridging the gaps between the points when reading a few unused registers costs
+ * less than another round trip. The result is the list of `BUS_MS_REQUEST` of a scan cycle, that the application
+ * enqueues as they are (after setting `onComplete`), and the location of each point in the registers read.
+ *
+ * The grouping is optimal for the cost model (see `BUS_SCAN_COSTS`): a dynamic programming over the points
+ * of each node sorted by address, with each read limited to `BUS_SCAN_COSTS::maxRegisters`.
+ */
+
+// Registers of a read whose response fits `RS485_BUF_SIZE`, see `bus_ms_isValid`
+#define BUS_SCAN_MAX_REGISTERS ((RS485_BUF_SIZE - 5) / 2)
+
+// Characters of a read transaction, other than the registers: the request (8), the response header and CRC (5),
+// and the silence before each frame (3.5 + 3.5)
+#define BUS_SCAN_TRANSACTION_CHARS (20)
+
+typedef struct {
+    // Cost of a read (request, turnaround, response overhead), and of each register read, in the same unit (e.g. ticks)
+    uint32_t transactionCost;
+    uint32_t registerCost;
+    // Registers of a read, up to `BUS_SCAN_MAX_REGISTERS` (less for nodes with smaller buffers)
+    uint8_t maxRegisters;
+    // Unused registers between two points read together, 0 for nodes that reject the reads of unmapped registers
+    uint16_t maxGap;
+} BUS_SCAN_COSTS;
+
+typedef struct {
+    uint8_t station;
+    uint16_t address;
+    // Registers of the point (e.g. 2 for 32-bit values)
+    uint8_t count;
+    // Set by `bus_scan_plan`: the registers of the point, in the data of its read
+    const uint16_t* data;
+    // Set by `bus_scan_plan`: the index of its read
+    uint16_t read;
+
+    // Planner state
+    // Cost of the best plan of the points up to this one, and the first point of its last read
+    uint32_t planCost;
+    uint16_t planFirst;
+} BUS_SCAN_POINT;
+
+/**
+ * Costs in ticks of a line at `RS485_BAUD`, for nodes that answer in `turnaround` ticks (e.g. measured,
+ * see `bus_ms_responseTimeout`). Reads up to `BUS_SCAN_MAX_REGISTERS` registers, and no limit to the gaps.
+ */
+void bus_scan_rtuCosts(BUS_SCAN_COSTS* costs, TICK_TYPE turnaround);
+
+/**
+ * Plan the reads of the points (sorted in place by station and address): the read requests are written to
+ * `reads`, with the registers in `data`. The points can overlap.
+ * Returns the count of reads, or -1 if `reads` or `data` are too small, or if a point is not valid
+ * (no registers, more than `maxRegisters`, or beyond the address space).
+ */
+int bus_scan_plan(BUS_SCAN_POINT* points, uint16_t pointCount, const BUS_SCAN_COSTS* costs, BUS_MS_REQUEST* reads, uint16_t maxReads, uint16_t* data, uint16_t dataSize);
+
+/**
+ * Returns the cost of the reads, see `BUS_SCAN_COSTS`
+ */
+uint32_t bus_scan_cost(const BUS_SCAN_COSTS* costs, const BUS_MS_REQUEST* reads, uint16_t readCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _MODBUS_SCAN_H */
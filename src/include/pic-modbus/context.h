@@ -0,0 +1,49 @@
+#ifndef _MODBUS_CONTEXT_H
+#define _MODBUS_CONTEXT_H
+
+#include "configuration.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The state of every module (CRC, UART, RS485 and bus client) is kept in a `<module>_CONTEXT` struct.
+ *
+ * By default the API is static, as required by the 8-bit MCUs: there is a single node, and each module has a single
+ * context at a static address (e.g. `rs485_ctx`). The functions have no additional parameters, so the compiled code
+ * is the same of plain global variables.
+ *
+ * When `MODBUS_CONTEXT_API` is defined, the contexts of a node are grouped in a `MODBUS_CONTEXT`, that is passed as
+ * the first argument `ctx` of every function, handlers included (see `regs_validateReg`). So a single process can run
+ * multiple nodes (e.g. multi-port gateways or multi-node simulations).
+ *
+ * The state variables (e.g. `rs485_buffer`, `bus_cl_header`) are macros that access the right context, so the code
+ * is the same in both cases: functions should be declared with `CTX_PARAM` and called with `CTX_ARG`.
+ * Functions that don't access the state (e.g. handlers of a table) use `CTX_UNUSED;`.
+ */
+typedef struct MODBUS_CONTEXT MODBUS_CONTEXT;
+
+#ifdef MODBUS_CONTEXT_API
+#define CTX_PARAM MODBUS_CONTEXT* ctx
+#define CTX_PARAM_ MODBUS_CONTEXT* ctx,
+#define CTX_ARG ctx
+#define CTX_ARG_ ctx,
+// The context of a module of the current node
+#define MODBUS_CTX(module) (ctx->module)
+#define CTX_UNUSED (void)ctx
+#else
+#define CTX_PARAM void
+#define CTX_PARAM_
+#define CTX_ARG
+#define CTX_ARG_
+// The static context of a module
+#define MODBUS_CTX(module) (module##_ctx)
+#define CTX_UNUSED
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
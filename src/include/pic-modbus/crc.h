@@ -2,21 +2,30 @@
 #define _CRC16_H
 
 #include <stdint.h>
+#include "context.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct {
+    uint16_t crc16;
+} CRC_CONTEXT;
+
+#ifndef MODBUS_CONTEXT_API
+extern CRC_CONTEXT crc_ctx;
+#endif
+
 /**
  * Current CRC, that is kept updated with all the bytes read/written.
  */
-extern uint16_t crc16;
+#define crc16 (MODBUS_CTX(crc).crc16)
 
-void crc_reset();
-void crc_update(uint8_t ch);
+void crc_reset(CTX_PARAM);
+void crc_update(CTX_PARAM_ uint8_t ch);
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
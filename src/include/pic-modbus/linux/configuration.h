@@ -0,0 +1,116 @@
+#ifndef _STD_CONF_H
+#define _STD_CONF_H
+
+#include <endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Linux host build (e.g. USB to RS485 dongles). It uses the instance-based API, see `MODBUS_CONTEXT_API`.
+ */
+#ifndef MODBUS_CONTEXT_API
+#define MODBUS_CONTEXT_API
+#endif
+
+typedef _Bool __bit;
+#define __persistent
+
+// Microseconds from `CLOCK_MONOTONIC`. It wraps around every ~71 minutes, only differences are used.
+typedef uint32_t TICK_TYPE;
+#define TICKS_PER_SECOND (1000000)
+#define TICKS_PER_MILLISECOND (1000)
+
+#ifndef RS485_BAUD
+#define RS485_BAUD (19200)
+#endif
+// A whole RTU frame, e.g. reads of 125 registers
+#ifndef RS485_BUF_SIZE
+#define RS485_BUF_SIZE (256)
+#endif
+
+// Define to stage write requests, and apply them only when the request CRC is validated 
+// (see `regs_onCommit` and `regs_onAbort`)
+//#define BUS_CL_STAGED_WRITE
+
+// Define (in ticks) to replay the response of write requests retried by the master, without 
+// committing them twice. Requires BUS_CL_STAGED_WRITE.
+//#define BUS_CL_WRITE_REPLAY_TIMEOUT (TICKS_PER_SECOND / 10)
+
+// Define to let `regs_onReceive` commit slow writes after the response is transmitted (see `bus_cl_deferCommit`).
+// Requires BUS_CL_STAGED_WRITE.
+//#define BUS_CL_DEFERRED_COMMIT
+
+// Define to cache the responses of the last N read requests of cacheable ranges (see `bus_cl_cacheable`)
+//#define BUS_CL_READ_CACHE_SIZE (1)
+
+// Define to track changes of N register ranges (see `regs_changeRanges`) and to enable the READ_CHANGED_RANGES function
+//#define BUS_CL_CHANGE_RANGES (4)
+
+// Define to enable the READ_MULTIPLE_RANGES function, to read up to N ranges in a single request
+//#define BUS_CL_MULTIPLE_RANGES_MAX (4)
+
+// Define to let `regs_onSend` defer the read data (`bus_cl_sendPending`) instead of failing with ERR_DEVICE_BUSY
+//#define BUS_CL_ASYNC_SEND
+
+// Define as a list of F(code, handlers) to add custom function codes (see `BUS_CL_FUNCTION`)
+//#define BUS_CL_CUSTOM_FUNCTIONS(F) F(100, myFunctionHandlers)
+
+// Define to serve N read-only register ranges from double-buffered images (see `regs_images`)
+//#define BUS_CL_IMAGES (1)
+
+// Define to enable the LATCH_SNAPSHOT function, to sample the registers of all the nodes at the same time (see `regs_onLatch`)
+//#define BUS_CL_SNAPSHOT
+
+// Define to derive the response timeout of up to N nodes from their response times, and to fail fast the
+// requests to the nodes down (see `bus_master.h`)
+//#define BUS_MS_ADAPTIVE_TIMEOUT (16)
+
+typedef struct {
+    _Bool OERR;
+    _Bool FERR;
+} UART_ERR_BITS;
+
+// Bytes read in one go from the serial port
+#define UART_RX_BUFFER_SIZE (64)
+// Bytes written in one go to the serial port, see `uart_flush`
+#define UART_TX_BUFFER_SIZE (64)
+// Bytes queued in the serial driver before the TX FIFO is considered full: the margin for the latency of the host
+// while the frame is fed, since a gap would split it. The line is disengaged only when they are transmitted.
+#define UART_TX_FIFO_SIZE (16)
+
+// The serial port of a node, see `uart_open`
+#define UART_HAS_PORT
+typedef struct {
+    int fd;
+    uint8_t rxBuffer[UART_RX_BUFFER_SIZE];
+    uint8_t rxCount;
+    uint8_t rxPos;
+    uint8_t txBuffer[UART_TX_BUFFER_SIZE];
+    uint8_t txCount;
+    // Set when the data is not accepted by the driver (`EAGAIN`), written when the port is writable again (`EPOLLOUT`)
+    _Bool txPending;
+    // Set by a failed write: the rest of the frame is dropped, and the next byte read has the FERR bit
+    _Bool txFailed;
+    _Bool rxFailed;
+    // `errno` of the last failed write
+    int lastError;
+    // Set when the transmitted data is received back (half-duplex dongles without automatic direction control),
+    // so the bytes written are dropped from the data received after the transmission
+    _Bool echo;
+    uint16_t echoCount;
+} UART_PORT;
+
+typedef const char* EXC_STRING_T;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Abort the process, see `sys_fatal`
+void RESET(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
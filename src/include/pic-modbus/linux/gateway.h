@@ -0,0 +1,228 @@
+#ifndef _MODBUS_GATEWAY_H
+#define _MODBUS_GATEWAY_H
+
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/linux/loop.h"
+#include "pic-modbus/linux/register_image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Modbus TCP to RTU gateway, to expose the nodes of the RS485 buses to Modbus TCP clients (e.g. SCADA).
+ * Everything runs in the thread of the event-driven loop (see `loop.h`): the TCP clients and a master
+ * engine (see `bus_master.h`) for each serial port.
+ * The MBAP requests are translated to RTU frames (the unit identifier is the station address), and routed
+ * to the port of the unit (see `gateway_route`). Each port has a queue of transactions, served one at a
+ * time: the clients take turns, so a client with many pipelined requests doesn't starve the others.
+ * The queued reads of the same unit, with overlapping or adjacent ranges, are coalesced in a single
+ * transaction (up to `GATEWAY_MAX_REGISTERS`), and the response is split back to each client. If the node
+ * answers the coalesced transaction with an exception, the requests are retried one by one.
+ * The reads of slowly changing ranges can be served from a cache, each range with its own time-to-live
+ * (see `gateway_cacheRange`): the writes to a unit invalidate its cached registers.
+ * The registers read can also be published to the local processes, see `GATEWAY::image`.
+ * Only `READ_HOLDING_REGISTERS` and `WRITE_HOLDING_REGISTERS` are supported, and the frames should fit `RS485_BUF_SIZE`.
+ *
+ * The application calls `timers_init`, `gateway_init`, `gateway_addPort` for each port, and then
+ * `modbus_loop_wait(&gateway.loop, ...)` forever.
+ */
+
+#ifndef GATEWAY_MAX_CLIENTS
+#define GATEWAY_MAX_CLIENTS (64)
+#endif
+
+// Transactions queued to each serial port, from all the clients
+#ifndef GATEWAY_PORT_QUEUE_SIZE
+#define GATEWAY_PORT_QUEUE_SIZE (32)
+#endif
+
+// Pipelined requests of each client: the client isn't read while it has that many requests in progress
+#ifndef GATEWAY_CLIENT_PENDING
+#define GATEWAY_CLIENT_PENDING (8)
+#endif
+
+// Register ranges with a cache time-to-live, see `gateway_cacheRange`
+#ifndef GATEWAY_CACHE_RULES
+#define GATEWAY_CACHE_RULES (16)
+#endif
+
+// Responses in the cache, the least recently stored are replaced
+#ifndef GATEWAY_CACHE_ENTRIES
+#define GATEWAY_CACHE_ENTRIES (32)
+#endif
+
+// MBAP header: transaction id, protocol id and length, followed by the unit identifier and the PDU
+#define GATEWAY_MBAP_SIZE (7)
+// The largest Modbus TCP frame
+#define GATEWAY_FRAME_SIZE (GATEWAY_MBAP_SIZE + 253)
+// Responses waiting to be sent to each client
+#define GATEWAY_CLIENT_TX_SIZE (GATEWAY_CLIENT_PENDING * GATEWAY_FRAME_SIZE)
+
+// Registers in a transaction, so that the frames fit `RS485_BUF_SIZE`
+#define GATEWAY_MAX_REGISTERS ((RS485_BUF_SIZE - 5) / 2)
+
+// Exception codes of the gateway
+// The unit has no route, or the port queue is full
+#define GATEWAY_ERR_PATH_UNAVAILABLE (0x0a)
+// No valid response from the unit
+#define GATEWAY_ERR_TARGET_FAILED (0x0b)
+
+// `GATEWAY::routes` of the units not routed
+#define GATEWAY_NO_ROUTE (0xff)
+
+typedef struct GATEWAY GATEWAY;
+
+/**
+ * A TCP client
+ * @internal
+ */
+typedef struct {
+    MODBUS_LOOP_FD source;
+    GATEWAY* gateway;
+    // Incremented when the slot is reused, to drop the responses of closed clients
+    uint16_t generation;
+    // The epoll events of the socket
+    uint32_t events;
+    uint8_t pending;
+    uint16_t rxCount;
+    uint8_t rxBuffer[GATEWAY_FRAME_SIZE];
+    uint16_t txCount;
+    uint8_t txBuffer[GATEWAY_CLIENT_TX_SIZE];
+} GATEWAY_CLIENT;
+
+/**
+ * A queued request, as received from the TCP client
+ * @internal
+ */
+typedef struct {
+    _Bool used;
+    // Order of arrival, to serve the requests of each client in order
+    uint32_t seq;
+    uint8_t client;
+    uint16_t generation;
+    uint16_t transactionId;
+    // Served by the transaction of the port in progress
+    _Bool merged;
+    // Not to be coalesced, e.g. after an exception of the coalesced transaction
+    _Bool alone;
+    BUS_MS_REQUEST request;
+    uint16_t data[GATEWAY_MAX_REGISTERS];
+} GATEWAY_TRANSACTION;
+
+/**
+ * See `gateway_cacheRange`
+ * @internal
+ */
+typedef struct {
+    uint8_t unit;
+    uint16_t address;
+    uint16_t count;
+    // In microseconds
+    uint64_t ttl;
+} GATEWAY_CACHE_RULE;
+
+/**
+ * Registers read from a unit
+ * @internal
+ */
+typedef struct {
+    _Bool used;
+    uint8_t unit;
+    uint16_t address;
+    uint8_t count;
+    // Microseconds from `CLOCK_MONOTONIC`, not affected by the wrap-around of the ticks
+    uint64_t time;
+    uint16_t data[GATEWAY_MAX_REGISTERS];
+} GATEWAY_CACHE_ENTRY;
+
+/**
+ * A serial port, with its master engine
+ * @internal
+ */
+typedef struct {
+    MODBUS_CONTEXT ctx;
+    GATEWAY* gateway;
+    GATEWAY_TRANSACTION queue[GATEWAY_PORT_QUEUE_SIZE];
+    uint8_t queueCount;
+    // The first transaction in the engine, or NULL
+    GATEWAY_TRANSACTION* active;
+    // The request in the engine, of the active transaction and of the ones coalesced with it
+    BUS_MS_REQUEST batch;
+    uint16_t batchData[GATEWAY_MAX_REGISTERS];
+    // The client served last, for the round-robin
+    uint8_t lastClient;
+} GATEWAY_PORT;
+
+struct GATEWAY {
+    MODBUS_LOOP loop;
+    MODBUS_LOOP_FD listener;
+    // The bound TCP port
+    uint16_t tcpPort;
+    GATEWAY_CLIENT clients[GATEWAY_MAX_CLIENTS];
+    GATEWAY_PORT ports[MODBUS_LOOP_MAX_NODES];
+    uint8_t portCount;
+    // Port of each unit, or `GATEWAY_NO_ROUTE`
+    uint8_t routes[256];
+    uint32_t nextSeq;
+    // Set to coalesce the reads (default)
+    _Bool coalesce;
+    GATEWAY_CACHE_RULE cacheRules[GATEWAY_CACHE_RULES];
+    uint8_t cacheRuleCount;
+    GATEWAY_CACHE_ENTRY cache[GATEWAY_CACHE_ENTRIES];
+    // Set to publish the registers read from the nodes (see `register_image_create`), NULL by default.
+    // The registers written are invalidated.
+    REGISTER_IMAGE* image;
+
+    // Statistics
+    uint32_t requests;
+    uint32_t exceptions;
+    // Transactions on the serial ports
+    uint32_t transactions;
+    // Requests served by the transactions of other requests
+    uint32_t coalesced;
+    // Requests served from the cache
+    uint32_t cacheHits;
+};
+
+/**
+ * Listen to `tcpPort` on all the interfaces (0 for an ephemeral port, see `GATEWAY::tcpPort`).
+ * Returns false in case of errors (see `errno`).
+ */
+_Bool gateway_init(GATEWAY* gateway, uint16_t tcpPort);
+
+/**
+ * Open a serial port (e.g. "/dev/ttyUSB0"). The first port is the route of all the units.
+ * Returns the port index, or -1 in case of errors (see `errno`).
+ */
+int gateway_addPort(GATEWAY* gateway, const char* device);
+
+/**
+ * Use a serial port already open, see `uart_attach`. Returns the port index, or -1 in case of errors.
+ */
+int gateway_attachPort(GATEWAY* gateway, int fd);
+
+/**
+ * Route the requests to `unit` to the port, or `GATEWAY_NO_ROUTE`
+ */
+void gateway_route(GATEWAY* gateway, uint8_t unit, uint8_t port);
+
+/**
+ * Serve the reads of `unit` in the range from the cache, if read less than `ttl` milliseconds ago (0 not to cache
+ * them, e.g. to exclude a part of a larger range). In milliseconds and not in ticks, for long TTLs of ranges that
+ * rarely change. A read is cached for the shortest TTL of the ranges it overlaps, and only if all its registers are
+ * in the ranges: so a range with TTL 0 excludes its registers also from the reads that span it.
+ * Returns false if there are already `GATEWAY_CACHE_RULES` ranges.
+ */
+_Bool gateway_cacheRange(GATEWAY* gateway, uint8_t unit, uint16_t address, uint16_t count, uint32_t ttl);
+
+/**
+ * Close the clients and the ports
+ */
+void gateway_close(GATEWAY* gateway);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _MODBUS_LOOP_H
+#define _MODBUS_LOOP_H
+
+#include "pic-modbus/modbus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Event-driven runtime of the Linux nodes, instead of busy polling.
+ * The loop blocks in epoll on the serial ports of the nodes and on a timerfd, armed with the next deadline
+ * of the nodes (see `modbus_timeout`): `modbus_poll` is only called when data is received or when a timed 
+ * transition of the line is due, so an idle node doesn't use CPU.
+ * Master contexts (see `bus_master.h`) can be run by the same loop, and other threads can wake it up
+ * (e.g. when new requests are queued). Other file descriptors of the application (e.g. sockets) can be
+ * added too, with their handlers (see `MODBUS_LOOP_FD`), to run everything in a single thread.
+ */
+
+#ifndef MODBUS_LOOP_MAX_NODES
+#define MODBUS_LOOP_MAX_NODES (8)
+#endif
+
+typedef struct MODBUS_LOOP_FD MODBUS_LOOP_FD;
+
+// A file descriptor of the application, owned by the caller until removed
+struct MODBUS_LOOP_FD {
+    int fd;
+    // Called by `modbus_loop_wait` with the epoll events (e.g. `EPOLLIN`)
+    void (*onEvents)(MODBUS_LOOP_FD* source, uint32_t events);
+    void* user;
+};
+
+typedef struct {
+    int epollFd;
+    int timerFd;
+    // Signaled by `modbus_loop_wake`
+    int wakeFd;
+    MODBUS_CONTEXT* nodes[MODBUS_LOOP_MAX_NODES];
+    // Set for the master contexts
+    _Bool isMaster[MODBUS_LOOP_MAX_NODES];
+    // Set when the serial port of the context is waited for `EPOLLOUT` too, see `UART_PORT::txPending`
+    _Bool waitWrite[MODBUS_LOOP_MAX_NODES];
+    uint8_t nodeCount;
+    // Count of the wake-ups, for statistics
+    uint32_t wakeups;
+} MODBUS_LOOP;
+
+/**
+ * Returns false in case of errors (see `errno`)
+ */
+_Bool modbus_loop_init(MODBUS_LOOP* loop);
+
+/**
+ * Add a node, with the serial port already open (see `uart_open`) and initialized (see `modbus_init`).
+ * Returns false in case of errors (see `errno`)
+ */
+_Bool modbus_loop_add(MODBUS_LOOP* loop, MODBUS_CONTEXT* ctx);
+
+/**
+ * Add a master, with the serial port already open (see `uart_open`) and initialized (see `rs485_init` and `bus_ms_init`).
+ * Returns false in case of errors (see `errno`)
+ */
+_Bool modbus_loop_addMaster(MODBUS_LOOP* loop, MODBUS_CONTEXT* ctx);
+
+/**
+ * Add a file descriptor of the application, to wait for `events` (e.g. `EPOLLIN`, level-triggered).
+ * Returns false in case of errors (see `errno`)
+ */
+_Bool modbus_loop_addFd(MODBUS_LOOP* loop, MODBUS_LOOP_FD* source, uint32_t events);
+
+/**
+ * Change the events to wait for (e.g. `EPOLLOUT` only when there is data to write).
+ * Returns false in case of errors (see `errno`)
+ */
+_Bool modbus_loop_modifyFd(MODBUS_LOOP* loop, MODBUS_LOOP_FD* source, uint32_t events);
+
+/**
+ * Remove a file descriptor, before closing it. Only the handler of the same source can remove it
+ * while its events are dispatched.
+ */
+void modbus_loop_removeFd(MODBUS_LOOP* loop, MODBUS_LOOP_FD* source);
+
+/**
+ * Make the current or the next `modbus_loop_wait` return. Can be called by any thread.
+ */
+void modbus_loop_wake(MODBUS_LOOP* loop);
+
+/**
+ * Poll all the nodes, and then block until data is received, the next deadline of the nodes is due,
+ * or at most `maxWait` ticks are elapsed (e.g. to run other application tasks).
+ * The handlers of the application file descriptors are called before returning.
+ * Returns false in case of errors (see `errno`)
+ */
+_Bool modbus_loop_wait(MODBUS_LOOP* loop, TICK_TYPE maxWait);
+
+void modbus_loop_close(MODBUS_LOOP* loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
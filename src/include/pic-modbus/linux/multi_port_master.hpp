@@ -0,0 +1,298 @@
+#ifndef _MODBUS_MULTI_PORT_MASTER_HPP
+#define _MODBUS_MULTI_PORT_MASTER_HPP
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/spsc_queue.hpp"
+#include "pic-modbus/linux/loop.h"
+
+/**
+ * Master runtime for Linux hosts with several serial lines (e.g. one USB to RS485 dongle per bus):
+ *
+ *   modbus::MultiPortMaster master;
+ *   int port = master.addPort("/dev/ttyUSB0");
+ *   master.start();
+ *   master.submit(port, request);
+ *   while (!master.poll(result)) { master.wait(100); }
+ *
+ * Each port is run by its own worker thread, with a master engine (see `bus_master.h`) in an event-driven loop
+ * (see `loop.h`): the buses are independent, so the aggregate throughput scales with the count of ports.
+ * The requests and the results are exchanged through lock-free single-producer single-consumer queues
+ * (see `spsc_queue.hpp`), with an eventfd to wake up the other side: `submit` should be called by a single
+ * thread, and `poll` and `wait` by a single thread (possibly the same).
+ * Call `timers_init` once, before adding the ports.
+ */
+
+namespace modbus {
+
+class MultiPortMaster {
+public:
+    // Registers that fit the frames of the engine
+    static constexpr uint8_t MaxRegisters = (RS485_BUF_SIZE - 5) / 2;
+
+    struct Request {
+        // Application data, returned in the result
+        uint32_t id;
+        // See `BUS_MS_REQUEST`
+        uint8_t station;
+        uint8_t function;
+        uint16_t address;
+        uint8_t count;
+        // The registers to write
+        uint16_t data[MaxRegisters];
+    };
+
+    struct Result {
+        uint32_t id;
+        uint8_t port;
+        // `NO_ERROR`, the exception code of the node or `BUS_MS_ERR_*`
+        uint8_t result;
+        // The registers read
+        uint8_t count;
+        uint16_t data[MaxRegisters];
+    };
+
+    // `queueSize` is the capacity of the request and result queues of each port
+    explicit MultiPortMaster(size_t queueSize = 64) : _queueSize(queueSize) {
+        _resultFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    MultiPortMaster(const MultiPortMaster&) = delete;
+    MultiPortMaster& operator=(const MultiPortMaster&) = delete;
+
+    ~MultiPortMaster() {
+        stop();
+        for (auto& port : _ports) {
+            modbus_loop_close(&port->loop);
+            uart_close(&port->ctx);
+        }
+        close(_resultFd);
+    }
+
+    /**
+     * Open a serial port (e.g. "/dev/ttyUSB0"), before `start`. Returns the port index, or -1 in case of errors (see `errno`)
+     */
+    int addPort(const char* device) {
+        std::unique_ptr<Port> port(new Port(*this, _queueSize));
+        if (!uart_open(&port->ctx, device)) {
+            return -1;
+        }
+        return add(std::move(port));
+    }
+
+    /**
+     * Use a serial port already open in non-blocking mode, see `uart_attach`. Returns the port index, or -1 in case of errors.
+     */
+    int addPort(int fd) {
+        std::unique_ptr<Port> port(new Port(*this, _queueSize));
+        uart_attach(&port->ctx, fd);
+        return add(std::move(port));
+    }
+
+    size_t ports() const { return _ports.size(); }
+
+    // Start the workers
+    void start() {
+        for (auto& port : _ports) {
+            port->running.store(true);
+            port->thread = std::thread(&Port::run, port.get());
+        }
+    }
+
+    // Stop the workers: the pending requests are dropped
+    void stop() {
+        for (auto& port : _ports) {
+            if (port->thread.joinable()) {
+                port->running.store(false);
+                modbus_loop_wake(&port->loop);
+                port->thread.join();
+            }
+        }
+    }
+
+    /**
+     * Queue a request to a port. Returns false if the queue of the port is full.
+     * Invalid requests are completed with `BUS_MS_ERR_INVALID_REQUEST` (see `bus_ms_isValid`).
+     */
+    bool submit(size_t port, const Request& request) {
+        Port& p = *_ports[port];
+        if (!p.requests.push(request)) {
+            return false;
+        }
+        modbus_loop_wake(&p.loop);
+        return true;
+    }
+
+    /**
+     * Get a completed request, from any port. Returns false if there are none.
+     */
+    bool poll(Result& result) {
+        for (size_t i = 0; i < _ports.size(); i++) {
+            Port& port = *_ports[(_nextPoll + i) % _ports.size()];
+            if (port.results.pop(result)) {
+                // Round-robin, not to starve the other ports
+                _nextPoll = (_nextPoll + i + 1) % _ports.size();
+                if (port.stalled.exchange(false)) {
+                    modbus_loop_wake(&port.loop);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Block until requests are completed, or `timeoutMs` milliseconds are elapsed (-1 for no timeout).
+     * Returns false in case of timeout.
+     */
+    bool wait(int timeoutMs) {
+        struct pollfd fd = { _resultFd, POLLIN, 0 };
+        if (::poll(&fd, 1, timeoutMs) <= 0) {
+            return false;
+        }
+        uint64_t counter;
+        (void)!read(_resultFd, &counter, sizeof(counter));
+        return true;
+    }
+
+    // Signaled when requests are completed, for applications with their own event loop (see `wait`)
+    int resultFd() const { return _resultFd; }
+
+private:
+    struct Port {
+        Port(MultiPortMaster& owner, size_t queueSize) : owner(owner), requests(queueSize), results(queueSize) {
+            memset(&ctx, 0, sizeof(ctx));
+            ctx.user = this;
+        }
+
+        // The queues are aligned to the cache lines, and `new` honors the alignment only since C++17
+        static void* operator new(size_t size) {
+            void* ptr;
+            if (posix_memalign(&ptr, alignof(Port), size) != 0) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+
+        static void operator delete(void* ptr) {
+            free(ptr);
+        }
+
+        // Worker thread
+        void run() {
+            MODBUS_CONTEXT* ctx = &this->ctx;
+            while (running.load(std::memory_order_relaxed)) {
+                feed(ctx);
+                if (!modbus_loop_wait(&loop, TICKS_PER_SECOND / 10)) {
+                    sys_fatal(ERR_DEVICE_HW_FAIL);
+                }
+            }
+        }
+
+        // Free slots of the result queue, not reserved by the requests in the engine
+        bool canFeed(MODBUS_CONTEXT* ctx) const {
+            return results.capacity() - results.size() > bus_ms_pending;
+        }
+
+        // Move the queued requests to the engine
+        void feed(MODBUS_CONTEXT* ctx) {
+            while (bus_ms_pending < BUS_MS_QUEUE_SIZE) {
+                if (!canFeed(ctx)) {
+                    // Woken up by `poll`. Check again, the consumer could have missed the flag
+                    // (and anyway the loop wait is bounded).
+                    stalled.store(true);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (!canFeed(ctx)) {
+                        return;
+                    }
+                    stalled.store(false);
+                }
+                // The engine completes the requests in order: the slots are used in the same order
+                Request& slot = slots[nextSlot];
+                if (!requests.pop(slot)) {
+                    return;
+                }
+                BUS_MS_REQUEST request = { slot.station, slot.function, slot.address, slot.count, slot.data, &Port::onComplete, &slot };
+                if (bus_ms_enqueue(ctx, &request)) {
+                    nextSlot = (nextSlot + 1) % BUS_MS_QUEUE_SIZE;
+                } else {
+                    complete(slot, BUS_MS_ERR_INVALID_REQUEST);
+                }
+            }
+        }
+
+        void complete(const Request& request, uint8_t result) {
+            Result& ret = completed;
+            ret.id = request.id;
+            ret.port = index;
+            ret.result = result;
+            ret.count = 0;
+            if (result == NO_ERROR && request.function == READ_HOLDING_REGISTERS) {
+                ret.count = request.count;
+                memcpy(ret.data, request.data, request.count * sizeof(uint16_t));
+            }
+            // Room reserved by `feed`
+            results.push(ret);
+            uint64_t one = 1;
+            (void)!write(owner._resultFd, &one, sizeof(one));
+        }
+
+        static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result) {
+            ((Port*)ctx->user)->complete(*(const Request*)request->user, result);
+        }
+
+        MultiPortMaster& owner;
+        uint8_t index = 0;
+        MODBUS_CONTEXT ctx;
+        MODBUS_LOOP loop;
+        SpscQueue<Request> requests;
+        SpscQueue<Result> results;
+        // The requests in the engine
+        Request slots[BUS_MS_QUEUE_SIZE];
+        uint8_t nextSlot = 0;
+        // Not on the stack of the engine callback
+        Result completed;
+        std::thread thread;
+        std::atomic<bool> running { false };
+        // The result queue is full
+        std::atomic<bool> stalled { false };
+    };
+
+    int add(std::unique_ptr<Port> port) {
+        MODBUS_CONTEXT* ctx = &port->ctx;
+        rs485_init(ctx);
+        bus_ms_init(ctx);
+        if (!modbus_loop_init(&port->loop)) {
+            uart_close(ctx);
+            return -1;
+        }
+        if (!modbus_loop_addMaster(&port->loop, ctx)) {
+            modbus_loop_close(&port->loop);
+            uart_close(ctx);
+            return -1;
+        }
+        port->index = (uint8_t)_ports.size();
+        _ports.push_back(std::move(port));
+        return (int)_ports.size() - 1;
+    }
+
+    const size_t _queueSize;
+    std::vector<std::unique_ptr<Port>> _ports;
+    // Round-robin of `poll`
+    size_t _nextPoll = 0;
+    int _resultFd;
+};
+
+} // namespace modbus
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _MODBUS_REGISTER_IMAGE_H
+#define _MODBUS_REGISTER_IMAGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Image of the registers of the nodes, in a memory-mapped file shared with the local processes (e.g. loggers and HMIs
+ * on the gateway host), so that they read the latest polled registers without TCP connections and serial transactions.
+ * The master process (e.g. the gateway, see `GATEWAY::image`) creates the image and publishes the registers read;
+ * any count of readers map the file read-only, and take snapshots without locks or system calls.
+ *
+ * Each unit has a sequence lock: the writer makes the sequence odd while it updates the registers, and the readers
+ * retry if the sequence was odd or has changed while copying the registers, so that a snapshot is never torn.
+ * Only one writer per image. The writer and the readers should be built with the same `REGISTER_IMAGE_REGISTERS`
+ * (checked by `register_image_open`).
+ */
+
+// Registers of each unit in the image, from address 0. Multiple of 8.
+#ifndef REGISTER_IMAGE_REGISTERS
+#define REGISTER_IMAGE_REGISTERS (256)
+#endif
+
+// `REGISTER_IMAGE_HEADER::magic`, set when the image is initialized
+#define REGISTER_IMAGE_MAGIC (0x494d5250)
+#define REGISTER_IMAGE_VERSION (1)
+
+/**
+ * Start of the file
+ * @internal
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t registers;
+    uint32_t size;
+} REGISTER_IMAGE_HEADER;
+
+/**
+ * A unit, aligned to the cache lines not to share them with the units updated concurrently
+ * @internal
+ */
+typedef struct {
+    // Odd while the writer updates the unit
+    uint32_t sequence;
+    uint32_t reserved;
+    // Microseconds from `CLOCK_MONOTONIC` of the last update, the same for all the processes of the host
+    uint64_t time;
+    // Registers published, and not invalidated since
+    uint8_t valid[REGISTER_IMAGE_REGISTERS / 8];
+    uint16_t registers[REGISTER_IMAGE_REGISTERS];
+} __attribute__((aligned(64))) REGISTER_IMAGE_UNIT;
+
+/**
+ * Layout of the file
+ * @internal
+ */
+typedef struct {
+    REGISTER_IMAGE_HEADER header;
+    REGISTER_IMAGE_UNIT units[256] __attribute__((aligned(64)));
+} REGISTER_IMAGE_LAYOUT;
+
+typedef struct {
+    int fd;
+    REGISTER_IMAGE_LAYOUT* layout;
+} REGISTER_IMAGE;
+
+/**
+ * Create (or reset) the image file of the writer, e.g. in "/dev/shm".
+ * Returns false in case of errors (see `errno`).
+ */
+_Bool register_image_create(REGISTER_IMAGE* image, const char* path);
+
+/**
+ * Map an image file read-only. Returns false in case of errors (see `errno`), or if the image is not initialized
+ * or has a different layout (`EINVAL`).
+ */
+_Bool register_image_open(REGISTER_IMAGE* image, const char* path);
+
+/**
+ * Writer only: publish the registers read from `unit`. The registers out of the image are ignored.
+ */
+void register_image_publish(REGISTER_IMAGE* image, uint8_t unit, uint16_t address, uint16_t count, const uint16_t* data);
+
+/**
+ * Writer only: mark the registers as unknown (e.g. written and not read since), `BROADCAST_ADDRESS` for all the units.
+ */
+void register_image_invalidate(REGISTER_IMAGE* image, uint8_t unit, uint16_t address, uint16_t count);
+
+/**
+ * Copy a consistent snapshot of the registers of `unit`, and the time of the last update of the unit (can be NULL).
+ * Returns false if some registers were never published, or are invalidated, or are out of the image.
+ */
+_Bool register_image_read(const REGISTER_IMAGE* image, uint8_t unit, uint16_t address, uint16_t count, uint16_t* data, uint64_t* time);
+
+/**
+ * Unmap the image. The file of the writer is not removed.
+ */
+void register_image_close(REGISTER_IMAGE* image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
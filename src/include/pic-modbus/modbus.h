@@ -8,16 +8,48 @@
 #include <stdlib.h>
 #include <string.h>
 
-void modbus_init(void);
-_Bool modbus_poll(void);
-
 /**
  * API
  */
+#include "context.h"
 #include "bus_client.h"
+#include "bus_master.h"
+#include "crc.h"
 #include "rs485.h"
 #include "sys.h"
 #include "timers.h"
 #include "uart.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef MODBUS_CONTEXT_API
+/**
+ * State of a node, see `MODBUS_CONTEXT_API`
+ */
+struct MODBUS_CONTEXT {
+    CRC_CONTEXT crc;
+    UART_CONTEXT uart;
+    RS485_CONTEXT rs485;
+    BUS_CL_CONTEXT bus_cl;
+    BUS_MS_CONTEXT bus_ms;
+    // Application data of the node (e.g. the serial port)
+    void* user;
+};
+#endif
+
+void modbus_init(CTX_PARAM);
+_Bool modbus_poll(CTX_PARAM);
+
+/**
+ * Returns the ticks before the node should be polled again if no data is received, 
+ * or `RS485_NO_TIMEOUT`. See `rs485_timeout`.
+ */
+TICK_TYPE modbus_timeout(CTX_PARAM);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif	/* _PIC_MODBUS_H */
@@ -8,6 +8,39 @@
 #define RS485_BAUD 19200
 #define STATION_NODE (1)
 
+// Define to stage write requests, and apply them only when the request CRC is validated 
+// (see `regs_onCommit` and `regs_onAbort`)
+//#define BUS_CL_STAGED_WRITE
+
+// Define (in ticks) to replay the response of write requests retried by the master, without 
+// committing them twice. Requires BUS_CL_STAGED_WRITE.
+//#define BUS_CL_WRITE_REPLAY_TIMEOUT (TICKS_PER_SECOND / 10)
+
+// Define to let `regs_onReceive` commit slow writes after the response is transmitted (see `bus_cl_deferCommit`).
+// Requires BUS_CL_STAGED_WRITE.
+//#define BUS_CL_DEFERRED_COMMIT
+
+// Define to cache the responses of the last N read requests of cacheable ranges (see `bus_cl_cacheable`)
+//#define BUS_CL_READ_CACHE_SIZE (1)
+
+// Define to track changes of N register ranges (see `regs_changeRanges`) and to enable the READ_CHANGED_RANGES function
+//#define BUS_CL_CHANGE_RANGES (4)
+
+// Define to enable the READ_MULTIPLE_RANGES function, to read up to N ranges in a single request
+//#define BUS_CL_MULTIPLE_RANGES_MAX (4)
+
+// Define to let `regs_onSend` defer the read data (`bus_cl_sendPending`) instead of failing with ERR_DEVICE_BUSY
+//#define BUS_CL_ASYNC_SEND
+
+// Define as a list of F(code, handlers) to add custom function codes (see `BUS_CL_FUNCTION`)
+//#define BUS_CL_CUSTOM_FUNCTIONS(F) F(100, myFunctionHandlers)
+
+// Define to serve N read-only register ranges from double-buffered images (see `regs_images`)
+//#define BUS_CL_IMAGES (1)
+
+// Define to enable the LATCH_SNAPSHOT function, to sample the registers of all the nodes at the same time (see `regs_onLatch`)
+//#define BUS_CL_SNAPSHOT
+
 // XC8 compiler is little-endian
 #define le16toh(b) (b)
 #define htole16(b) (b)
@@ -0,0 +1,246 @@
+#ifndef _MODBUS_REGISTERS_HPP
+#define _MODBUS_REGISTERS_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Typed bindings of the holding registers, for host applications (e.g. of the master, see `bus_master.h`, or
+ * Modbus TCP clients of the gateway):
+ *
+ *   using Voltage = modbus::F32<0>;
+ *   using Status = modbus::U16<4>;
+ *   using Energy = modbus::U32<6, modbus::WordOrder::LowFirst>;
+ *   using Meter = modbus::Layout<Voltage, Status, Energy>;
+ *
+ *   Meter::Registers registers;
+ *   registers.decode(responseData);        // big-endian bytes, as on the wire
+ *   float voltage = registers.get<Voltage>();
+ *
+ * The layouts are checked at compile time: the fields can't overlap, and the whole layout must fit a single read
+ * (`MaxRegisters`, see `Layout::fits` for smaller frames). `decodeRegisters` byte-swaps whole blocks of registers
+ * with SIMD instructions where available (AVX2, SSSE3, SSE2 or NEON), and then the fields are read from the
+ * registers in host endianness, also the ones read by the master engine (`BUS_MS_REQUEST::data`).
+ */
+
+namespace modbus {
+
+// Registers in a read response of the Modbus protocol
+static constexpr uint16_t MaxRegisters = 125;
+
+/**
+ * Order of the two registers of the 32-bit fields: the Modbus convention is the high word first, but many devices
+ * send the low word first
+ */
+enum class WordOrder {
+    HighFirst,
+    LowFirst
+};
+
+/**
+ * Byte-swap `count` big-endian registers (e.g. the data of a read response) to host endianness.
+ * `wire` and `registers` can be unaligned, but they should not overlap.
+ */
+inline void decodeRegisters(const uint8_t* wire, uint16_t* registers, size_t count) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i swap256 = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(wire + i * 2));
+        _mm256_storeu_si256((__m256i*)(registers + i), _mm256_shuffle_epi8(v, swap256));
+    }
+#endif
+#if defined(__SSSE3__)
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(wire + i * 2));
+        _mm_storeu_si128((__m128i*)(registers + i), _mm_shuffle_epi8(v, swap));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(wire + i * 2));
+        _mm_storeu_si128((__m128i*)(registers + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8) {
+        uint8x16_t v = vld1q_u8(wire + i * 2);
+        vst1q_u16(registers + i, vreinterpretq_u16_u8(vrev16q_u8(v)));
+    }
+#endif
+    for (; i < count; i++) {
+        registers[i] = (uint16_t)((wire[i * 2] << 8) | wire[i * 2 + 1]);
+    }
+}
+
+/**
+ * Byte-swap `count` registers in host endianness to big-endian (e.g. the data of a write request)
+ */
+inline void encodeRegisters(const uint16_t* registers, uint8_t* wire, size_t count) {
+    // The swap is symmetric
+    decodeRegisters((const uint8_t*)registers, (uint16_t*)wire, count);
+}
+
+/**
+ * A field of type `T` (uint16_t, int16_t, uint32_t, int32_t or float) at the register `Offset` of a layout
+ */
+template<typename T, uint16_t Offset, WordOrder Order = WordOrder::HighFirst>
+struct Field {
+    static_assert(std::is_same<T, uint16_t>::value || std::is_same<T, int16_t>::value || std::is_same<T, uint32_t>::value
+        || std::is_same<T, int32_t>::value || std::is_same<T, float>::value, "Unsupported field type");
+    static_assert(!std::is_same<T, float>::value || (std::numeric_limits<float>::is_iec559 && sizeof(float) == 4),
+        "float32 fields require IEEE 754 floats");
+
+    using Type = T;
+    static constexpr uint16_t offset = Offset;
+    static constexpr uint16_t size = sizeof(T) / sizeof(uint16_t);
+    static_assert(Offset + size <= 0x10000, "The field exceeds the address space");
+
+    // From the registers of the layout, in host endianness
+    static T get(const uint16_t* registers) {
+        return get(registers + Offset, std::integral_constant<uint16_t, size>());
+    }
+
+    static void set(uint16_t* registers, T value) {
+        set(registers + Offset, value, std::integral_constant<uint16_t, size>());
+    }
+
+private:
+    static T get(const uint16_t* r, std::integral_constant<uint16_t, 1>) {
+        return (T)r[0];
+    }
+
+    static T get(const uint16_t* r, std::integral_constant<uint16_t, 2>) {
+        uint32_t bits = Order == WordOrder::HighFirst ? ((uint32_t)r[0] << 16) | r[1] : ((uint32_t)r[1] << 16) | r[0];
+        T value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static void set(uint16_t* r, T value, std::integral_constant<uint16_t, 1>) {
+        r[0] = (uint16_t)value;
+    }
+
+    static void set(uint16_t* r, T value, std::integral_constant<uint16_t, 2>) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        r[Order == WordOrder::HighFirst ? 0 : 1] = (uint16_t)(bits >> 16);
+        r[Order == WordOrder::HighFirst ? 1 : 0] = (uint16_t)bits;
+    }
+};
+
+template<uint16_t Offset> using U16 = Field<uint16_t, Offset>;
+template<uint16_t Offset> using I16 = Field<int16_t, Offset>;
+template<uint16_t Offset, WordOrder Order = WordOrder::HighFirst> using U32 = Field<uint32_t, Offset, Order>;
+template<uint16_t Offset, WordOrder Order = WordOrder::HighFirst> using I32 = Field<int32_t, Offset, Order>;
+template<uint16_t Offset, WordOrder Order = WordOrder::HighFirst> using F32 = Field<float, Offset, Order>;
+
+namespace detail {
+
+template<typename F, typename... Fields>
+struct Contains : std::false_type { };
+
+template<typename F, typename First, typename... Fields>
+struct Contains<F, First, Fields...> : std::integral_constant<bool, std::is_same<F, First>::value || Contains<F, Fields...>::value> { };
+
+template<size_t N>
+constexpr uint32_t end(const uint16_t (&offsets)[N], const uint16_t (&sizes)[N]) {
+    uint32_t ret = 0;
+    for (size_t i = 0; i < N; i++) {
+        ret = offsets[i] + sizes[i] > ret ? offsets[i] + sizes[i] : ret;
+    }
+    return ret;
+}
+
+template<size_t N>
+constexpr bool overlap(const uint16_t (&offsets)[N], const uint16_t (&sizes)[N]) {
+    for (size_t i = 0; i < N; i++) {
+        for (size_t j = i + 1; j < N; j++) {
+            if (offsets[i] < offsets[j] + sizes[j] && offsets[j] < offsets[i] + sizes[i]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+} // namespace detail
+
+/**
+ * The fields of a register range, from the register 0 of the range (the address of the read)
+ */
+template<typename... Fields>
+struct Layout {
+    static_assert(sizeof...(Fields) > 0, "Empty layout");
+
+private:
+    static constexpr uint16_t _offsets[] = { Fields::offset... };
+    static constexpr uint16_t _sizes[] = { Fields::size... };
+
+public:
+    // Registers to read
+    static constexpr uint16_t size = (uint16_t)detail::end(_offsets, _sizes);
+    static_assert(detail::end(_offsets, _sizes) <= MaxRegisters, "The layout doesn't fit a read");
+    static_assert(!detail::overlap(_offsets, _sizes), "Fields of the layout overlap");
+
+    // The layout fits reads of `maxRegisters`, e.g. `static_assert(Layout::fits(BUS_SCAN_MAX_REGISTERS), ...)`
+    static constexpr bool fits(uint16_t maxRegisters) {
+        return size <= maxRegisters;
+    }
+
+    template<typename F>
+    static typename F::Type get(const uint16_t* registers) {
+        static_assert(detail::Contains<F, Fields...>::value, "Field not in the layout");
+        return F::get(registers);
+    }
+
+    template<typename F>
+    static void set(uint16_t* registers, typename F::Type value) {
+        static_assert(detail::Contains<F, Fields...>::value, "Field not in the layout");
+        F::set(registers, value);
+    }
+
+    // The registers of the layout, in host endianness
+    struct Registers {
+        uint16_t data[size];
+
+        // From the data of a read response of `size` registers, in big-endian
+        void decode(const uint8_t* wire) {
+            decodeRegisters(wire, data, size);
+        }
+
+        // To the data of a write request of `size` registers
+        void encode(uint8_t* wire) const {
+            encodeRegisters(data, wire, size);
+        }
+
+        template<typename F>
+        typename F::Type get() const {
+            return Layout::get<F>(data);
+        }
+
+        template<typename F>
+        void set(typename F::Type value) {
+            Layout::set<F>(data, value);
+        }
+    };
+};
+
+// Out-of-class definitions of the constexpr arrays, ODR-used before C++17
+template<typename... Fields>
+constexpr uint16_t Layout<Fields...>::_offsets[];
+template<typename... Fields>
+constexpr uint16_t Layout<Fields...>::_sizes[];
+
+} // namespace modbus
+
+#endif
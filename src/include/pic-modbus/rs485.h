@@ -2,6 +2,7 @@
 #define	RS485_H
 
 #include "configuration.h"
+#include "context.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,7 +18,7 @@ extern "C" {
 /**
  * Initialize asynchronous mode, but only half-duplex is used
  */
-void rs485_init();
+void rs485_init(CTX_PARAM);
 
 /**
  * When the bus is engaged and a packet is transiting, poll should be called with 
@@ -27,39 +28,87 @@ void rs485_init();
  * slower on a more buffered UART, but at least able to detect a message before his end).
  * Returns `true` if the bus is active (so fast poll is required).
  */
-_Bool rs485_poll();
+_Bool rs485_poll(CTX_PARAM);
+
+// No timed transition of the line is pending, see `rs485_timeout`
+#define RS485_NO_TIMEOUT ((TICK_TYPE)-1)
+
+/**
+ * Returns the ticks before the next timed transition of the line (e.g. the mark condition after the last byte 
+ * received, or the start of the transmission), or `RS485_NO_TIMEOUT` if only the data received can change its state.
+ * Event-driven hosts can sleep until then, instead of polling at a fixed rate.
+ */
+TICK_TYPE rs485_timeout(CTX_PARAM);
 
 /**
  * Set to true when the line is not active from more than 3.5 characters (ModBus mark condition)
  */
-extern _Bool rs485_isMarkCondition;
+#define rs485_isMarkCondition (MODBUS_CTX(rs485).isMarkCondition)
 
 /**
- * The whole buffer. `RS485_BUF_SIZE` should be at least 16 bytes.
+ * The whole buffer. `RS485_BUF_SIZE` should be at least 16 bytes, and at most 256 (a whole RTU frame).
  * The buffer data should not be accessed until operation is completed.
  */
-extern uint8_t rs485_buffer[RS485_BUF_SIZE];
+#define rs485_buffer (MODBUS_CTX(rs485).buffer)
+
+#if RS485_BUF_SIZE > 256
+#error RS485_BUF_SIZE too big: a RTU frame is at most 256 bytes
+#endif
+
+// Sizes and positions in the buffer: 8-bit on the MCUs, 16-bit only if the buffer fits a whole RTU frame
+#if RS485_BUF_SIZE > 255
+typedef uint16_t RS485_SIZE_TYPE;
+#else
+typedef uint8_t RS485_SIZE_TYPE;
+#endif
 
 /**
  * Start writing the data in the `rs485_buffer`.
  * `size` is the number of bytes valid in the buffer to write.
  */ 
-void rs485_write(uint8_t size);
+void rs485_write(CTX_PARAM_ RS485_SIZE_TYPE size);
+
+#ifndef RS485_HEADER_SIZE
+#define RS485_HEADER_SIZE (3)
+#endif
+
+/**
+ * Small buffer for the header of a packet, transmitted before the `rs485_buffer` data.
+ */
+#define rs485_header (MODBUS_CTX(rs485).header)
+
+/**
+ * Start writing `headerSize` bytes of `rs485_header`, followed by `size` bytes of the `rs485_buffer`.
+ * The line is engaged, but no data is fetched before the next `rs485_poll`: so the `rs485_buffer` 
+ * can be filled after this call, and the data preparation overlaps the `START_TRANSMIT_TIMEOUT` window.
+ */ 
+void rs485_writeWithHeader(CTX_PARAM_ uint8_t headerSize, RS485_SIZE_TYPE size);
 
 /**
- * Discard `count` bytes from the read buffer
+ * Signal that the frame received is complete (e.g. its length was predicted by the function code and byte count).
+ * The next write doesn't need to wait for the mark condition to be polled: the line is engaged 
+ * `MARK_CONDITION_TIMEOUT` after the last byte received, and the response starts exactly
+ * `MARK_CONDITION_TIMEOUT + START_TRANSMIT_TIMEOUT` after it.
+ * If more data is received before the line is engaged, the response is dropped.
  */
-void rs485_discard(uint8_t count);
+void rs485_setFrameComplete(CTX_PARAM);
+
+/**
+ * Discard the first `count` bytes from the read buffer, once they are consumed.
+ * The following bytes (e.g. received in the same burst from the kernel buffer of Linux hosts) 
+ * are moved at the beginning of the buffer.
+ */
+void rs485_discard(CTX_PARAM_ RS485_SIZE_TYPE count);
 
 /**
  * Get count of available bytes in the read `rs485_buffer`
  */
-uint8_t rs485_readAvail();
+RS485_SIZE_TYPE rs485_readAvail(CTX_PARAM);
 
 /**
  * Check if the buffer contains data still to be sent
  */
-_Bool rs485_writeInProgress();
+_Bool rs485_writeInProgress(CTX_PARAM);
 
 // The following timings are required to avoid the two-wire RS485 line to remain floating, potentially
 // triggering frame errors. The line will be driven low by two stations at the same time.
@@ -100,9 +149,44 @@ typedef enum {
     // Transmitting, data
     RS485_LINE_TX,
     // After TX engaged, wait before transmitting
-    RS485_LINE_WAIT_FOR_START_TRANSMIT
+    RS485_LINE_WAIT_FOR_START_TRANSMIT,
+    // Response to a complete frame written, wait for the mark condition before engaging TX
+    RS485_LINE_WAIT_FOR_ENGAGE
 } RS485_LINE_STATE;
-extern RS485_LINE_STATE rs485_state;
+#define rs485_state (MODBUS_CTX(rs485).state)
+
+/**
+ * Once this is set, it skip reading in the buffer until mark condition is detected.
+ * @internal
+ */
+#define rs485_frameError (MODBUS_CTX(rs485).frameError)
+
+/**
+ * State of the RS485 module
+ * @internal
+ */
+typedef struct {
+    RS485_LINE_STATE state;
+    uint8_t buffer[RS485_BUF_SIZE];
+    uint8_t header[RS485_HEADER_SIZE];
+    _Bool isMarkCondition;
+    _Bool frameError;
+    // Pointer of the read/writing head. When writing, it counts the header bytes too
+    RS485_SIZE_TYPE bufferPtr;
+    // Size of the valid to-be-written data in the header and in the buffer
+    RS485_SIZE_TYPE writeDataSize;
+    // Size of the header to write before the buffer data
+    uint8_t writeHeaderSize;
+    // Set at the beginning of states RS485_LINE_TX_DISENGAGE, RS485_LINE_WAIT_FOR_START_TRANSMIT
+    // In RS485_LINE_RX mode, it is set for every character received to detect mark condition
+    TICK_TYPE lastTick;
+    // Set when the frame received is known to be complete, before the mark condition
+    _Bool frameComplete;
+} RS485_CONTEXT;
+
+#ifndef MODBUS_CONTEXT_API
+extern RS485_CONTEXT rs485_ctx;
+#endif
 
 #ifdef __cplusplus
 }
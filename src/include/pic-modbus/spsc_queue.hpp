@@ -0,0 +1,93 @@
+#ifndef _MODBUS_SPSC_QUEUE_HPP
+#define _MODBUS_SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * Bounded lock-free queue, between exactly one producer thread and one consumer thread (e.g. the application
+ * and the worker of a serial port, see `multi_port_master.hpp`).
+ * The items are copied in a ring allocated once: no allocations and no system calls after the construction.
+ */
+
+namespace modbus {
+
+template<typename T>
+class SpscQueue {
+public:
+    // The capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) : _mask(roundUp(capacity) - 1), _items(new T[_mask + 1]) { }
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    /**
+     * Producer only. Returns false if the queue is full.
+     */
+    bool push(const T& item) {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _headCache > _mask) {
+            // Only refreshed when the queue looks full, to not share the cache line of the consumer
+            _headCache = _head.load(std::memory_order_acquire);
+            if (tail - _headCache > _mask) {
+                return false;
+            }
+        }
+        _items[tail & _mask] = item;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Consumer only. Returns false if the queue is empty.
+     */
+    bool pop(T& item) {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tailCache) {
+            _tailCache = _tail.load(std::memory_order_acquire);
+            if (head == _tailCache) {
+                return false;
+            }
+        }
+        item = _items[head & _mask];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Count of the queued items. Exact only from the producer or the consumer while the other thread is idle,
+     * otherwise a snapshot (e.g. a lower bound of the free slots for the producer).
+     */
+    size_t size() const {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return _mask + 1; }
+
+private:
+    static size_t roundUp(size_t capacity) {
+        size_t ret = 1;
+        while (ret < capacity) {
+            ret <<= 1;
+        }
+        return ret;
+    }
+
+    // Avoid false sharing between the two threads
+    static constexpr size_t CacheLine = 64;
+
+    const size_t _mask;
+    const std::unique_ptr<T[]> _items;
+    // Written by the consumer
+    alignas(CacheLine) std::atomic<size_t> _head { 0 };
+    // Owned by the consumer
+    size_t _tailCache = 0;
+    // Written by the producer
+    alignas(CacheLine) std::atomic<size_t> _tail { 0 };
+    // Owned by the producer
+    size_t _headCache = 0;
+};
+
+} // namespace modbus
+
+#endif
@@ -59,7 +59,7 @@ typedef enum {
     EXC_CODE_RS485_READ_OVERRUN = 0x11,
 
     /**
-     * Mismatch between read data and processed data (discard)
+     * More data processed than read (discard)
      */
     EXC_CODE_RS485_DISCARD_MISMATCH = 0x12,
             
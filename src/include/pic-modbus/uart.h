@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include "configuration.h"
+#include "context.h"
 
 /**
  * Module that virtualize 8-bit UART support for bus wired communication from RS485 module.
@@ -18,16 +19,61 @@ typedef struct {
     uint8_t data;
     UART_ERR_BITS errs;
 } UART_LAST_CH;
-extern UART_LAST_CH uart_lastCh;
 
-void uart_init();
-void uart_transmit();
-void uart_receive();
-void uart_write(uint8_t b);
-void uart_read();
+typedef struct {
+    UART_LAST_CH lastCh;
+#ifdef UART_HAS_PORT
+    // Platform-specific data of the port
+    UART_PORT port;
+#endif
+} UART_CONTEXT;
+
+#ifndef MODBUS_CONTEXT_API
+extern UART_CONTEXT uart_ctx;
+#endif
+
+/**
+ * The last character read by `uart_read`
+ */
+#define uart_lastCh (MODBUS_CTX(uart).lastCh)
+
+void uart_init(CTX_PARAM);
+void uart_transmit(CTX_PARAM);
+void uart_receive(CTX_PARAM);
+void uart_write(CTX_PARAM_ uint8_t b);
+void uart_read(CTX_PARAM);
+
+_Bool uart_tx_fifo_empty(CTX_PARAM);
+_Bool uart_rx_fifo_empty(CTX_PARAM);
+
+#ifdef UART_HAS_PORT
+/**
+ * Transmit the bytes written so far, at the end of each poll of the line: the ports of the hosts buffer the data
+ */
+void uart_flush(CTX_PARAM);
+#else
+#define uart_flush(...)
+#endif
+
+#ifdef UART_HAS_PORT
+/**
+ * Open the serial port of the node (e.g. "/dev/ttyUSB0"), before `rs485_init`.
+ * Returns false in case of errors (see `errno`).
+ * Set `UART_PORT::echo` if the dongle receives back the transmitted data.
+ */
+_Bool uart_open(CTX_PARAM_ const char* device);
 
-_Bool uart_tx_fifo_empty();
-_Bool uart_rx_fifo_empty();
+/**
+ * Use a serial port already open in non-blocking mode (e.g. the master side of a pseudo-terminal), before `rs485_init`.
+ * The port is then owned by the node, see `uart_close`.
+ */
+void uart_attach(CTX_PARAM_ int fd);
+
+/**
+ * Close the serial port of the node
+ */
+void uart_close(CTX_PARAM);
+#endif
 
 #ifdef __cplusplus
 }
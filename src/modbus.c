@@ -1,15 +1,24 @@
 #include "pic-modbus/modbus.h"
 
-void modbus_init() {
+void modbus_init(CTX_PARAM) {
+#ifndef MODBUS_CONTEXT_API
+    // Otherwise shared by all the nodes, and initialized by the application
     timers_init();
-    bus_cl_init();
-    rs485_init();
+#endif
+    bus_cl_init(CTX_ARG);
+    rs485_init(CTX_ARG);
 }
 
-_Bool modbus_poll() {
-    _Bool active = rs485_poll();
-    if (bus_cl_poll()) {
+_Bool modbus_poll(CTX_PARAM) {
+    _Bool active = rs485_poll(CTX_ARG);
+    if (bus_cl_poll(CTX_ARG)) {
         active = true;
     }
     return active;
 }
+
+TICK_TYPE modbus_timeout(CTX_PARAM) {
+    TICK_TYPE timeout = rs485_timeout(CTX_ARG);
+    TICK_TYPE clientTimeout = bus_cl_timeout(CTX_ARG);
+    return clientTimeout < timeout ? clientTimeout : timeout;
+}
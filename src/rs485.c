@@ -1,44 +1,36 @@
-#include "pic-modbus/crc.h"
-#include "pic-modbus/rs485.h"
-#include "pic-modbus/sys.h"
-#include "pic-modbus/timers.h"
-#include "pic-modbus/uart.h"
-
-RS485_LINE_STATE rs485_state;
-uint8_t rs485_buffer[RS485_BUF_SIZE];
-
-// Pointer of the read/writing head
-static uint8_t s_bufferPtr;
-// Size of the valid to-be-written data in the buffer
-static uint8_t s_writeDataSize;
-// Once this is set, it skip reading in the buffer until mark condition is detected.
-// @internal
-_Bool rs485_frameError;
-_Bool rs485_isMarkCondition;
-
-// Set at the beginning of states RS485_LINE_TX_DISENGAGE, RS485_LINE_WAIT_FOR_START_TRANSMIT
-// In RS485_LINE_RX mode, it is set for every character received to detect mark condition
-static TICK_TYPE s_lastTick;
-
-static void rs485_startRead() {
+#include "pic-modbus/modbus.h"
+
+#ifndef MODBUS_CONTEXT_API
+RS485_CONTEXT rs485_ctx;
+#endif
+
+// See `RS485_CONTEXT`
+#define s_bufferPtr (MODBUS_CTX(rs485).bufferPtr)
+#define s_writeDataSize (MODBUS_CTX(rs485).writeDataSize)
+#define s_writeHeaderSize (MODBUS_CTX(rs485).writeHeaderSize)
+#define s_lastTick (MODBUS_CTX(rs485).lastTick)
+#define s_frameComplete (MODBUS_CTX(rs485).frameComplete)
+
+static void rs485_startRead(CTX_PARAM) {
     // Disable RS485 driver
-    uart_receive();
+    uart_receive(CTX_ARG);
     rs485_state = RS485_LINE_RX;
     rs485_frameError = false;
     rs485_isMarkCondition = true;
-    crc_reset();
+    s_frameComplete = false;
+    crc_reset(CTX_ARG);
 
     // Reset circular buffer
     s_bufferPtr = 0;
 }
 
-void rs485_init() {
-    uart_init();
+void rs485_init(CTX_PARAM) {
+    uart_init(CTX_ARG);
     s_lastTick = timers_get();
-    rs485_startRead();
+    rs485_startRead(CTX_ARG);
 }
 
-uint8_t rs485_readAvail() {
+RS485_SIZE_TYPE rs485_readAvail(CTX_PARAM) {
     if (rs485_state == RS485_LINE_RX) {
         return s_bufferPtr;
     } else {
@@ -46,7 +38,7 @@ uint8_t rs485_readAvail() {
     }
 }
 
-_Bool rs485_writeInProgress() {
+_Bool rs485_writeInProgress(CTX_PARAM) {
     if (rs485_state != RS485_LINE_RX) {
         return s_bufferPtr < s_writeDataSize;
     } else {
@@ -58,46 +50,62 @@ _Bool rs485_writeInProgress() {
 /**
  * Returns `true` if the bus is active (so fast poll is required).
  */
-_Bool rs485_poll() {
+_Bool rs485_poll(CTX_PARAM) {
     TICK_TYPE elapsed = timers_get() - s_lastTick;
 
-    if (rs485_state == RS485_LINE_WAIT_FOR_START_TRANSMIT && elapsed >= START_TRANSMIT_TIMEOUT) {
+    if (rs485_state == RS485_LINE_WAIT_FOR_ENGAGE) {
+        if (!uart_rx_fifo_empty(CTX_ARG)) {
+            // The frame was not complete: drop the response and skip the data until the mark condition
+            rs485_startRead(CTX_ARG);
+            rs485_frameError = true;
+        } else if (elapsed >= MARK_CONDITION_TIMEOUT) {
+            // Enable RS485 driver
+            uart_transmit(CTX_ARG);
+            rs485_state = RS485_LINE_WAIT_FOR_START_TRANSMIT;
+            // Exact timing, regardless of the polling time
+            s_lastTick += MARK_CONDITION_TIMEOUT;
+        }
+    } else if (rs485_state == RS485_LINE_WAIT_FOR_START_TRANSMIT && elapsed >= START_TRANSMIT_TIMEOUT) {
         // Go in TX mode
         rs485_state = RS485_LINE_TX;
     } else if (rs485_state == RS485_LINE_TX_DISENGAGE && elapsed >= DISENGAGE_CHANNEL_TIMEOUT) {
         // Detach TX line
-        rs485_startRead();
-    } else if (rs485_state == RS485_LINE_RX && elapsed >= MARK_CONDITION_TIMEOUT) {
+        rs485_startRead(CTX_ARG);
+    } else if (rs485_state == RS485_LINE_RX && elapsed >= MARK_CONDITION_TIMEOUT && uart_rx_fifo_empty(CTX_ARG)) {
+        // Not if the data was received in time, but the poll is late
         rs485_isMarkCondition = true;
         rs485_frameError = false;
-        crc_reset();
+        crc_reset(CTX_ARG);
     }
 
     if (rs485_state == RS485_LINE_TX) {
         // Empty TX buffer? Check for more data
-        while (uart_tx_fifo_empty()) {
-            if (rs485_writeInProgress()) {
+        while (uart_tx_fifo_empty(CTX_ARG)) {
+            if (rs485_writeInProgress(CTX_ARG)) {
                 // Feed more data, read at read pointer and then increase
-                uint8_t ch = rs485_buffer[s_bufferPtr++];
-                uart_write(ch);
-                crc_update(ch);
+                uint8_t ch = s_bufferPtr < s_writeHeaderSize ? rs485_header[s_bufferPtr] : rs485_buffer[s_bufferPtr - s_writeHeaderSize];
+                s_bufferPtr++;
+                uart_write(CTX_ARG_ ch);
+                crc_update(CTX_ARG_ ch);
             } else {
                 // NO MORE data to transmit
                 // goto first phase of tx end
+                uart_flush(CTX_ARG);
                 rs485_state = RS485_LINE_TX_DISENGAGE;
                 s_lastTick = timers_get();
                 return true;
             }
         };
+        uart_flush(CTX_ARG);
         // Wait for a character to be written: slow timer
         return false;
     } else if (rs485_state == RS485_LINE_RX) {
         // Data received
         _Bool haveData = false;
-        while (!uart_rx_fifo_empty()) {
+        while (!uart_rx_fifo_empty(CTX_ARG)) {
             haveData = true;
 
-            uart_read();
+            uart_read(CTX_ARG);
 
             if (uart_lastCh.errs.OERR) {
                 // Not enough fast polling, reboot
@@ -109,11 +117,11 @@ _Bool rs485_poll() {
 
             // Only read data if not in skip mode
             if (!rs485_frameError) {
-                rs485_buffer[s_bufferPtr++] = uart_lastCh.data;
-                if (s_bufferPtr > RS485_BUF_SIZE) {
+                if (s_bufferPtr >= RS485_BUF_SIZE) {
                     // Overflow error
                     sys_fatal(EXC_CODE_RS485_READ_OVERRUN);
                 }
+                rs485_buffer[s_bufferPtr++] = uart_lastCh.data;
             }
         }
 
@@ -121,6 +129,7 @@ _Bool rs485_poll() {
             // Mark the last byte received timestamp
             s_lastTick = timers_get();
             rs485_isMarkCondition = false;
+            s_frameComplete = false;
         }
 
         // Wait for a character to be read: slow timer
@@ -131,32 +140,80 @@ _Bool rs485_poll() {
     return true;
 }
 
-void rs485_write(uint8_t size) {
+// Ticks left before `timeout` ticks are elapsed from the last transition
+static TICK_TYPE rs485_remaining(CTX_PARAM_ TICK_TYPE timeout) {
+    TICK_TYPE elapsed = timers_get() - s_lastTick;
+    return elapsed >= timeout ? 0 : timeout - elapsed;
+}
+
+TICK_TYPE rs485_timeout(CTX_PARAM) {
+    switch (rs485_state) {
+        case RS485_LINE_WAIT_FOR_ENGAGE:
+            return rs485_remaining(CTX_ARG_ MARK_CONDITION_TIMEOUT);
+        case RS485_LINE_WAIT_FOR_START_TRANSMIT:
+            return rs485_remaining(CTX_ARG_ START_TRANSMIT_TIMEOUT);
+        case RS485_LINE_TX_DISENGAGE:
+            return rs485_remaining(CTX_ARG_ DISENGAGE_CHANNEL_TIMEOUT);
+        case RS485_LINE_TX:
+            if (s_bufferPtr == 0) {
+                // A new write (e.g. the CRC after the data): without a gap, or the frame would be split
+                return 0;
+            }
+            // Feed the UART at the character rate
+            return TICKS_PER_CHAR;
+        default:
+            if (rs485_isMarkCondition) {
+                // Only data can wake up the line
+                return RS485_NO_TIMEOUT;
+            }
+            return rs485_remaining(CTX_ARG_ MARK_CONDITION_TIMEOUT);
+    }
+}
+
+void rs485_write(CTX_PARAM_ RS485_SIZE_TYPE size) {
+    rs485_writeWithHeader(CTX_ARG_ 0, size);
+}
+
+void rs485_writeWithHeader(CTX_PARAM_ uint8_t headerSize, RS485_SIZE_TYPE size) {
     // Abort reader, if in progress
     if (rs485_state == RS485_LINE_RX) {
-        // Enable RS485 driver
-        uart_transmit();
+        crc_reset(CTX_ARG);
 
-        crc_reset();
+        if (s_frameComplete && !rs485_isMarkCondition && (TICK_TYPE)(timers_get() - s_lastTick) < MARK_CONDITION_TIMEOUT) {
+            // Engage when the mark condition is expected, measured from the last byte received
+            rs485_state = RS485_LINE_WAIT_FOR_ENGAGE;
+        } else {
+            // Enable RS485 driver
+            uart_transmit(CTX_ARG);
 
-        // Engage
-        rs485_state = RS485_LINE_WAIT_FOR_START_TRANSMIT;
-        s_lastTick = timers_get();
+            // Engage
+            rs485_state = RS485_LINE_WAIT_FOR_START_TRANSMIT;
+            s_lastTick = timers_get();
+        }
     } else if (rs485_state == RS485_LINE_TX_DISENGAGE) {
         // Re-convert it to tx without additional delays
         rs485_state = RS485_LINE_TX;
     }
     rs485_isMarkCondition = false;
     s_bufferPtr = 0;
-    s_writeDataSize = size;
+    s_writeHeaderSize = headerSize;
+    s_writeDataSize = headerSize + size;
+}
+
+void rs485_setFrameComplete(CTX_PARAM) {
+    s_frameComplete = true;
 }
 
-void rs485_discard(uint8_t count) {
-    if (count != s_bufferPtr || rs485_state != RS485_LINE_RX) {
+void rs485_discard(CTX_PARAM_ RS485_SIZE_TYPE count) {
+    if (count > s_bufferPtr || rs485_state != RS485_LINE_RX) {
         sys_fatal(EXC_CODE_RS485_DISCARD_MISMATCH);
     }
-    for (uint8_t i = 0; i < count; i++) {
-        crc_update(rs485_buffer[i]);
+    for (RS485_SIZE_TYPE i = 0; i < count; i++) {
+        crc_update(CTX_ARG_ rs485_buffer[i]);
+    }
+    // Keep the data received in the same burst
+    s_bufferPtr -= count;
+    for (RS485_SIZE_TYPE i = 0; i < s_bufferPtr; i++) {
+        rs485_buffer[i] = rs485_buffer[i + count];
     }
-    s_bufferPtr = 0;
 }
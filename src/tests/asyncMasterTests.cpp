@@ -0,0 +1,118 @@
+#include <catch2/catch.hpp>
+#include <stdbool.h>
+
+#include "simulatedBus.h"
+#include "pic-modbus/async_master.hpp"
+
+// The coroutine interface of the master, against the nodes of the client stack on the simulated line
+
+using modbus::AsyncMaster;
+using modbus::Executor;
+using modbus::ReadResponse;
+using modbus::Task;
+
+static void run(Executor& executor) {
+    TICK_TYPE start = simTimer;
+    executor.run([&] {
+        if ((TICK_TYPE)(simTimer - start) > TICKS_PER_SECOND * 60) {
+            throw std::runtime_error("Tasks not completed");
+        }
+        simPoll(SIM_POLL_TICKS);
+    });
+}
+
+static Task<void> readModifyWrite(AsyncMaster& master, uint8_t station, uint16_t address, uint16_t mask, std::vector<uint8_t>* results) {
+    ReadResponse response = co_await master.readHolding(station, address, 1);
+    results->push_back(response.error);
+    if (!response) {
+        co_return;
+    }
+    std::vector<uint16_t> data(1, response.registers[0] | mask);
+    results->push_back(co_await master.writeHolding(station, address, std::move(data)));
+}
+
+TEST_CASE("Async master: read-modify-write sequence") {
+    simInit(2);
+    Executor executor;
+    AsyncMaster master(&simMaster->ctx, executor);
+
+    std::vector<uint8_t> results;
+    executor.spawn(readModifyWrite(master, 2, 3, 0x8000, &results));
+    run(executor);
+
+    REQUIRE(results == std::vector<uint8_t>({ NO_ERROR, NO_ERROR }));
+    REQUIRE(simNodes[1]->regs[3] == 0x8203);
+    REQUIRE(simNodes[0]->regs[3] == 0x0103);
+}
+
+// Returns the stations that answer
+static Task<std::vector<uint8_t>> discover(AsyncMaster& master, uint8_t maxStation) {
+    std::vector<uint8_t> found;
+    for (uint8_t station = 1; station <= maxStation; station++) {
+        if (co_await master.readHolding(station, 0, 1)) {
+            found.push_back(station);
+        }
+    }
+    co_return found;
+}
+
+static Task<void> scan(AsyncMaster& master, std::vector<uint8_t>* found) {
+    *found = co_await discover(master, 5);
+}
+
+TEST_CASE("Async master: discovery scan with nested tasks") {
+    simInit(3);
+    Executor executor;
+    AsyncMaster master(&simMaster->ctx, executor);
+
+    std::vector<uint8_t> found;
+    executor.spawn(scan(master, &found));
+    run(executor);
+
+    REQUIRE(found == std::vector<uint8_t>({ 1, 2, 3 }));
+    // Stations 4 and 5, with the retries
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == 2 * (BUS_MS_RETRIES + 1));
+}
+
+static Task<void> readOne(AsyncMaster& master, uint8_t station, uint16_t address, int* completed) {
+    ReadResponse response = co_await master.readHolding(station, address, 1);
+    if (response && response.registers[0] == station * 0x100 + address) {
+        (*completed)++;
+    }
+}
+
+TEST_CASE("Async master: thousands of pending operations") {
+    simInit(4);
+    Executor executor;
+    AsyncMaster master(&simMaster->ctx, executor);
+
+    const int count = 2000;
+    int completed = 0;
+    for (int i = 0; i < count; i++) {
+        executor.spawn(readOne(master, i % 4 + 1, i % SIM_REGS_COUNT, &completed));
+    }
+    executor.runReady();
+    // Waiting for the engine queue
+    REQUIRE(master.waiting() == count - BUS_MS_QUEUE_SIZE);
+    REQUIRE(executor.spawned() == count);
+
+    run(executor);
+    REQUIRE(completed == count);
+    REQUIRE(master.waiting() == 0);
+}
+
+static Task<void> readInvalid(AsyncMaster& master, uint8_t* error) {
+    *error = (co_await master.readHolding(1, 0, RS485_BUF_SIZE)).error;
+}
+
+TEST_CASE("Async master: invalid requests") {
+    simInit(1);
+    Executor executor;
+    AsyncMaster master(&simMaster->ctx, executor);
+
+    uint8_t error = NO_ERROR;
+    executor.spawn(readInvalid(master, &error));
+    run(executor);
+    REQUIRE(error == BUS_MS_ERR_INVALID_REQUEST);
+    REQUIRE(simMaster->ctx.bus_ms.queueCount == 0);
+}
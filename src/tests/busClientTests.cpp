@@ -6,13 +6,23 @@
 #include "pic-modbus/bus_client.h"
 #include "pic-modbus/crc.h"
 #include "pic-modbus/rs485.h"
+#include "pic-modbus/timers.h"
 
 using namespace std::string_literals;
 
+static TICK_TYPE s_timer = 0;
+
 extern "C" {
-    RS485_LINE_STATE rs485_state;
-    bool rs485_isMarkCondition;
-    uint8_t rs485_buffer[RS485_BUF_SIZE];
+    // The RS485 module is mocked, only its state is used
+    RS485_CONTEXT rs485_ctx;
+
+    TICK_TYPE timers_get() {
+        return s_timer;
+    }
+}
+
+static void advanceTime(TICK_TYPE delta) {
+    s_timer += delta;
 }
 
 union BigEndian {
@@ -22,6 +32,9 @@ union BigEndian {
         uint8_t b1;
     };
 
+    // Not an aggregate, so byte initializer lists are not ambiguous with `std::vector<uint8_t>`
+    BigEndian() { }
+
     static BigEndian fromH(uint16_t value) {
         BigEndian ret;
         ret.be = htobe16(value);
@@ -33,28 +46,50 @@ class Rs485Mock {
 private:
     int receivePointer;
     std::vector<uint8_t> lastDataWritten;
+    // Buffer data still to be transmitted. Fetched at the next poll, like the real RS485 module
+    int pendingWriteSize;
+
+    void flush() {
+        for (auto i = 0; i < pendingWriteSize; ++i) {
+            lastDataWritten.push_back(rs485_buffer[i]);
+            crc_update(rs485_buffer[i]);
+        }
+        pendingWriteSize = 0;
+    }
 public:
     // For CRC calculation
     std::vector<uint8_t> packetData;
+    // Set by `rs485_setFrameComplete`
+    bool frameComplete;
 
     Rs485Mock() {
         reset();
     }
 
+    // Set to keep the response in the buffer, e.g. waiting for the line to be engaged
+    bool holdWrite;
+
+    // The UART and the line are infinitely fast: data is sent at the first check
     bool writeInProgress() {
+        if (holdWrite) {
+            return true;
+        }
+        flush();
         return false;
     }
 
-    void write(int size) {
+    void write(int headerSize, int size) {
+        flush();
         if (rs485_state != RS485_LINE_TX) {
             crc_reset();
         }
         rs485_isMarkCondition = false;
         rs485_state = RS485_LINE_TX;
-        for (auto i = 0; i < size; ++i) {
-            lastDataWritten.push_back(rs485_buffer[i]);
-            crc_update(rs485_buffer[i]);
+        for (auto i = 0; i < headerSize; ++i) {
+            lastDataWritten.push_back(rs485_header[i]);
+            crc_update(rs485_header[i]);
         }
+        pendingWriteSize = size;
     }
 
     int readAvail() {
@@ -62,17 +97,22 @@ public:
     }
 
     void discard(int size) {
-        if (receivePointer != size) {
+        if (size > receivePointer) {
             throw std::runtime_error("Discard called with the wrong current buffer size");
         }
         for (int i = 0; i < size; i++) {
             crc_update(rs485_buffer[i]);
         }
-        receivePointer = 0;
+        // Keep the data received in the same burst, like the real RS485 module
+        receivePointer -= size;
+        memmove(rs485_buffer, rs485_buffer + size, receivePointer);
     }
 
     void reset() {
         receivePointer = 0;
+        pendingWriteSize = 0;
+        frameComplete = false;
+        holdWrite = false;
         lastDataWritten.clear();
         packetData.clear();
     }
@@ -85,7 +125,7 @@ public:
         rs485_isMarkCondition = false;
     }
 
-    void simulateData(const std::vector<BigEndian>& data) {
+    void simulateData(std::initializer_list<BigEndian> data) {
         for (auto it = data.begin(); it != data.end(); ++it) {
             simulateData({ it->b0, it->b1 });
         }
@@ -98,6 +138,7 @@ public:
     }
 
     std::vector<uint8_t> getDataWritten() {
+        flush();
         return lastDataWritten;
     }
 };
@@ -109,17 +150,25 @@ extern "C" {
         return rs485mock.writeInProgress();
     }
 
-    void rs485_write(uint8_t size) {
-        rs485mock.write(size);
+    void rs485_write(RS485_SIZE_TYPE size) {
+        rs485mock.write(0, size);
     }
 
-    uint8_t rs485_readAvail() {
-        return (uint8_t)rs485mock.readAvail();
+    void rs485_writeWithHeader(uint8_t headerSize, RS485_SIZE_TYPE size) {
+        rs485mock.write(headerSize, size);
     }
 
-    void rs485_discard(uint8_t size) {
+    RS485_SIZE_TYPE rs485_readAvail() {
+        return (RS485_SIZE_TYPE)rs485mock.readAvail();
+    }
+
+    void rs485_discard(RS485_SIZE_TYPE size) {
         rs485mock.discard(size);
     }
+
+    void rs485_setFrameComplete() {
+        rs485mock.frameComplete = true;
+    }
 }
 
 static std::vector<uint8_t> operator+ (const std::vector<uint8_t>& vec1, const std::vector<uint8_t>& vec2) {
@@ -134,25 +183,45 @@ extern uint16_t calcCrc16(uint16_t prevCrc, const uint8_t* buffer, int wLength);
 class RegisterRange { 
     bool readyForRead;
     bool isWritten;
+    bool isCommitted;
+    bool isAborted;
 
     std::vector<uint8_t> bufferToSend;
     std::vector<uint8_t> bufferReceived;
+    std::vector<uint8_t> bufferCommitted;
 public:
     int address;
     const int writeSize; // in register count
     const int readSize; // in register count
-
-    RegisterRange(int address, int readSize, int writeSize)
-        :address(address), readSize(readSize), writeSize(writeSize)
+    const bool cacheable;
+    int validateCount;
+    int sendCount;
+    // Polls of `onSendComplete` before the data is ready
+    int pendingPolls;
+    // Slow write, commit after the response
+    bool deferCommit;
+    // Error of `onCommit`
+    uint8_t commitException;
+
+    RegisterRange(int address, int readSize, int writeSize, bool cacheable = false)
+        :address(address), writeSize(writeSize), readSize(readSize), cacheable(cacheable)
     { 
         reset();
     }
 
     void reset() {
+        validateCount = 0;
+        sendCount = 0;
+        pendingPolls = 0;
+        deferCommit = false;
+        commitException = NO_ERROR;
         bufferToSend.clear();
         bufferReceived.clear();
+        bufferCommitted.clear();
         readyForRead = false;
         isWritten = false;
+        isCommitted = false;
+        isAborted = false;
     }
 
     /**
@@ -161,6 +230,12 @@ public:
      */
     void onSend() {
         REQUIRE(readyForRead);
+        if (pendingPolls > 0) {
+            // Device busy
+            bus_cl_sendPending = true;
+            return;
+        }
+        sendCount++;
         uint8_t* di = rs485_buffer;
         int toRead = std::min(RS485_BUF_SIZE, (int)(bufferToSend.size()));
         for (int i = 0; i < toRead; i++, di++) {
@@ -170,8 +245,21 @@ public:
 
         // Done
         if (bufferToSend.size() == 0) {
-            reset();
+            readyForRead = false;
+        }
+    }
+
+    /**
+     * Completes a deferred `onSend`
+     */
+    bool onSendComplete() {
+        REQUIRE(bus_cl_sendPending);
+        if (pendingPolls > 0) {
+            pendingPolls--;
+            return false;
         }
+        onSend();
+        return true;
     }
 
     /**
@@ -180,6 +268,7 @@ public:
      */
     bool onReceive() {
         REQUIRE(!isWritten);
+        bus_cl_deferCommit = deferCommit;
         int toWrite = std::min(RS485_BUF_SIZE, (int)((writeSize * 2) - bufferReceived.size()));
         const uint8_t* si = rs485_buffer;
         for (int i = 0; i < toWrite; i++, si++) {
@@ -192,15 +281,64 @@ public:
         return true;
     }
 
-    void prepareDataToSend(const std::vector<uint8_t>& data) {
+    /**
+     * Applies the data staged by `onReceive`, once the request CRC is validated
+     */
+    bool onCommit() {
+        REQUIRE(isWritten);
+        REQUIRE(!isCommitted);
+        bufferCommitted = bufferReceived;
+        isCommitted = true;
+        if (commitException != NO_ERROR) {
+            bus_cl_exceptionCode = commitException;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Drops the data staged by `onReceive`
+     */
+    void onAbort() {
+        REQUIRE(isWritten);
+        REQUIRE(!isCommitted);
+        isAborted = true;
+    }
+
+    void prepareDataToSend(const std::vector<uint8_t>& data, int pendingPolls = 0) {
         REQUIRE(!readyForRead);
         readyForRead = true;
         bufferToSend = data;
+        this->pendingPolls = pendingPolls;
     }
     
     void checkDataReceived(const std::vector<uint8_t>& data) {
         REQUIRE(isWritten);
         REQUIRE(bufferReceived == data);
+        // Staged, but not yet applied
+        REQUIRE(!isCommitted);
+    }
+
+    void checkDataCommitted(const std::vector<uint8_t>& data) {
+        REQUIRE(isCommitted);
+        REQUIRE(!isAborted);
+        REQUIRE(bufferCommitted == data);
+        // Done
+        reset();
+    }
+
+    // The register handlers were not called
+    void checkNoData() {
+        REQUIRE(validateCount == 0);
+        REQUIRE(!isWritten);
+        REQUIRE(!isAborted);
+        REQUIRE(!isCommitted);
+    }
+
+    void checkDataAborted() {
+        REQUIRE(isAborted);
+        REQUIRE(!isCommitted);
+        REQUIRE(bufferCommitted.empty());
         // Done
         reset();
     }
@@ -210,6 +348,8 @@ public:
     }
 
     bool validateReg(int address, int size, int function) {
+        validateCount++;
+        bus_cl_cacheable = cacheable;
         if (size <= 0) {
             bus_cl_exceptionCode = ERR_INVALID_SIZE;
             return false;
@@ -271,18 +411,62 @@ public:
         }
         throw std::runtime_error("onReceive called with invalid header");
     }
+
+    bool onSendComplete() {
+        int address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            if (it->addressMatch(address)) {
+                return it->onSendComplete();
+            }
+        }
+        throw std::runtime_error("onSendComplete called with invalid header");
+    }
+
+    bool onCommit() {
+        int address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            if (it->addressMatch(address)) {
+                return it->onCommit();
+            }
+        }
+        throw std::runtime_error("onCommit called with invalid header");
+    }
+
+    void onAbort() {
+        int address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            if (it->addressMatch(address)) {
+                return it->onAbort();
+            }
+        }
+        throw std::runtime_error("onAbort called with invalid header");
+    }
 };
 
 static RegistersMock registersMock({
     // Starts at 1024, 2 for read, 2 for write
     RegisterRange(1024, 2, 2),
-    // Starts at 2048, 2 for read, 0 for write
-    RegisterRange(2048, 2, 0),
+    // Starts at 2048, 2 for read, 0 for write. Static data, cacheable
+    RegisterRange(2048, 2, 0, true),
     // Starts at 2048, 0 for read, 2 for write
-    RegisterRange(4096, 0, 2)
+    RegisterRange(4096, 0, 2),
+    // Starts at 8192, 125 for read, 0 for write
+    RegisterRange(8192, 125, 0)
 });
 
 extern "C" {
+    const BUS_CL_REG_RANGE regs_changeRanges[BUS_CL_CHANGE_RANGES] = {
+        { 1024, 2 },
+        { 2048, 2 },
+        { 4096, 2 }
+    };
+
+    // 4 registers at 512
+    BUS_CL_IMAGE_DEFINE(testImage, 8);
+    const BUS_CL_IMAGE_RANGE regs_images[BUS_CL_IMAGES] = {
+        { 512, 4, &testImage }
+    };
+
     _Bool regs_validateReg() {
         return registersMock.validateReg();
     }
@@ -294,6 +478,18 @@ extern "C" {
     void regs_onSend() {
         registersMock.onSend();
     }
+
+    _Bool regs_onSendComplete() {
+        return registersMock.onSendComplete();
+    }
+
+    _Bool regs_onCommit() {
+        return registersMock.onCommit();
+    }
+
+    void regs_onAbort() {
+        registersMock.onAbort();
+    }
 }
 
 static void initRs485() {
@@ -585,10 +781,59 @@ TEST_CASE("Wrong CRC in write") {
     REQUIRE(bus_cl_poll() == false);
 
     REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+    // Staged data dropped
+    registersMock.ranges[0].checkDataAborted();
+
     // Mark condition, now the station will NOT respond due to CRC error
     rs485mock.simulateMark();
     REQUIRE(bus_cl_poll() == false);
     REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+}
+
+TEST_CASE("Wrong CRC in write, single bit error") {
+    testSizeSetup(1024, 2, 0x10);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+
+    rs485mock.simulateData({ 0xf1, 0xf2, 0xf3, 0xf4 });
+    REQUIRE(bus_cl_poll() == false);
+    registersMock.ranges[0].checkDataReceived({ 0xf1, 0xf2, 0xf3, 0xf4 });
+
+    // Flip a single bit of the right CRC
+    auto crc = crcOf(rs485mock.packetData);
+    crc[1] ^= 0x10;
+    rs485mock.simulateData(crc);
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+    registersMock.ranges[0].checkDataAborted();
+
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+}
+
+TEST_CASE("Truncated CRC in write") {
+    testSizeSetup(1024, 2, 0x10);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+
+    rs485mock.simulateData({ 0xf1, 0xf2, 0xf3, 0xf4 });
+    REQUIRE(bus_cl_poll() == false);
+    registersMock.ranges[0].checkDataReceived({ 0xf1, 0xf2, 0xf3, 0xf4 });
+
+    // Only one byte of CRC
+    rs485mock.simulateData({ crcOf(rs485mock.packetData)[0] });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_CHECK_REQUEST_CRC);
+
+    // Mark condition, the packet is dropped
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    registersMock.ranges[0].checkDataAborted();
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
 }
 
 static void testCorrectRead(RegisterRange& range) {
@@ -648,6 +893,9 @@ static void testCorrectWrite(RegisterRange& range) {
     REQUIRE(bus_cl_poll() == false);
     REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
 
+    // Data applied only after the CRC
+    range.checkDataCommitted(dataToSend);
+
     rs485mock.simulateMark();
     REQUIRE(bus_cl_poll() == false);
     REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
@@ -670,3 +918,887 @@ TEST_CASE("Correct size, register 1024, read") {
 TEST_CASE("Correct size, register 1024, write") {
     testCorrectWrite(registersMock.ranges[0]);
 }
+
+static void simulateWrite(RegisterRange& range, const std::vector<uint8_t>& data) {
+    testSizeSetup(range.address, range.writeSize, 0x10);
+    rs485mock.simulateData({ (uint8_t)(range.writeSize * 2) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(data);
+    REQUIRE(bus_cl_poll() == false);
+    range.checkDataReceived(data);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+
+    // Echo response
+    auto address = BigEndian::fromH(range.address);
+    auto size = BigEndian::fromH(range.writeSize);
+    REQUIRE(rs485mock.getDataWritten() == padWithCrc({ 0x2, 0x10, address.b0, address.b1, size.b0, size.b1 }));
+
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+}
+
+// Start a new request without resetting the bus client state
+static void nextRequest() {
+    rs485_isMarkCondition = true;
+    rs485_state = RS485_LINE_RX;
+    crc_reset();
+    rs485mock.reset();
+}
+
+TEST_CASE("Retried write is replayed without committing twice") {
+    auto& range = registersMock.ranges[0];
+    simulateWrite(range, { 0x1, 0x2, 0x3, 0x4 });
+    range.checkDataCommitted({ 0x1, 0x2, 0x3, 0x4 });
+
+    // The master lost the response, and it retries
+    advanceTime(BUS_CL_WRITE_REPLAY_TIMEOUT / 2);
+    nextRequest();
+    // `testSizeSetup` resets the state: use the same sequence, without the initialization
+    rs485mock.simulateData({ 0x2, 0x10 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.writeSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 0x1, 0x2, 0x3, 0x4 });
+    REQUIRE(bus_cl_poll() == false);
+    // The data is kept until the CRC is received
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_RECEIVE_DATA);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    // Not even staged again
+    range.checkNoData();
+
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    auto address = BigEndian::fromH(range.address);
+    auto size = BigEndian::fromH(range.writeSize);
+    REQUIRE(rs485mock.getDataWritten() == padWithCrc({ 0x2, 0x10, address.b0, address.b1, size.b0, size.b1 }));
+}
+
+TEST_CASE("Retried write with a wrong CRC is dropped") {
+    auto& range = registersMock.ranges[0];
+    simulateWrite(range, { 0x1, 0x2, 0x3, 0x4 });
+    range.checkDataCommitted({ 0x1, 0x2, 0x3, 0x4 });
+
+    advanceTime(BUS_CL_WRITE_REPLAY_TIMEOUT / 2);
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x10 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.writeSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 0x1, 0x2, 0x3, 0x4 });
+    REQUIRE(bus_cl_poll() == false);
+    auto crc = crcOf(rs485mock.packetData);
+    rs485mock.simulateData({ crc[0], (uint8_t)(crc[1] ^ 1) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+    // Not a replay: the data was staged and then dropped
+    range.checkDataAborted();
+}
+
+static void testRetriedWriteCommitted(bool expire, bool differentData, bool readInBetween) {
+    auto& range = registersMock.ranges[0];
+    simulateWrite(range, { 0x1, 0x2, 0x3, 0x4 });
+    range.checkDataCommitted({ 0x1, 0x2, 0x3, 0x4 });
+
+    if (readInBetween) {
+        nextRequest();
+        rs485mock.simulateData({ 0x2, 0x3 });
+        rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.readSize) });
+        REQUIRE(bus_cl_poll() == false);
+        rs485mock.simulateData(crcOf(rs485mock.packetData));
+        REQUIRE(bus_cl_poll() == false);
+        REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+        rs485mock.simulateMark();
+        range.prepareDataToSend({ 0x1, 0x2, 0x3, 0x4 });
+        REQUIRE(bus_cl_poll() == false);
+        rs485_state = RS485_LINE_RX;
+        REQUIRE(bus_cl_poll() == false);
+        REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    }
+
+    advanceTime(expire ? BUS_CL_WRITE_REPLAY_TIMEOUT : (BUS_CL_WRITE_REPLAY_TIMEOUT / 2));
+    std::vector<uint8_t> data({ 0x1, 0x2, 0x3, (uint8_t)(differentData ? 0x5 : 0x4) });
+
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x10 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.writeSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(data);
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    // New write, committed
+    range.checkDataCommitted(data);
+}
+
+TEST_CASE("Retried write after the replay timeout is committed again") {
+    testRetriedWriteCommitted(true, false, false);
+}
+TEST_CASE("Different write is committed") {
+    testRetriedWriteCommitted(false, true, false);
+}
+TEST_CASE("Same write after a read is committed again") {
+    testRetriedWriteCommitted(false, false, true);
+}
+
+static std::vector<uint8_t> simulateRead(RegisterRange& range, const std::vector<uint8_t>& dataToSend) {
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.readSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    if (!dataToSend.empty()) {
+        range.prepareDataToSend(dataToSend);
+    }
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    auto ret = rs485mock.getDataWritten();
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    return ret;
+}
+
+TEST_CASE("Read cache: cached response sent without calling the register handlers") {
+    initRs485();
+    bus_cl_init();
+    auto& range = registersMock.ranges[1];
+
+    std::vector<uint8_t> data({ 0x10, 0x20, 0x30, 0x40 });
+    std::vector<uint8_t> header({ 0x2, 0x3, 0x4 });
+    auto expected = header + data + crcOf(header, data);
+    REQUIRE(simulateRead(range, data) == expected);
+    REQUIRE(range.validateCount == 1);
+    REQUIRE(range.sendCount == 1);
+
+    // No data prepared: `onSend` would fail
+    REQUIRE(simulateRead(range, { }) == expected);
+    REQUIRE(simulateRead(range, { }) == expected);
+    REQUIRE(range.validateCount == 1);
+    REQUIRE(range.sendCount == 1);
+
+    // Data version changed: handlers are called again
+    bus_cl_dataVersion++;
+    data = { 0x11, 0x21, 0x31, 0x41 };
+    expected = header + data + crcOf(header, data);
+    REQUIRE(simulateRead(range, data) == expected);
+    REQUIRE(range.validateCount == 2);
+    REQUIRE(range.sendCount == 2);
+    REQUIRE(simulateRead(range, { }) == expected);
+    REQUIRE(range.sendCount == 2);
+}
+
+TEST_CASE("Read cache: old responses are not served when the data version wraps around") {
+    initRs485();
+    bus_cl_init();
+    auto& cached = registersMock.ranges[1];
+    auto& other = registersMock.ranges[0];
+
+    uint16_t version = bus_cl_dataVersion;
+    std::vector<uint8_t> header({ 0x2, 0x3, 0x4 });
+    std::vector<uint8_t> data({ 0x10, 0x20, 0x30, 0x40 });
+    REQUIRE(simulateRead(cached, data) == header + data + crcOf(header, data));
+
+    // Changed, and seen by another read
+    bus_cl_dataVersion++;
+    simulateRead(other, { 0x1, 0x2, 0x3, 0x4 });
+    // Back to the same version after the wrap around
+    bus_cl_dataVersion = version;
+
+    data = { 0x11, 0x21, 0x31, 0x41 };
+    REQUIRE(simulateRead(cached, data) == header + data + crcOf(header, data));
+    REQUIRE(cached.sendCount == 2);
+}
+
+TEST_CASE("Read cache: ranges not flagged as cacheable are not cached") {
+    initRs485();
+    bus_cl_init();
+    auto& range = registersMock.ranges[0];
+
+    std::vector<uint8_t> data({ 0x10, 0x20, 0x30, 0x40 });
+    simulateRead(range, data);
+    simulateRead(range, data);
+    REQUIRE(range.validateCount == 2);
+    REQUIRE(range.sendCount == 2);
+}
+
+TEST_CASE("Read cache: wrong CRC of a cached request is not answered") {
+    initRs485();
+    bus_cl_init();
+    auto& range = registersMock.ranges[1];
+    simulateRead(range, { 0x10, 0x20, 0x30, 0x40 });
+
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.readSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 0xde, 0xad });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+}
+
+static std::vector<uint8_t> readChangedRanges(int since, int maxCount) {
+    nextRequest();
+    rs485mock.simulateData({ 0x2, READ_CHANGED_RANGES });
+    rs485mock.simulateData({ BigEndian::fromH(since), BigEndian::fromH(maxCount) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_CHECK_REQUEST_CRC);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    auto ret = rs485mock.getDataWritten();
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    return ret;
+}
+
+TEST_CASE("Changed ranges: all ranges changed after reset, oldest first") {
+    initRs485();
+    bus_cl_init();
+
+    // Only 2 ranges fit the buffer
+    REQUIRE(readChangedRanges(0, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 10, 0x00, 0x02, 0x04, 0x00, 0x00, 0x02, 0x08, 0x00, 0x00, 0x02 }));
+    REQUIRE(readChangedRanges(2, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 6, 0x00, 0x03, 0x10, 0x00, 0x00, 0x02 }));
+    // Nothing changed
+    REQUIRE(readChangedRanges(3, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 2, 0x00, 0x03 }));
+}
+
+TEST_CASE("Changed ranges: only modified ranges are returned") {
+    initRs485();
+    bus_cl_init();
+
+    bus_cl_setChanged(2);
+    bus_cl_setChanged(0);
+    REQUIRE(bus_cl_changeSeq == 5);
+    // Oldest change first
+    REQUIRE(readChangedRanges(3, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 10, 0x00, 0x05, 0x10, 0x00, 0x00, 0x02, 0x04, 0x00, 0x00, 0x02 }));
+
+    // Truncated response: continue from the last range returned
+    bus_cl_setChanged(0);
+    bus_cl_setChanged(1);
+    REQUIRE(readChangedRanges(5, 1) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 6, 0x00, 0x06, 0x04, 0x00, 0x00, 0x02 }));
+    REQUIRE(readChangedRanges(6, 1) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 6, 0x00, 0x07, 0x08, 0x00, 0x00, 0x02 }));
+    REQUIRE(readChangedRanges(7, 1) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 2, 0x00, 0x07 }));
+}
+
+TEST_CASE("Changed ranges: at least a range should be asked") {
+    initRs485();
+    bus_cl_init();
+
+    // Also with changes pending, or the master would never progress
+    nextRequest();
+    rs485mock.simulateData({ 0x2, READ_CHANGED_RANGES });
+    rs485mock.simulateData({ BigEndian::fromH(0), BigEndian::fromH(0) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(rs485mock.getDataWritten() == padWithCrc({ 0x2, 0x80 | READ_CHANGED_RANGES, ERR_INVALID_SIZE }));
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+
+    REQUIRE(readChangedRanges(0, 1) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 6, 0x00, 0x01, 0x04, 0x00, 0x00, 0x02 }));
+}
+
+TEST_CASE("Changed ranges: all ranges returned to a master that polled before the reset of the node") {
+    initRs485();
+    bus_cl_init();
+    for (int i = 0; i < 10; i++) {
+        bus_cl_setChanged(1);
+    }
+    REQUIRE(readChangedRanges(3, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 6, 0x00, 0x0d, 0x08, 0x00, 0x00, 0x02 }));
+
+    // Reset: the master still knows the sequence number 13
+    bus_cl_init();
+    bus_cl_setChanged(0);
+    // Only 2 ranges fit the buffer: the master goes on from the returned sequence number
+    REQUIRE(readChangedRanges(13, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 10, 0x00, 0x03, 0x08, 0x00, 0x00, 0x02, 0x10, 0x00, 0x00, 0x02 }));
+    REQUIRE(readChangedRanges(3, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 6, 0x00, 0x04, 0x04, 0x00, 0x00, 0x02 }));
+    REQUIRE(readChangedRanges(4, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 2, 0x00, 0x04 }));
+}
+
+TEST_CASE("Changed ranges: sequence number wrap around") {
+    initRs485();
+    bus_cl_init();
+
+    bus_cl_changeSeq = 0xfffe;
+    bus_cl_setChanged(1);
+    bus_cl_setChanged(2);
+    REQUIRE(bus_cl_changeSeq == 0);
+    REQUIRE(readChangedRanges(0xfffe, 10) == padWithCrc({ 0x2, READ_CHANGED_RANGES, 10, 0x00, 0x00, 0x08, 0x00, 0x00, 0x02, 0x10, 0x00, 0x00, 0x02 }));
+}
+
+static std::vector<uint8_t> readMultipleRanges(const std::vector<std::pair<int, int>>& ranges) {
+    nextRequest();
+    rs485mock.simulateData({ 0x2, READ_MULTIPLE_RANGES });
+    rs485mock.simulateData({ BigEndian::fromH(ranges[0].first), BigEndian::fromH(ranges[0].second) });
+    REQUIRE(bus_cl_poll() == false);
+    if (bus_cl_rtu_state == BUS_CL_RTU_RECEIVE_DATA_SIZE) {
+        rs485mock.simulateData({ (uint8_t)((ranges.size() - 1) * 4) });
+        REQUIRE(bus_cl_poll() == false);
+    }
+    if (bus_cl_rtu_state == BUS_CL_RTU_RECEIVE_DATA) {
+        for (auto it = ranges.begin() + 1; it != ranges.end(); ++it) {
+            rs485mock.simulateData({ BigEndian::fromH(it->first), BigEndian::fromH(it->second) });
+        }
+        REQUIRE(bus_cl_poll() == false);
+    }
+    if (bus_cl_rtu_state == BUS_CL_RTU_CHECK_REQUEST_CRC) {
+        rs485mock.simulateData(crcOf(rs485mock.packetData));
+        REQUIRE(bus_cl_poll() == false);
+    }
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    // Each range is sent in a separate poll
+    for (int i = 0; i < ranges.size() && bus_cl_rtu_state == BUS_CL_RTU_SEND_DATA; i++) {
+        REQUIRE(bus_cl_poll() == false);
+    }
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    auto ret = rs485mock.getDataWritten();
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    return ret;
+}
+
+TEST_CASE("Read multiple ranges in one request") {
+    initRs485();
+    bus_cl_init();
+
+    std::vector<uint8_t> data1({ 0x10, 0x11, 0x12, 0x13 });
+    std::vector<uint8_t> data2({ 0x20, 0x21, 0x22, 0x23 });
+    registersMock.ranges[0].prepareDataToSend(data1);
+    registersMock.ranges[1].prepareDataToSend(data2);
+
+    std::vector<uint8_t> header({ 0x2, READ_MULTIPLE_RANGES, 8 });
+    REQUIRE(readMultipleRanges({ { 2048, 2 }, { 1024, 2 } }) == header + data2 + data1 + crcOf(header, data2 + data1));
+    REQUIRE(registersMock.ranges[0].sendCount == 1);
+    REQUIRE(registersMock.ranges[1].sendCount == 1);
+    // Validated again before sending
+    REQUIRE(registersMock.ranges[0].validateCount == 2);
+    REQUIRE(registersMock.ranges[1].validateCount == 2);
+}
+
+TEST_CASE("Read multiple ranges, single range") {
+    initRs485();
+    bus_cl_init();
+
+    std::vector<uint8_t> data({ 0x10, 0x11, 0x12, 0x13 });
+    registersMock.ranges[0].prepareDataToSend(data);
+
+    std::vector<uint8_t> header({ 0x2, READ_MULTIPLE_RANGES, 4 });
+    REQUIRE(readMultipleRanges({ { 1024, 2 } }) == header + data + crcOf(header, data));
+}
+
+TEST_CASE("Read multiple ranges, invalid range") {
+    initRs485();
+    bus_cl_init();
+
+    // Register 4096 can't be read
+    REQUIRE(readMultipleRanges({ { 1024, 2 }, { 4096, 2 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_INVALID_SIZE }));
+    REQUIRE(readMultipleRanges({ { 1024, 2 }, { 3000, 2 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_INVALID_ADDRESS }));
+    REQUIRE(readMultipleRanges({ { 3000, 2 }, { 1024, 2 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_INVALID_ADDRESS }));
+}
+
+TEST_CASE("Read multiple ranges, too many ranges") {
+    initRs485();
+    bus_cl_init();
+
+    REQUIRE(readMultipleRanges({ { 1024, 1 }, { 1024, 1 }, { 1024, 1 }, { 1024, 1 }, { 1024, 1 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_INVALID_SIZE }));
+}
+
+TEST_CASE("Read multiple ranges, device busy") {
+    initRs485();
+    bus_cl_init();
+
+    // The second range is not ready: no data is sent
+    registersMock.ranges[0].prepareDataToSend({ 0x10, 0x11, 0x12, 0x13 });
+    registersMock.ranges[1].prepareDataToSend({ 0x20, 0x21, 0x22, 0x23 }, 1);
+    REQUIRE(readMultipleRanges({ { 1024, 2 }, { 2048, 2 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_DEVICE_BUSY }));
+
+    // The first one
+    initRs485();
+    registersMock.ranges[0].prepareDataToSend({ 0x10, 0x11, 0x12, 0x13 }, 1);
+    registersMock.ranges[1].prepareDataToSend({ 0x20, 0x21, 0x22, 0x23 });
+    REQUIRE(readMultipleRanges({ { 1024, 2 }, { 2048, 2 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_DEVICE_BUSY }));
+}
+
+TEST_CASE("Read multiple ranges, the data should fit the buffer") {
+    initRs485();
+    bus_cl_init();
+
+    std::vector<uint8_t> data1({ 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b });
+    std::vector<uint8_t> data2({ 0x20, 0x21, 0x22, 0x23 });
+    registersMock.ranges[3].prepareDataToSend(data1);
+    registersMock.ranges[0].prepareDataToSend(data2);
+    std::vector<uint8_t> header({ 0x2, READ_MULTIPLE_RANGES, 16 });
+    REQUIRE(readMultipleRanges({ { 8192, 6 }, { 1024, 2 } }) == header + data1 + data2 + crcOf(header, data1 + data2));
+
+    REQUIRE(readMultipleRanges({ { 8192, 7 }, { 1024, 2 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_INVALID_SIZE }));
+}
+
+TEST_CASE("Read multiple ranges, response bigger than the RTU packet") {
+    initRs485();
+    bus_cl_init();
+
+    // Each range is valid, but the response doesn't fit
+    REQUIRE(readMultipleRanges({ { 8192, 125 }, { 8192, 1 } }) == padWithCrc({ 0x2, 0x80 | READ_MULTIPLE_RANGES, ERR_INVALID_SIZE }));
+    REQUIRE(registersMock.ranges[3].sendCount == 0);
+}
+
+static void startDeferredRead(RegisterRange& range, const std::vector<uint8_t>& data, int pendingPolls) {
+    initRs485();
+    bus_cl_init();
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.readSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    range.prepareDataToSend(data, pendingPolls);
+
+    // Response deferred, the line is still free
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_DATA);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+}
+
+TEST_CASE("Deferred read data is sent when ready") {
+    auto& range = registersMock.ranges[0];
+    std::vector<uint8_t> data({ 0x10, 0x20, 0x30, 0x40 });
+    startDeferredRead(range, data, 3);
+
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_DATA);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    std::vector<uint8_t> header({ 0x2, 0x3, 0x4 });
+    REQUIRE(rs485mock.getDataWritten() == header + data + crcOf(header, data));
+    REQUIRE(range.sendCount == 1);
+
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+}
+
+TEST_CASE("Deferred read data not ready in time") {
+    auto& range = registersMock.ranges[0];
+    startDeferredRead(range, { 0x10, 0x20, 0x30, 0x40 }, 100);
+
+    advanceTime(BUS_CL_ASYNC_SEND_TIMEOUT - 1);
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_DATA);
+
+    advanceTime(1);
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    REQUIRE(rs485mock.getDataWritten() == padWithCrc({ 0x2, 0x83, ERR_DEVICE_BUSY }));
+    REQUIRE(range.sendCount == 0);
+}
+
+TEST_CASE("Deferred read data dropped when the line is active again") {
+    auto& range = registersMock.ranges[0];
+    startDeferredRead(range, { 0x10, 0x20, 0x30, 0x40 }, 3);
+
+    // The master timed out, and it is addressing another station
+    rs485mock.simulateData({ 0x5, 0x3 });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(bus_cl_poll() == false);
+    }
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+    REQUIRE(range.sendCount == 0);
+}
+
+TEST_CASE("Wrong function size read: the data should fit the buffer") {
+    testWrongSizeRead(8192, RS485_BUF_SIZE / 2 + 1);
+}
+
+static void testDeferredCommit(uint8_t commitException) {
+    initRs485();
+    bus_cl_init();
+    auto& range = registersMock.ranges[0];
+    range.deferCommit = true;
+    range.commitException = commitException;
+
+    std::vector<uint8_t> data({ 0x1, 0x2, 0x3, 0x4 });
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x10 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.writeSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(data);
+    REQUIRE(bus_cl_poll() == false);
+    range.checkDataReceived(data);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    REQUIRE(bus_cl_commitStatus == BUS_CL_COMMIT_PENDING);
+
+    // The echo response is sent before committing the data
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    auto address = BigEndian::fromH(range.address);
+    auto size = BigEndian::fromH(range.writeSize);
+    REQUIRE(rs485mock.getDataWritten() == padWithCrc({ 0x2, 0x10, address.b0, address.b1, size.b0, size.b1 }));
+    range.checkDataReceived(data);
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_commitStatus == BUS_CL_COMMIT_PENDING);
+
+    // Response transmitted
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(bus_cl_commitStatus == commitException);
+    range.checkDataCommitted(data);
+}
+
+TEST_CASE("Deferred commit after the write response") {
+    testDeferredCommit(NO_ERROR);
+}
+TEST_CASE("Deferred commit error is stored in the status") {
+    testDeferredCommit(ERR_DEVICE_FAILURE);
+}
+
+static void testDeferredCommitDropped(bool markCondition) {
+    initRs485();
+    bus_cl_init();
+    auto& range = registersMock.ranges[0];
+    range.deferCommit = true;
+
+    std::vector<uint8_t> data({ 0x1, 0x2, 0x3, 0x4 });
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x10 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.writeSize) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ 4 });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(data);
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_commitStatus == BUS_CL_COMMIT_PENDING);
+
+    // The line is not engaged yet
+    rs485mock.holdWrite = true;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WRITE_RESPONSE_CRC);
+
+    // More data received: the RS485 module drops the response
+    rs485_state = RS485_LINE_RX;
+    rs485_isMarkCondition = markCondition;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(bus_cl_commitStatus == BUS_CL_COMMIT_ABORTED);
+    range.checkDataAborted();
+
+    // The next request doesn't commit anything
+    data = { 0x10, 0x20, 0x30, 0x40 };
+    std::vector<uint8_t> header({ 0x2, 0x3, 0x4 });
+    REQUIRE(simulateRead(range, data) == header + data + crcOf(header, data));
+    REQUIRE(bus_cl_commitStatus == BUS_CL_COMMIT_ABORTED);
+}
+
+TEST_CASE("Deferred commit aborted when the response is dropped") {
+    testDeferredCommitDropped(false);
+}
+TEST_CASE("Deferred commit aborted when the response is dropped, mark condition") {
+    testDeferredCommitDropped(true);
+}
+
+// Custom function: the response contains the sum of the request data bytes
+static uint8_t s_sumSize;
+static uint8_t s_sum;
+
+extern "C" {
+    static _Bool sumOnHeader() {
+        return true;
+    }
+
+    static _Bool sumOnDataSize(uint8_t size) {
+        s_sumSize = size;
+        return size > 0 && size <= RS485_BUF_SIZE;
+    }
+
+    static _Bool sumOnData() {
+        s_sum = 0;
+        for (int i = 0; i < s_sumSize; i++) {
+            s_sum += rs485_buffer[i];
+        }
+        return true;
+    }
+
+    static BUS_CL_RTU_STATE sumOnResponse() {
+        rs485_buffer[0] = bus_cl_header.header.stationAddress;
+        rs485_buffer[1] = bus_cl_header.header.function;
+        rs485_buffer[2] = s_sum;
+        rs485_write(3);
+        return BUS_CL_RTU_WRITE_RESPONSE_CRC;
+    }
+
+    const BUS_CL_FUNCTION testSumFunction = { sumOnHeader, sumOnDataSize, sumOnData, sumOnResponse, NULL };
+}
+
+static std::vector<uint8_t> callSumFunction(const std::vector<uint8_t>& data) {
+    initRs485();
+    bus_cl_init();
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 100, 0, 0, 0, 0 });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData({ (uint8_t)data.size() });
+    REQUIRE(bus_cl_poll() == false);
+    if (bus_cl_rtu_state == BUS_CL_RTU_RECEIVE_DATA) {
+        rs485mock.simulateData(data);
+        REQUIRE(bus_cl_poll() == false);
+        rs485mock.simulateData(crcOf(rs485mock.packetData));
+        REQUIRE(bus_cl_poll() == false);
+    }
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    return rs485mock.getDataWritten();
+}
+
+TEST_CASE("Custom function") {
+    REQUIRE(callSumFunction({ 0x1, 0x2, 0x3 }) == padWithCrc({ 0x2, 100, 0x6 }));
+}
+
+TEST_CASE("Custom function, invalid data size") {
+    REQUIRE(callSumFunction({ }) == padWithCrc({ 0x2, 0x80 | 100, ERR_INVALID_SIZE }));
+}
+
+TEST_CASE("Response to a complete request doesn't wait for the mark condition") {
+    initRs485();
+    bus_cl_init();
+    auto& range = registersMock.ranges[0];
+
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(range.address), BigEndian::fromH(range.readSize) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(!rs485mock.frameComplete);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    REQUIRE(rs485mock.frameComplete);
+
+    // No mark condition
+    std::vector<uint8_t> data({ 0x10, 0x20, 0x30, 0x40 });
+    range.prepareDataToSend(data);
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    std::vector<uint8_t> header({ 0x2, 0x3, 0x4 });
+    REQUIRE(rs485mock.getDataWritten() == header + data + crcOf(header, data));
+}
+
+TEST_CASE("Error response waits for the mark condition") {
+    initRs485();
+    bus_cl_init();
+
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(1024), BigEndian::fromH(3) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    // The request length is unknown
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    REQUIRE(!rs485mock.frameComplete);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+}
+
+static void publishImage(const std::vector<uint8_t>& data) {
+    memcpy(BUS_CL_IMAGE_WRITE_BUFFER(&testImage), data.data(), data.size());
+    bus_cl_publishImage(&testImage);
+}
+
+static std::vector<uint8_t> readImage(int address, int count) {
+    nextRequest();
+    rs485mock.simulateData({ 0x2, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(address), BigEndian::fromH(count) });
+    REQUIRE(bus_cl_poll() == false);
+    rs485mock.simulateData(crcOf(rs485mock.packetData));
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_RESPONSE);
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    auto ret = rs485mock.getDataWritten();
+    rs485_state = RS485_LINE_RX;
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    return ret;
+}
+
+TEST_CASE("Image: read served from the published buffer") {
+    initRs485();
+    bus_cl_init();
+
+    std::vector<uint8_t> data1({ 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17 });
+    publishImage(data1);
+
+    // The register handlers would reject the address
+    std::vector<uint8_t> header({ 0x2, 0x3, 8 });
+    REQUIRE(readImage(512, 4) == header + data1 + crcOf(header, data1));
+
+    std::vector<uint8_t> header2({ 0x2, 0x3, 4 });
+    std::vector<uint8_t> data1Part({ 0x12, 0x13, 0x14, 0x15 });
+    REQUIRE(readImage(513, 2) == header2 + data1Part + crcOf(header2, data1Part));
+
+    // The write buffer is not visible until published
+    std::vector<uint8_t> data2({ 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27 });
+    memcpy(BUS_CL_IMAGE_WRITE_BUFFER(&testImage), data2.data(), data2.size());
+    REQUIRE(readImage(512, 4) == header + data1 + crcOf(header, data1));
+
+    bus_cl_publishImage(&testImage);
+    REQUIRE(readImage(512, 4) == header + data2 + crcOf(header, data2));
+}
+
+TEST_CASE("Image: range not entirely in the image is validated by the register handlers") {
+    initRs485();
+    bus_cl_init();
+
+    REQUIRE(readImage(514, 3) == padWithCrc({ 0x2, 0x83, ERR_INVALID_ADDRESS }));
+    REQUIRE(readImage(511, 2) == padWithCrc({ 0x2, 0x83, ERR_INVALID_ADDRESS }));
+}
+
+TEST_CASE("Image: read multiple ranges from images and register handlers") {
+    initRs485();
+    bus_cl_init();
+
+    std::vector<uint8_t> image({ 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37 });
+    publishImage(image);
+    std::vector<uint8_t> data({ 0x10, 0x11, 0x12, 0x13 });
+    registersMock.ranges[0].prepareDataToSend(data);
+
+    std::vector<uint8_t> header({ 0x2, READ_MULTIPLE_RANGES, 8 });
+    std::vector<uint8_t> imagePart({ 0x34, 0x35, 0x36, 0x37 });
+    REQUIRE(readMultipleRanges({ { 514, 2 }, { 1024, 2 } }) == header + imagePart + data + crcOf(header, imagePart + data));
+    REQUIRE(registersMock.ranges[0].sendCount == 1);
+}
+
+static int s_latchCount;
+// The live data, latched in the image with the sequence number
+static std::vector<uint8_t> s_liveData({ 0, 0, 0, 0, 0, 0 });
+
+extern "C" {
+    void regs_onLatch() {
+        s_latchCount++;
+        uint8_t* buffer = BUS_CL_IMAGE_WRITE_BUFFER(&testImage);
+        buffer[0] = (uint8_t)(bus_cl_snapshotSeq >> 8);
+        buffer[1] = (uint8_t)bus_cl_snapshotSeq;
+        memcpy(buffer + 2, s_liveData.data(), s_liveData.size());
+        bus_cl_publishImage(&testImage);
+    }
+}
+
+static void simulateLatch(int station, int seq, bool wrongCrc = false) {
+    nextRequest();
+    rs485mock.simulateData({ (uint8_t)station, LATCH_SNAPSHOT });
+    rs485mock.simulateData({ BigEndian::fromH(seq), BigEndian::fromH(0) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_CHECK_REQUEST_CRC);
+    auto crc = crcOf(rs485mock.packetData);
+    if (wrongCrc) {
+        crc[0]++;
+    }
+    rs485mock.simulateData(crc);
+    REQUIRE(bus_cl_poll() == false);
+}
+
+TEST_CASE("Snapshot: broadcast latch is not answered") {
+    initRs485();
+    bus_cl_init();
+    s_latchCount = 0;
+
+    s_liveData = { 0x10, 0x11, 0x12, 0x13, 0x14, 0x15 };
+    simulateLatch(BROADCAST_ADDRESS, 0x1234);
+    // Latched at the end of the frame
+    REQUIRE(s_latchCount == 1);
+    REQUIRE(bus_cl_snapshotSeq == 0x1234);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+
+    // The live data changes, the snapshot doesn't
+    s_liveData = { 0x20, 0x21, 0x22, 0x23, 0x24, 0x25 };
+    rs485mock.simulateMark();
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_IDLE);
+    REQUIRE(rs485mock.getDataWritten() == std::vector<uint8_t>({ }));
+
+    std::vector<uint8_t> snapshot({ 0x12, 0x34, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15 });
+    std::vector<uint8_t> header({ 0x2, 0x3, 8 });
+    REQUIRE(readImage(512, 4) == header + snapshot + crcOf(header, snapshot));
+}
+
+TEST_CASE("Snapshot: broadcast latch with wrong CRC is ignored") {
+    initRs485();
+    bus_cl_init();
+    s_latchCount = 0;
+
+    simulateLatch(BROADCAST_ADDRESS, 0x1234, true);
+    REQUIRE(s_latchCount == 0);
+    REQUIRE(bus_cl_crcErrors == 1);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+}
+
+TEST_CASE("Snapshot: latch addressed to the station is echoed") {
+    initRs485();
+    bus_cl_init();
+    s_latchCount = 0;
+
+    simulateLatch(0x2, 0x5678);
+    REQUIRE(s_latchCount == 1);
+    REQUIRE(bus_cl_snapshotSeq == 0x5678);
+    // The request is complete, no need to wait for the mark condition
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_FLUSH);
+    REQUIRE(rs485mock.getDataWritten() == padWithCrc({ 0x2, LATCH_SNAPSHOT, 0x56, 0x78, 0x0, 0x0 }));
+}
+
+TEST_CASE("Snapshot: other broadcast functions are ignored") {
+    initRs485();
+    bus_cl_init();
+
+    nextRequest();
+    rs485mock.simulateData({ BROADCAST_ADDRESS, 0x3 });
+    rs485mock.simulateData({ BigEndian::fromH(1024), BigEndian::fromH(2) });
+    REQUIRE(bus_cl_poll() == false);
+    REQUIRE(bus_cl_rtu_state == BUS_CL_RTU_WAIT_FOR_IDLE);
+}
@@ -0,0 +1,261 @@
+#include <catch2/catch.hpp>
+#include <stdbool.h>
+#include <string.h>
+
+#include "simulatedBus.h"
+
+// The master engine against the nodes of the client stack, on the same simulated RS485 line
+
+// A completed request
+struct Result {
+    uint8_t station;
+    uint8_t result;
+    std::vector<uint16_t> data;
+};
+static std::vector<Result> s_results;
+
+static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result) {
+    CTX_UNUSED;
+    Result r = { request->station, result, std::vector<uint16_t>(request->data, request->data + request->count) };
+    s_results.push_back(r);
+}
+
+static void initBus(int count) {
+    simInit(count);
+    s_results.clear();
+}
+
+// Poll until all the requests are completed
+static void runMaster() {
+    for (int i = 0; i < 1000 && simMaster->ctx.bus_ms.queueCount > 0; i++) {
+        simPoll(TICKS_PER_CHAR);
+    }
+    REQUIRE(simMaster->ctx.bus_ms.queueCount == 0);
+}
+
+static BUS_MS_REQUEST request(uint8_t station, uint8_t function, uint16_t address, uint8_t count, uint16_t* data) {
+    BUS_MS_REQUEST ret = { station, function, address, count, data, onComplete, NULL };
+    return ret;
+}
+
+TEST_CASE("Master: read and write registers of multiple nodes") {
+    initBus(2);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data1[3] = { 0 };
+    uint16_t data2[2] = { 0 };
+    uint16_t write[2] = { 0xaaaa, 0xbbbb };
+    uint16_t readBack[2] = { 0 };
+    BUS_MS_REQUEST r1 = request(1, READ_HOLDING_REGISTERS, 2, 3, data1);
+    BUS_MS_REQUEST r2 = request(2, READ_HOLDING_REGISTERS, 0, 2, data2);
+    BUS_MS_REQUEST r3 = request(2, WRITE_HOLDING_REGISTERS, 6, 2, write);
+    BUS_MS_REQUEST r4 = request(2, READ_HOLDING_REGISTERS, 6, 2, readBack);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r1));
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r2));
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r3));
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r4));
+    runMaster();
+
+    // In order
+    REQUIRE(s_results.size() == 4);
+    REQUIRE(s_results[0].result == NO_ERROR);
+    REQUIRE(s_results[0].station == 1);
+    REQUIRE(s_results[0].data == std::vector<uint16_t>({ 0x102, 0x103, 0x104 }));
+    REQUIRE(s_results[1].result == NO_ERROR);
+    REQUIRE(s_results[1].data == std::vector<uint16_t>({ 0x200, 0x201 }));
+    REQUIRE(s_results[2].result == NO_ERROR);
+    REQUIRE(simNodes[1]->regs[6] == 0xaaaa);
+    REQUIRE(simNodes[1]->regs[7] == 0xbbbb);
+    REQUIRE(s_results[3].result == NO_ERROR);
+    REQUIRE(s_results[3].data == std::vector<uint16_t>({ 0xaaaa, 0xbbbb }));
+    REQUIRE(simMaster->ctx.bus_ms.crcErrors == 0);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == 0);
+}
+
+TEST_CASE("Master: exception codes of the nodes") {
+    initBus(1);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data[2];
+    BUS_MS_REQUEST r = request(1, READ_HOLDING_REGISTERS, 7, 2, data);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    runMaster();
+
+    // Not retried
+    REQUIRE(s_results.size() == 1);
+    REQUIRE(s_results[0].result == ERR_INVALID_ADDRESS);
+    REQUIRE(simNodes[0]->ctx.bus_cl.crcErrors == 0);
+}
+
+TEST_CASE("Master: missing node times out after the retries") {
+    initBus(1);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data[1];
+    BUS_MS_REQUEST r1 = request(3, READ_HOLDING_REGISTERS, 0, 1, data);
+    BUS_MS_REQUEST r2 = request(1, READ_HOLDING_REGISTERS, 0, 1, data);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r1));
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r2));
+    TICK_TYPE start = simTimer;
+    runMaster();
+
+    REQUIRE(s_results.size() == 2);
+    REQUIRE(s_results[0].result == BUS_MS_ERR_TIMEOUT);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == BUS_MS_RETRIES + 1);
+    REQUIRE((TICK_TYPE)(simTimer - start) >= BUS_MS_RESPONSE_TIMEOUT * (BUS_MS_RETRIES + 1));
+    // The next request is served
+    REQUIRE(s_results[1].result == NO_ERROR);
+    REQUIRE(s_results[1].data == std::vector<uint16_t>({ 0x100 }));
+}
+
+TEST_CASE("Master: corrupted responses are retried") {
+    initBus(1);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data[2];
+    BUS_MS_REQUEST r = request(1, READ_HOLDING_REGISTERS, 4, 2, data);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    simNodes[0]->corruptByte = 4;
+    runMaster();
+
+    REQUIRE(s_results.size() == 1);
+    REQUIRE(s_results[0].result == NO_ERROR);
+    REQUIRE(s_results[0].data == std::vector<uint16_t>({ 0x104, 0x105 }));
+    REQUIRE(simMaster->ctx.bus_ms.crcErrors == 1);
+}
+
+TEST_CASE("Master: corrupted requests are retried") {
+    initBus(1);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data[1] = { 0x1234 };
+    BUS_MS_REQUEST r = request(1, WRITE_HOLDING_REGISTERS, 0, 1, data);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    // In the register data
+    simMaster->corruptByte = 9;
+    runMaster();
+
+    REQUIRE(s_results.size() == 1);
+    REQUIRE(s_results[0].result == NO_ERROR);
+    REQUIRE(simNodes[0]->regs[0] == 0x1234);
+    // Dropped by the node
+    REQUIRE(simNodes[0]->ctx.bus_cl.crcErrors == 1);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == 1);
+}
+
+TEST_CASE("Master: broadcast writes are not answered") {
+    initBus(3);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    uint16_t data[1] = { 0x4321 };
+    BUS_MS_REQUEST r = request(BROADCAST_ADDRESS, WRITE_HOLDING_REGISTERS, 1, 1, data);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    runMaster();
+
+    // Completed after the turnaround delay
+    REQUIRE(s_results.size() == 1);
+    REQUIRE(s_results[0].result == NO_ERROR);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == 0);
+    // The nodes of this stack only accept broadcast LATCH_SNAPSHOT requests
+    REQUIRE(simNodes[0]->regs[1] == 0x101);
+}
+
+TEST_CASE("Master: invalid requests and full queue") {
+    initBus(1);
+
+    uint16_t data[RS485_BUF_SIZE];
+    BUS_MS_REQUEST r = request(1, READ_HOLDING_REGISTERS, 0, (RS485_BUF_SIZE - 5) / 2 + 1, data);
+    // Response too big
+    REQUIRE(!bus_ms_enqueue(&simMaster->ctx, &r));
+    r.count--;
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    // Request too big
+    r = request(1, WRITE_HOLDING_REGISTERS, 0, (RS485_BUF_SIZE - 7) / 2 + 1, data);
+    REQUIRE(!bus_ms_enqueue(&simMaster->ctx, &r));
+    // Broadcast read
+    r = request(BROADCAST_ADDRESS, READ_HOLDING_REGISTERS, 0, 1, data);
+    REQUIRE(!bus_ms_enqueue(&simMaster->ctx, &r));
+    // Unsupported function
+    r = request(1, LATCH_SNAPSHOT, 0, 1, data);
+    REQUIRE(!bus_ms_enqueue(&simMaster->ctx, &r));
+
+    r = request(1, READ_HOLDING_REGISTERS, 0, 1, data);
+    for (int i = 1; i < BUS_MS_QUEUE_SIZE; i++) {
+        REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    }
+    REQUIRE(!bus_ms_enqueue(&simMaster->ctx, &r));
+}
+
+// Read a register of the node, and returns the result
+static uint8_t readNode(uint8_t station) {
+    s_results.clear();
+    uint16_t data[1];
+    BUS_MS_REQUEST r = request(station, READ_HOLDING_REGISTERS, 0, 1, data);
+    REQUIRE(bus_ms_enqueue(&simMaster->ctx, &r));
+    runMaster();
+    REQUIRE(s_results.size() == 1);
+    return s_results[0].result;
+}
+
+TEST_CASE("Master: response timeouts adapt to the nodes") {
+    initBus(2);
+    // A slow node
+    simNodes[1]->rxDelay = TICKS_PER_SECOND / 50;
+    simPoll(TICKS_PER_CHAR * 10);
+
+    // Not measured yet
+    REQUIRE(bus_ms_responseTimeout(&simMaster->ctx, 1) == BUS_MS_RESPONSE_TIMEOUT);
+    for (int i = 0; i < 10; i++) {
+        REQUIRE(readNode(1) == NO_ERROR);
+        REQUIRE(readNode(2) == NO_ERROR);
+    }
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == 0);
+
+    TICK_TYPE fast = bus_ms_responseTimeout(&simMaster->ctx, 1);
+    TICK_TYPE slow = bus_ms_responseTimeout(&simMaster->ctx, 2);
+    REQUIRE(fast == BUS_MS_MIN_RESPONSE_TIMEOUT);
+    REQUIRE(slow > TICKS_PER_SECOND / 50);
+    REQUIRE(slow < BUS_MS_RESPONSE_TIMEOUT);
+    REQUIRE(bus_ms_responseTimeout(&simMaster->ctx, 3) == BUS_MS_RESPONSE_TIMEOUT);
+}
+
+TEST_CASE("Master: nodes down fail fast, and are probed with backoff") {
+    initBus(1);
+    simPoll(TICKS_PER_CHAR * 10);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(readNode(1) == NO_ERROR);
+    }
+
+    // Detected with the shorter timeouts, doubled at each retry
+    simNodes[0]->offline = true;
+    TICK_TYPE start = simTimer;
+    REQUIRE(readNode(1) == BUS_MS_ERR_TIMEOUT);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == BUS_MS_RETRIES + 1);
+    REQUIRE((TICK_TYPE)(simTimer - start) < BUS_MS_RESPONSE_TIMEOUT * (BUS_MS_RETRIES + 1));
+    REQUIRE(bus_ms_isDown(&simMaster->ctx, 1));
+
+    // Not transmitted: completed in the first round of polls
+    start = simTimer;
+    REQUIRE(readNode(1) == BUS_MS_ERR_NODE_DOWN);
+    REQUIRE((TICK_TYPE)(simTimer - start) < TICKS_PER_CHAR * 2);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == BUS_MS_RETRIES + 1);
+    REQUIRE(simMaster->ctx.bus_ms.skipped == 1);
+
+    // Probed once, then after twice the interval
+    simPoll(BUS_MS_PROBE_INTERVAL);
+    REQUIRE(readNode(1) == BUS_MS_ERR_TIMEOUT);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == BUS_MS_RETRIES + 2);
+    simPoll(BUS_MS_PROBE_INTERVAL);
+    REQUIRE(readNode(1) == BUS_MS_ERR_NODE_DOWN);
+    simPoll(BUS_MS_PROBE_INTERVAL);
+    REQUIRE(readNode(1) == BUS_MS_ERR_TIMEOUT);
+    REQUIRE(simMaster->ctx.bus_ms.timeouts == BUS_MS_RETRIES + 3);
+
+    // Back
+    simNodes[0]->offline = false;
+    simPoll(BUS_MS_PROBE_INTERVAL * 4);
+    REQUIRE(readNode(1) == NO_ERROR);
+    REQUIRE(!bus_ms_isDown(&simMaster->ctx, 1));
+    REQUIRE(readNode(1) == NO_ERROR);
+    REQUIRE(simMaster->ctx.bus_ms.skipped == 2);
+}
@@ -0,0 +1,216 @@
+#include <catch2/catch.hpp>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "simulatedBus.h"
+#include "pic-modbus/bus_scan.h"
+
+// The scan-cycle planner, and its schedule executed by the master on the simulated line
+
+static BUS_SCAN_POINT point(uint8_t station, uint16_t address, uint8_t count) {
+    BUS_SCAN_POINT ret = { };
+    ret.station = station;
+    ret.address = address;
+    ret.count = count;
+    return ret;
+}
+
+static BUS_SCAN_COSTS costs(uint32_t transactionCost, uint32_t registerCost, uint8_t maxRegisters = 5, uint16_t maxGap = 0xffff) {
+    BUS_SCAN_COSTS ret = { transactionCost, registerCost, maxRegisters, maxGap };
+    return ret;
+}
+
+struct Plan {
+    std::vector<BUS_MS_REQUEST> reads;
+    uint16_t data[256];
+};
+
+static int plan(std::vector<BUS_SCAN_POINT>& points, const BUS_SCAN_COSTS& costs, Plan& plan) {
+    plan.reads.resize(points.size());
+    int count = bus_scan_plan(points.data(), (uint16_t)points.size(), &costs, plan.reads.data(), (uint16_t)plan.reads.size(), plan.data, 256);
+    plan.reads.resize(count > 0 ? count : 0);
+    return count;
+}
+
+TEST_CASE("Scan planner: close points are read together") {
+    std::vector<BUS_SCAN_POINT> points = { point(1, 0, 1), point(1, 1, 1), point(1, 3, 1), point(1, 20, 2) };
+    BUS_SCAN_COSTS c = costs(10, 1);
+    Plan p;
+    REQUIRE(plan(points, c, p) == 2);
+
+    REQUIRE(p.reads[0].station == 1);
+    REQUIRE(p.reads[0].function == READ_HOLDING_REGISTERS);
+    REQUIRE(p.reads[0].address == 0);
+    REQUIRE(p.reads[0].count == 4);
+    REQUIRE(p.reads[1].address == 20);
+    REQUIRE(p.reads[1].count == 2);
+    REQUIRE(points[2].read == 0);
+    REQUIRE(points[2].data == p.reads[0].data + 3);
+    REQUIRE(points[3].read == 1);
+    REQUIRE(points[3].data == p.reads[1].data);
+    // Consecutive in the data buffer
+    REQUIRE(p.reads[1].data == p.reads[0].data + 4);
+    REQUIRE(bus_scan_cost(&c, p.reads.data(), 2) == 10 + 4 + 10 + 2);
+}
+
+TEST_CASE("Scan planner: gaps more expensive than a round trip are not read") {
+    std::vector<BUS_SCAN_POINT> points = { point(1, 0, 1), point(1, 4, 1) };
+    Plan p;
+    // 2 + 5 registers together, 2 * (2 + 1) apart
+    REQUIRE(plan(points, costs(2, 1), p) == 2);
+    // 4 + 5 together, 2 * (4 + 1) apart
+    REQUIRE(plan(points, costs(4, 1), p) == 1);
+    REQUIRE(p.reads[0].count == 5);
+    // Not bridged
+    REQUIRE(plan(points, costs(4, 1, 5, 2), p) == 2);
+    REQUIRE(plan(points, costs(4, 1, 5, 3), p) == 1);
+}
+
+TEST_CASE("Scan planner: reads limited by the buffer of the nodes") {
+    std::vector<BUS_SCAN_POINT> points;
+    for (uint16_t i = 0; i < 12; i++) {
+        points.push_back(point(1, i, 1));
+    }
+    Plan p;
+    REQUIRE(plan(points, costs(100, 1), p) == 3);
+    for (auto& read : p.reads) {
+        REQUIRE(read.count <= 5);
+    }
+    REQUIRE(plan(points, costs(100, 1, 3), p) == 4);
+    // Never more than the frames can hold
+    REQUIRE(plan(points, costs(100, 1, 200), p) == 3);
+}
+
+TEST_CASE("Scan planner: unsorted and overlapping points of several nodes") {
+    std::vector<BUS_SCAN_POINT> points = { point(2, 3, 2), point(1, 0, 2), point(2, 0, 1), point(1, 1, 1), point(2, 3, 1) };
+    Plan p;
+    REQUIRE(plan(points, costs(10, 1), p) == 2);
+
+    REQUIRE(p.reads[0].station == 1);
+    REQUIRE(p.reads[0].address == 0);
+    REQUIRE(p.reads[0].count == 2);
+    REQUIRE(p.reads[1].station == 2);
+    REQUIRE(p.reads[1].address == 0);
+    REQUIRE(p.reads[1].count == 5);
+    // Sorted
+    REQUIRE(points[0].station == 1);
+    REQUIRE(points[0].address == 0);
+    REQUIRE(points[1].address == 1);
+    REQUIRE(points[1].data == p.reads[0].data + 1);
+    REQUIRE(points[3].count == 1);
+    REQUIRE(points[3].data == p.reads[1].data + 3);
+    REQUIRE(points[4].data == p.reads[1].data + 3);
+}
+
+TEST_CASE("Scan planner: invalid points and small buffers") {
+    Plan p;
+    std::vector<BUS_SCAN_POINT> points = { point(1, 0, 0) };
+    REQUIRE(plan(points, costs(10, 1), p) == -1);
+    points = { point(1, 0, 6) };
+    REQUIRE(plan(points, costs(10, 1), p) == -1);
+    points = { point(1, 0xffff, 2) };
+    REQUIRE(plan(points, costs(10, 1), p) == -1);
+
+    points = { point(1, 0, 1), point(1, 10, 1) };
+    BUS_MS_REQUEST reads[2];
+    uint16_t data[2];
+    BUS_SCAN_COSTS c = costs(1, 1);
+    REQUIRE(bus_scan_plan(points.data(), 2, &c, reads, 1, data, 2) == -1);
+    REQUIRE(bus_scan_plan(points.data(), 2, &c, reads, 2, data, 1) == -1);
+    REQUIRE(bus_scan_plan(points.data(), 2, &c, reads, 2, data, 2) == 2);
+    REQUIRE(bus_scan_plan(points.data(), 0, &c, reads, 2, data, 2) == 0);
+}
+
+// Cost of the cheapest partition of the sorted points in consecutive reads, by enumeration
+static uint32_t bruteForce(const std::vector<BUS_SCAN_POINT>& points, const BUS_SCAN_COSTS& costs) {
+    uint32_t best = UINT32_MAX;
+    size_t n = points.size();
+    for (uint32_t cuts = 0; cuts < (1u << (n - 1)); cuts++) {
+        uint32_t cost = 0;
+        size_t first = 0;
+        bool valid = true;
+        for (size_t i = 0; i < n && valid; i++) {
+            if (i < n - 1 && !(cuts & (1 << i)) && points[i + 1].station == points[i].station) {
+                continue;
+            }
+            uint32_t end = 0;
+            for (size_t j = first; j <= i; j++) {
+                if (j > first && points[j].address > end && points[j].address - end > costs.maxGap) {
+                    valid = false;
+                }
+                end = std::max(end, (uint32_t)points[j].address + points[j].count);
+            }
+            uint32_t span = end - points[first].address;
+            valid = valid && span <= costs.maxRegisters;
+            cost += costs.transactionCost + span * costs.registerCost;
+            first = i + 1;
+        }
+        if (valid) {
+            best = std::min(best, cost);
+        }
+    }
+    return best;
+}
+
+TEST_CASE("Scan planner: optimal plans of random maps") {
+    srand(1);
+    for (int run = 0; run < 200; run++) {
+        std::vector<BUS_SCAN_POINT> points;
+        int n = rand() % 10 + 1;
+        for (int i = 0; i < n; i++) {
+            points.push_back(point((uint8_t)(rand() % 2 + 1), (uint16_t)(rand() % 24), (uint8_t)(rand() % 2 + 1)));
+        }
+        BUS_SCAN_COSTS c = costs(rand() % 8 + 1, rand() % 2 + 1, 5, rand() % 2 ? 0xffff : (uint16_t)(rand() % 3));
+        Plan p;
+        int count = plan(points, c, p);
+        REQUIRE(count > 0);
+        // Sorted by the planner
+        REQUIRE(bus_scan_cost(&c, p.reads.data(), (uint16_t)count) == bruteForce(points, c));
+        for (auto& pt : points) {
+            const BUS_MS_REQUEST& read = p.reads[pt.read];
+            REQUIRE(read.station == pt.station);
+            REQUIRE(pt.address >= read.address);
+            REQUIRE(pt.address + pt.count <= read.address + read.count);
+            REQUIRE(pt.data == read.data + (pt.address - read.address));
+        }
+    }
+}
+
+static int s_completed;
+
+static void onComplete(MODBUS_CONTEXT* ctx, const BUS_MS_REQUEST* request, uint8_t result) {
+    CTX_UNUSED;
+    (void)request;
+    REQUIRE(result == NO_ERROR);
+    s_completed++;
+}
+
+TEST_CASE("Scan planner: the schedule is executed by the master") {
+    simInit(2);
+    simPoll(TICKS_PER_CHAR * 10);
+
+    // The registers of the simulated nodes are station * 0x100 + address
+    std::vector<BUS_SCAN_POINT> points = { point(2, 6, 2), point(1, 0, 1), point(1, 3, 2), point(2, 0, 1), point(1, 7, 1) };
+    BUS_SCAN_COSTS c;
+    bus_scan_rtuCosts(&c, TICKS_PER_SECOND / 500);
+    Plan p;
+    int count = plan(points, c, p);
+    REQUIRE(count > 0);
+    REQUIRE(count < (int)points.size());
+
+    s_completed = 0;
+    for (auto& read : p.reads) {
+        read.onComplete = onComplete;
+        REQUIRE(bus_ms_enqueue(&simMaster->ctx, &read));
+    }
+    for (int i = 0; i < 1000 && s_completed < count; i++) {
+        simPoll(TICKS_PER_CHAR);
+    }
+    REQUIRE(s_completed == count);
+    for (auto& pt : points) {
+        for (uint8_t i = 0; i < pt.count; i++) {
+            REQUIRE(pt.data[i] == pt.station * 0x100 + pt.address + i);
+        }
+    }
+}
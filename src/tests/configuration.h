@@ -19,6 +19,31 @@ typedef struct {
 #define RS485_BUF_SIZE (16)
 #define STATION_NODE (2)
 
+// Stage write requests and commit them after the CRC is validated
+#define BUS_CL_STAGED_WRITE
+// Replay the response of write requests retried in less than 0.1 seconds
+#define BUS_CL_WRITE_REPLAY_TIMEOUT (TICKS_PER_SECOND / 10)
+// Writes can be committed after the response
+#define BUS_CL_DEFERRED_COMMIT
+// Cache up to 2 read responses
+#define BUS_CL_READ_CACHE_SIZE (2)
+// Track changes of 3 register ranges
+#define BUS_CL_CHANGE_RANGES (3)
+// Read up to 4 ranges with a single request
+#define BUS_CL_MULTIPLE_RANGES_MAX (4)
+// Read data can be deferred
+#define BUS_CL_ASYNC_SEND
+// Custom function code 100, see `testSumFunction`
+#define BUS_CL_CUSTOM_FUNCTIONS(F) F(100, testSumFunction)
+// Serve 1 register range from an image
+#define BUS_CL_IMAGES (1)
+// Broadcast snapshot trigger
+#define BUS_CL_SNAPSHOT
+// Response times of 16 nodes on the master (the fixed timeout in the benchmark to compare with)
+#ifndef SIM_FIXED_TIMEOUT
+#define BUS_MS_ADAPTIVE_TIMEOUT (16)
+#endif
+
 typedef const char* EXC_STRING_T;
 
 #ifdef __cplusplus
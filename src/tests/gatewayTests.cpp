@@ -0,0 +1,425 @@
+#include <catch2/catch.hpp>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "ptyNode.h"
+#include "pic-modbus/linux/gateway.h"
+
+// The Modbus TCP to RTU gateway on localhost, with nodes of the client stack on pseudo-terminal pairs
+
+// Unit of the first port (default route), and of the second one
+#define UNIT_A (3)
+#define UNIT_B (4)
+// Routed to the first port, but no node answers
+#define UNIT_MISSING (7)
+// Not routed
+#define UNIT_NO_ROUTE (9)
+
+struct Gateway {
+    GATEWAY gateway;
+    std::vector<PtyNode*> nodes;
+    std::thread thread;
+    std::atomic<bool> running;
+};
+
+static void runGateway(Gateway* gateway);
+
+// `configure` is called before the gateway thread is started. Not started if `run` is false, see `runGateway`.
+static Gateway* startGateway(std::function<void(GATEWAY*)> configure = nullptr, bool run = true) {
+    timers_init();
+    Gateway* ret = new Gateway();
+    REQUIRE(gateway_init(&ret->gateway, 0));
+    const uint8_t units[] = { UNIT_A, UNIT_B };
+    for (uint8_t unit : units) {
+        PtyNode* node = ptyNode_start(unit);
+        REQUIRE(node);
+        ret->nodes.push_back(node);
+        int port = gateway_attachPort(&ret->gateway, node->masterFd);
+        REQUIRE(port >= 0);
+        gateway_route(&ret->gateway, unit, (uint8_t)port);
+    }
+    gateway_route(&ret->gateway, UNIT_NO_ROUTE, GATEWAY_NO_ROUTE);
+    if (configure) {
+        configure(&ret->gateway);
+    }
+    if (run) {
+        runGateway(ret);
+    }
+    return ret;
+}
+
+static void runGateway(Gateway* gateway) {
+    gateway->running.store(true);
+    gateway->thread = std::thread([gateway] {
+        while (gateway->running.load()) {
+            // Not in the thread of the tests
+            if (!modbus_loop_wait(&gateway->gateway.loop, TICKS_PER_SECOND / 10)) {
+                abort();
+            }
+        }
+    });
+}
+
+static void stopGateway(Gateway* gateway) {
+    gateway->running.store(false);
+    modbus_loop_wake(&gateway->gateway.loop);
+    gateway->thread.join();
+    for (auto node : gateway->nodes) {
+        ptyNode_stop(node);
+    }
+    gateway_close(&gateway->gateway);
+    delete gateway;
+}
+
+static int connectClient(Gateway* gateway) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    REQUIRE(fd >= 0);
+    struct sockaddr_in address = { };
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(gateway->gateway.tcpPort);
+    REQUIRE(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+    return fd;
+}
+
+// MBAP frame, with unit and PDU
+static std::vector<uint8_t> mbap(uint16_t transactionId, uint8_t unit, const std::vector<uint8_t>& pdu) {
+    std::vector<uint8_t> frame = { (uint8_t)(transactionId >> 8), (uint8_t)transactionId, 0, 0, 0, (uint8_t)(pdu.size() + 1), unit };
+    frame.insert(frame.end(), pdu.begin(), pdu.end());
+    return frame;
+}
+
+static void sendFrame(int fd, const std::vector<uint8_t>& frame) {
+    REQUIRE(send(fd, frame.data(), frame.size(), 0) == (ssize_t)frame.size());
+}
+
+// Read a whole MBAP frame, or an empty one after 2 seconds
+static std::vector<uint8_t> receiveFrame(int fd) {
+    std::vector<uint8_t> frame;
+    size_t size = GATEWAY_MBAP_SIZE;
+    while (frame.size() < size) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 2000) <= 0) {
+            return { };
+        }
+        uint8_t buffer[GATEWAY_FRAME_SIZE];
+        ssize_t count = recv(fd, buffer, size - frame.size(), 0);
+        if (count <= 0) {
+            return { };
+        }
+        frame.insert(frame.end(), buffer, buffer + count);
+        if (frame.size() >= 6) {
+            size = 6 + ((frame[4] << 8) | frame[5]);
+        }
+    }
+    return frame;
+}
+
+static std::vector<uint8_t> transact(int fd, uint16_t transactionId, uint8_t unit, const std::vector<uint8_t>& pdu) {
+    sendFrame(fd, mbap(transactionId, unit, pdu));
+    return receiveFrame(fd);
+}
+
+TEST_CASE("Gateway: read and write registers of the units on two ports") {
+    Gateway* gateway = startGateway();
+    int fd = connectClient(gateway);
+
+    REQUIRE(transact(fd, 0x1234, UNIT_A, { READ_HOLDING_REGISTERS, 0, 2, 0, 2 }) == mbap(0x1234, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, 2, UNIT_A, 3 }));
+    REQUIRE(transact(fd, 2, UNIT_B, { WRITE_HOLDING_REGISTERS, 0, 5, 0, 2, 4, 0xaa, 0xbb, 0xcc, 0xdd }) == mbap(2, UNIT_B, { WRITE_HOLDING_REGISTERS, 0, 5, 0, 2 }));
+    REQUIRE(transact(fd, 3, UNIT_B, { READ_HOLDING_REGISTERS, 0, 4, 0, 3 }) == mbap(3, UNIT_B, { READ_HOLDING_REGISTERS, 6, UNIT_B, 4, 0xaa, 0xbb, 0xcc, 0xdd }));
+    REQUIRE(gateway->nodes[1]->regs[5] == 0xaabb);
+
+    // Whole RTU frames: the largest read, and the largest write of the protocol
+    std::vector<uint8_t> response = { READ_HOLDING_REGISTERS, GATEWAY_MAX_REGISTERS * 2 };
+    for (uint8_t i = 0; i < GATEWAY_MAX_REGISTERS; i++) {
+        response.insert(response.end(), { UNIT_A, i });
+    }
+    REQUIRE(GATEWAY_MAX_REGISTERS == 125);
+    REQUIRE(transact(fd, 4, UNIT_A, { READ_HOLDING_REGISTERS, 0, 0, 0, GATEWAY_MAX_REGISTERS }) == mbap(4, UNIT_A, response));
+    std::vector<uint8_t> request = { WRITE_HOLDING_REGISTERS, 0, 0, 0, 123, 246 };
+    for (uint8_t i = 0; i < 123; i++) {
+        request.insert(request.end(), { 0x55, i });
+    }
+    REQUIRE(transact(fd, 5, UNIT_B, request) == mbap(5, UNIT_B, { WRITE_HOLDING_REGISTERS, 0, 0, 0, 123 }));
+    REQUIRE(gateway->nodes[1]->regs[122] == 0x557a);
+
+    close(fd);
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: exceptions") {
+    Gateway* gateway = startGateway();
+    int fd = connectClient(gateway);
+
+    // Of the node
+    REQUIRE(transact(fd, 1, UNIT_A, { READ_HOLDING_REGISTERS, 0, PTY_NODE_REGS_COUNT, 0, 1 }) == mbap(1, UNIT_A, { 0x80 | READ_HOLDING_REGISTERS, ERR_INVALID_ADDRESS }));
+    // Of the gateway
+    REQUIRE(transact(fd, 2, UNIT_A, { 4, 0, 0, 0, 1 }) == mbap(2, UNIT_A, { 0x84, ERR_INVALID_FUNCTION }));
+    REQUIRE(transact(fd, 3, UNIT_A, { READ_HOLDING_REGISTERS, 0, 0, 0, 0 }) == mbap(3, UNIT_A, { 0x80 | READ_HOLDING_REGISTERS, ERR_INVALID_SIZE }));
+    REQUIRE(transact(fd, 4, UNIT_A, { READ_HOLDING_REGISTERS, 0, 0, 0, GATEWAY_MAX_REGISTERS + 1 }) == mbap(4, UNIT_A, { 0x80 | READ_HOLDING_REGISTERS, ERR_INVALID_SIZE }));
+    REQUIRE(transact(fd, 5, UNIT_A, { WRITE_HOLDING_REGISTERS, 0, 0, 0, 2, 2, 0, 0 }) == mbap(5, UNIT_A, { 0x80 | WRITE_HOLDING_REGISTERS, ERR_INVALID_SIZE }));
+    REQUIRE(transact(fd, 6, UNIT_NO_ROUTE, { READ_HOLDING_REGISTERS, 0, 0, 0, 1 }) == mbap(6, UNIT_NO_ROUTE, { 0x80 | READ_HOLDING_REGISTERS, GATEWAY_ERR_PATH_UNAVAILABLE }));
+    REQUIRE(transact(fd, 7, UNIT_MISSING, { READ_HOLDING_REGISTERS, 0, 0, 0, 1 }) == mbap(7, UNIT_MISSING, { 0x80 | READ_HOLDING_REGISTERS, GATEWAY_ERR_TARGET_FAILED }));
+
+    // The connection is still usable
+    REQUIRE(transact(fd, 8, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 1 }) == mbap(8, UNIT_A, { READ_HOLDING_REGISTERS, 2, UNIT_A, 1 }));
+
+    // Not Modbus: closed
+    sendFrame(fd, { 0, 1, 0x12, 0x34, 0, 6, UNIT_A, READ_HOLDING_REGISTERS, 0, 0, 0, 1 });
+    REQUIRE(receiveFrame(fd).empty());
+
+    close(fd);
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: the clients take turns") {
+    Gateway* gateway = startGateway();
+    int greedy = connectClient(gateway);
+    int other = connectClient(gateway);
+
+    // Pipelined requests, in a single segment. Not adjacent, not to be coalesced.
+    std::vector<uint8_t> batch;
+    for (uint16_t i = 0; i < GATEWAY_CLIENT_PENDING; i++) {
+        std::vector<uint8_t> frame = mbap(i, UNIT_A, { READ_HOLDING_REGISTERS, 0, (uint8_t)(i * 3), 0, 1 });
+        batch.insert(batch.end(), frame.begin(), frame.end());
+    }
+    sendFrame(greedy, batch);
+    usleep(2000);
+    REQUIRE(transact(other, 100, UNIT_A, { READ_HOLDING_REGISTERS, 0, 31, 0, 1 }) == mbap(100, UNIT_A, { READ_HOLDING_REGISTERS, 2, UNIT_A, 31 }));
+
+    // Served after the first request of the greedy client, and not after all of them
+    int available = 0;
+    REQUIRE(ioctl(greedy, FIONREAD, &available) == 0);
+    const int responseSize = GATEWAY_MBAP_SIZE + 4;
+    REQUIRE(available / responseSize <= 2);
+    for (uint16_t i = 0; i < GATEWAY_CLIENT_PENDING; i++) {
+        REQUIRE(receiveFrame(greedy) == mbap(i, UNIT_A, { READ_HOLDING_REGISTERS, 2, UNIT_A, (uint8_t)(i * 3) }));
+    }
+    REQUIRE(gateway->gateway.transactions == GATEWAY_CLIENT_PENDING + 1);
+
+    close(greedy);
+    close(other);
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: more pipelined requests than the pending ones of a client") {
+    Gateway* gateway = startGateway();
+    int fd = connectClient(gateway);
+
+    // In a single segment, also larger than the receive buffer
+    const uint16_t count = 3 * GATEWAY_CLIENT_PENDING;
+    std::vector<uint8_t> batch;
+    for (uint16_t i = 0; i < count; i++) {
+        std::vector<uint8_t> frame = mbap(i, UNIT_A, { READ_HOLDING_REGISTERS, 0, (uint8_t)(i % PTY_NODE_REGS_COUNT), 0, 1 });
+        batch.insert(batch.end(), frame.begin(), frame.end());
+    }
+    REQUIRE(batch.size() > GATEWAY_FRAME_SIZE);
+    sendFrame(fd, batch);
+    for (uint16_t i = 0; i < count; i++) {
+        REQUIRE(receiveFrame(fd) == mbap(i, UNIT_A, { READ_HOLDING_REGISTERS, 2, UNIT_A, (uint8_t)(i % PTY_NODE_REGS_COUNT) }));
+    }
+    REQUIRE(gateway->gateway.requests == count);
+
+    close(fd);
+    stopGateway(gateway);
+}
+
+// The requests are sent before the gateway is run (see `startGateway`): the clients are accepted in the order
+// of connection, and then all their requests are handled in the same iteration of the loop, in the same order.
+// The first one keeps the first port busy for the retries of a unit that doesn't answer, and the next ones
+// queue up, regardless of the timing.
+static void keepBusy(int fd) {
+    sendFrame(fd, mbap(1, UNIT_MISSING, { READ_HOLDING_REGISTERS, 0, 0, 0, 1 }));
+}
+
+static void queueRequest(int fd, uint16_t transactionId, const std::vector<uint8_t>& pdu) {
+    sendFrame(fd, mbap(transactionId, UNIT_A, pdu));
+}
+
+TEST_CASE("Gateway: overlapping and adjacent reads are coalesced") {
+    Gateway* gateway = startGateway(nullptr, false);
+    std::vector<int> fds;
+    for (int i = 0; i < 5; i++) {
+        fds.push_back(connectClient(gateway));
+    }
+
+    keepBusy(fds[0]);
+    queueRequest(fds[1], 10, { READ_HOLDING_REGISTERS, 0, 0, 0, 4 });
+    // Adjacent
+    queueRequest(fds[2], 20, { READ_HOLDING_REGISTERS, 0, 4, 0, 4 });
+    // Not adjacent
+    queueRequest(fds[2], 21, { READ_HOLDING_REGISTERS, 0, 20, 0, 2 });
+    queueRequest(fds[3], 30, { WRITE_HOLDING_REGISTERS, 0, 4, 0, 1, 2, 0xbe, 0xef });
+    // Overlapping, but after the write
+    queueRequest(fds[4], 40, { READ_HOLDING_REGISTERS, 0, 2, 0, 4 });
+
+    runGateway(gateway);
+
+    REQUIRE(receiveFrame(fds[0]) == mbap(1, UNIT_MISSING, { 0x80 | READ_HOLDING_REGISTERS, GATEWAY_ERR_TARGET_FAILED }));
+    REQUIRE(receiveFrame(fds[1]) == mbap(10, UNIT_A, { READ_HOLDING_REGISTERS, 8, UNIT_A, 0, UNIT_A, 1, UNIT_A, 2, UNIT_A, 3 }));
+    REQUIRE(receiveFrame(fds[2]) == mbap(20, UNIT_A, { READ_HOLDING_REGISTERS, 8, UNIT_A, 4, UNIT_A, 5, UNIT_A, 6, UNIT_A, 7 }));
+    REQUIRE(receiveFrame(fds[2]) == mbap(21, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, 20, UNIT_A, 21 }));
+    REQUIRE(receiveFrame(fds[3]) == mbap(30, UNIT_A, { WRITE_HOLDING_REGISTERS, 0, 4, 0, 1 }));
+    REQUIRE(receiveFrame(fds[4]) == mbap(40, UNIT_A, { READ_HOLDING_REGISTERS, 8, UNIT_A, 2, UNIT_A, 3, 0xbe, 0xef, UNIT_A, 5 }));
+
+    // The unit that doesn't answer, the two reads coalesced, the other read, the write and the last read
+    REQUIRE(gateway->gateway.transactions == 5);
+    REQUIRE(gateway->gateway.coalesced == 1);
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: the reads are not coalesced before the older requests of the same client") {
+    Gateway* gateway = startGateway(nullptr, false);
+    std::vector<int> fds;
+    for (int i = 0; i < 3; i++) {
+        fds.push_back(connectClient(gateway));
+    }
+
+    keepBusy(fds[0]);
+    queueRequest(fds[1], 10, { READ_HOLDING_REGISTERS, 0, 0, 0, 4 });
+    queueRequest(fds[2], 20, { READ_HOLDING_REGISTERS, 0, 20, 0, 2 });
+    // Adjacent to the first read, but after the read of the same client
+    queueRequest(fds[2], 21, { READ_HOLDING_REGISTERS, 0, 4, 0, 4 });
+
+    runGateway(gateway);
+
+    REQUIRE(receiveFrame(fds[0]) == mbap(1, UNIT_MISSING, { 0x80 | READ_HOLDING_REGISTERS, GATEWAY_ERR_TARGET_FAILED }));
+    REQUIRE(receiveFrame(fds[1]) == mbap(10, UNIT_A, { READ_HOLDING_REGISTERS, 8, UNIT_A, 0, UNIT_A, 1, UNIT_A, 2, UNIT_A, 3 }));
+    REQUIRE(receiveFrame(fds[2]) == mbap(20, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, 20, UNIT_A, 21 }));
+    REQUIRE(receiveFrame(fds[2]) == mbap(21, UNIT_A, { READ_HOLDING_REGISTERS, 8, UNIT_A, 4, UNIT_A, 5, UNIT_A, 6, UNIT_A, 7 }));
+    REQUIRE(gateway->gateway.transactions == 4);
+    REQUIRE(gateway->gateway.coalesced == 0);
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: exception of coalesced reads") {
+    Gateway* gateway = startGateway(nullptr, false);
+    std::vector<int> fds;
+    for (int i = 0; i < 3; i++) {
+        fds.push_back(connectClient(gateway));
+    }
+
+    keepBusy(fds[0]);
+    queueRequest(fds[1], 10, { READ_HOLDING_REGISTERS, 0, PTY_NODE_REGS_COUNT - 2, 0, 2 });
+    // Past the last register
+    queueRequest(fds[2], 20, { READ_HOLDING_REGISTERS, 0, PTY_NODE_REGS_COUNT - 1, 0, 2 });
+
+    runGateway(gateway);
+
+    REQUIRE(receiveFrame(fds[0]) == mbap(1, UNIT_MISSING, { 0x80 | READ_HOLDING_REGISTERS, GATEWAY_ERR_TARGET_FAILED }));
+    // Retried one by one
+    REQUIRE(receiveFrame(fds[1]) == mbap(10, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, PTY_NODE_REGS_COUNT - 2, UNIT_A, PTY_NODE_REGS_COUNT - 1 }));
+    REQUIRE(receiveFrame(fds[2]) == mbap(20, UNIT_A, { 0x80 | READ_HOLDING_REGISTERS, ERR_INVALID_ADDRESS }));
+    REQUIRE(gateway->gateway.transactions == 4);
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: cached reads") {
+    Gateway* gateway = startGateway([](GATEWAY* g) {
+        // Excluded
+        REQUIRE(gateway_cacheRange(g, UNIT_A, 8, 2, 0));
+        REQUIRE(gateway_cacheRange(g, UNIT_A, 0, 16, 300));
+    });
+    int fd = connectClient(gateway);
+
+    REQUIRE(transact(fd, 1, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 2 }) == mbap(1, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, 1, UNIT_A, 2 }));
+    REQUIRE(gateway->gateway.transactions == 1);
+
+    // Changed behind the gateway: still the cached registers, also of a part of the range
+    gateway->nodes[0]->regs[1] = 0x1111;
+    REQUIRE(transact(fd, 2, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 2 }) == mbap(2, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, 1, UNIT_A, 2 }));
+    REQUIRE(transact(fd, 3, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 1 }) == mbap(3, UNIT_A, { READ_HOLDING_REGISTERS, 2, UNIT_A, 1 }));
+    REQUIRE(gateway->gateway.transactions == 1);
+    REQUIRE(gateway->gateway.cacheHits == 2);
+
+    // Excluded, and out of the ranges
+    for (int i = 0; i < 2; i++) {
+        REQUIRE(transact(fd, 4, UNIT_A, { READ_HOLDING_REGISTERS, 0, 8, 0, 1 }) == mbap(4, UNIT_A, { READ_HOLDING_REGISTERS, 2, UNIT_A, 8 }));
+        REQUIRE(transact(fd, 5, UNIT_A, { READ_HOLDING_REGISTERS, 0, 15, 0, 2 }) == mbap(5, UNIT_A, { READ_HOLDING_REGISTERS, 4, UNIT_A, 15, UNIT_A, 16 }));
+        REQUIRE(transact(fd, 6, UNIT_B, { READ_HOLDING_REGISTERS, 0, 1, 0, 1 }) == mbap(6, UNIT_B, { READ_HOLDING_REGISTERS, 2, UNIT_B, 1 }));
+    }
+    REQUIRE(gateway->gateway.transactions == 7);
+    REQUIRE(gateway->gateway.cacheHits == 2);
+
+    // Expired
+    usleep(350000);
+    REQUIRE(transact(fd, 7, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 2 }) == mbap(7, UNIT_A, { READ_HOLDING_REGISTERS, 4, 0x11, 0x11, UNIT_A, 2 }));
+    REQUIRE(gateway->gateway.transactions == 8);
+
+    // Invalidated by the writes
+    REQUIRE(transact(fd, 8, UNIT_A, { WRITE_HOLDING_REGISTERS, 0, 2, 0, 1, 2, 0xab, 0xcd }) == mbap(8, UNIT_A, { WRITE_HOLDING_REGISTERS, 0, 2, 0, 1 }));
+    REQUIRE(transact(fd, 9, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 2 }) == mbap(9, UNIT_A, { READ_HOLDING_REGISTERS, 4, 0x11, 0x11, 0xab, 0xcd }));
+    REQUIRE(gateway->gateway.transactions == 10);
+    REQUIRE(transact(fd, 10, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 2 }) == mbap(10, UNIT_A, { READ_HOLDING_REGISTERS, 4, 0x11, 0x11, 0xab, 0xcd }));
+    REQUIRE(gateway->gateway.transactions == 10);
+    REQUIRE(gateway->gateway.cacheHits == 3);
+
+    // Spanning the excluded registers, or past the range: never cached
+    std::vector<uint8_t> response = { READ_HOLDING_REGISTERS, 12 };
+    for (uint8_t i = 6; i < 12; i++) {
+        response.insert(response.end(), { UNIT_A, i });
+    }
+    for (int i = 0; i < 2; i++) {
+        REQUIRE(transact(fd, 11, UNIT_A, { READ_HOLDING_REGISTERS, 0, 6, 0, 6 }) == mbap(11, UNIT_A, response));
+        REQUIRE(transact(fd, 12, UNIT_A, { READ_HOLDING_REGISTERS, 0, 14, 0, 4 }) == mbap(12, UNIT_A, { READ_HOLDING_REGISTERS, 8, UNIT_A, 14, UNIT_A, 15, UNIT_A, 16, UNIT_A, 17 }));
+    }
+    REQUIRE(gateway->gateway.transactions == 14);
+    REQUIRE(gateway->gateway.cacheHits == 3);
+
+    close(fd);
+    stopGateway(gateway);
+}
+
+TEST_CASE("Gateway: registers published to the image") {
+    char path[] = "/tmp/gatewayImageXXXXXX";
+    close(mkstemp(path));
+    REGISTER_IMAGE image, reader;
+    REQUIRE(register_image_create(&image, path));
+    REQUIRE(register_image_open(&reader, path));
+    Gateway* gateway = startGateway([&](GATEWAY* g) {
+        g->image = &image;
+    });
+    int fd = connectClient(gateway);
+
+    uint16_t data[3];
+    REQUIRE_FALSE(register_image_read(&reader, UNIT_A, 1, 3, data, nullptr));
+    REQUIRE(transact(fd, 1, UNIT_A, { READ_HOLDING_REGISTERS, 0, 1, 0, 3 }) == mbap(1, UNIT_A, { READ_HOLDING_REGISTERS, 6, UNIT_A, 1, UNIT_A, 2, UNIT_A, 3 }));
+    REQUIRE(register_image_read(&reader, UNIT_A, 1, 3, data, nullptr));
+    REQUIRE(data[0] == UNIT_A * 0x100 + 1);
+    REQUIRE(data[2] == UNIT_A * 0x100 + 3);
+
+    // Written, unknown until read again
+    REQUIRE(transact(fd, 2, UNIT_A, { WRITE_HOLDING_REGISTERS, 0, 2, 0, 1, 2, 0xab, 0xcd }) == mbap(2, UNIT_A, { WRITE_HOLDING_REGISTERS, 0, 2, 0, 1 }));
+    REQUIRE_FALSE(register_image_read(&reader, UNIT_A, 1, 3, data, nullptr));
+    REQUIRE(register_image_read(&reader, UNIT_A, 3, 1, data, nullptr));
+    REQUIRE(transact(fd, 3, UNIT_A, { READ_HOLDING_REGISTERS, 0, 2, 0, 1 }) == mbap(3, UNIT_A, { READ_HOLDING_REGISTERS, 2, 0xab, 0xcd }));
+    REQUIRE(register_image_read(&reader, UNIT_A, 1, 3, data, nullptr));
+    REQUIRE(data[1] == 0xabcd);
+
+    close(fd);
+    stopGateway(gateway);
+    register_image_close(&reader);
+    register_image_close(&image);
+    unlink(path);
+}
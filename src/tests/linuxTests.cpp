@@ -0,0 +1,281 @@
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/linux/loop.h"
+
+// End-to-end tests of the Linux backend: the node runs on the slave side of a pseudo-terminal pair, 
+// and the test acts as the master on the other side
+
+#define STATION (5)
+#define REGS_COUNT (4)
+
+struct Node {
+    MODBUS_CONTEXT ctx;
+    int masterFd;
+    uint16_t regs[REGS_COUNT];
+};
+
+static Node* nodeOf(MODBUS_CONTEXT* ctx) {
+    return (Node*)ctx->user;
+}
+
+extern uint16_t calcCrc16(uint16_t prevCrc, const uint8_t* buffer, int wLength);
+
+extern "C" {
+    _Bool regs_validateReg(MODBUS_CONTEXT* ctx) {
+        if (be16toh(bus_cl_header.address.registerAddressBe) + be16toh(bus_cl_header.address.countBe) > REGS_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_ADDRESS;
+            return false;
+        }
+        return true;
+    }
+
+    _Bool regs_onReceive(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            nodeOf(ctx)->regs[address + i] = (rs485_buffer[i * 2] << 8) | rs485_buffer[i * 2 + 1];
+        }
+        return true;
+    }
+
+    void regs_onSend(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            rs485_buffer[i * 2] = (uint8_t)(nodeOf(ctx)->regs[address + i] >> 8);
+            rs485_buffer[i * 2 + 1] = (uint8_t)nodeOf(ctx)->regs[address + i];
+        }
+    }
+}
+
+// Open a pseudo-terminal pair, and start the node on the slave side
+static void openNode(Node& node) {
+    memset(&node, 0, sizeof(Node));
+    node.ctx.user = &node;
+    node.ctx.bus_cl.station = STATION;
+
+    node.masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    REQUIRE(node.masterFd >= 0);
+    REQUIRE(grantpt(node.masterFd) == 0);
+    REQUIRE(unlockpt(node.masterFd) == 0);
+    REQUIRE(fcntl(node.masterFd, F_SETFL, O_NONBLOCK) == 0);
+    REQUIRE(uart_open(&node.ctx, ptsname(node.masterFd)));
+
+    timers_init();
+    modbus_init(&node.ctx);
+}
+
+static void closeNode(Node& node) {
+    uart_close(&node.ctx);
+    close(node.masterFd);
+}
+
+static std::vector<uint8_t> withCrc(const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> ret(data);
+    uint16_t crc = calcCrc16(0xffff, data.data(), data.size());
+    ret.push_back((uint8_t)crc);
+    ret.push_back((uint8_t)(crc >> 8));
+    return ret;
+}
+
+// Busy polling, or the event-driven loop
+static void pollNode(Node& node, MODBUS_LOOP* loop) {
+    if (loop) {
+        REQUIRE(modbus_loop_wait(loop, TICKS_PER_SECOND / 10));
+    } else {
+        modbus_poll(&node.ctx);
+        usleep(50);
+    }
+}
+
+// The master sends a frame, and then polls the node until `responseSize` bytes are received, or a timeout
+static std::vector<uint8_t> sendFrame(Node& node, const std::vector<uint8_t>& data, size_t responseSize, MODBUS_LOOP* loop = nullptr) {
+    std::vector<uint8_t> frame = withCrc(data);
+    REQUIRE(write(node.masterFd, frame.data(), frame.size()) == (ssize_t)frame.size());
+
+    std::vector<uint8_t> response;
+    TICK_TYPE start = timers_get();
+    while (response.size() < responseSize && (TICK_TYPE)(timers_get() - start) < TICKS_PER_SECOND) {
+        pollNode(node, loop);
+        uint8_t buffer[RS485_BUF_SIZE];
+        ssize_t count = read(node.masterFd, buffer, sizeof(buffer));
+        if (count > 0) {
+            response.insert(response.end(), buffer, buffer + count);
+        }
+    }
+    // Let the node release the line before the next request
+    start = timers_get();
+    while (node.ctx.rs485.state != RS485_LINE_RX && (TICK_TYPE)(timers_get() - start) < TICKS_PER_SECOND) {
+        pollNode(node, loop);
+    }
+    return response;
+}
+
+TEST_CASE("Linux: read and write registers over a pseudo-terminal") {
+    Node node;
+    openNode(node);
+    node.regs[1] = 0x1234;
+    node.regs[2] = 0x5678;
+
+    REQUIRE(sendFrame(node, { STATION, READ_HOLDING_REGISTERS, 0, 1, 0, 2 }, 9) == withCrc({ STATION, READ_HOLDING_REGISTERS, 4, 0x12, 0x34, 0x56, 0x78 }));
+
+    REQUIRE(sendFrame(node, { STATION, WRITE_HOLDING_REGISTERS, 0, 2, 0, 2, 4, 0xaa, 0xbb, 0xcc, 0xdd }, 8) == withCrc({ STATION, WRITE_HOLDING_REGISTERS, 0, 2, 0, 2 }));
+    REQUIRE(node.regs[2] == 0xaabb);
+    REQUIRE(node.regs[3] == 0xccdd);
+
+    REQUIRE(sendFrame(node, { STATION, READ_HOLDING_REGISTERS, 0, 3, 0, 1 }, 7) == withCrc({ STATION, READ_HOLDING_REGISTERS, 2, 0xcc, 0xdd }));
+
+    closeNode(node);
+}
+
+TEST_CASE("Linux: errors and other stations over a pseudo-terminal") {
+    Node node;
+    openNode(node);
+
+    REQUIRE(sendFrame(node, { STATION, READ_HOLDING_REGISTERS, 0, 3, 0, 2 }, 5) == withCrc({ STATION, 0x80 | READ_HOLDING_REGISTERS, ERR_INVALID_ADDRESS }));
+    // Not answered
+    REQUIRE(sendFrame(node, { STATION + 1, READ_HOLDING_REGISTERS, 0, 0, 0, 1 }, 1) == std::vector<uint8_t>({ }));
+    REQUIRE(node.ctx.bus_cl.crcErrors == 0);
+
+    closeNode(node);
+}
+
+TEST_CASE("Linux: idle nodes don't wake up the event loop") {
+    Node node;
+    openNode(node);
+    MODBUS_LOOP loop;
+    REQUIRE(modbus_loop_init(&loop));
+    REQUIRE(modbus_loop_add(&loop, &node.ctx));
+
+    TICK_TYPE start = timers_get();
+    for (int i = 0; i < 3; i++) {
+        REQUIRE(modbus_loop_wait(&loop, TICKS_PER_SECOND / 20));
+    }
+    // Only the max wait time
+    REQUIRE(loop.wakeups == 3);
+    REQUIRE((TICK_TYPE)(timers_get() - start) >= TICKS_PER_SECOND / 20 * 3);
+
+    modbus_loop_close(&loop);
+    closeNode(node);
+}
+
+TEST_CASE("Linux: the event loop serves requests") {
+    Node node;
+    openNode(node);
+    MODBUS_LOOP loop;
+    REQUIRE(modbus_loop_init(&loop));
+    REQUIRE(modbus_loop_add(&loop, &node.ctx));
+    node.regs[0] = 0x1234;
+
+    REQUIRE(sendFrame(node, { STATION, READ_HOLDING_REGISTERS, 0, 0, 0, 1 }, 7, &loop) == withCrc({ STATION, READ_HOLDING_REGISTERS, 2, 0x12, 0x34 }));
+    REQUIRE(sendFrame(node, { STATION, WRITE_HOLDING_REGISTERS, 0, 1, 0, 1, 2, 0xaa, 0xbb }, 8, &loop) == withCrc({ STATION, WRITE_HOLDING_REGISTERS, 0, 1, 0, 1 }));
+    REQUIRE(node.regs[1] == 0xaabb);
+    // Woken up by the data and by the line transitions only
+    REQUIRE(loop.wakeups < 40);
+
+    modbus_loop_close(&loop);
+    closeNode(node);
+}
+
+TEST_CASE("Linux: bytes not accepted by the driver are written later") {
+    MODBUS_CONTEXT ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    REQUIRE(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+    uart_attach(&ctx, fds[1]);
+
+    // Fill the driver buffer
+    uint8_t filler[256] = { 0 };
+    size_t filled = 0;
+    ssize_t count;
+    while ((count = write(fds[1], filler, sizeof(filler))) > 0) {
+        filled += count;
+    }
+
+    uart_write(&ctx, 0x55);
+    uart_flush(&ctx);
+    REQUIRE(ctx.uart.port.txPending);
+    REQUIRE(!uart_tx_fifo_empty(&ctx));
+
+    // Drain the pipe, the pending byte is written when the port is writable again
+    std::vector<uint8_t> data;
+    uint8_t buffer[4096];
+    while (data.size() < filled && (count = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        data.insert(data.end(), buffer, buffer + count);
+    }
+    REQUIRE(uart_tx_fifo_empty(&ctx));
+    REQUIRE(!ctx.uart.port.txPending);
+    REQUIRE(read(fds[0], buffer, sizeof(buffer)) == 1);
+    REQUIRE(buffer[0] == 0x55);
+
+    uart_close(&ctx);
+    close(fds[0]);
+}
+
+TEST_CASE("Linux: write errors are reported as framing errors") {
+    signal(SIGPIPE, SIG_IGN);
+    Node node;
+    memset(&node, 0, sizeof(Node));
+    node.ctx.user = &node;
+    node.ctx.bus_cl.station = STATION;
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    REQUIRE(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    node.masterFd = fds[1];
+    uart_attach(&node.ctx, fds[0]);
+    timers_init();
+    modbus_init(&node.ctx);
+
+    // The response can't be written
+    REQUIRE(shutdown(node.masterFd, SHUT_RD) == 0);
+    REQUIRE(sendFrame(node, { STATION, READ_HOLDING_REGISTERS, 0, 0, 0, 1 }, 1) == std::vector<uint8_t>({ }));
+    REQUIRE(node.ctx.uart.port.lastError == EPIPE);
+    REQUIRE(node.ctx.rs485.state == RS485_LINE_RX);
+
+    // The next byte received has the error bit
+    uint8_t ch = 0x12;
+    REQUIRE(write(node.masterFd, &ch, 1) == 1);
+    REQUIRE(!uart_rx_fifo_empty(&node.ctx));
+    uart_read(&node.ctx);
+    REQUIRE(node.ctx.uart.lastCh.errs.FERR);
+    REQUIRE(node.ctx.uart.lastCh.data == 0x12);
+
+    closeNode(node);
+}
+
+TEST_CASE("Linux: the echo of the transmitted data is dropped") {
+    MODBUS_CONTEXT ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    REQUIRE(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    uart_attach(&ctx, fds[0]);
+    ctx.uart.port.echo = true;
+
+    uart_transmit(&ctx);
+    for (uint8_t b = 1; b <= 3; b++) {
+        uart_write(&ctx, b);
+    }
+    uart_flush(&ctx);
+    uart_receive(&ctx);
+
+    // The echo and the response can be received together, after the line is released
+    uint8_t buffer[3];
+    REQUIRE(read(fds[1], buffer, sizeof(buffer)) == 3);
+    uint8_t received[] = { 1, 2, 3, 0x42 };
+    REQUIRE(write(fds[1], received, sizeof(received)) == sizeof(received));
+    REQUIRE(!uart_rx_fifo_empty(&ctx));
+    uart_read(&ctx);
+    REQUIRE(ctx.uart.lastCh.data == 0x42);
+    REQUIRE(uart_rx_fifo_empty(&ctx));
+
+    uart_close(&ctx);
+    close(fds[1]);
+}
@@ -0,0 +1,270 @@
+#include <catch2/catch.hpp>
+#include <stdbool.h>
+#include <string.h>
+#include <queue>
+
+#include "pic-modbus/modbus.h"
+
+// Multiple nodes on the same simulated RS485 line, using the instance-based API (MODBUS_CONTEXT_API)
+
+#ifndef MODBUS_CONTEXT_API
+#error The multi-node tests require MODBUS_CONTEXT_API
+#endif
+
+// Polling period of the nodes
+#define POLL_TICKS (20)
+// Address of the snapshot registers: sequence number and the latched sample (32-bit)
+#define SNAPSHOT_ADDRESS (100)
+#define SNAPSHOT_COUNT (3)
+
+static TICK_TYPE s_timer = 0;
+
+struct Node {
+    MODBUS_CONTEXT ctx;
+    enum { TRANSMIT, RECEIVE } mode;
+    std::queue<uint8_t> rxQueue;
+    // When the UART will have finished transmitting the last byte
+    TICK_TYPE txBusyUntil;
+
+    int latchCount;
+    TICK_TYPE latchTime;
+    uint8_t snapshot[SNAPSHOT_COUNT * 2];
+};
+
+static std::vector<Node*> s_nodes;
+// Data transmitted by the nodes, as received by the master
+static std::vector<uint8_t> s_masterRx;
+
+static Node* nodeOf(MODBUS_CONTEXT* ctx) {
+    return (Node*)ctx->user;
+}
+
+extern uint16_t calcCrc16(uint16_t prevCrc, const uint8_t* buffer, int wLength);
+
+extern "C" {
+    SYS_RESET_REASON sys_resetReason;
+
+    TICK_TYPE timers_get() {
+        return s_timer;
+    }
+
+    void uart_init(MODBUS_CONTEXT* ctx) {
+        nodeOf(ctx)->rxQueue = std::queue<uint8_t>();
+        nodeOf(ctx)->txBusyUntil = 0;
+        uart_receive(ctx);
+    }
+
+    void uart_transmit(MODBUS_CONTEXT* ctx) {
+        nodeOf(ctx)->mode = Node::TRANSMIT;
+    }
+
+    void uart_receive(MODBUS_CONTEXT* ctx) {
+        nodeOf(ctx)->mode = Node::RECEIVE;
+    }
+
+    void uart_read(MODBUS_CONTEXT* ctx) {
+        Node* node = nodeOf(ctx);
+        if (node->mode != Node::RECEIVE || node->rxQueue.empty()) {
+            throw std::runtime_error("Invalid read");
+        }
+        uart_lastCh.data = node->rxQueue.front();
+        uart_lastCh.errs.FERR = false;
+        uart_lastCh.errs.OERR = false;
+        node->rxQueue.pop();
+    }
+
+    void uart_write(MODBUS_CONTEXT* ctx, uint8_t byte) {
+        Node* node = nodeOf(ctx);
+        if (node->mode != Node::TRANSMIT) {
+            throw std::runtime_error("Write called in receive mode");
+        }
+        node->txBusyUntil = s_timer + TICKS_PER_CHAR;
+        // Received by the master and by all the other nodes
+        s_masterRx.push_back(byte);
+        for (auto it = s_nodes.begin(); it != s_nodes.end(); ++it) {
+            if (*it != node && (*it)->mode == Node::RECEIVE) {
+                (*it)->rxQueue.push(byte);
+            }
+        }
+    }
+
+    _Bool uart_tx_fifo_empty(MODBUS_CONTEXT* ctx) {
+        return s_timer >= nodeOf(ctx)->txBusyUntil;
+    }
+
+    _Bool uart_rx_fifo_empty(MODBUS_CONTEXT* ctx) {
+        return nodeOf(ctx)->rxQueue.empty();
+    }
+
+    // Only the snapshot registers are exposed
+    _Bool regs_validateReg(MODBUS_CONTEXT* ctx) {
+        if (be16toh(bus_cl_header.address.registerAddressBe) != SNAPSHOT_ADDRESS || be16toh(bus_cl_header.address.countBe) != SNAPSHOT_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_ADDRESS;
+            return false;
+        }
+        if (bus_cl_header.header.function != READ_HOLDING_REGISTERS) {
+            bus_cl_exceptionCode = ERR_INVALID_FUNCTION;
+            return false;
+        }
+        return true;
+    }
+
+    _Bool regs_onReceive(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+        return false;
+    }
+
+    _Bool regs_onCommit(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+        return false;
+    }
+
+    void regs_onAbort(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+    }
+
+    void regs_onSend(MODBUS_CONTEXT* ctx) {
+        memcpy(rs485_buffer, nodeOf(ctx)->snapshot, sizeof(Node::snapshot));
+    }
+
+    _Bool regs_onSendComplete(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+        return true;
+    }
+
+    // The sample is the current time
+    void regs_onLatch(MODBUS_CONTEXT* ctx) {
+        Node* node = nodeOf(ctx);
+        node->latchCount++;
+        node->latchTime = s_timer;
+        node->snapshot[0] = (uint8_t)(bus_cl_snapshotSeq >> 8);
+        node->snapshot[1] = (uint8_t)bus_cl_snapshotSeq;
+        node->snapshot[2] = (uint8_t)(s_timer >> 24);
+        node->snapshot[3] = (uint8_t)(s_timer >> 16);
+        node->snapshot[4] = (uint8_t)(s_timer >> 8);
+        node->snapshot[5] = (uint8_t)s_timer;
+    }
+
+    // Not used, but required by the test configuration
+    const BUS_CL_REG_RANGE regs_changeRanges[BUS_CL_CHANGE_RANGES] = {
+        { 1000, 1 },
+        { 1001, 1 },
+        { 1002, 1 }
+    };
+
+    BUS_CL_IMAGE_DEFINE(unusedImage, 2);
+    const BUS_CL_IMAGE_RANGE regs_images[BUS_CL_IMAGES] = {
+        { 2000, 1, &unusedImage }
+    };
+
+    const BUS_CL_FUNCTION testSumFunction = { NULL, NULL, NULL, NULL, NULL };
+}
+
+// Create `count` nodes, with station addresses from 1
+static void initNodes(int count) {
+    for (auto it = s_nodes.begin(); it != s_nodes.end(); ++it) {
+        delete *it;
+    }
+    s_nodes.clear();
+    s_masterRx.clear();
+    for (int i = 0; i < count; i++) {
+        Node* node = new Node();
+        node->ctx.user = node;
+        node->ctx.bus_cl.station = i + 1;
+        s_nodes.push_back(node);
+        modbus_init(&node->ctx);
+    }
+}
+
+static void pollNodes(TICK_TYPE duration) {
+    for (TICK_TYPE t = 0; t < duration; t += POLL_TICKS) {
+        s_timer += POLL_TICKS;
+        for (auto it = s_nodes.begin(); it != s_nodes.end(); ++it) {
+            modbus_poll(&(*it)->ctx);
+        }
+    }
+}
+
+// The master sends a frame, and then waits for the response
+static std::vector<uint8_t> sendFrame(const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> frame(data);
+    uint16_t crc = calcCrc16(0xffff, data.data(), data.size());
+    frame.push_back((uint8_t)crc);
+    frame.push_back((uint8_t)(crc >> 8));
+
+    s_masterRx.clear();
+    for (auto it = frame.begin(); it != frame.end(); ++it) {
+        for (auto node = s_nodes.begin(); node != s_nodes.end(); ++node) {
+            (*node)->rxQueue.push(*it);
+        }
+        pollNodes(TICKS_PER_CHAR);
+    }
+    // Enough for the response
+    pollNodes(TICKS_PER_CHAR * 30);
+    return s_masterRx;
+}
+
+static std::vector<uint8_t> withCrc(const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> ret(data);
+    uint16_t crc = calcCrc16(0xffff, data.data(), data.size());
+    ret.push_back((uint8_t)crc);
+    ret.push_back((uint8_t)(crc >> 8));
+    return ret;
+}
+
+TEST_CASE("Multiple nodes: each node only answers its address") {
+    initNodes(3);
+    pollNodes(TICKS_PER_CHAR * 10);
+
+    for (uint8_t station = 1; station <= 3; station++) {
+        REQUIRE(sendFrame({ station, READ_HOLDING_REGISTERS, 0, SNAPSHOT_ADDRESS, 0, SNAPSHOT_COUNT }) == withCrc({ station, READ_HOLDING_REGISTERS, SNAPSHOT_COUNT * 2, 0, 0, 0, 0, 0, 0 }));
+    }
+    // Error response
+    REQUIRE(sendFrame({ 2, READ_HOLDING_REGISTERS, 0, 0, 0, 1 }) == withCrc({ 2, 0x80 | READ_HOLDING_REGISTERS, ERR_INVALID_ADDRESS }));
+    // No nodes
+    REQUIRE(sendFrame({ 4, READ_HOLDING_REGISTERS, 0, SNAPSHOT_ADDRESS, 0, SNAPSHOT_COUNT }) == std::vector<uint8_t>({ }));
+}
+
+TEST_CASE("Multiple nodes: broadcast latch samples all the nodes at the same time") {
+    initNodes(4);
+    pollNodes(TICKS_PER_CHAR * 10);
+
+    // Not answered
+    REQUIRE(sendFrame({ BROADCAST_ADDRESS, LATCH_SNAPSHOT, 0x12, 0x34, 0, 0 }) == std::vector<uint8_t>({ }));
+    TICK_TYPE latchTime = s_nodes[0]->latchTime;
+    for (auto it = s_nodes.begin(); it != s_nodes.end(); ++it) {
+        REQUIRE((*it)->latchCount == 1);
+        REQUIRE((*it)->latchTime == latchTime);
+    }
+
+    // The snapshots are read later, with the same sample
+    pollNodes(TICKS_PER_SECOND / 100);
+    for (uint8_t station = 1; station <= 4; station++) {
+        REQUIRE(sendFrame({ station, READ_HOLDING_REGISTERS, 0, SNAPSHOT_ADDRESS, 0, SNAPSHOT_COUNT }) == withCrc({
+            station, READ_HOLDING_REGISTERS, SNAPSHOT_COUNT * 2,
+            0x12, 0x34, (uint8_t)(latchTime >> 24), (uint8_t)(latchTime >> 16), (uint8_t)(latchTime >> 8), (uint8_t)latchTime
+        }));
+    }
+}
+
+TEST_CASE("Multiple nodes: latch with wrong CRC is ignored by all the nodes") {
+    initNodes(2);
+    pollNodes(TICKS_PER_CHAR * 10);
+
+    s_masterRx.clear();
+    std::vector<uint8_t> frame = withCrc({ BROADCAST_ADDRESS, LATCH_SNAPSHOT, 0x12, 0x34, 0, 0 });
+    frame[frame.size() - 1]++;
+    for (auto it = frame.begin(); it != frame.end(); ++it) {
+        for (auto node = s_nodes.begin(); node != s_nodes.end(); ++node) {
+            (*node)->rxQueue.push(*it);
+        }
+        pollNodes(TICKS_PER_CHAR);
+    }
+    pollNodes(TICKS_PER_CHAR * 30);
+
+    REQUIRE(s_masterRx.empty());
+    for (auto it = s_nodes.begin(); it != s_nodes.end(); ++it) {
+        REQUIRE((*it)->latchCount == 0);
+        REQUIRE((*it)->ctx.bus_cl.crcErrors == 1);
+    }
+}
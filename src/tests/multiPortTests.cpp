@@ -0,0 +1,173 @@
+#include <catch2/catch.hpp>
+#include <map>
+#include <vector>
+
+#include "ptyNode.h"
+#include "pic-modbus/linux/multi_port_master.hpp"
+
+// The multi-port master runtime, with a node of the client stack on each port (pseudo-terminal pairs)
+
+using modbus::MultiPortMaster;
+using modbus::SpscQueue;
+
+#define STATION (3)
+
+static MultiPortMaster::Request readRequest(uint32_t id, uint16_t address, uint8_t count) {
+    MultiPortMaster::Request request = { };
+    request.id = id;
+    request.station = STATION;
+    request.function = READ_HOLDING_REGISTERS;
+    request.address = address;
+    request.count = count;
+    return request;
+}
+
+// Wait for `count` results, indexed by id
+static std::map<uint32_t, MultiPortMaster::Result> waitResults(MultiPortMaster& master, size_t count) {
+    std::map<uint32_t, MultiPortMaster::Result> results;
+    TICK_TYPE start = timers_get();
+    while (results.size() < count && (TICK_TYPE)(timers_get() - start) < TICKS_PER_SECOND * 10) {
+        MultiPortMaster::Result result;
+        if (master.poll(result)) {
+            results[result.id] = result;
+        } else {
+            master.wait(100);
+        }
+    }
+    return results;
+}
+
+TEST_CASE("SPSC queue: order and capacity") {
+    SpscQueue<int> queue(3);
+    REQUIRE(queue.capacity() == 4);
+    for (int i = 0; i < 4; i++) {
+        REQUIRE(queue.push(i));
+    }
+    REQUIRE(!queue.push(4));
+    int item;
+    REQUIRE(queue.pop(item));
+    REQUIRE(item == 0);
+    REQUIRE(queue.push(4));
+    for (int i = 1; i <= 4; i++) {
+        REQUIRE(queue.pop(item));
+        REQUIRE(item == i);
+    }
+    REQUIRE(!queue.pop(item));
+    REQUIRE(queue.size() == 0);
+}
+
+TEST_CASE("SPSC queue: producer and consumer threads") {
+    SpscQueue<uint32_t> queue(16);
+    const uint32_t count = 200000;
+    std::thread producer([&] {
+        for (uint32_t i = 0; i < count; i++) {
+            while (!queue.push(i)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    uint32_t expected = 0;
+    uint32_t outOfOrder = 0;
+    while (expected < count) {
+        uint32_t item;
+        if (!queue.pop(item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (item != expected) {
+            outOfOrder++;
+        }
+        expected++;
+    }
+    producer.join();
+    REQUIRE(outOfOrder == 0);
+}
+
+TEST_CASE("Multi-port master: requests to several ports") {
+    const int ports = 3;
+    timers_init();
+    std::vector<PtyNode*> nodes;
+    MultiPortMaster master;
+    for (int i = 0; i < ports; i++) {
+        PtyNode* node = ptyNode_start(STATION);
+        REQUIRE(node);
+        nodes.push_back(node);
+        REQUIRE(master.addPort(node->masterFd) == i);
+    }
+    master.start();
+
+    // Write a register of each node, then read it back with its neighbors
+    for (int i = 0; i < ports; i++) {
+        MultiPortMaster::Request request = readRequest(i, 4, 1);
+        request.function = WRITE_HOLDING_REGISTERS;
+        request.data[0] = 0xa000 + i;
+        REQUIRE(master.submit(i, request));
+        REQUIRE(master.submit(i, readRequest(100 + i, 3, 3)));
+    }
+    auto results = waitResults(master, ports * 2);
+    REQUIRE(results.size() == ports * 2);
+    for (int i = 0; i < ports; i++) {
+        REQUIRE(results[i].port == i);
+        REQUIRE(results[i].result == NO_ERROR);
+        const MultiPortMaster::Result& read = results[100 + i];
+        REQUIRE(read.port == i);
+        REQUIRE(read.result == NO_ERROR);
+        REQUIRE(read.count == 3);
+        REQUIRE(read.data[0] == STATION * 0x100 + 3);
+        REQUIRE(read.data[1] == 0xa000 + i);
+        REQUIRE(read.data[2] == STATION * 0x100 + 5);
+    }
+
+    master.stop();
+    for (auto node : nodes) {
+        REQUIRE(node->regs[4] >= 0xa000);
+        ptyNode_stop(node);
+    }
+}
+
+TEST_CASE("Multi-port master: errors and full result queues") {
+    timers_init();
+    PtyNode* node = ptyNode_start(STATION);
+    REQUIRE(node);
+    // Smaller than the engine queue
+    MultiPortMaster master(4);
+    REQUIRE(master.addPort(node->masterFd) == 0);
+    master.start();
+
+    REQUIRE(master.submit(0, readRequest(1, PTY_NODE_REGS_COUNT, 1)));
+    REQUIRE(master.submit(0, readRequest(2, 0, MultiPortMaster::MaxRegisters + 1)));
+    MultiPortMaster::Request other = readRequest(3, 0, 1);
+    other.station = STATION + 1;
+    REQUIRE(master.submit(0, other));
+    auto results = waitResults(master, 3);
+    REQUIRE(results[1].result == ERR_INVALID_ADDRESS);
+    REQUIRE(results[2].result == BUS_MS_ERR_INVALID_REQUEST);
+    REQUIRE(results[3].result == BUS_MS_ERR_TIMEOUT);
+
+    // Results consumed only when the queues are full: the worker waits for room in the result queue
+    const uint32_t first = 10;
+    const size_t count = 12;
+    results.clear();
+    size_t submitted = 0;
+    while (submitted < count) {
+        if (master.submit(0, readRequest(first + submitted, submitted % 8, 1))) {
+            submitted++;
+            continue;
+        }
+        MultiPortMaster::Result result;
+        while (!master.poll(result)) {
+            REQUIRE(master.wait(1000));
+        }
+        results[result.id] = result;
+    }
+    auto last = waitResults(master, count - results.size());
+    results.insert(last.begin(), last.end());
+    REQUIRE(results.size() == count);
+    for (size_t i = 0; i < count; i++) {
+        REQUIRE(results[first + i].result == NO_ERROR);
+        REQUIRE(results[first + i].data[0] == STATION * 0x100 + i % 8);
+    }
+
+    master.stop();
+    ptyNode_stop(node);
+}
@@ -0,0 +1,80 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ptyNode.h"
+
+static PtyNode* nodeOf(MODBUS_CONTEXT* ctx) {
+    return (PtyNode*)ctx->user;
+}
+
+extern "C" {
+    _Bool regs_validateReg(MODBUS_CONTEXT* ctx) {
+        if (be16toh(bus_cl_header.address.registerAddressBe) + be16toh(bus_cl_header.address.countBe) > PTY_NODE_REGS_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_ADDRESS;
+            return false;
+        }
+        return true;
+    }
+
+    _Bool regs_onReceive(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            nodeOf(ctx)->regs[address + i] = (rs485_buffer[i * 2] << 8) | rs485_buffer[i * 2 + 1];
+        }
+        return true;
+    }
+
+    void regs_onSend(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            rs485_buffer[i * 2] = (uint8_t)(nodeOf(ctx)->regs[address + i] >> 8);
+            rs485_buffer[i * 2 + 1] = (uint8_t)nodeOf(ctx)->regs[address + i];
+        }
+    }
+}
+
+static void run(PtyNode* node) {
+    while (node->running.load()) {
+        if (!modbus_loop_wait(&node->loop, TICKS_PER_SECOND / 10)) {
+            abort();
+        }
+    }
+}
+
+PtyNode* ptyNode_start(uint8_t station) {
+    PtyNode* node = new PtyNode();
+    node->ctx.user = node;
+    node->ctx.bus_cl.station = station;
+    for (int i = 0; i < PTY_NODE_REGS_COUNT; i++) {
+        node->regs[i] = station * 0x100 + i;
+    }
+
+    node->masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (node->masterFd < 0 || grantpt(node->masterFd) != 0 || unlockpt(node->masterFd) != 0 || fcntl(node->masterFd, F_SETFL, O_NONBLOCK) != 0
+        || !uart_open(&node->ctx, ptsname(node->masterFd))) {
+        close(node->masterFd);
+        delete node;
+        return nullptr;
+    }
+    modbus_init(&node->ctx);
+    if (!modbus_loop_init(&node->loop) || !modbus_loop_add(&node->loop, &node->ctx)) {
+        uart_close(&node->ctx);
+        close(node->masterFd);
+        delete node;
+        return nullptr;
+    }
+    node->running.store(true);
+    node->thread = std::thread(run, node);
+    return node;
+}
+
+void ptyNode_stop(PtyNode* node) {
+    node->running.store(false);
+    modbus_loop_wake(&node->loop);
+    node->thread.join();
+    modbus_loop_close(&node->loop);
+    uart_close(&node->ctx);
+    delete node;
+}
@@ -0,0 +1,33 @@
+#ifndef _PTY_NODE_H
+#define _PTY_NODE_H
+
+#include <atomic>
+#include <thread>
+
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/linux/loop.h"
+
+// A node of the client stack on the slave side of a pseudo-terminal pair, run by its own thread in an
+// event-driven loop. The master side of the pair is left to the test (e.g. for the master engine, see `uart_attach`,
+// that then owns it).
+
+// Holding registers of the nodes, initialized to station * 0x100 + address
+#define PTY_NODE_REGS_COUNT (128)
+
+struct PtyNode {
+    MODBUS_CONTEXT ctx;
+    MODBUS_LOOP loop;
+    // Non-blocking
+    int masterFd;
+    uint16_t regs[PTY_NODE_REGS_COUNT];
+    std::thread thread;
+    std::atomic<bool> running;
+};
+
+// Returns nullptr in case of errors. Call `timers_init` first.
+PtyNode* ptyNode_start(uint8_t station);
+
+// Stop the node, and close the pair
+void ptyNode_stop(PtyNode* node);
+
+#endif
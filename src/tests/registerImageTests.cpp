@@ -0,0 +1,223 @@
+#include <catch2/catch.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "pic-modbus/modbus.h"
+#include "pic-modbus/linux/register_image.h"
+
+// The shared image of the registers, with the readers in other mappings of the file (as other processes)
+
+#define UNIT (5)
+// Registers updated at once by the writer
+#define COUNT (64)
+
+// A new file, removed at the end of the test
+struct ImageFile {
+    ImageFile() {
+        char name[] = "/tmp/registerImageXXXXXX";
+        int fd = mkstemp(name);
+        REQUIRE(fd >= 0);
+        close(fd);
+        path = name;
+    }
+    ~ImageFile() {
+        unlink(path.c_str());
+    }
+    std::string path;
+};
+
+TEST_CASE("Register image: publish, read and invalidate") {
+    ImageFile file;
+    REGISTER_IMAGE writer, reader;
+    REQUIRE(register_image_create(&writer, file.path.c_str()));
+    REQUIRE(register_image_open(&reader, file.path.c_str()));
+
+    uint16_t data[4] = { };
+    uint64_t time = 0;
+    // Never published
+    REQUIRE_FALSE(register_image_read(&reader, UNIT, 10, 2, data, &time));
+
+    const uint16_t registers[] = { 0x1234, 0x5678, 0x9abc };
+    register_image_publish(&writer, UNIT, 10, 3, registers);
+    REQUIRE(register_image_read(&reader, UNIT, 10, 3, data, &time));
+    REQUIRE(data[0] == 0x1234);
+    REQUIRE(data[1] == 0x5678);
+    REQUIRE(data[2] == 0x9abc);
+    REQUIRE(time > 0);
+    REQUIRE(register_image_read(&reader, UNIT, 11, 1, data, nullptr));
+    REQUIRE(data[0] == 0x5678);
+    // Partially published, other units
+    REQUIRE_FALSE(register_image_read(&reader, UNIT, 9, 2, data, nullptr));
+    REQUIRE_FALSE(register_image_read(&reader, UNIT + 1, 10, 1, data, nullptr));
+
+    register_image_invalidate(&writer, UNIT, 11, 1);
+    REQUIRE_FALSE(register_image_read(&reader, UNIT, 10, 2, data, nullptr));
+    REQUIRE(register_image_read(&reader, UNIT, 12, 1, data, nullptr));
+    register_image_invalidate(&writer, BROADCAST_ADDRESS, 0, REGISTER_IMAGE_REGISTERS);
+    REQUIRE_FALSE(register_image_read(&reader, UNIT, 12, 1, data, nullptr));
+
+    // Out of the image
+    register_image_publish(&writer, UNIT, REGISTER_IMAGE_REGISTERS - 1, 3, registers);
+    REQUIRE(register_image_read(&reader, UNIT, REGISTER_IMAGE_REGISTERS - 1, 1, data, nullptr));
+    REQUIRE(data[0] == 0x1234);
+    REQUIRE_FALSE(register_image_read(&reader, UNIT, REGISTER_IMAGE_REGISTERS - 1, 2, data, nullptr));
+
+    register_image_close(&reader);
+    register_image_close(&writer);
+}
+
+TEST_CASE("Register image: files not initialized") {
+    ImageFile file;
+    REGISTER_IMAGE reader;
+    // Empty
+    REQUIRE_FALSE(register_image_open(&reader, file.path.c_str()));
+    REQUIRE(errno == EINVAL);
+
+    // Of the right size, but without the header
+    int fd = open(file.path.c_str(), O_WRONLY);
+    REQUIRE(ftruncate(fd, sizeof(REGISTER_IMAGE_LAYOUT)) == 0);
+    close(fd);
+    REQUIRE_FALSE(register_image_open(&reader, file.path.c_str()));
+    REQUIRE(errno == EINVAL);
+}
+
+TEST_CASE("Register image: readers wait for the update in progress") {
+    ImageFile file;
+    REGISTER_IMAGE writer, reader;
+    REQUIRE(register_image_create(&writer, file.path.c_str()));
+    REQUIRE(register_image_open(&reader, file.path.c_str()));
+    uint16_t data[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        data[i] = 1;
+    }
+    register_image_publish(&writer, UNIT, 0, COUNT, data);
+
+    // As the writer, stopped in the middle of an update
+    REGISTER_IMAGE_UNIT* unit = &writer.layout->units[UNIT];
+    __atomic_store_n(&unit->sequence, unit->sequence + 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < COUNT / 2; i++) {
+        unit->registers[i] = 2;
+    }
+    std::atomic<bool> done(false);
+    uint16_t snapshot[COUNT];
+    std::thread thread([&] {
+        register_image_read(&reader, UNIT, 0, COUNT, snapshot, nullptr);
+        done.store(true);
+    });
+    usleep(50000);
+    REQUIRE_FALSE(done.load());
+    for (int i = COUNT / 2; i < COUNT; i++) {
+        unit->registers[i] = 2;
+    }
+    __atomic_store_n(&unit->sequence, unit->sequence + 1, __ATOMIC_RELEASE);
+    thread.join();
+    for (int i = 0; i < COUNT; i++) {
+        REQUIRE(snapshot[i] == 2);
+    }
+
+    register_image_close(&reader);
+    register_image_close(&writer);
+}
+
+// Read snapshots until `stop`: all the registers should have the same value, never decreasing.
+// Returns the count of torn snapshots.
+static int readSnapshots(const char* path, const std::atomic<bool>& stop, int& snapshots) {
+    REGISTER_IMAGE reader;
+    if (!register_image_open(&reader, path)) {
+        return -1;
+    }
+    int torn = 0;
+    uint16_t last = 0;
+    while (!stop.load()) {
+        uint16_t data[COUNT];
+        if (!register_image_read(&reader, UNIT, 0, COUNT, data, nullptr)) {
+            // Not published yet
+            sched_yield();
+            continue;
+        }
+        snapshots++;
+        for (int i = 0; i < COUNT; i++) {
+            torn += data[i] != data[0];
+        }
+        torn += data[0] < last;
+        last = data[0];
+    }
+    register_image_close(&reader);
+    return torn;
+}
+
+// Mostly effective with more CPUs, where the readers copy while the writer updates
+TEST_CASE("Register image: snapshots are not torn by concurrent updates") {
+    timers_init();
+    ImageFile file;
+    REGISTER_IMAGE writer;
+    REQUIRE(register_image_create(&writer, file.path.c_str()));
+
+    // A reader in another process, stopped by a signal of the pipe
+    int stopPipe[2];
+    REQUIRE(pipe(stopPipe) == 0);
+    pid_t child = fork();
+    REQUIRE(child >= 0);
+    if (child == 0) {
+        close(stopPipe[1]);
+        std::atomic<bool> stop(false);
+        std::thread waiter([&] {
+            char c;
+            (void)!read(stopPipe[0], &c, 1);
+            stop.store(true);
+        });
+        int snapshots = 0;
+        int torn = readSnapshots(file.path.c_str(), stop, snapshots);
+        waiter.join();
+        _exit(torn == 0 && snapshots > 0 ? 0 : 1);
+    }
+    close(stopPipe[0]);
+
+    // And two in threads of this process
+    std::atomic<bool> stop(false);
+    int snapshots[2] = { }, torn[2] = { };
+    std::thread readers[2];
+    for (int i = 0; i < 2; i++) {
+        readers[i] = std::thread([&, i] {
+            torn[i] = readSnapshots(file.path.c_str(), stop, snapshots[i]);
+        });
+    }
+
+    uint16_t data[COUNT];
+    TICK_TYPE start = timers_get();
+    uint16_t value = 1;
+    for (; (TICK_TYPE)(timers_get() - start) < TICKS_PER_SECOND / 2 && value < 0xffff; value++) {
+        for (int i = 0; i < COUNT; i++) {
+            data[i] = value;
+        }
+        register_image_publish(&writer, UNIT, 0, COUNT, data);
+        if (value % 16 == 0) {
+            // Let the readers run during the updates too
+            sched_yield();
+        }
+    }
+
+    stop.store(true);
+    for (int i = 0; i < 2; i++) {
+        readers[i].join();
+        REQUIRE(torn[i] == 0);
+        REQUIRE(snapshots[i] > 0);
+    }
+    close(stopPipe[1]);
+    int status;
+    REQUIRE(waitpid(child, &status, 0) == child);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+    REQUIRE(value > 16);
+    // Not left odd by the writer
+    REQUIRE(writer.layout->units[UNIT].sequence % 2 == 0);
+
+    register_image_close(&writer);
+}
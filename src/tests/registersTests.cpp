@@ -0,0 +1,91 @@
+#include <catch2/catch.hpp>
+#include <stdlib.h>
+#include <vector>
+
+#include "pic-modbus/registers.hpp"
+
+// The typed bindings of the registers, and the byte-swap of the register blocks
+
+using namespace modbus;
+
+using Voltage = F32<0>;
+using Status = U16<2>;
+using Temperature = I16<3>;
+using Energy = U32<4, WordOrder::LowFirst>;
+using Offset = I32<6>;
+using Meter = Layout<Voltage, Status, Temperature, Energy, Offset>;
+
+// Compile-time checks of the layouts
+static_assert(Meter::size == 8, "Size of the layout");
+static_assert(Layout<U16<10>, F32<0>>::size == 11, "Size of unsorted layouts");
+static_assert(Meter::fits(8) && !Meter::fits(5), "Layout fits");
+static_assert(Layout<U16<MaxRegisters - 1>>::size == MaxRegisters, "Largest layout");
+static_assert(F32<0>::size == 2 && U16<0>::size == 1, "Size of the fields");
+
+TEST_CASE("Registers: fields decoded from a response") {
+    // 230.5 V, 0x1234, -20 C, 100000 Wh (low word first), -2
+    const uint8_t wire[] = { 0x43, 0x66, 0x80, 0x00, 0x12, 0x34, 0xff, 0xec, 0x86, 0xa0, 0x00, 0x01, 0xff, 0xff, 0xff, 0xfe };
+    Meter::Registers registers;
+    registers.decode(wire);
+
+    REQUIRE(registers.data[0] == 0x4366);
+    REQUIRE(registers.get<Voltage>() == 230.5f);
+    REQUIRE(registers.get<Status>() == 0x1234);
+    REQUIRE(registers.get<Temperature>() == -20);
+    REQUIRE(registers.get<Energy>() == 100000);
+    REQUIRE(registers.get<Offset>() == -2);
+}
+
+TEST_CASE("Registers: fields encoded to a request") {
+    Meter::Registers registers = { };
+    registers.set<Voltage>(-1.5f);
+    registers.set<Status>(0xabcd);
+    registers.set<Temperature>(-1);
+    registers.set<Energy>(0x12345678);
+    registers.set<Offset>(0x01020304);
+
+    uint8_t wire[Meter::size * 2];
+    registers.encode(wire);
+    const uint8_t expected[] = { 0xbf, 0xc0, 0x00, 0x00, 0xab, 0xcd, 0xff, 0xff, 0x56, 0x78, 0x12, 0x34, 0x01, 0x02, 0x03, 0x04 };
+    REQUIRE(memcmp(wire, expected, sizeof(expected)) == 0);
+
+    Meter::Registers decoded;
+    decoded.decode(wire);
+    REQUIRE(decoded.get<Voltage>() == -1.5f);
+    REQUIRE(decoded.get<Energy>() == 0x12345678);
+}
+
+TEST_CASE("Registers: word order of the 32-bit fields") {
+    const uint16_t registers[] = { 0x1234, 0x5678 };
+    REQUIRE(U32<0>::get(registers) == 0x12345678);
+    REQUIRE(U32<0, WordOrder::LowFirst>::get(registers) == 0x56781234);
+    REQUIRE(I32<0, WordOrder::LowFirst>::get(registers) == 0x56781234);
+
+    uint16_t swapped[2];
+    F32<0, WordOrder::LowFirst>::set(swapped, 1.0f);
+    REQUIRE(swapped[0] == 0x0000);
+    REQUIRE(swapped[1] == 0x3f80);
+    REQUIRE(F32<0, WordOrder::LowFirst>::get(swapped) == 1.0f);
+}
+
+TEST_CASE("Registers: blocks decoded as by the scalar code, at any length and wire alignment") {
+    srand(1);
+    std::vector<uint8_t> wire(MaxRegisters * 2 + 1);
+    for (auto& b : wire) {
+        b = (uint8_t)rand();
+    }
+    for (size_t align = 0; align < 2; align++) {
+        for (size_t count = 0; count <= MaxRegisters; count++) {
+            // Guards after the registers, not written
+            std::vector<uint16_t> registers(MaxRegisters + 2, 0x5555);
+            decodeRegisters(wire.data() + align, registers.data() + align, count);
+            for (size_t i = 0; i < count; i++) {
+                REQUIRE(registers[align + i] == (uint16_t)((wire[align + i * 2] << 8) | wire[align + i * 2 + 1]));
+            }
+            REQUIRE(registers[align + count] == 0x5555);
+            if (align > 0) {
+                REQUIRE(registers[0] == 0x5555);
+            }
+        }
+    }
+}
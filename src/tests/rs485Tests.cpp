@@ -50,10 +50,8 @@ static void advanceTime(TICK_TYPE delta) {
 }
 
 extern "C" {
-    // Internal
-    extern _Bool rs485_frameError;
     SYS_RESET_REASON sys_resetReason;
-    UART_LAST_CH uart_lastCh;
+    UART_CONTEXT uart_ctx;
 
     void uart_init() {
         while(!rxQueue.empty()) rxQueue.pop();
@@ -402,6 +400,24 @@ TEST_CASE("Test mark condition") {
     REQUIRE(rs485_isMarkCondition);
 }
 
+TEST_CASE("Late polls don't detect a mark condition if data is received") {
+    initMock(1);
+    rs485_init();
+    simulateSend({ 0x1 });
+    REQUIRE(rs485_poll() == false);
+
+    // The data was received in time, but the poll is late (e.g. a busy host)
+    simulateSend({ 0x2 });
+    advanceTime(TICKS_PER_CHAR * 4);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(!rs485_isMarkCondition);
+    REQUIRE(rs485_readAvail() == 2);
+
+    advanceTime(TICKS_PER_CHAR * 4);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_isMarkCondition);
+}
+
 TEST_CASE("Test CRC on read") {
     initMock(1);
     rs485_init();
@@ -435,3 +451,177 @@ TEST_CASE("Test CRC on write") {
     REQUIRE(rs485_state == RS485_LINE_TX_DISENGAGE);
     REQUIRE(crc16 == 0xE181);
 }
+
+TEST_CASE("Test CRC on write with header") {
+    initMock(16);
+    rs485_init();
+    REQUIRE(rs485_poll() == false);
+
+    rs485_header[0] = 0x01;
+    rs485_writeWithHeader(1, 1);
+    rs485_buffer[0] = 0x02;
+    REQUIRE(crc16 == 0xFFFF);
+    REQUIRE(rs485_poll() == true);
+    advanceTime(START_TRANSMIT_TIMEOUT + 1);
+    REQUIRE(rs485_poll() == true);
+    REQUIRE(rs485_state == RS485_LINE_TX_DISENGAGE);
+    REQUIRE(receiveAllData() == std::vector<uint8_t>({ 0x01, 0x02 }));
+    REQUIRE(crc16 == 0xE181);
+}
+
+TEST_CASE("Header and data are transmitted back to back") {
+    // 2 characters of hardware FIFO, like the PIC UART
+    initMock(2);
+    rs485_init();
+    REQUIRE(rs485_poll() == false);
+
+    rs485_header[0] = 0x02;
+    rs485_header[1] = 0x03;
+    rs485_header[2] = 0x04;
+    rs485_writeWithHeader(3, 4);
+    REQUIRE(rs485_state == RS485_LINE_WAIT_FOR_START_TRANSMIT);
+    // The data is prepared while the line is engaged
+    for (int i = 0; i < 4; i++) {
+        rs485_buffer[i] = (uint8_t)(0x10 + i);
+    }
+
+    // Poll twice per character. The UART shifts out one character every TICKS_PER_CHAR.
+    const TICK_TYPE step = TICKS_PER_CHAR / 2;
+    std::vector<uint8_t> data;
+    std::vector<TICK_TYPE> times;
+    TICK_TYPE lineFreeAt = 0;
+    for (int i = 0; i < 100 && rs485_state != RS485_LINE_RX; i++) {
+        advanceTime(step);
+        if (!txQueue.empty() && s_timer >= lineFreeAt) {
+            data.push_back(txQueue.front());
+            times.push_back(s_timer);
+            txQueue.pop();
+            lineFreeAt = s_timer + TICKS_PER_CHAR;
+        }
+        rs485_poll();
+    }
+
+    REQUIRE(data == std::vector<uint8_t>({ 0x02, 0x03, 0x04, 0x10, 0x11, 0x12, 0x13 }));
+    // No gaps between characters: each one starts as soon as the previous one is completed
+    for (int i = 1; i < times.size(); i++) {
+        REQUIRE(times[i] - times[i - 1] < TICKS_PER_CHAR + step);
+    }
+    REQUIRE(rs485_isMarkCondition);
+}
+
+// Receive a frame, and write the response `delay` ticks after the last byte was polled.
+// Returns the ticks between the last byte and the first byte of the response.
+static TICK_TYPE measureTurnaround(TICK_TYPE delay, bool frameComplete) {
+    initMock(2);
+    rs485_init();
+    simulateSend({ 0x1, 0x2, 0x3 });
+    REQUIRE(rs485_poll() == false);
+    TICK_TYPE lastByte = s_timer;
+    rs485_discard(3);
+
+    // Poll every tick
+    for (TICK_TYPE i = 0; i < delay; i++) {
+        advanceTime(1);
+        rs485_poll();
+    }
+    if (frameComplete) {
+        rs485_setFrameComplete();
+    } else {
+        // Wait for the mark condition
+        while (!rs485_isMarkCondition) {
+            advanceTime(1);
+            rs485_poll();
+        }
+    }
+    rs485_write(3);
+    while (txQueue.empty()) {
+        advanceTime(1);
+        rs485_poll();
+    }
+    return s_timer - lastByte;
+}
+
+TEST_CASE("Predicted frame end: response timed from the last byte") {
+    TICK_TYPE min = (TICK_TYPE)-1, max = 0;
+    for (TICK_TYPE delay = 0; delay < MARK_CONDITION_TIMEOUT; delay++) {
+        TICK_TYPE turnaround = measureTurnaround(delay, true);
+        min = std::min(min, turnaround);
+        max = std::max(max, turnaround);
+    }
+    REQUIRE(max - min <= 1);
+    REQUIRE(min >= MARK_CONDITION_TIMEOUT + START_TRANSMIT_TIMEOUT);
+
+    // The mark condition detection adds the polling delay to the turnaround
+    REQUIRE(measureTurnaround(0, false) >= MARK_CONDITION_TIMEOUT + START_TRANSMIT_TIMEOUT);
+}
+
+TEST_CASE("Predicted frame end: response dropped if more data is received") {
+    initMock(2);
+    rs485_init();
+    simulateSend({ 0x1, 0x2, 0x3 });
+    REQUIRE(rs485_poll() == false);
+    rs485_discard(3);
+
+    rs485_setFrameComplete();
+    rs485_write(3);
+    REQUIRE(rs485_state == RS485_LINE_WAIT_FOR_ENGAGE);
+    REQUIRE(mode == RECEIVE);
+
+    advanceTime(1);
+    simulateSend({ 0x4 });
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_state == RS485_LINE_RX);
+    REQUIRE(rs485_frameError);
+    REQUIRE(rs485_readAvail() == 0);
+    REQUIRE(txQueue.empty());
+
+    // Data skipped until the mark condition
+    advanceTime(MARK_CONDITION_TIMEOUT);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_isMarkCondition);
+    REQUIRE(!rs485_frameError);
+}
+
+TEST_CASE("Timeout of the next line transition") {
+    initMock(1);
+    rs485_init();
+    REQUIRE(rs485_poll() == false);
+    // Only data can change the state
+    REQUIRE(rs485_timeout() == RS485_NO_TIMEOUT);
+
+    simulateSend({ 0x1 });
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_timeout() == MARK_CONDITION_TIMEOUT);
+    advanceTime(TICKS_PER_CHAR);
+    REQUIRE(rs485_timeout() == MARK_CONDITION_TIMEOUT - TICKS_PER_CHAR);
+    advanceTime(TICKS_PER_CHAR);
+    REQUIRE(rs485_timeout() == 0);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_isMarkCondition);
+    REQUIRE(rs485_timeout() == RS485_NO_TIMEOUT);
+
+    rs485_write(1);
+    REQUIRE(rs485_timeout() == START_TRANSMIT_TIMEOUT);
+    advanceTime(START_TRANSMIT_TIMEOUT);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_state == RS485_LINE_TX);
+    REQUIRE(rs485_timeout() == TICKS_PER_CHAR);
+
+    receiveAllData();
+    REQUIRE(rs485_poll() == true);
+    REQUIRE(rs485_state == RS485_LINE_TX_DISENGAGE);
+    REQUIRE(rs485_timeout() == DISENGAGE_CHANNEL_TIMEOUT);
+
+    // More data (e.g. the CRC) is fed at the next poll, without a gap
+    rs485_write(1);
+    REQUIRE(rs485_state == RS485_LINE_TX);
+    REQUIRE(rs485_timeout() == 0);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_timeout() == TICKS_PER_CHAR);
+    receiveAllData();
+    REQUIRE(rs485_poll() == true);
+    REQUIRE(rs485_state == RS485_LINE_TX_DISENGAGE);
+    advanceTime(DISENGAGE_CHANNEL_TIMEOUT);
+    REQUIRE(rs485_poll() == false);
+    REQUIRE(rs485_timeout() == RS485_NO_TIMEOUT);
+}
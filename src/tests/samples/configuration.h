@@ -0,0 +1,10 @@
+#ifndef _TEST_SAMPLES_CONF_H
+#define _TEST_SAMPLES_CONF_H
+
+// The test configuration, with the tracked ranges of the samples
+#include "../configuration.h"
+
+#undef BUS_CL_CHANGE_RANGES
+#define BUS_CL_CHANGE_RANGES (2)
+
+#endif
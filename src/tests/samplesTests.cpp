@@ -0,0 +1,119 @@
+#include <catch2/catch.hpp>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pic-modbus/modbus.h"
+// Not all the sample headers are C++ ready
+extern "C" {
+#include "samples.h"
+}
+
+static TICK_TYPE s_timer = 0;
+static DCNT_DATA s_counter;
+static DCNT_DATA s_counterSnapshot;
+static int s_latchCount;
+
+extern "C" {
+    // The bus client and RS485 modules are not linked, only their state is used
+    BUS_CL_CONTEXT bus_cl_ctx;
+    RS485_CONTEXT rs485_ctx;
+    SYS_RESET_REASON sys_resetReason;
+
+    TICK_TYPE timers_get() {
+        return s_timer;
+    }
+
+    void bus_cl_setChanged(uint8_t) { }
+
+    // The hardware of the other samples
+    LedBlinkRegsiters blinker_regs;
+    void blinker_init() { }
+    void blinker_poll() { }
+    _Bool blinker_conf() {
+        return true;
+    }
+    void i2c_init() { }
+    __bit i2c_poll() {
+        return true;
+    }
+    void bmp180_init() { }
+    void bmp180_poll() { }
+    void bmp180_readRawData() { }
+    void bmp180_readCalibrationData() { }
+    void bmp180_latch() { }
+    void bmp180_readSnapshot() { }
+
+    // The counter interrupt is simulated by the tests
+    void dcnt_init() { }
+    void dcnt_poll() { }
+    void dcnt_getDataCopy(DCNT_DATA* data) {
+        *data = s_counter;
+    }
+    void dcnt_latch() {
+        s_latchCount++;
+        s_counterSnapshot = s_counter;
+    }
+    void dcnt_getSnapshot(DCNT_DATA* data) {
+        *data = s_counterSnapshot;
+    }
+}
+
+static void init() {
+    memset(&bus_cl_ctx, 0, sizeof(bus_cl_ctx));
+    memset(&rs485_ctx, 0, sizeof(rs485_ctx));
+    s_counter = { 0, 0 };
+    s_counterSnapshot = { 0, 0 };
+    s_latchCount = 0;
+    samples_init();
+}
+
+static std::vector<uint8_t> read(uint16_t address, uint8_t count) {
+    bus_cl_header.header.function = READ_HOLDING_REGISTERS;
+    bus_cl_header.address.registerAddressBe = LE_TO_BE_16(address);
+    bus_cl_header.address.countL = count;
+    REQUIRE(regs_validateReg());
+    memset(rs485_buffer, 0, sizeof(rs485_buffer));
+    regs_onSend();
+    return std::vector<uint8_t>(rs485_buffer, rs485_buffer + count * 2);
+}
+
+static void latch(uint16_t seq) {
+    bus_cl_snapshotSeq = seq;
+    regs_onLatch();
+}
+
+TEST_CASE("The counter registers are the current data") {
+    init();
+    s_counter = { 0x12345678, 0x9abc };
+    REQUIRE(read(DCNT_REGS_DATA_ADDRESS, DCNT_REGS_DATA_COUNT) == std::vector<uint8_t>({ 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc }));
+}
+
+TEST_CASE("The latch trigger samples the counter") {
+    init();
+    s_counter = { 100, 5 };
+    latch(0x0102);
+    REQUIRE(s_latchCount == 1);
+
+    // The counter goes on
+    s_counter = { 120, 20 };
+    REQUIRE(read(DCNT_REGS_SNAPSHOT_ADDRESS, DCNT_REGS_SNAPSHOT_COUNT) == std::vector<uint8_t>({ 0x01, 0x02, 0, 0, 0, 100, 0, 5 }));
+    REQUIRE(read(DCNT_REGS_DATA_ADDRESS, DCNT_REGS_DATA_COUNT) == std::vector<uint8_t>({ 0, 0, 0, 120, 0, 20 }));
+
+    // The next trigger
+    latch(0x0103);
+    REQUIRE(read(DCNT_REGS_SNAPSHOT_ADDRESS, DCNT_REGS_SNAPSHOT_COUNT) == std::vector<uint8_t>({ 0x01, 0x03, 0, 0, 0, 120, 0, 20 }));
+}
+
+TEST_CASE("The counter registers are read-only") {
+    init();
+    bus_cl_header.header.function = WRITE_HOLDING_REGISTERS;
+    bus_cl_header.address.registerAddressBe = LE_TO_BE_16(DCNT_REGS_SNAPSHOT_ADDRESS);
+    bus_cl_header.address.countL = DCNT_REGS_SNAPSHOT_COUNT;
+    REQUIRE(!regs_validateReg());
+    REQUIRE(bus_cl_exceptionCode == ERR_INVALID_FUNCTION);
+
+    bus_cl_header.header.function = READ_HOLDING_REGISTERS;
+    bus_cl_header.address.countL = DCNT_REGS_SNAPSHOT_COUNT + 1;
+    REQUIRE(!regs_validateReg());
+    REQUIRE(bus_cl_exceptionCode == ERR_INVALID_SIZE);
+}
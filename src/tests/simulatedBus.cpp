@@ -0,0 +1,200 @@
+#include <stdexcept>
+#include "simulatedBus.h"
+
+TICK_TYPE simTimer = 0;
+SimStation* simMaster;
+std::vector<SimStation*> simNodes;
+
+// A byte on the line, received by the other stations when its transmission ends
+struct LineByte {
+    SimStation* sender;
+    uint8_t data;
+    TICK_TYPE time;
+};
+static std::queue<LineByte> s_line;
+
+static SimStation* stationOf(MODBUS_CONTEXT* ctx) {
+    return (SimStation*)ctx->user;
+}
+
+extern "C" {
+    SYS_RESET_REASON sys_resetReason;
+
+    TICK_TYPE timers_get() {
+        return simTimer;
+    }
+
+    void uart_init(MODBUS_CONTEXT* ctx) {
+        stationOf(ctx)->rxQueue = std::queue<uint8_t>();
+        stationOf(ctx)->txBusyUntil = 0;
+        uart_receive(ctx);
+    }
+
+    void uart_transmit(MODBUS_CONTEXT* ctx) {
+        stationOf(ctx)->mode = SimStation::TRANSMIT;
+    }
+
+    void uart_receive(MODBUS_CONTEXT* ctx) {
+        stationOf(ctx)->mode = SimStation::RECEIVE;
+    }
+
+    void uart_read(MODBUS_CONTEXT* ctx) {
+        SimStation* station = stationOf(ctx);
+        if (station->mode != SimStation::RECEIVE || station->rxQueue.empty()) {
+            throw std::runtime_error("Invalid read");
+        }
+        uart_lastCh.data = station->rxQueue.front();
+        uart_lastCh.errs.FERR = false;
+        uart_lastCh.errs.OERR = false;
+        station->rxQueue.pop();
+    }
+
+    void uart_write(MODBUS_CONTEXT* ctx, uint8_t byte) {
+        SimStation* station = stationOf(ctx);
+        if (station->mode != SimStation::TRANSMIT) {
+            throw std::runtime_error("Write called in receive mode");
+        }
+        if (station->corruptByte > 0 && --station->corruptByte == 0) {
+            byte ^= 0x10;
+        }
+        station->txBusyUntil = simTimer + TICKS_PER_CHAR;
+        s_line.push({ station, byte, station->txBusyUntil });
+    }
+
+    _Bool uart_tx_fifo_empty(MODBUS_CONTEXT* ctx) {
+        return simTimer >= stationOf(ctx)->txBusyUntil;
+    }
+
+    _Bool uart_rx_fifo_empty(MODBUS_CONTEXT* ctx) {
+        return stationOf(ctx)->rxQueue.empty();
+    }
+
+    _Bool regs_validateReg(MODBUS_CONTEXT* ctx) {
+        if (be16toh(bus_cl_header.address.registerAddressBe) + be16toh(bus_cl_header.address.countBe) > SIM_REGS_COUNT) {
+            bus_cl_exceptionCode = ERR_INVALID_ADDRESS;
+            return false;
+        }
+        return true;
+    }
+
+    _Bool regs_onReceive(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            stationOf(ctx)->staged[address + i] = (rs485_buffer[i * 2] << 8) | rs485_buffer[i * 2 + 1];
+        }
+        return true;
+    }
+
+    _Bool regs_onCommit(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            stationOf(ctx)->regs[address + i] = stationOf(ctx)->staged[address + i];
+        }
+        return true;
+    }
+
+    void regs_onAbort(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+    }
+
+    void regs_onSend(MODBUS_CONTEXT* ctx) {
+        uint16_t address = be16toh(bus_cl_header.address.registerAddressBe);
+        for (uint16_t i = 0; i < be16toh(bus_cl_header.address.countBe); i++) {
+            rs485_buffer[i * 2] = (uint8_t)(stationOf(ctx)->regs[address + i] >> 8);
+            rs485_buffer[i * 2 + 1] = (uint8_t)stationOf(ctx)->regs[address + i];
+        }
+    }
+
+    _Bool regs_onSendComplete(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+        return true;
+    }
+
+    void regs_onLatch(MODBUS_CONTEXT* ctx) {
+        CTX_UNUSED;
+    }
+
+    // Not used, but required by the test configuration
+    const BUS_CL_REG_RANGE regs_changeRanges[BUS_CL_CHANGE_RANGES] = {
+        { 1000, 1 },
+        { 1001, 1 },
+        { 1002, 1 }
+    };
+
+    BUS_CL_IMAGE_DEFINE(unusedImage, 2);
+    const BUS_CL_IMAGE_RANGE regs_images[BUS_CL_IMAGES] = {
+        { 2000, 1, &unusedImage }
+    };
+
+    const BUS_CL_FUNCTION testSumFunction = { NULL, NULL, NULL, NULL, NULL };
+}
+
+void simInit(int count) {
+    for (auto it = simNodes.begin(); it != simNodes.end(); ++it) {
+        delete *it;
+    }
+    simNodes.clear();
+    delete simMaster;
+    s_line = std::queue<LineByte>();
+
+    simMaster = new SimStation();
+    simMaster->ctx.user = simMaster;
+    rs485_init(&simMaster->ctx);
+    bus_ms_init(&simMaster->ctx);
+
+    for (int i = 0; i < count; i++) {
+        SimStation* node = new SimStation();
+        node->ctx.user = node;
+        node->ctx.bus_cl.station = i + 1;
+        for (int j = 0; j < SIM_REGS_COUNT; j++) {
+            node->regs[j] = (uint16_t)((i + 1) * 0x100 + j);
+        }
+        simNodes.push_back(node);
+        modbus_init(&node->ctx);
+    }
+}
+
+// Received by all the other stations listening
+static void deliverLine() {
+    while (!s_line.empty() && s_line.front().time <= simTimer) {
+        const LineByte& byte = s_line.front();
+        if (simMaster != byte.sender && simMaster->mode == SimStation::RECEIVE) {
+            simMaster->rxQueue.push(byte.data);
+        }
+        for (auto it = simNodes.begin(); it != simNodes.end(); ++it) {
+            SimStation* node = *it;
+            if (node == byte.sender || node->offline) {
+                continue;
+            }
+            if (node->rxDelay > 0) {
+                node->delayed.push({ byte.time + node->rxDelay, byte.data });
+            } else if (node->mode == SimStation::RECEIVE) {
+                node->rxQueue.push(byte.data);
+            }
+        }
+        s_line.pop();
+    }
+    for (auto it = simNodes.begin(); it != simNodes.end(); ++it) {
+        SimStation* node = *it;
+        while (!node->delayed.empty() && node->delayed.front().first <= simTimer) {
+            if (node->mode == SimStation::RECEIVE) {
+                node->rxQueue.push(node->delayed.front().second);
+            }
+            node->delayed.pop();
+        }
+    }
+}
+
+void simPoll(TICK_TYPE duration) {
+    for (TICK_TYPE t = 0; t < duration; t += SIM_POLL_TICKS) {
+        simTimer += SIM_POLL_TICKS;
+        deliverLine();
+        rs485_poll(&simMaster->ctx);
+        bus_ms_poll(&simMaster->ctx);
+        for (auto it = simNodes.begin(); it != simNodes.end(); ++it) {
+            if (!(*it)->offline) {
+                modbus_poll(&(*it)->ctx);
+            }
+        }
+    }
+}
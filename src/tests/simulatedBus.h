@@ -0,0 +1,50 @@
+#ifndef _SIMULATED_BUS_H
+#define _SIMULATED_BUS_H
+
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "pic-modbus/modbus.h"
+
+// A simulated RS485 line, shared by a master and by the nodes of the client stack (instance-based API).
+// The bytes are received by the other stations at the end of their character time.
+
+#ifndef MODBUS_CONTEXT_API
+#error The simulated bus requires MODBUS_CONTEXT_API
+#endif
+
+// Polling period of the master and of the nodes
+#define SIM_POLL_TICKS (20)
+// Holding registers of the nodes, initialized to station * 0x100 + address
+#define SIM_REGS_COUNT (8)
+
+struct SimStation {
+    MODBUS_CONTEXT ctx;
+    enum { TRANSMIT, RECEIVE } mode;
+    std::queue<uint8_t> rxQueue;
+    // When the UART will have finished transmitting the last byte
+    TICK_TYPE txBusyUntil;
+    // Set to corrupt the n-th next byte transmitted (from 1)
+    int corruptByte;
+    // Set to receive the bytes later (a slow node), and the bytes in flight with their time
+    TICK_TYPE rxDelay;
+    std::queue<std::pair<TICK_TYPE, uint8_t>> delayed;
+    // Set to disconnect the station from the line, and to stop polling it
+    bool offline;
+
+    uint16_t regs[SIM_REGS_COUNT];
+    uint16_t staged[SIM_REGS_COUNT];
+};
+
+extern TICK_TYPE simTimer;
+extern SimStation* simMaster;
+extern std::vector<SimStation*> simNodes;
+
+// Create the master, and `count` nodes with station addresses from 1
+void simInit(int count);
+
+// Advance the time, polling all the stations
+void simPoll(TICK_TYPE duration);
+
+#endif
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pic-modbus/linux/gateway.h"
+
+// Modbus TCP to RTU gateway, see `gateway.h`.
+// Usage: modbus-gateway [-p tcp port] [-c unit:address:count:milliseconds]... [-m image file] device[=first unit-last unit] ...
+// e.g. modbus-gateway -p 502 -c 5:0:11:60000 -m /dev/shm/modbus /dev/ttyUSB0 /dev/ttyUSB1=20-29: the units from 20 to 29 are on
+// the second port, all the others on the first one, the reads of the registers 0-10 of the unit 5 are cached for a minute,
+// and the registers read are published to the local processes (see `register_image.h`).
+
+static GATEWAY s_gateway;
+static REGISTER_IMAGE s_image;
+
+// The gateway has no registers of its own
+_Bool regs_validateReg(MODBUS_CONTEXT* ctx) {
+    bus_cl_exceptionCode = ERR_INVALID_ADDRESS;
+    return false;
+}
+
+_Bool regs_onReceive(MODBUS_CONTEXT* ctx) {
+    (void)ctx;
+    return false;
+}
+
+void regs_onSend(MODBUS_CONTEXT* ctx) {
+    (void)ctx;
+}
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void onSignal(int signal) {
+    (void)signal;
+    s_stop = 1;
+}
+
+int main(int argc, char** argv) {
+    uint16_t tcpPort = 502;
+    // The cache ranges, added after the initialization
+    const char* cacheRanges[GATEWAY_CACHE_RULES];
+    int cacheRangeCount = 0;
+    const char* imagePath = NULL;
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-p") == 0) {
+            tcpPort = (uint16_t)atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "-c") == 0 && cacheRangeCount < GATEWAY_CACHE_RULES) {
+            cacheRanges[cacheRangeCount++] = argv[arg + 1];
+        } else if (strcmp(argv[arg], "-m") == 0) {
+            imagePath = argv[arg + 1];
+        } else {
+            break;
+        }
+        arg += 2;
+    }
+    if (arg >= argc || argv[arg][0] == '-') {
+        fprintf(stderr, "Usage: %s [-p tcp port] [-c unit:address:count:milliseconds]... [-m image file] device[=first unit-last unit] ...\n", argv[0]);
+        return 2;
+    }
+
+    timers_init();
+    if (!gateway_init(&s_gateway, tcpPort)) {
+        fprintf(stderr, "Cannot listen to port %d: %s\n", tcpPort, strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < cacheRangeCount; i++) {
+        unsigned int unit, address, count, milliseconds;
+        if (sscanf(cacheRanges[i], "%u:%u:%u:%u", &unit, &address, &count, &milliseconds) != 4) {
+            fprintf(stderr, "Invalid cache range %s\n", cacheRanges[i]);
+            return 2;
+        }
+        gateway_cacheRange(&s_gateway, (uint8_t)unit, (uint16_t)address, (uint16_t)count, milliseconds);
+    }
+    if (imagePath) {
+        if (!register_image_create(&s_image, imagePath)) {
+            fprintf(stderr, "Cannot create %s: %s\n", imagePath, strerror(errno));
+            return 1;
+        }
+        s_gateway.image = &s_image;
+    }
+    for (; arg < argc; arg++) {
+        char* units = strchr(argv[arg], '=');
+        if (units) {
+            *units++ = '\0';
+        }
+        int port = gateway_addPort(&s_gateway, argv[arg]);
+        if (port < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", argv[arg], strerror(errno));
+            return 1;
+        }
+        int first, last;
+        if (units && sscanf(units, "%d-%d", &first, &last) == 2) {
+            for (int unit = first; unit <= last && unit < 256; unit++) {
+                gateway_route(&s_gateway, (uint8_t)unit, (uint8_t)port);
+            }
+        }
+    }
+    printf("Listening to port %d\n", s_gateway.tcpPort);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    while (!s_stop) {
+        if (!modbus_loop_wait(&s_gateway.loop, TICKS_PER_SECOND)) {
+            fprintf(stderr, "Loop error: %s\n", strerror(errno));
+            break;
+        }
+    }
+    printf("%u requests, %u exceptions, %u serial transactions, %u coalesced, %u from the cache\n",
+        s_gateway.requests, s_gateway.exceptions, s_gateway.transactions, s_gateway.coalesced, s_gateway.cacheHits);
+    gateway_close(&s_gateway);
+    if (imagePath) {
+        register_image_close(&s_image);
+    }
+    return 0;
+}